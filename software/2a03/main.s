@@ -36,17 +36,46 @@ PCA_CON_STO     = $10 ; Stop
 PCA_CON_SI      = $08 ; Serial Interrupt
 PCA_CON_CR      = $07 ; Clock Rate (MASK)
 
+; PCA9564 Control value for slave mode, written to reset the SI bit
+PCA_CON_ACK     = (PCA_CON_AA | PCA_CON_ENSIO | PCA_CON_330kHz)
+
+; Received byte ring, filled by the IRQ handler
+RING_SIZE       = 64
+
 ; I2C Receive States
 RECV_STATE_REG  = 0
 RECV_STATE_VAL  = 1
-RECV_STATE_DATA = 2
+RECV_STATE_LIST_REG = 2
+RECV_STATE_LIST_VAL = 3
+RECV_STATE_QUEUE_DELTA = 4
+RECV_STATE_QUEUE_REG = 5
+RECV_STATE_QUEUE_VAL = 6
+RECV_STATE_PCM  = 7
 
 ; I2C Registers
 REG_CONFIG      = $7F ; Device configuration register
+REG_LIST        = $7E ; Register list write, followed by (reg, val) pairs
+REG_QUEUE       = $7D ; Queue write, followed by (delta, reg, val) records
+REG_PCM         = $7C ; PCM stream write, followed by samples for $4011
+REG_PCM_DELAY   = $7B ; Delay loop count between PCM samples
 REG_OUTPUT      = $16 ; Output control register
 REG_DATA_START  = $88 ; Data write start block register ($C200)
 REG_DATA_END    = $FF ; Data write end block register ($DFC0)
 
+; CONFIG register flags
+CONFIG_INCREMENT = $01 ; Auto-increment APU registers on write
+CONFIG_QUEUE    = $02 ; Apply queued writes on APU frame counter ticks
+CONFIG_PCM      = $04 ; Play streamed PCM samples to $4011
+
+; Buffered PCM samples to start playing at, and to keep the buffer at
+PCM_LEVEL       = 64
+
+; Most PCM samples taken from the ring on each pass of the main loop
+PCM_RECV_MAX    = 2
+
+; Most queued writes applied on each pass of the main loop
+QUEUE_APPLY_MAX = 4
+
 .segment "ZEROPAGE"
 ; Variables go here
 cmd_register:   .res 1 ; I2C selected register
@@ -54,7 +83,35 @@ cmd_value:      .res 1
 cmd_recv_state: .res 1 ; I2C receive state
 output_value:   .res 1 ; Value of the OUTPUT register
 config_value:   .res 1 ; Value of the CONFIG register
-data_offset:    .res 2 ; Location for DATA loading
+queue_head:     .res 1 ; Index of the next queued write to apply
+queue_tail:     .res 1 ; Index of the next free queue record
+queue_wait:     .res 1 ; Frames remaining before the head write applies
+queue_loaded:   .res 1 ; Whether queue_wait holds the head record delay
+queue_due:      .res 1 ; Whether writes due on the last tick are still applying
+queue_budget:   .res 1 ; Queued writes left to apply on this pass
+frame_ticks:    .res 1 ; Frame counter ticks not yet seen by queue_service
+i2c_held:       .res 1 ; Whether the IRQ handler left SI set on a full ring
+i2c_first:      .res 1 ; Whether the next received byte is a register byte
+i2c_register:   .res 1 ; Register selected by the last write, for reads
+data_block:     .res 2 ; Location for DATA loading and reads
+data_read:      .res 1 ; Offset of the next data byte to read
+read_value:     .res 1 ; Scratch value for register_read
+ring_head:      .res 1 ; Index of the next received byte to handle
+ring_tail:      .res 1 ; Index of the next free ring entry
+ring_data:      .res RING_SIZE ; Received bytes
+ring_end:       .res RING_SIZE ; Nonzero where a transaction ended
+pcm_head:       .res 1 ; Index of the next PCM sample to play
+pcm_tail:       .res 1 ; Index of the next free PCM buffer entry
+pcm_playing:    .res 1 ; Whether PCM samples are being played
+pcm_delay:      .res 1 ; Delay loop count with PCM_LEVEL samples buffered
+pcm_level:      .res 1 ; Distance of the PCM buffer level from PCM_LEVEL
+
+.segment "BSS"
+; Write queue records, split into one page per field
+queue_delta:    .res 256 ; Frames to wait after the previous write
+queue_reg:      .res 256 ; APU register offset
+queue_val:      .res 256 ; Value to write
+pcm_buffer:     .res 256 ; Streamed PCM samples
 
 .segment "STARTUP"
 
@@ -89,14 +146,29 @@ start:
     sta cmd_recv_state
     sta output_value
     sta config_value
-    sta data_offset
-    sta data_offset+1
-
-    ; Initialize the I2C controller
+    sta i2c_held
+    sta i2c_first
+    sta i2c_register
+    sta data_read
+    sta ring_head
+    sta ring_tail
+    ldx #(RING_SIZE - 1)
+:   sta ring_end,X
+    dex
+    bpl :-
+    lda #$01
+    sta pcm_delay
+    jsr queue_reset
+
+    ; Initialize the I2C controller, which is handled from the
+    ; IRQ handler from here on
     jsr i2c_init
+    cli
 
 @cmd_loop:
-    jsr i2c_slave_cmd
+    jsr i2c_recv_service ; Handle any bytes the IRQ handler received
+    jsr queue_service   ; Apply any queued writes that are due
+    jsr pcm_service     ; Play the next streamed PCM sample
 
     lda output_value    ; Load the value of OUTPUT into A
     and #$80            ; Mask the APU Initialize bit
@@ -104,6 +176,8 @@ start:
     bne @cmd_loop       ; Restart the loop if the bit was not set
 
     jsr init_apu        ; Initialize the APU
+    jsr queue_reset     ; Drop any queued writes
+    jsr pcm_reset       ; and any buffered PCM samples
     lda output_value    ; Clear the bit in the OUTPUT register
     and #$7F
     sta output_value
@@ -151,197 +225,423 @@ forever:
     sta PCA_CON         ; Enable serial I/O
     nop                 ; Wait for oscillator startup
     nop
-    lda #(PCA_CON_AA | PCA_CON_ENSIO | PCA_CON_330kHz)
+    lda #PCA_CON_ACK
     sta PCA_CON         ; Start as slave
     rts
 .endproc
 
 ;
-; Wait for the I2C interrupt flag to be set
+; Reset the PCA9564 I2C Controller, after the bus got stuck
 ;
-.proc i2c_wait_busy
-    ; TODO: store a timeout counter somewhere
-@loop:
-    lda PCA_CON         ; Load the current value of I2CCON
-    and #PCA_CON_SI     ; Mask the SI bit
-    cmp #PCA_CON_SI     ; Check if the SI bit is set
-    ; TODO: decrement a timer counter. and fail if zero
-    bne @loop           ; If not set, then loop
-    rts
+.proc i2c_reset
+    lda #$00
+    sta PCA_CON         ; Disable serial I/O
+    jmp i2c_init
 .endproc
 
 ;
-; Wait as an I2C slave for the next command
+; Take the next received byte from the ring into A, branching to idle
+; if the ring is empty, or to stop at the end of a transaction. Expects
+; the ring head in X, and leaves it there advanced past the byte. If
+; the IRQ handler stopped on a full ring, it takes the next byte as
+; soon as this one is out of the way.
 ;
-.proc i2c_slave_cmd
-    lda #RECV_STATE_REG
-    sta cmd_recv_state  ; Reset the receive state
-
-    jsr i2c_wait_busy   ; Wait for SI
+.macro ring_pop idle, stop
+    cpx ring_tail       ; Check if the ring is empty
+    beq idle
+    lda ring_end,X      ; Check for the end of a transaction
+    bne stop
+    lda ring_data,X     ; Load the received byte
+    inx                 ; Advance the head, wrapping around the ring
+    cpx #RING_SIZE
+    bne :+
+    ldx #$00
+:   lsr i2c_held        ; Check if the IRQ handler is waiting for room,
+    stx ring_head       ; before making it
+    bcc :+
+    cli                 ; Let the IRQ handler in, now there is room
+:
+.endmacro
 
-    lda PCA_STA
-    cmp #$60            ; Own SLA+W has been received
-    beq @receiver
-    cmp #$A8            ; Own SLA+R has been received
-    beq @transmitter
-    jmp @fault
-
-@receiver:
-    lda #(PCA_CON_AA | PCA_CON_ENSIO | PCA_CON_330kHz)
-    sta PCA_CON         ; Reset SI bit
-
-    jsr i2c_wait_busy
-
-    lda PCA_STA
-    cmp #$80            ; Data has been received
-    bne @receiver_done
-
-    lda cmd_recv_state  ; Load our current state
-    
-    cmp #RECV_STATE_DATA ; Check if we are in the data load state
-    beq @receiver_data
-
-    cmp #RECV_STATE_VAL  ; Check if we are in the value state
-    beq @receiver_value
+;
+; Handle the bytes the IRQ handler has added to the ring
+;
+; The receive state picks the handler from a jump table, and each
+; handler keeps taking bytes for as long as the ring has them. The end
+; of a transaction always goes back to the register state. Data block
+; writes never reach the ring, since the IRQ handler stores them itself.
+;
+.proc i2c_recv_service
+    ldx cmd_recv_state
+    lda @handlers_hi,X  ; Push the handler address minus one,
+    pha                 ; so RTS jumps to it
+    lda @handlers_lo,X
+    pha
+    ldx ring_head       ; Every handler expects the ring head in X
+    rts
 
-@receiver_register:
-    lda PCA_DAT
+@register:
+    ring_pop @register_idle, @register_stop
     sta cmd_register    ; Store the register byte
-    cmp #REG_DATA_START ; Check if we received a data load register
-    bcs @receiver_register_data
+    cmp #REG_LIST       ; Check if we received a register list
+    beq @register_list
+    cmp #REG_QUEUE      ; Check if we received a queue write
+    beq @register_queue
+    cmp #REG_PCM        ; Check if we received a PCM stream write
+    beq @register_pcm
 
-@receiver_register_value:
     lda #RECV_STATE_VAL
     sta cmd_recv_state  ; Register received, switch to value state
-    jmp @receiver
-
-@receiver_register_data:
-    lda #RECV_STATE_DATA
-    sta cmd_recv_state  ; Register received, switch to data load state
-    
-    ; Populate the upper byte of the data block
-    lda cmd_register
-    and #$7F
-    lsr
-    lsr
-    eor #$C0
-    sta data_offset+1
-
-    ; Populate the lower byte of the data block
-    lda cmd_register
-    ror
-    ror
-    ror
-    and #$C0
-    sta data_offset
-
-    ; Initialize the block offset
+    jmp @value
+
+@register_idle:
+    jmp @idle
+
+@register_stop:
+    jmp @stop           ; Empty transaction
+
+@register_list:
+    lda #RECV_STATE_LIST_REG
+    sta cmd_recv_state  ; List started, switch to list register state
+    jmp @list_register
+
+@register_queue:
+    lda #RECV_STATE_QUEUE_DELTA
+    sta cmd_recv_state  ; Queue write started, switch to delay state
+    jmp @queue_delta
+
+@register_pcm:
+    lda #RECV_STATE_PCM
+    sta cmd_recv_state  ; PCM stream started, switch to sample state
+    jmp @pcm
+
+    ; Value bytes for the selected register, which advances after
+    ; each one in increment mode
+@value:
+    ring_pop @value_idle, @value_stop
+    sta cmd_value       ; Store the value byte
+    jsr register_write  ; Handle the register write
+    ldx ring_head
+    jmp @value
+
+@value_idle:
+    jmp @idle
+
+@value_stop:
+    jmp @stop
+
+    ; Register list, as (reg, val) pairs
+@list_register:
+    ring_pop @list_idle, @list_stop
+    sta cmd_register    ; Store the register byte of this pair
+    lda #RECV_STATE_LIST_VAL
+    sta cmd_recv_state  ; Switch to list value state
+
+@list_value:
+    ring_pop @list_idle, @list_stop
+    sta cmd_value       ; Store the value byte of this pair
+    jsr register_write  ; Handle the register write
+    ldx ring_head
+    lda #RECV_STATE_LIST_REG
+    sta cmd_recv_state  ; Switch back to list register state
+    jmp @list_register
+
+@list_idle:
+    jmp @idle
+
+@list_stop:
+    jmp @stop
+
+    ; Queue write, as (delta, reg, val) records added at the tail
+@queue_delta:
+    ldy queue_tail
+    ring_pop @queue_idle, @queue_stop
+    sta queue_delta,Y   ; Store the delay of the new record
+    lda #RECV_STATE_QUEUE_REG
+    sta cmd_recv_state  ; Switch to queue register state
+
+@queue_reg:
+    ldy queue_tail
+    ring_pop @queue_idle, @queue_stop
+    sta queue_reg,Y     ; Store the register of the new record
+    lda #RECV_STATE_QUEUE_VAL
+    sta cmd_recv_state  ; Switch to queue value state
+
+@queue_val:
+    ldy queue_tail
+    ring_pop @queue_idle, @queue_stop
+    sta queue_val,Y     ; Store the value of the new record
+    iny                 ; Advance the tail, unless the queue is full
+    cpy queue_head
+    beq :+
+    sty queue_tail
+:   lda #RECV_STATE_QUEUE_DELTA
+    sta cmd_recv_state  ; Switch back to queue delay state
+    jmp @queue_delta
+
+@queue_idle:
+    jmp @idle
+
+@queue_stop:
+    jmp @stop
+
+    ; PCM samples, added at the tail of the buffer with the tail kept in Y.
+    ; Only a few are taken on each pass, so a whole transaction does
+    ; not hold up the samples being played from the main loop.
+@pcm:
+    ldy pcm_tail
+    lda #PCM_RECV_MAX
+    sta cmd_value       ; Count down the samples left for this pass
+@pcm_loop:
+    ring_pop @pcm_idle, @pcm_stop
+    sta pcm_buffer,Y    ; Store the sample in the free entry at the tail
+    iny                 ; Advance the tail, unless the buffer is full
+    cpy pcm_head
+    bne :+
+    dey                 ; Full, so the next sample replaces this one
+:   sty pcm_tail
+    dec cmd_value
+    bne @pcm_loop
+    rts                 ; Pick up the rest on the next pass
+
+@pcm_idle:
+    jmp @idle
+
+@pcm_stop:
+    jmp @stop
+
+@stop:
     lda #$00
-    sta cmd_value
+    sta ring_end,X      ; Clear the end marker
+    inx                 ; Advance the head, wrapping around the ring
+    cpx #RING_SIZE
+    bne :+
+    ldx #$00
+:   lsr i2c_held        ; Check if the IRQ handler is waiting for room,
+    stx ring_head       ; before making it
+    bcc :+
+    cli                 ; Let the IRQ handler in, now there is room
+:   lda #RECV_STATE_REG
+    sta cmd_recv_state  ; Wait for the register of the next transaction
+    jmp @register
+
+@idle:
+    rts
 
-    jmp @receiver
+@handlers_lo:
+    .lobytes @register-1, @value-1, @list_register-1, @list_value-1
+    .lobytes @queue_delta-1, @queue_reg-1, @queue_val-1, @pcm-1
+@handlers_hi:
+    .hibytes @register-1, @value-1, @list_register-1, @list_value-1
+    .hibytes @queue_delta-1, @queue_reg-1, @queue_val-1, @pcm-1
+.endproc
 
-@receiver_value:
-    lda PCA_DAT          ; Load the received byte
-    sta cmd_value        ; Store the value byte
-    jsr register_write   ; Handle the register write
-    jmp @receiver
+;
+; Wait for the I2C interrupt flag to be set, giving up after
+; about 0.4 seconds.
+; Returns with carry set on timeout.
+;
+.proc i2c_wait_timeout
+    ldx #$00
+    ldy #$00
+    lda #PCA_CON_SI
+@loop:
+    bit PCA_CON         ; Test the SI bit
+    bne @done
+    dex
+    bne @loop
+    dey
+    bne @loop
+    sec                 ; Timed out
+    rts
+@done:
+    clc
+    rts
+.endproc
 
-@receiver_data:
-    lda PCA_DAT          ; Load the received byte
-    ldy cmd_value        ; Load the block offset
-    sta (data_offset),Y  ; Write the data
-    iny                  ; Increment the block offset
-    sty cmd_value        ; Store the block offset
-    jmp @receiver
+;
+; Handle IRQs from the PCA9564 and the APU frame counter
+;
+; Received bytes are added to the ring for the main loop, and SI is
+; reset right away so the master can send the next one. When the ring
+; is full, SI is left set and IRQs stay masked after RTI until the
+; main loop has taken a byte out.
+;
+; Data block writes skip the ring, since going through it costs more
+; than the bus takes to send a byte. Once the register byte selects a
+; block, the handler polls SI for the rest of the transaction and
+; stores each byte itself. Reads are answered here too, a byte per
+; IRQ, so the master never waits on the main loop.
+;
+.proc irq
+    pha
+    txa
+    pha
 
-@receiver_done:
     lda PCA_STA
-    cmp #$A0            ; A STOP condition has been received
-    bne @fault
-    jmp @done
-
-@transmitter:
-    ; Check if we are reading from a data block
-    lda cmd_register
-    cmp #REG_DATA_START
-    bcs @transmitter_register_data
-
-@transmitter_register_value:
-    jsr register_read   ; Handle the register read
-    lda cmd_value
-    sta PCA_DAT
-    jmp @transmitter_done
-
-@transmitter_register_data:
-    ldy cmd_value       ; Load the block offset
-    lda (data_offset),Y ; Load the data
-    sta PCA_DAT         ; Store the byte to transmit
-    iny                 ; Increment the block offset
-    sty cmd_value       ; Store the block offset
+    cmp #$80            ; Data has been received
+    bne @event
 
-@transmitter_done:
-    lda #(PCA_CON_AA | PCA_CON_ENSIO | PCA_CON_330kHz)
+    lda PCA_DAT
+    ldx i2c_first       ; Check if this is the register byte
+    bne @register
+@store:
+    ldx ring_tail
+    sta ring_data,X     ; Store the byte in the free entry at the tail
+    inx                 ; Advance the tail, wrapping around the ring
+    cpx #RING_SIZE
+    bne :+
+    ldx #$00
+:   cpx ring_head       ; Check if the ring is full
+    beq @full
+    stx ring_tail
+
+@release:
+    lda #PCA_CON_ACK
     sta PCA_CON         ; Reset SI bit
+@return:
+    pla
+    tax
+    pla
+    rti
 
-    jsr i2c_wait_busy
-
-    lda PCA_STA
+@register:
+    ldx #$00
+    stx i2c_first
+    sta i2c_register    ; Keep the register for reads
+    cmp #REG_DATA_START ; Check if it selected a data block
+    bcc @store
+    jsr i2c_recv_block  ; Take the whole block here, which never goes
+    bcs @return         ; through the ring, so neither does its end
+    cmp #$A0
+    beq @release
+    jmp @event          ; Handle anything else like any other status
+
+@event:
+    cmp #$60            ; Own SLA+W has been received
+    beq @write
+    cmp #$A0            ; STOP condition or repeated START has been received
+    beq @end
+    cmp #$F8            ; No PCA9564 status, so it came from the APU
+    beq @apu
+    cmp #$A8            ; Own SLA+R has been received
+    beq @read
     cmp #$B8            ; Data byte in I2CDAT has been transmitted (ACK)
-    beq @transmitter
-    cmp #$C0            ; Data byte in I2CDAT has been transmitted (NACK)
-    bne @fault
-
-    jmp @done
-
-@fault:
-    ; figure out what to do in a fault condition
-    ; PCA_STA in A
-    ;
-    ; Fault cases: 
-    ; Initial SI
-    ;     Not $60 (SLA+W) or $A8 (SLA+R)
-    ; Receiver done
-    ;     Not $A0 (STOP condition)
-    ; Transmitter almost done
-    ;     Not $B8 (ACK) or $C0 (NACK)
-
-@done:
-    lda #(PCA_CON_AA | PCA_CON_ENSIO | PCA_CON_330kHz)
+    beq @read
+    cmp #$C0            ; The last byte was sent (NACK)
+    beq @release
+
+    ; A STOP condition or repeated START ends the transaction, and so
+    ; does anything unexpected. A bus error ($00) also needs STO set
+    ; to recover.
+    cmp #$00
+    beq @bus_error
+@end:
+    lda #PCA_CON_ACK
+    bne @stop
+@bus_error:
+    lda #(PCA_CON_ACK | PCA_CON_STO)
+@stop:
+    ldx ring_tail
+    inc ring_end,X      ; Mark the end of the transaction
+    inx                 ; Advance the tail, wrapping around the ring
+    cpx #RING_SIZE
+    bne :+
+    ldx #$00
+:   cpx ring_head       ; Check if the ring is full
+    beq @full
+    stx ring_tail
     sta PCA_CON         ; Reset SI bit
-    rts
+    jmp @return
+
+@write:
+    lda #$01
+    sta i2c_first       ; The register byte comes next
+    jmp @release
+
+@full:
+    lda #$01
+    sta i2c_held        ; Leave SI set for the main loop to deal with
+    tsx
+    lda $0103,X         ; Set the I flag in the stacked processor status,
+    ora #$04            ; so IRQs stay masked after RTI
+    sta $0103,X
+    jmp @return
+
+@apu:
+    lda APU_CHANCTRL    ; Reading acknowledges the frame interrupt
+    and #$40            ; Mask the frame interrupt bit
+    beq @return
+    inc frame_ticks     ; Count the tick for queue_service
+    jmp @return
+
+@read:
+    lda i2c_register    ; Check if we are reading from a data block
+    cmp #REG_DATA_START
+    bcs @read_data
+    jsr register_read   ; Load the register value into A
+    ; TODO: Check if increment mode is enabled, and increment i2c_register
+@read_send:
+    sta PCA_DAT         ; Store the byte to transmit
+    jmp @release
+
+@read_data:
+    tya
+    pha
+    ldy data_read       ; Load the block offset
+    lda (data_block),Y  ; Load the data
+    iny                 ; Increment the block offset
+    sty data_read
+    tax
+    pla
+    tay
+    txa
+    jmp @read_send
 .endproc
 
 ;
 ; Write to the selected register
 ;
+; Registers $00-$17 are dispatched through a jump table, and anything
+; above that can only be CONFIG or the PCM delay.
+;
 .proc register_write
-    lda cmd_register
-
-    ; Check if the command register maps to a writable NES APU register
-    cmp #$14            ; Check if in range $00-$13
-    bmi @apu_write
-    cmp #$15            ; Check if equal to $15
-    beq @apu_write
-    cmp #$17            ; Check if equal to $17
-    beq @apu_write
-
-    ; Check if the command register maps to the OUTPUT register
-    cmp #REG_OUTPUT
-    beq @output_write
+    ldx cmd_register
+    cpx #$18            ; Check if in range $00-$17
+    bcs @high
+    lda @handlers_hi,X  ; Push the handler address minus one,
+    pha                 ; so RTS jumps to it
+    lda @handlers_lo,X
+    pha
+    rts
 
-    ; Check if the command register maps to the CONFIG register
-    cmp #REG_CONFIG
+@high:
+    cpx #REG_CONFIG     ; Check if the command register maps to CONFIG
     beq @config_write
+    cpx #REG_PCM_DELAY  ; Check if the command register maps to the PCM delay
+    beq @pcm_delay_write
+    rts                 ; If nothing matched, ignore and return
 
-    ; If nothing matched, ignore and return
-    jmp @done
+@pcm_delay_write:
+    lda cmd_value
+    sta pcm_delay       ; Delay for a buffer at PCM_LEVEL
+    rts
 
 @apu_write:
-    tay                 ; Transfer APU register offset into Y
     lda cmd_value       ; Load the value into A
-    sta $4000, Y        ; Store A in $4000 + Y
-    jmp @done
+@apu_store:
+    sta $4000,X         ; Store A in $4000 + X
+
+    ; In increment mode, advance to the next APU register so the
+    ; following value byte in this transaction is written there.
+    lda config_value    ; Load the CONFIG value into A
+    lsr                 ; Shift the increment bit into carry
+    bcc @return         ; Return if increment mode is disabled
+    cpx #$14            ; Only increment within $00-$13
+    bcs @return
+    inc cmd_register
+@return:
+    rts
 
 @output_write:
     lda cmd_value       ; Load the value into A
@@ -349,62 +649,352 @@ forever:
     and #$07            ; Mask so only the lower 3 bits are used
     eor #$02            ; Make sure we don't reset the I2C controller
     sta APU_PAD1        ; Store in the output control register
-    jmp @done
+    rts
 
 @config_write:
-    ; Config register is currently N/A, handle as a simple
-    ; readable / writable byte of memory.
+    ; Config register only holds mode flags, otherwise
+    ; handle as a simple readable / writable byte of memory.
     lda cmd_value
     sta config_value
+    jsr pcm_reset       ; Any mode change starts with an empty buffer
+    jmp queue_reset     ; and an empty queue
+
+@dmc_write:
+    lda cmd_value       ; Load the value into A
+    and #$7F            ; Keep the DMC IRQ disabled, since nothing
+    jmp @apu_store      ; would acknowledge it
+
+    ; Handlers for $00-$13, $14 (OAMDMA), $15, OUTPUT and $17
+@handlers_lo:
+    .lobytes @apu_write-1, @apu_write-1, @apu_write-1, @apu_write-1
+    .lobytes @apu_write-1, @apu_write-1, @apu_write-1, @apu_write-1
+    .lobytes @apu_write-1, @apu_write-1, @apu_write-1, @apu_write-1
+    .lobytes @apu_write-1, @apu_write-1, @apu_write-1, @apu_write-1
+    .lobytes @dmc_write-1, @apu_write-1, @apu_write-1, @apu_write-1
+    .lobytes @return-1, @apu_write-1, @output_write-1, @apu_write-1
+@handlers_hi:
+    .hibytes @apu_write-1, @apu_write-1, @apu_write-1, @apu_write-1
+    .hibytes @apu_write-1, @apu_write-1, @apu_write-1, @apu_write-1
+    .hibytes @apu_write-1, @apu_write-1, @apu_write-1, @apu_write-1
+    .hibytes @apu_write-1, @apu_write-1, @apu_write-1, @apu_write-1
+    .hibytes @dmc_write-1, @apu_write-1, @apu_write-1, @apu_write-1
+    .hibytes @return-1, @apu_write-1, @output_write-1, @apu_write-1
+.endproc
+
+;
+; Receive a data block write, from the IRQ handler
+;
+; Called with the register byte in A, and SI still set for it. The
+; block offset is kept in Y, and each data byte is stored as soon as
+; SI is reset for it, so the next byte is already on the bus. Returns
+; with the status that ended the block in A, or with carry set if the
+; master stopped clocking and the controller was reset.
+;
+.proc i2c_recv_block
+    ldx #PCA_CON_ACK
+    stx PCA_CON         ; Reset SI bit, and set up while the first byte arrives
+
+    ; Populate the upper byte of the data block
+    tax
+    and #$7F
+    lsr
+    lsr
+    eor #$C0
+    sta data_block+1
+
+    ; Populate the lower byte of the data block
+    txa
+    ror
+    ror
+    ror
+    and #$C0
+    sta data_block
+
+    tya
+    pha
+    ldy #$00            ; Keep the block offset in Y
+    sty data_read       ; Reads start at the beginning of the block
+@loop:
+    ldx #$00            ; Poll SI up to 256 times, then wait with a timeout
+    lda #PCA_CON_SI
+@poll:
+    bit PCA_CON         ; Test the SI bit
+    bne @ready
+    dex
+    bne @poll
+    tya                 ; i2c_wait_timeout takes X and Y
+    pha
+    jsr i2c_wait_timeout
+    pla
+    tay
+    bcs @timeout
+@ready:
+    lda PCA_STA
+    cmp #$80            ; Data has been received
+    bne @done
+    ldx PCA_DAT
+    lda #PCA_CON_ACK
+    sta PCA_CON         ; Reset SI bit, so the next byte is on its way
+    txa
+    sta (data_block),Y  ; Write the data
+    iny                 ; Increment the block offset
+    jmp @loop
 
 @done:
-    ; TODO: Check if increment mode is enabled, and increment cmd_register
+    tax
+    pla
+    tay
+    txa
+    clc
+    rts
+
+@timeout:
+    pla
+    tay
+    jsr i2c_reset       ; The master stopped clocking, so start over
+    sec
     rts
 .endproc
 
 ;
-; Read from the selected register
+; Read from a register, for the IRQ handler
+;
+; Takes the register in A and returns its value in A, changing only X.
+; Records still in the ring have not been counted by the main loop yet,
+; so the free space in the queue is given less one entry for every
+; byte in the ring.
 ;
 .proc register_read
-    lda cmd_register
-
-    ; Check if the command register maps to a readable NES APU register
-    cmp #$15            ; Check if equal to $15
+    cmp #$15            ; Check if it maps to a readable NES APU register
     beq @apu_read
-
-    ; Check if the command register maps to the OUTPUT register
     cmp #REG_OUTPUT
     beq @output_read
-
-    ; Check if the command register maps to the CONFIG register
     cmp #REG_CONFIG
     beq @config_read
-
-    ; Handle the default case of an unknown register
-    jmp @unknown_read
+    cmp #REG_QUEUE
+    beq @queue_read
+    lda #$00            ; Unknown registers read as zero
+    rts
 
 @apu_read:
     lda APU_CHANCTRL    ; Load the value from $4015 into A
-    sta cmd_value       ; Store the value
-    jmp @done
+    tax
+    and #$40            ; Reading acknowledges the frame interrupt,
+    beq :+              ; so count the tick for queue_service
+    inc frame_ticks
+:   txa
+    rts
 
 @output_read:
     lda output_value    ; Load the OUTPUT value into A
     and #$07            ; Mask the readable bits
-    sta cmd_value       ; Store the value
-    jmp @done
+    rts
 
 @config_read:
     lda config_value    ; Load the CONFIG value into A
-    sta cmd_value       ; Store the value
-    jmp @done
+    rts
 
-@unknown_read:
+@queue_read:
+    lda queue_head      ; Free records are head - tail - 1
+    clc
+    sbc queue_tail
+    sta read_value
+    lda ring_tail       ; Bytes in the ring are tail - head
+    sec
+    sbc ring_head
+    and #(RING_SIZE - 1)
+    eor #$FF            ; Subtract them, stopping at zero
+    sec
+    adc read_value
+    bcs :+
     lda #$00
-    sta cmd_value
+:   rts
+.endproc
+
+;
+; Empty the write queue, and restart the APU frame counter with its
+; interrupt flag enabled if queue mode is enabled
+;
+.proc queue_reset
+    lda #$00
+    sta queue_head
+    sta queue_tail
+    sta queue_wait
+    sta queue_loaded
+    sta queue_due
+
+    lda config_value
+    and #CONFIG_QUEUE
+    beq @done
+    lda #$00
+    sta APU_PAD2        ; 4-step sequence, frame interrupt flag enabled
+    lda APU_CHANCTRL    ; Clear any pending frame interrupt flag
+@done:
+    lda #$00
+    sta frame_ticks     ; Forget any ticks counted so far
+    rts
+.endproc
+
+;
+; Apply any queued writes that are due on this APU frame counter tick.
+;
+; The frame interrupt flag in $4015 is set once per 4-step sequence
+; (29830 cycles), and the IRQ handler acknowledges it and counts the
+; tick in frame_ticks. Each record waits its delay in ticks after the
+; previous record was applied. Only a few due records are applied on
+; each pass, so the main loop gets back to the ring quickly if the
+; IRQ handler is waiting for room in it.
+;
+.proc queue_service
+    lda config_value
+    and #CONFIG_QUEUE
+    beq @done           ; Return if queue mode is disabled
+
+    lda queue_due
+    bne @apply          ; Carry on with the records due on the last tick
+
+    lda frame_ticks
+    beq @done           ; Return if no tick has happened
+    dec frame_ticks     ; Take one tick, which the IRQ handler cannot split
+    inc queue_due
+
+    lda queue_loaded
+    beq @apply          ; Nothing counting down yet
+    lda queue_wait
+    beq @apply
+    dec queue_wait      ; Count down the delay of the head record
+
+@apply:
+    lda #QUEUE_APPLY_MAX
+    sta queue_budget
+
+@loop:
+    ldy queue_head
+    cpy queue_tail
+    beq @idle           ; Stop if the queue is empty
+
+    lda queue_loaded
+    bne @check
+    lda queue_delta,Y   ; Start counting down the head record
+    sta queue_wait
+    lda #$01
+    sta queue_loaded
+
+@check:
+    lda queue_wait
+    bne @idle           ; Stop if the head record is not due yet
+
+    ldx queue_reg,Y     ; Load the APU register offset into X
+    lda queue_val,Y     ; Load the value into A
+    cpx #$17
+    beq @frame_counter
+    cpx #$14            ; Skip $4014 (OAMDMA), used for padding records
+    beq @next
+    cpx #$16            ; Skip $4016 (joypad strobe)
+    beq @next
+    cpx #$18            ; Skip anything past $4017
+    bcs @next
+    cpx #$10
+    bne :+
+    and #$7F            ; Keep the DMC IRQ disabled
+:   sta $4000,X         ; Store A in $4000 + X
+    jmp @next
+
+@frame_counter:
+    lda #$00            ; Keep the frame counter driving the queue
+    sta APU_PAD2
+
+@next:
+    iny
+    sty queue_head
+    lda #$00
+    sta queue_loaded
+    dec queue_budget
+    bne @loop           ; Leave the rest for the next pass
+    rts
 
+@idle:
+    lda #$00
+    sta queue_due       ; Nothing more is due until the next tick
+@done:
+    rts
+.endproc
+
+;
+; Empty the PCM buffer, and wait for it to fill again before playing
+;
+.proc pcm_reset
+    lda #$00
+    sta pcm_head
+    sta pcm_tail
+    sta pcm_playing
+    rts
+.endproc
+
+;
+; Play the next streamed PCM sample to $4011, if PCM mode is enabled.
+;
+; Samples are spaced out by a delay loop after each one, of five cycles
+; per pass. The ESP32 sends samples at the stream rate, so the delay is
+; shortened as the buffer fills past PCM_LEVEL and lengthened as it
+; drains, which keeps playback at that rate however long the rest of
+; the main loop takes.
+;
+.proc pcm_service
+    lda config_value
+    and #CONFIG_PCM
+    beq @done           ; Return if PCM mode is disabled
+
+    lda pcm_tail        ; Buffer level is tail - head
+    sec
+    sbc pcm_head
+    beq @underrun       ; Stop if the buffer ran dry
+    ldx pcm_playing
+    bne @play
+    cmp #PCM_LEVEL      ; Wait for enough samples to start playing
+    bcc @done
+    inc pcm_playing
+
+@play:
+    lsr                 ; Distance from PCM_LEVEL in steps of 8 samples,
+    lsr                 ; from -8 to 23
+    lsr
+    sec
+    sbc #(PCM_LEVEL / 8)
+    bmi @below
+    sta pcm_level
+    lda pcm_delay       ; One pass less for every 8 samples above
+    sec
+    sbc pcm_level
+    beq :+
+    bcs @write
+:   lda #$01            ; Keep at least one pass
+    bne @write
+
+@below:
+    sta pcm_level
+    lda pcm_delay       ; One pass more for every 8 samples below,
+    sec                 ; which only borrows if it stays in range
+    sbc pcm_level
+    bcc @write
+    lda #$FF            ; Keep at most 255 passes
+
+@write:
+    tax
+
+    ldy pcm_head
+    lda pcm_buffer,Y
+    sta APU_MODDA       ; Write the sample to the DMC load counter
+    iny
+    sty pcm_head
+
+:   dex                 ; Wait until the next sample is due
+    bne :-
 @done:
-    ; TODO: Check if increment mode is enabled, and increment cmd_register
+    rts
+
+@underrun:
+    sta pcm_playing
     rts
 .endproc
 
@@ -436,10 +1026,9 @@ forever:
 .endproc
 
 ;
-; Handle interrupts by doing nothing
+; Handle NMIs by doing nothing
 ;
 nmi:
-irq:
     rti
 
 .segment "RODATA"
@@ -0,0 +1,606 @@
+/*
+ * Cycle-counted benchmark for the 2A03 firmware I2C link
+ *
+ * Loads the assembled firmware image from software/2a03 into the
+ * fake6502 core, with a PCA9564 model at $6000-$6003 standing in for
+ * the bus controller, then drives it with scripted transactions from
+ * the I2C master. Every run reports the 6502 cycles spent per
+ * transaction and per byte, along with how long the firmware left SI
+ * set for each controller status, and checks that the APU registers
+ * and sample memory ended up holding what was sent. PCM streaming is
+ * also checked for the rate and spacing of its writes to $4011, and
+ * for buffer underruns.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "fake6502.h"
+#include "sim_pca9564.h"
+
+/* From fake6502.c */
+extern uint32_t clockticks6502;
+extern uint8_t status;
+extern uint8_t x;
+
+#define CPU_FLAG_INTERRUPT 0x04
+#define CPU_IRQ_CYCLES 7
+
+#define CPU_CLOCK_HZ 1789773
+
+/* Master clock stretch timeout, as i2c_util.c sets it in APB cycles */
+#define APB_CLOCK_HZ 80000000
+#define MASTER_TIMEOUT 12800
+
+/* Firmware address and registers, from software/2a03/main.s */
+#define SLAVE_ADDR 0x08
+#define REG_CONFIG 0x7F
+#define REG_LIST   0x7E
+#define REG_QUEUE  0x7D
+#define REG_PCM    0x7C
+#define REG_PCM_DELAY 0x7B
+#define REG_DATA_START 0x88
+
+#define CONFIG_INCREMENT 0x01
+#define CONFIG_QUEUE     0x02
+#define CONFIG_PCM       0x04
+
+/* PCM stream rate and chunk size, matching vgm_player.c */
+#define PCM_RATE_HZ 5512
+#define PCM_CHUNK   16
+
+/* Cycles the PCM delay loop takes per pass, and around it, from nes.h */
+#define PCM_PASS_CYCLES 5
+#define PCM_LOOP_CYCLES 306
+
+/* Most the PCM chunks are sent early or late, in samples */
+#define PCM_JITTER 6
+
+/* Most $4011 writes recorded by the PCM benchmark */
+#define PCM_LOG_SIZE 4096
+
+/* APU frame counter period for the 4-step sequence, in cycles */
+#define FRAME_CYCLES 29830
+
+/* Upper limit on the cycles for any single scenario */
+#define RUN_LIMIT (CPU_CLOCK_HZ * 60ULL)
+
+/* Time for the firmware to finish handling what it has received */
+#define SETTLE_CYCLES 20000
+
+static struct {
+    uint8_t ram[0x2000];
+    uint8_t sample[0x2000];
+    uint8_t rom[0x2000];
+    uint8_t apu[0x18];
+    uint32_t apu_writes;
+    bool frame_irq_enabled;
+    bool frame_flag;
+    uint64_t frame_next;
+    uint64_t now;
+    uint32_t last_ticks;
+    uint64_t pcm_time[PCM_LOG_SIZE];
+    uint8_t pcm_value[PCM_LOG_SIZE];
+    uint8_t pcm_passes[PCM_LOG_SIZE];
+    uint32_t pcm_count;
+} bench = { 0 };
+
+static void frame_counter_update()
+{
+    while (bench.frame_irq_enabled && bench.now >= bench.frame_next) {
+        bench.frame_flag = true;
+        bench.frame_next += FRAME_CYCLES;
+    }
+}
+
+/*
+ * Memory accesses are stamped with the cycle count at the start of the
+ * instruction, since fake6502 only adds up the cycles once it is done.
+ */
+uint8_t read6502(uint16_t address)
+{
+    if (address < 0x2000) {
+        return bench.ram[address];
+    } else if (address == 0x4015) {
+        frame_counter_update();
+        uint8_t value = bench.frame_flag ? 0x40 : 0x00;
+        bench.frame_flag = false;
+        return value;
+    } else if (address >= 0x6000 && address < 0x6004) {
+        return sim_pca9564_read(address & 0x03, bench.now);
+    } else if (address >= 0xC000 && address < 0xE000) {
+        return bench.sample[address - 0xC000];
+    } else if (address >= 0xE000) {
+        return bench.rom[address - 0xE000];
+    }
+    return 0;
+}
+
+void write6502(uint16_t address, uint8_t value)
+{
+    if (address < 0x2000) {
+        bench.ram[address] = value;
+    } else if (address >= 0x4000 && address < 0x4018) {
+        bench.apu[address - 0x4000] = value;
+        bench.apu_writes++;
+        if (address == 0x4011 && bench.pcm_count < PCM_LOG_SIZE) {
+            bench.pcm_time[bench.pcm_count] = bench.now;
+            bench.pcm_value[bench.pcm_count] = value;
+            // The firmware holds its delay loop count in X as it
+            // writes the sample
+            bench.pcm_passes[bench.pcm_count] = x;
+            bench.pcm_count++;
+        }
+        if (address == 0x4017) {
+            // Writing the frame counter restarts the sequence
+            bench.frame_irq_enabled = (value & 0xC0) == 0;
+            bench.frame_flag = false;
+            bench.frame_next = bench.now + FRAME_CYCLES;
+        }
+    } else if (address >= 0x6000 && address < 0x6004) {
+        sim_pca9564_write(address & 0x03, value, bench.now);
+    } else if (address >= 0xC000 && address < 0xE000) {
+        bench.sample[address - 0xC000] = value;
+    }
+}
+
+/*
+ * The PCA9564 interrupt output and the APU frame interrupt share the
+ * IRQ line, which is level triggered.
+ */
+static void cpu_step()
+{
+    frame_counter_update();
+    if (!(status & CPU_FLAG_INTERRUPT) && (sim_pca9564_int(bench.now) || bench.frame_flag)) {
+        irq6502();
+        clockticks6502 += CPU_IRQ_CYCLES;
+    }
+    step6502();
+    bench.now += (uint32_t)(clockticks6502 - bench.last_ticks);
+    bench.last_ticks = clockticks6502;
+}
+
+static void run_for(uint64_t cycles)
+{
+    uint64_t end = bench.now + cycles;
+    while (bench.now < end) {
+        cpu_step();
+    }
+}
+
+/**
+ * Run the firmware until the master has finished its script, then
+ * for long enough to handle any bytes still waiting in the firmware.
+ * @return Cycles taken by the master, or 0 if it never finished
+ */
+static uint64_t run_until_done()
+{
+    uint64_t start = bench.now;
+    while (!sim_pca9564_master_done(bench.now)) {
+        cpu_step();
+        if (bench.now - start > RUN_LIMIT) {
+            return 0;
+        }
+    }
+    uint64_t cycles = bench.now - start;
+    run_for(SETTLE_CYCLES);
+    return cycles;
+}
+
+static bool send(const uint8_t *data, size_t len)
+{
+    if (!sim_pca9564_master_write(SLAVE_ADDR, data, len)) {
+        fprintf(stderr, "Master script is full\n");
+        return false;
+    }
+    return true;
+}
+
+static bool set_config(uint8_t value)
+{
+    const uint8_t buf[] = { REG_CONFIG, value };
+    return send(buf, sizeof(buf)) && run_until_done() > 0;
+}
+
+static void print_status(const char *name, uint8_t code)
+{
+    sim_pca9564_status_stats_t stats;
+    sim_pca9564_get_status_stats(code, &stats);
+    if (stats.count == 0) {
+        return;
+    }
+    printf("    %-8s ($%02X) count=%-6u avg=%-6.1f max=%u\n", name, code,
+            stats.count, (double)stats.service / stats.count, stats.max);
+}
+
+static void print_result(const char *name, uint64_t cycles,
+        uint32_t transactions, uint32_t bytes, const char *unit, uint32_t units)
+{
+    double us = (cycles * 1000000.0) / CPU_CLOCK_HZ;
+    printf("%s\n", name);
+    printf("  transactions=%u, bytes=%u, cycles=%llu (%.0fus)\n",
+            transactions, bytes, (unsigned long long)cycles, us);
+    printf("  cycles/transaction=%.1f, cycles/byte=%.1f",
+            (double)cycles / transactions, (double)cycles / bytes);
+    if (unit) {
+        printf(", cycles/%s=%.1f", unit, (double)cycles / units);
+    }
+    printf("\n");
+    printf("  throughput=%.0f bytes/s\n", us > 0 ? (bytes * 1000000.0) / us : 0.0);
+    printf("  SI service cycles:\n");
+    print_status("SLA+W", 0x60);
+    print_status("Data", 0x80);
+    print_status("STOP", 0xA0);
+    print_status("SLA+R", 0xA8);
+    print_status("TX ACK", 0xB8);
+    print_status("TX NACK", 0xC0);
+    printf("\n");
+}
+
+/*
+ * The firmware keeps the DMC IRQ disabled, whatever is written to $4010.
+ */
+static uint8_t apu_expected(uint8_t reg, uint8_t val)
+{
+    return (reg == 0x10) ? (val & 0x7F) : val;
+}
+
+static uint32_t bench_rand(uint32_t *state)
+{
+    *state = (*state * 1103515245) + 12345;
+    return (*state >> 16) & 0x7FFF;
+}
+
+/*
+ * Single register writes, with each [register, value] pair in its own
+ * transaction the way nes_apu_write() sends them.
+ */
+static bool bench_register_writes(uint32_t count)
+{
+    uint8_t expected[0x14];
+    uint32_t seed = 1;
+
+    if (!set_config(0)) { return false; }
+    sim_pca9564_reset_stats();
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t buf[2];
+        buf[0] = i % 0x14;
+        buf[1] = (uint8_t)bench_rand(&seed);
+        expected[buf[0]] = apu_expected(buf[0], buf[1]);
+        if (!send(buf, sizeof(buf))) { return false; }
+    }
+
+    uint64_t cycles = run_until_done();
+    if (cycles == 0) { return false; }
+
+    print_result("Register writes", cycles, count, count * 2, "write", count);
+    return memcmp(bench.apu, expected, sizeof(expected)) == 0;
+}
+
+/*
+ * Register list writes, with 16 [register, value] pairs per transaction.
+ */
+static bool bench_register_list(uint32_t count)
+{
+    uint8_t expected[0x14];
+    uint32_t seed = 2;
+
+    if (!set_config(0)) { return false; }
+    sim_pca9564_reset_stats();
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t buf[33];
+        buf[0] = REG_LIST;
+        for (int j = 0; j < 16; j++) {
+            uint8_t reg = (i + j) % 0x14;
+            uint8_t val = (uint8_t)bench_rand(&seed);
+            buf[1 + (j * 2)] = reg;
+            buf[2 + (j * 2)] = val;
+            expected[reg] = apu_expected(reg, val);
+        }
+        if (!send(buf, sizeof(buf))) { return false; }
+    }
+
+    uint64_t cycles = run_until_done();
+    if (cycles == 0) { return false; }
+
+    print_result("Register list writes", cycles, count, count * 33, "write", count * 16);
+    return memcmp(bench.apu, expected, sizeof(expected)) == 0;
+}
+
+/*
+ * Queued writes, with 15 [delta, register, value] records per
+ * transaction, all due on the next frame counter tick.
+ */
+static bool bench_queue(uint32_t count)
+{
+    uint8_t expected[0x14];
+    uint32_t seed = 3;
+
+    if (count * 15 > 255) {
+        count = 255 / 15;
+    }
+    if (!set_config(CONFIG_QUEUE)) { return false; }
+    sim_pca9564_reset_stats();
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t buf[46];
+        buf[0] = REG_QUEUE;
+        for (int j = 0; j < 15; j++) {
+            uint8_t reg = (i + j) % 0x14;
+            uint8_t val = (uint8_t)bench_rand(&seed);
+            buf[1 + (j * 3)] = 0;
+            buf[2 + (j * 3)] = reg;
+            buf[3 + (j * 3)] = val;
+            expected[reg] = apu_expected(reg, val);
+        }
+        if (!send(buf, sizeof(buf))) { return false; }
+    }
+
+    uint64_t cycles = run_until_done();
+    if (cycles == 0) { return false; }
+
+    // Give the frame counter time to drain the queue
+    run_for(FRAME_CYCLES * 2);
+
+    print_result("Queued writes", cycles, count, count * 46, "record", count * 15);
+    bool result = memcmp(bench.apu, expected, sizeof(expected)) == 0;
+    return set_config(0) && result;
+}
+
+/*
+ * Data writes of whole 64-byte DMC sample blocks.
+ */
+static bool bench_data_blocks(uint32_t count)
+{
+    uint8_t *expected = malloc(sizeof(bench.sample));
+    uint32_t seed = 4;
+
+    if (!expected) { return false; }
+    if (!set_config(0)) { free(expected); return false; }
+    sim_pca9564_reset_stats();
+    memcpy(expected, bench.sample, sizeof(bench.sample));
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t buf[65];
+        uint8_t block = REG_DATA_START + (i % (0x100 - REG_DATA_START));
+        buf[0] = block;
+        for (int j = 0; j < 64; j++) {
+            buf[1 + j] = (uint8_t)bench_rand(&seed);
+        }
+        memcpy(expected + ((block & 0x7F) * 64), buf + 1, 64);
+        if (!send(buf, sizeof(buf))) { free(expected); return false; }
+    }
+
+    uint64_t cycles = run_until_done();
+    if (cycles == 0) { free(expected); return false; }
+
+    print_result("DMC block writes", cycles, count, count * 65, "block", count);
+    bool result = memcmp(bench.sample, expected, sizeof(bench.sample)) == 0;
+    free(expected);
+    return result;
+}
+
+/*
+ * Register reads, each as a register select write followed by a
+ * single byte read.
+ */
+static bool bench_register_reads(uint32_t count)
+{
+    uint8_t *values = malloc(count);
+    bool result = true;
+
+    if (!values) { return false; }
+    if (!set_config(CONFIG_INCREMENT)) { free(values); return false; }
+    sim_pca9564_reset_stats();
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t reg = REG_CONFIG;
+        if (!send(&reg, 1) || !sim_pca9564_master_read(SLAVE_ADDR, &values[i], 1)) {
+            free(values);
+            return false;
+        }
+    }
+
+    uint64_t cycles = run_until_done();
+    if (cycles == 0) { free(values); return false; }
+
+    print_result("Register reads", cycles, count, count * 2, "read", count);
+    for (uint32_t i = 0; i < count; i++) {
+        if (values[i] != CONFIG_INCREMENT) {
+            result = false;
+        }
+    }
+    free(values);
+    return set_config(0) && result;
+}
+
+/*
+ * PCM streaming, with a chunk of samples due each time the stream rate
+ * has used one up, and each chunk sent up to PCM_JITTER samples early
+ * or late. The samples count up, so any that were dropped or repeated
+ * show up as a break in the sequence, and the buffer running dry shows
+ * up as a gap of more than a chunk between samples.
+ *
+ * The cycles each sample takes outside of the delay loop, which nes.c
+ * uses to pick the delay, are measured from the time between samples
+ * less the delay loop passes the firmware picked for each one.
+ */
+static bool bench_pcm(uint32_t count)
+{
+    const uint32_t period = CPU_CLOCK_HZ / PCM_RATE_HZ;
+    const uint8_t delay = (period - PCM_LOOP_CYCLES) / PCM_PASS_CYCLES;
+    uint32_t seed = 5;
+    bool result = true;
+
+    if (!set_config(CONFIG_PCM)) { return false; }
+    const uint8_t settings[] = { REG_PCM_DELAY, delay };
+    if (!send(settings, sizeof(settings)) || run_until_done() == 0) { return false; }
+    sim_pca9564_reset_stats();
+    bench.pcm_count = 0;
+
+    uint64_t start = bench.now;
+    uint8_t sample = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t buf[1 + PCM_CHUNK];
+        buf[0] = REG_PCM;
+        for (int j = 0; j < PCM_CHUNK; j++) {
+            buf[1 + j] = sample++ & 0x7F;
+        }
+
+        int32_t jitter = (int32_t)(bench_rand(&seed) % ((PCM_JITTER * 2) + 1)) - PCM_JITTER;
+        int64_t due = (int64_t)(i + 1) * PCM_CHUNK + jitter;
+        uint64_t end = start + ((due > 0) ? (uint64_t)due * period : 0);
+        if (end > bench.now) {
+            run_for(end - bench.now);
+        }
+        if (!send(buf, sizeof(buf))) { return false; }
+    }
+    run_for((uint64_t)period * PCM_CHUNK);
+    uint64_t cycles = bench.now - start;
+
+    // Let the buffer play out
+    run_for((uint64_t)period * 512);
+
+    print_result("PCM stream writes", cycles, count, count * (1 + PCM_CHUNK),
+            "sample", count * PCM_CHUNK);
+
+    // Rate, spacing and loop cycles are taken over the second half, once
+    // the delay has had time to settle, and up to where the buffer plays out
+    uint32_t first = bench.pcm_count / 2;
+    uint32_t last = bench.pcm_count > 256 ? bench.pcm_count - 256 : 0;
+    uint32_t gap_min = UINT32_MAX;
+    uint32_t gap_max = 0;
+    uint32_t underruns = 0;
+    uint64_t passes = 0;
+    uint8_t passes_min = UINT8_MAX;
+    uint8_t passes_max = 0;
+    for (uint32_t i = 1; i < bench.pcm_count; i++) {
+        if (bench.pcm_value[i] != ((bench.pcm_value[i - 1] + 1) & 0x7F)) {
+            result = false;
+        }
+        uint32_t gap = (uint32_t)(bench.pcm_time[i] - bench.pcm_time[i - 1]);
+        if (gap > period * PCM_CHUNK) {
+            underruns++;
+        }
+        if (i > first && i <= last) {
+            if (gap < gap_min) { gap_min = gap; }
+            if (gap > gap_max) { gap_max = gap; }
+            uint8_t n = bench.pcm_passes[i - 1];
+            passes += n;
+            if (n < passes_min) { passes_min = n; }
+            if (n > passes_max) { passes_max = n; }
+        }
+    }
+    if (last > first) {
+        uint64_t span = bench.pcm_time[last] - bench.pcm_time[first];
+        double rate = (last - first) * (double)CPU_CLOCK_HZ / span;
+        double loop = (span - (double)passes * PCM_PASS_CYCLES) / (last - first);
+        printf("  samples=%u, rate=%.0f Hz (programmed %u Hz), period=%u-%u cycles\n",
+                bench.pcm_count, rate, PCM_RATE_HZ, gap_min, gap_max);
+        printf("  delay=%u-%u passes (programmed %u), loop=%.1f cycles/sample, underruns=%u\n\n",
+                passes_min, passes_max, delay, loop, underruns);
+    }
+    if (bench.pcm_count != count * PCM_CHUNK || last <= first || underruns > 0) {
+        result = false;
+    }
+
+    return set_config(0) && result;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-r rate] [-n count] nestronic.nes\n", name);
+    fprintf(stderr, "  -r rate   I2C bus clock rate, in Hz (default 400000)\n");
+    fprintf(stderr, "  -n count  Transactions per benchmark (default 100)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int rate = 400000;
+    int count = 100;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:n:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || rate <= 0 || count <= 0 || count > 100) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *filename = argv[optind];
+
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Unable to open: %s\n", filename);
+        return 1;
+    }
+    size_t len = fread(bench.rom, 1, sizeof(bench.rom), file);
+    fclose(file);
+    if (len != sizeof(bench.rom)) {
+        fprintf(stderr, "Firmware image is not 8 KiB: %s\n", filename);
+        return 1;
+    }
+
+    uint32_t bit_cycles = (uint32_t)(((uint64_t)CPU_CLOCK_HZ << 8) / rate);
+    sim_pca9564_reset(bit_cycles);
+    sim_pca9564_set_timeout((uint32_t)(((uint64_t)MASTER_TIMEOUT * CPU_CLOCK_HZ) / APB_CLOCK_HZ));
+
+    // Run through startup until the firmware enables the controller
+    reset6502();
+    bench.last_ticks = clockticks6502;
+    while (!sim_pca9564_is_ready()) {
+        cpu_step();
+        if (bench.now > RUN_LIMIT) {
+            fprintf(stderr, "Firmware never enabled the I2C controller\n");
+            return 1;
+        }
+    }
+    printf("Startup took %llu cycles, bus byte time is %.1f cycles\n\n",
+            (unsigned long long)bench.now, (bit_cycles * 9) / 256.0);
+
+    struct {
+        const char *name;
+        bool (*run)(uint32_t count);
+    } benchmarks[] = {
+        { "register writes", bench_register_writes },
+        { "register list", bench_register_list },
+        { "queued writes", bench_queue },
+        { "DMC blocks", bench_data_blocks },
+        { "register reads", bench_register_reads },
+        { "PCM stream", bench_pcm }
+    };
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (!benchmarks[i].run(count)) {
+            fprintf(stderr, "Failed: %s\n\n", benchmarks[i].name);
+            failed++;
+        }
+    }
+    if (sim_pca9564_nacks() > 0) {
+        fprintf(stderr, "Slave did not acknowledge %u transactions\n", sim_pca9564_nacks());
+        failed++;
+    }
+    if (sim_pca9564_timeouts() > 0) {
+        fprintf(stderr, "Master timed out on %u transactions\n", sim_pca9564_timeouts());
+        failed++;
+    }
+
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * Host-side benchmark for the NSF 6502 interpreter
+ *
+ * Plays a song from each NSF file through both fake6502 and the
+ * interpreter in nsf_cpu.c for a fixed number of frames, then reports
+ * the emulated cycles/second of each. Both runs must produce the same
+ * APU writes, at the same cycle counts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "nsf.h"
+
+typedef struct {
+    uint32_t ticks;
+    uint16_t reg;
+    uint8_t dat;
+} trace_write_t;
+
+typedef struct {
+    trace_write_t *writes;
+    size_t len;
+    size_t size;
+    uint32_t frames;
+    uint32_t ticks;
+    int64_t time_us;
+} trace_t;
+
+static nsf_file_t *trace_nsf = NULL;
+static trace_t *trace_active = NULL;
+
+static int64_t time_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+}
+
+static void trace_apu_write(nes_apu_register_t reg, uint8_t dat)
+{
+    trace_t *trace = trace_active;
+
+    if (trace->len == trace->size) {
+        size_t size = trace->size ? trace->size * 2 : 65536;
+        trace_write_t *writes = realloc(trace->writes, size * sizeof(trace_write_t));
+        if (!writes) {
+            return;
+        }
+        trace->writes = writes;
+        trace->size = size;
+    }
+
+    trace_write_t *write = &trace->writes[trace->len++];
+    write->ticks = nsf_get_ticks(trace_nsf);
+    write->reg = reg;
+    write->dat = dat;
+}
+
+/*
+ * Play the song on one of the two cores, recording every APU write.
+ */
+static int bench_core(const char *filename, uint8_t song, uint32_t frames, bool reference, trace_t *trace)
+{
+    nsf_file_t *nsf;
+
+    bzero(trace, sizeof(trace_t));
+
+    if (nsf_open(&nsf, filename) != ESP_OK) {
+        fprintf(stderr, "Unable to open: %s\n", filename);
+        return -1;
+    }
+    const nsf_header_t *header = nsf_get_header(nsf);
+    if (song < 1 || song > header->total_songs) {
+        fprintf(stderr, "Invalid song: %d\n", song);
+        nsf_free(nsf);
+        return -1;
+    }
+    nsf_set_reference_cpu(nsf, reference);
+
+    trace_nsf = nsf;
+    trace_active = trace;
+
+    int64_t time0 = time_now_us();
+    if (nsf_playback_init(nsf, (header->starting_song + (song - 1)) - 1, trace_apu_write) == ESP_OK) {
+        while (trace->frames < frames) {
+            if (nsf_playback_frame(nsf) != ESP_OK) {
+                fprintf(stderr, "Frame %d failed\n", trace->frames);
+                break;
+            }
+            trace->frames++;
+        }
+    } else {
+        fprintf(stderr, "Init failed\n");
+    }
+    int64_t time1 = time_now_us();
+
+    trace->ticks = nsf_get_ticks(nsf);
+    trace->time_us = time1 - time0;
+
+    trace_nsf = NULL;
+    trace_active = NULL;
+    nsf_free(nsf);
+    return 0;
+}
+
+static bool trace_compare(const trace_t *expected, const trace_t *actual)
+{
+    size_t len = expected->len < actual->len ? expected->len : actual->len;
+
+    for (size_t i = 0; i < len; i++) {
+        const trace_write_t *e = &expected->writes[i];
+        const trace_write_t *a = &actual->writes[i];
+        if (e->ticks != a->ticks || e->reg != a->reg || e->dat != a->dat) {
+            printf("  Write %zu differs: [%u] $%04X <- $%02X, expected [%u] $%04X <- $%02X\n",
+                    i, a->ticks, a->reg, a->dat, e->ticks, e->reg, e->dat);
+            return false;
+        }
+    }
+    if (expected->len != actual->len) {
+        printf("  Write count differs: %zu, expected %zu\n", actual->len, expected->len);
+        return false;
+    }
+    if (expected->frames != actual->frames || expected->ticks != actual->ticks) {
+        printf("  Run differs: %u frames and %u cycles, expected %u frames and %u cycles\n",
+                actual->frames, actual->ticks, expected->frames, expected->ticks);
+        return false;
+    }
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-f frames] [-s song] file.nsf...\n", name);
+    fprintf(stderr, "  -f frames  Number of play calls to run (default 3600)\n");
+    fprintf(stderr, "  -s song    Song to play from each file (default 1)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t frames = 3600;
+    int song = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:s:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            frames = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            song = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || song < 1 || song > 255) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    bool failed = false;
+    uint64_t total_ticks = 0;
+    int64_t total_reference_us = 0;
+    int64_t total_interpreter_us = 0;
+
+    for (int i = optind; i < argc; i++) {
+        const char *filename = argv[i];
+        trace_t reference;
+        trace_t interpreter;
+
+        if (bench_core(filename, song, frames, true, &reference) != 0) {
+            failed = true;
+            continue;
+        }
+        if (bench_core(filename, song, frames, false, &interpreter) != 0) {
+            free(reference.writes);
+            failed = true;
+            continue;
+        }
+
+        printf("%s: %u frames, %u cycles, %zu writes\n",
+                filename, interpreter.frames, interpreter.ticks, interpreter.len);
+        printf("  fake6502: %8lld us, %12.0f cycles/s\n",
+                (long long)reference.time_us, reference.ticks / (reference.time_us / 1000000.0));
+        printf("  nsf_cpu:  %8lld us, %12.0f cycles/s\n",
+                (long long)interpreter.time_us, interpreter.ticks / (interpreter.time_us / 1000000.0));
+
+        if (!trace_compare(&reference, &interpreter)) {
+            failed = true;
+        } else {
+            total_ticks += interpreter.ticks;
+            total_reference_us += reference.time_us;
+            total_interpreter_us += interpreter.time_us;
+        }
+
+        free(reference.writes);
+        free(interpreter.writes);
+    }
+
+    if (total_ticks > 0) {
+        printf("Total: %llu cycles, fake6502 %.0f cycles/s, nsf_cpu %.0f cycles/s, speedup %.2fx\n",
+                (unsigned long long)total_ticks,
+                total_ticks / (total_reference_us / 1000000.0),
+                total_ticks / (total_interpreter_us / 1000000.0),
+                total_reference_us / (double)total_interpreter_us);
+    }
+
+    return failed ? 1 : 0;
+}
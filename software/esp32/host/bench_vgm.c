@@ -0,0 +1,345 @@
+/*
+ * Host-side benchmark for the VGM command reader
+ *
+ * Replays a VGM file through both a per-command gzread() reader, which
+ * mirrors how vgm_next_command() used to work, and the buffered reader
+ * in vgm.c, then reports the command throughput of each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "zlib.h"
+#include "vgm.h"
+
+#define UINT32_FROM_BYTES(buf, n) \
+    (uint32_t)(buf[n+3] << 24 | buf[n+2] << 16 | buf[n+1] << 8 | buf[n])
+#define UINT16_FROM_BYTES(buf, n) \
+    (uint16_t)(buf[n+1] << 8 | buf[n])
+
+static int64_t time_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+}
+
+/*
+ * Command decoder that issues a separate gzread() for the opcode and
+ * each of its operands, the same way vgm_next_command() used to.
+ */
+static int unbuffered_next_command(gzFile file, vgm_command_t *command)
+{
+    uint8_t cmd;
+
+    memset(command, 0, sizeof(vgm_command_t));
+
+    if (gzread(file, &cmd, sizeof(cmd)) != sizeof(cmd)) {
+        return -1;
+    }
+
+    if (cmd == 0x61) {
+        uint8_t buf[2];
+        if (gzread(file, &buf, sizeof(buf)) != sizeof(buf)) {
+            return -1;
+        }
+        command->type = VGM_CMD_WAIT;
+        command->info.wait.samples = UINT16_FROM_BYTES(buf, 0);
+    } else if (cmd == 0x62) {
+        command->type = VGM_CMD_WAIT;
+        command->info.wait.samples = 735;
+    } else if (cmd == 0x63) {
+        command->type = VGM_CMD_WAIT;
+        command->info.wait.samples = 882;
+    } else if (cmd == 0x66) {
+        command->type = VGM_CMD_DONE;
+    } else if (cmd == 0x67) {
+        uint8_t header[6];
+        if (gzread(file, &header, sizeof(header)) != sizeof(header)) {
+            return -1;
+        }
+        uint32_t data_size = UINT32_FROM_BYTES(header, 2);
+        if (header[1] >= 0xC0 && header[1] <= 0xDF) {
+            uint8_t addr_buf[2];
+            if (gzread(file, addr_buf, 2) != 2) {
+                return -1;
+            }
+            data_size -= 2;
+            command->info.data_block.addr = UINT16_FROM_BYTES(addr_buf, 0);
+            command->info.data_block.len = data_size;
+        }
+        if (gzseek(file, data_size, SEEK_CUR) < 0) {
+            return -1;
+        }
+        command->type = VGM_CMD_DATA_BLOCK;
+    } else if (cmd >= 0x70 && cmd <= 0x7F) {
+        command->type = VGM_CMD_WAIT;
+        command->info.wait.samples = (cmd & 0x0F) + 1;
+    } else if (cmd == 0xB4) {
+        uint8_t buf[2];
+        if (gzread(file, &buf, sizeof(buf)) != sizeof(buf)) {
+            return -1;
+        }
+        command->type = VGM_CMD_NES_APU;
+        command->info.nes_apu.reg = 0x4000 + buf[0];
+        command->info.nes_apu.dat = buf[1];
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static long bench_unbuffered(const char *filename, uint32_t data_offset)
+{
+    long count = 0;
+    vgm_command_t command;
+    gzFile file = gzopen(filename, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    if (gzseek(file, data_offset, SEEK_SET) < 0) {
+        gzclose(file);
+        return -1;
+    }
+
+    while (true) {
+        if (unbuffered_next_command(file, &command) != 0) {
+            count = -1;
+            break;
+        }
+        count++;
+        if (command.type == VGM_CMD_DONE) {
+            break;
+        }
+    }
+
+    gzclose(file);
+    return count;
+}
+
+/*
+ * Time spent purely inflating the file, which both readers have to pay.
+ */
+static int64_t bench_inflate(const char *filename)
+{
+    uint8_t buf[4096];
+    gzFile file = gzopen(filename, "rb");
+    if (!file) {
+        return -1;
+    }
+    int64_t time0 = time_now_us();
+    while (gzread(file, buf, sizeof(buf)) > 0) { }
+    int64_t time1 = time_now_us();
+    gzclose(file);
+    return time1 - time0;
+}
+
+static long bench_buffered(vgm_file_t *vgm_file)
+{
+    long count = 0;
+    vgm_command_t command;
+
+    if (vgm_seek_restart(vgm_file) != ESP_OK) {
+        return -1;
+    }
+
+    while (true) {
+        if (vgm_next_command(vgm_file, &command, /*load_data*/false) != ESP_OK) {
+            return -1;
+        }
+        count++;
+        if (command.type == VGM_CMD_DONE) {
+            break;
+        }
+    }
+    return count;
+}
+
+/*
+ * Write a GD3 tag block with only the track name filled in, since the
+ * player will not open a file without one. Returns its length.
+ */
+static uint32_t write_gd3(gzFile file, const char *track_name)
+{
+    // The track name, then ten empty strings, all in UTF-16
+    uint32_t size = ((strlen(track_name) + 1) * 2) + (10 * 2);
+    uint8_t gd3[12] = {
+        'G', 'd', '3', ' ',
+        0x00, 0x01, 0x00, 0x00,
+        size & 0xFF, (size >> 8) & 0xFF, (size >> 16) & 0xFF, (size >> 24) & 0xFF
+    };
+    if (file) {
+        gzwrite(file, gd3, sizeof(gd3));
+        for (const char *p = track_name; *p; p++) {
+            gzputc(file, *p);
+            gzputc(file, 0x00);
+        }
+        for (int i = 0; i < 11 * 2; i++) {
+            gzputc(file, 0x00);
+        }
+    }
+    return sizeof(gd3) + size;
+}
+
+/*
+ * Write a synthetic NES APU track that looks like a busy song, with
+ * groups of register writes separated by short waits.
+ */
+static int generate_track(const char *filename, long apu_writes)
+{
+    uint8_t header[0x100] = {0};
+    gzFile file = gzopen(filename, "wb6");
+    if (!file) {
+        return -1;
+    }
+
+    // The GD3 tags go between the header and the data, since the file
+    // is compressed as it is written and cannot be patched afterwards
+    const char *track_name = "Synthetic APU track";
+    uint32_t data_offset = sizeof(header) + write_gd3(NULL, track_name);
+
+    memcpy(header, "Vgm ", 4);
+    header[0x08] = 0x61;
+    header[0x09] = 0x01;
+    header[0x14] = sizeof(header) - 0x14;
+    header[0x34] = (data_offset - 0x34) & 0xFF;
+    header[0x35] = ((data_offset - 0x34) >> 8) & 0xFF;
+    header[0x84] = 0x4C; /* 1789772 Hz */
+    header[0x85] = 0x4F;
+    header[0x86] = 0x1B;
+    gzwrite(file, header, sizeof(header));
+    write_gd3(file, track_name);
+
+    // Build a set of short phrases and repeat them with small variations,
+    // so the result compresses roughly like a real track does.
+    uint8_t phrases[16][64][2];
+    srand(1);
+    for (int p = 0; p < 16; p++) {
+        for (int i = 0; i < 64; i++) {
+            phrases[p][i][0] = rand() % 0x14;
+            phrases[p][i][1] = rand() & 0xFF;
+        }
+    }
+
+    long written = 0;
+    while (written < apu_writes) {
+        int p = rand() % 16;
+        for (int i = 0; i < 64 && written < apu_writes; i += 4) {
+            for (int j = i; j < i + 4; j++) {
+                uint8_t cmd[3] = { 0xB4, phrases[p][j][0], phrases[p][j][1] };
+                if (rand() % 16 == 0) {
+                    cmd[2] ^= 0x01;
+                }
+                gzwrite(file, cmd, sizeof(cmd));
+                written++;
+            }
+            gzputc(file, 0x62);
+        }
+    }
+    gzputc(file, 0x66);
+    gzclose(file);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-g writes] [-n iterations] file.vgz\n", name);
+    fprintf(stderr, "  -g writes      Generate a synthetic track with this many APU writes\n");
+    fprintf(stderr, "  -n iterations  Number of passes over the file (default 3)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    long generate = 0;
+    int iterations = 3;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g:n:h")) != -1) {
+        switch (opt) {
+        case 'g':
+            generate = atol(optarg);
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *filename = argv[optind];
+
+    if (generate > 0 && generate_track(filename, generate) != 0) {
+        fprintf(stderr, "Unable to write: %s\n", filename);
+        return 1;
+    }
+
+    vgm_file_t *vgm_file;
+    if (vgm_open(&vgm_file, filename) != ESP_OK) {
+        fprintf(stderr, "Unable to open: %s\n", filename);
+        return 1;
+    }
+    uint32_t data_offset = vgm_get_header(vgm_file)->data_offset;
+
+    int64_t best_inflate = INT64_MAX;
+    int64_t best_unbuffered = INT64_MAX;
+    int64_t best_buffered = INT64_MAX;
+    long count_unbuffered = 0;
+    long count_buffered = 0;
+
+    for (int i = 0; i < iterations; i++) {
+        int64_t time0 = time_now_us();
+        count_unbuffered = bench_unbuffered(filename, data_offset);
+        int64_t time1 = time_now_us();
+        count_buffered = bench_buffered(vgm_file);
+        int64_t time2 = time_now_us();
+
+        if (count_unbuffered < 0 || count_buffered < 0) {
+            fprintf(stderr, "Command stream error\n");
+            vgm_free(vgm_file);
+            return 1;
+        }
+        int64_t inflate_time = bench_inflate(filename);
+        if (inflate_time >= 0 && inflate_time < best_inflate) { best_inflate = inflate_time; }
+        if (time1 - time0 < best_unbuffered) { best_unbuffered = time1 - time0; }
+        if (time2 - time1 < best_buffered) { best_buffered = time2 - time1; }
+    }
+    vgm_free(vgm_file);
+
+    if (count_unbuffered != count_buffered) {
+        fprintf(stderr, "Command count mismatch: %ld != %ld\n",
+                count_unbuffered, count_buffered);
+        return 1;
+    }
+
+    double rate_unbuffered = count_unbuffered / (best_unbuffered / 1000000.0);
+    double rate_buffered = count_buffered / (best_buffered / 1000000.0);
+
+    printf("Commands:   %ld\n", count_buffered);
+    printf("Unbuffered: %8lld us, %12.0f commands/s\n",
+            (long long)best_unbuffered, rate_unbuffered);
+    printf("Buffered:   %8lld us, %12.0f commands/s\n",
+            (long long)best_buffered, rate_buffered);
+    printf("Inflate:    %8lld us\n", (long long)best_inflate);
+    printf("Speedup:    %.2fx", rate_buffered / rate_unbuffered);
+
+    // Inflate is timed on its own, so on small inputs it can come out
+    // longer than a whole buffered pass, which leaves nothing to compare
+    if (best_inflate < best_buffered && best_inflate < best_unbuffered) {
+        printf(" (%.2fx excluding inflate)\n",
+                (best_unbuffered - best_inflate) / (double)(best_buffered - best_inflate));
+    } else {
+        printf(" (n/a excluding inflate)\n");
+    }
+
+    return 0;
+}
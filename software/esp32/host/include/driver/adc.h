@@ -0,0 +1,12 @@
+/*
+ * Host build shim for the ESP-IDF ADC driver types
+ */
+
+#ifndef DRIVER_ADC_H
+#define DRIVER_ADC_H
+
+typedef enum {
+    ADC1_CHANNEL_5 = 5
+} adc1_channel_t;
+
+#endif /* DRIVER_ADC_H */
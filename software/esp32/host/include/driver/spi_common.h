@@ -0,0 +1,13 @@
+/*
+ * Host build shim for the ESP-IDF SPI driver types
+ */
+
+#ifndef DRIVER_SPI_COMMON_H
+#define DRIVER_SPI_COMMON_H
+
+typedef enum {
+    HSPI_HOST = 1,
+    VSPI_HOST = 2
+} spi_host_device_t;
+
+#endif /* DRIVER_SPI_COMMON_H */
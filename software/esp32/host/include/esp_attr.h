@@ -0,0 +1,11 @@
+/*
+ * Host build shim for the ESP-IDF memory placement attributes
+ */
+
+#ifndef ESP_ATTR_H
+#define ESP_ATTR_H
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+#endif /* ESP_ATTR_H */
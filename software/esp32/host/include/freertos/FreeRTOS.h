@@ -0,0 +1,50 @@
+/*
+ * Host build shim for the FreeRTOS kernel types
+ *
+ * Tasks map onto POSIX threads, and critical sections onto a single
+ * process-wide lock. Task priorities are accepted but not applied,
+ * so scheduling follows the host rather than the ESP32.
+ */
+
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE  ((BaseType_t)0)
+#define pdTRUE   ((BaseType_t)1)
+#define pdFAIL   pdFALSE
+#define pdPASS   pdTRUE
+
+/* Ticks are kept at one per millisecond, as in the ESP32 configuration */
+#define portMAX_DELAY      ((TickType_t)0xFFFFFFFF)
+#define portTICK_RATE_MS   ((TickType_t)1)
+#define portTICK_PERIOD_MS portTICK_RATE_MS
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+
+void host_enter_critical();
+void host_exit_critical();
+
+#define portENTER_CRITICAL(mux)     do { (void)(mux); host_enter_critical(); } while (0)
+#define portEXIT_CRITICAL(mux)      do { (void)(mux); host_exit_critical(); } while (0)
+#define portENTER_CRITICAL_ISR(mux) portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux)  portEXIT_CRITICAL(mux)
+
+#define BIT0  0x00000001
+#define BIT1  0x00000002
+#define BIT2  0x00000004
+#define BIT3  0x00000008
+#define BIT4  0x00000010
+#define BIT5  0x00000020
+#define BIT6  0x00000040
+#define BIT7  0x00000080
+
+#endif /* FREERTOS_H */
@@ -0,0 +1,144 @@
+/*
+ * ESP-IDF high resolution timer on top of POSIX threads
+ */
+
+#include <esp_timer.h>
+#include <esp_err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int64_t alarm;
+    bool armed;
+    bool exiting;
+};
+
+int64_t esp_timer_get_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((int64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static void *esp_timer_thread(void *arg)
+{
+    struct esp_timer *timer = arg;
+
+    pthread_mutex_lock(&timer->lock);
+    while (!timer->exiting) {
+        if (!timer->armed) {
+            pthread_cond_wait(&timer->cond, &timer->lock);
+            continue;
+        }
+
+        if (esp_timer_get_time() < timer->alarm) {
+            struct timespec deadline = {
+                .tv_sec = timer->alarm / 1000000,
+                .tv_nsec = (timer->alarm % 1000000) * 1000
+            };
+            pthread_cond_timedwait(&timer->cond, &timer->lock, &deadline);
+            continue;
+        }
+
+        // Like the ESP-IDF timer task, callbacks run without the lock held
+        timer->armed = false;
+        pthread_mutex_unlock(&timer->lock);
+        timer->callback(timer->arg);
+        pthread_mutex_lock(&timer->lock);
+    }
+    pthread_mutex_unlock(&timer->lock);
+
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    if (!create_args || !create_args->callback || !out_handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct esp_timer *timer = malloc(sizeof(struct esp_timer));
+    if (!timer) {
+        return ESP_ERR_NO_MEM;
+    }
+    bzero(timer, sizeof(struct esp_timer));
+    timer->callback = create_args->callback;
+    timer->arg = create_args->arg;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&timer->lock, NULL);
+
+    if (pthread_create(&timer->thread, NULL, esp_timer_thread, timer) != 0) {
+        pthread_cond_destroy(&timer->cond);
+        pthread_mutex_destroy(&timer->lock);
+        free(timer);
+        return ESP_ERR_NO_MEM;
+    }
+
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    esp_err_t ret = ESP_OK;
+
+    pthread_mutex_lock(&timer->lock);
+    if (timer->armed) {
+        ret = ESP_ERR_INVALID_STATE;
+    } else {
+        timer->alarm = esp_timer_get_time() + (int64_t)timeout_us;
+        timer->armed = true;
+        pthread_cond_signal(&timer->cond);
+    }
+    pthread_mutex_unlock(&timer->lock);
+
+    return ret;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    esp_err_t ret = ESP_OK;
+
+    pthread_mutex_lock(&timer->lock);
+    if (!timer->armed) {
+        ret = ESP_ERR_INVALID_STATE;
+    } else {
+        timer->armed = false;
+        pthread_cond_signal(&timer->cond);
+    }
+    pthread_mutex_unlock(&timer->lock);
+
+    return ret;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    if (!timer) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pthread_mutex_lock(&timer->lock);
+    timer->exiting = true;
+    pthread_cond_signal(&timer->cond);
+    pthread_mutex_unlock(&timer->lock);
+
+    pthread_join(timer->thread, NULL);
+    pthread_cond_destroy(&timer->cond);
+    pthread_mutex_destroy(&timer->lock);
+    free(timer);
+
+    return ESP_OK;
+}
@@ -0,0 +1,382 @@
+/*
+ * FreeRTOS kernel services on top of POSIX threads
+ */
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <freertos/event_groups.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+struct host_task_t {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notify;
+    TaskFunction_t function;
+    void *parameters;
+};
+
+struct host_semaphore_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UBaseType_t count;
+    UBaseType_t max_count;
+};
+
+struct host_event_group_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    EventBits_t bits;
+};
+
+static pthread_mutex_t critical_lock;
+static pthread_once_t critical_once = PTHREAD_ONCE_INIT;
+static __thread struct host_task_t *current_task = NULL;
+
+static void host_critical_init()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&critical_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void host_enter_critical()
+{
+    pthread_once(&critical_once, host_critical_init);
+    pthread_mutex_lock(&critical_lock);
+}
+
+void host_exit_critical()
+{
+    pthread_mutex_unlock(&critical_lock);
+}
+
+/*
+ * Condition variables wait against the monotonic clock, so the
+ * timeouts line up with esp_timer_get_time().
+ */
+static void host_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void host_ticks_to_deadline(TickType_t ticks, struct timespec *deadline)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    uint64_t ms = (uint64_t)ticks * portTICK_RATE_MS;
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/**
+ * Wait on a condition variable for a number of ticks.
+ * @return false if the wait timed out
+ */
+static bool host_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock,
+        TickType_t ticks, const struct timespec *deadline)
+{
+    if (ticks == portMAX_DELAY) {
+        pthread_cond_wait(cond, lock);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT;
+}
+
+static struct host_task_t *host_task_create()
+{
+    struct host_task_t *task = malloc(sizeof(struct host_task_t));
+    if (!task) {
+        return NULL;
+    }
+    bzero(task, sizeof(struct host_task_t));
+    pthread_mutex_init(&task->lock, NULL);
+    host_cond_init(&task->cond);
+    return task;
+}
+
+static void host_task_free(struct host_task_t *task)
+{
+    pthread_mutex_destroy(&task->lock);
+    pthread_cond_destroy(&task->cond);
+    free(task);
+}
+
+static void *host_task_entry(void *arg)
+{
+    struct host_task_t *task = arg;
+    current_task = task;
+    task->function(task->parameters);
+
+    // Tasks are supposed to delete themselves rather than return
+    vTaskDelete(NULL);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t pvTaskCode, const char *pcName,
+        uint32_t usStackDepth, void *pvParameters,
+        UBaseType_t uxPriority, TaskHandle_t *pxCreatedTask)
+{
+    struct host_task_t *task = host_task_create();
+    if (!task) {
+        return pdFAIL;
+    }
+    task->function = pvTaskCode;
+    task->parameters = pvParameters;
+
+    // The handle has to be valid before the task starts running,
+    // since tasks commonly look themselves up through it
+    if (pxCreatedTask) {
+        *pxCreatedTask = task;
+    }
+
+    if (pthread_create(&task->thread, NULL, host_task_entry, task) != 0) {
+        if (pxCreatedTask) {
+            *pxCreatedTask = NULL;
+        }
+        host_task_free(task);
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char *pcName,
+        uint32_t usStackDepth, void *pvParameters,
+        UBaseType_t uxPriority, TaskHandle_t *pxCreatedTask, BaseType_t xCoreID)
+{
+    // Threads are left to the host scheduler
+    return xTaskCreate(pvTaskCode, pcName, usStackDepth, pvParameters, uxPriority, pxCreatedTask);
+}
+
+void vTaskDelete(TaskHandle_t xTask)
+{
+    // Only self-deletion is supported, which is all this code uses
+    if (xTask && xTask != current_task) {
+        abort();
+    }
+    struct host_task_t *task = current_task;
+    current_task = NULL;
+    if (task) {
+        host_task_free(task);
+    }
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t xTicksToDelay)
+{
+    struct timespec deadline;
+    host_ticks_to_deadline(xTicksToDelay, &deadline);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+}
+
+TickType_t xTaskGetTickCount()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (TickType_t)(((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000) / portTICK_RATE_MS);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+    // Threads that were not created as tasks, such as the one
+    // running main(), are given a task the first time they ask
+    if (!current_task) {
+        current_task = host_task_create();
+        if (!current_task) {
+            abort();
+        }
+        current_task->thread = pthread_self();
+    }
+    return current_task;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify)
+{
+    pthread_mutex_lock(&xTaskToNotify->lock);
+    xTaskToNotify->notify++;
+    pthread_cond_signal(&xTaskToNotify->cond);
+    pthread_mutex_unlock(&xTaskToNotify->lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait)
+{
+    struct host_task_t *task = xTaskGetCurrentTaskHandle();
+    struct timespec deadline;
+    host_ticks_to_deadline(xTicksToWait, &deadline);
+
+    pthread_mutex_lock(&task->lock);
+    while (task->notify == 0) {
+        if (!host_cond_wait(&task->cond, &task->lock, xTicksToWait, &deadline)) {
+            break;
+        }
+    }
+    uint32_t value = task->notify;
+    if (value > 0) {
+        task->notify = xClearCountOnExit ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+
+    return value;
+}
+
+static SemaphoreHandle_t host_semaphore_create(UBaseType_t max_count, UBaseType_t count)
+{
+    struct host_semaphore_t *sem = malloc(sizeof(struct host_semaphore_t));
+    if (!sem) {
+        return NULL;
+    }
+    pthread_mutex_init(&sem->lock, NULL);
+    host_cond_init(&sem->cond);
+    sem->count = count;
+    sem->max_count = max_count;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+    return host_semaphore_create(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    return host_semaphore_create(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount)
+{
+    return host_semaphore_create(uxMaxCount, uxInitialCount);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t xSemaphore)
+{
+    if (xSemaphore) {
+        pthread_mutex_destroy(&xSemaphore->lock);
+        pthread_cond_destroy(&xSemaphore->cond);
+        free(xSemaphore);
+    }
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xTicksToWait)
+{
+    struct timespec deadline;
+    host_ticks_to_deadline(xTicksToWait, &deadline);
+
+    pthread_mutex_lock(&xSemaphore->lock);
+    while (xSemaphore->count == 0) {
+        if (!host_cond_wait(&xSemaphore->cond, &xSemaphore->lock, xTicksToWait, &deadline)) {
+            break;
+        }
+    }
+    BaseType_t result = pdFALSE;
+    if (xSemaphore->count > 0) {
+        xSemaphore->count--;
+        result = pdTRUE;
+    }
+    pthread_mutex_unlock(&xSemaphore->lock);
+
+    return result;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore)
+{
+    BaseType_t result = pdFALSE;
+
+    pthread_mutex_lock(&xSemaphore->lock);
+    if (xSemaphore->count < xSemaphore->max_count) {
+        xSemaphore->count++;
+        pthread_cond_signal(&xSemaphore->cond);
+        result = pdTRUE;
+    }
+    pthread_mutex_unlock(&xSemaphore->lock);
+
+    return result;
+}
+
+EventGroupHandle_t xEventGroupCreate()
+{
+    struct host_event_group_t *group = malloc(sizeof(struct host_event_group_t));
+    if (!group) {
+        return NULL;
+    }
+    pthread_mutex_init(&group->lock, NULL);
+    host_cond_init(&group->cond);
+    group->bits = 0;
+    return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t xEventGroup)
+{
+    if (xEventGroup) {
+        pthread_mutex_destroy(&xEventGroup->lock);
+        pthread_cond_destroy(&xEventGroup->cond);
+        free(xEventGroup);
+    }
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t xEventGroup)
+{
+    pthread_mutex_lock(&xEventGroup->lock);
+    EventBits_t bits = xEventGroup->bits;
+    pthread_mutex_unlock(&xEventGroup->lock);
+    return bits;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToSet)
+{
+    pthread_mutex_lock(&xEventGroup->lock);
+    xEventGroup->bits |= uxBitsToSet;
+    EventBits_t bits = xEventGroup->bits;
+    pthread_cond_broadcast(&xEventGroup->cond);
+    pthread_mutex_unlock(&xEventGroup->lock);
+    return bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToClear)
+{
+    pthread_mutex_lock(&xEventGroup->lock);
+    EventBits_t bits = xEventGroup->bits;
+    xEventGroup->bits &= ~uxBitsToClear;
+    pthread_mutex_unlock(&xEventGroup->lock);
+    return bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup,
+        const EventBits_t uxBitsToWaitFor, const BaseType_t xClearOnExit,
+        const BaseType_t xWaitForAllBits, TickType_t xTicksToWait)
+{
+    struct timespec deadline;
+    host_ticks_to_deadline(xTicksToWait, &deadline);
+
+    pthread_mutex_lock(&xEventGroup->lock);
+    for (;;) {
+        EventBits_t matched = xEventGroup->bits & uxBitsToWaitFor;
+        bool done = xWaitForAllBits ? (matched == uxBitsToWaitFor) : (matched != 0);
+        if (done || !host_cond_wait(&xEventGroup->cond, &xEventGroup->lock, xTicksToWait, &deadline)) {
+            break;
+        }
+    }
+    EventBits_t bits = xEventGroup->bits;
+    EventBits_t matched = bits & uxBitsToWaitFor;
+    if (xClearOnExit && (xWaitForAllBits ? (matched == uxBitsToWaitFor) : (matched != 0))) {
+        xEventGroup->bits &= ~uxBitsToWaitFor;
+    }
+    pthread_mutex_unlock(&xEventGroup->lock);
+
+    return bits;
+}
@@ -0,0 +1,54 @@
+/*
+ * Simulated 2A03 endpoint for host builds
+ *
+ * This implements the ESP-IDF I2C master driver functions, and decodes
+ * every transaction addressed to the 2A03 the same way its firmware
+ * does. That way the real nes.c and i2c_util.c run unchanged on top.
+ *
+ * Each transaction blocks for as long as it would take on the bus,
+ * counting nine clocks per byte and one each for start and stop
+ * conditions, and every write that reaches the APU is recorded.
+ */
+
+#ifndef SIM_2A03_H
+#define SIM_2A03_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <esp_err.h>
+
+typedef struct {
+    uint32_t transactions; /*!< Completed transactions to the 2A03 */
+    uint32_t nacks;        /*!< Transactions to addresses with no device */
+    uint64_t bytes;        /*!< Bytes sent or received, including addresses */
+    int64_t busy_us;       /*!< Time the bus was in use */
+    uint32_t apu_writes;   /*!< APU register writes applied immediately */
+    uint32_t queue_writes; /*!< APU register writes applied from the queue */
+    uint32_t pcm_writes;   /*!< Samples played from the PCM buffer */
+    uint32_t data_bytes;   /*!< Bytes written to sample memory */
+} sim_2a03_stats_t;
+
+/**
+ * Set the simulated bus clock rate.
+ *
+ * @param rate Clock rate in Hz, or 0 to use the rate passed to i2c_param_config()
+ */
+void sim_2a03_set_bus_rate(uint32_t rate);
+
+/**
+ * Write a line to the given file for every write that reaches the APU
+ * or sample memory, or pass NULL to stop.
+ *
+ * Lines hold the time in microseconds since the log was set, then
+ * "W reg val" for register writes, "Q reg val" for register writes
+ * applied from the queue, "P 11 val" for samples played from the PCM
+ * buffer, or "D addr len" for sample data writes.
+ */
+void sim_2a03_set_log(FILE *file);
+
+void sim_2a03_get_stats(sim_2a03_stats_t *stats);
+void sim_2a03_reset_stats();
+
+#endif /* SIM_2A03_H */
@@ -0,0 +1,417 @@
+#include "sim_pca9564.h"
+
+#include <string.h>
+#include <strings.h>
+
+/* Most bus operations the master can have queued up */
+#define SCRIPT_SIZE 8192
+
+/* Bus bit times for each operation */
+#define BITS_START 1
+#define BITS_STOP  1
+#define BITS_BYTE  9
+
+/* Status codes for slave mode */
+#define STA_SLAW_ACK   0x60 /*!< Own SLA+W received, ACK returned */
+#define STA_RX_ACK     0x80 /*!< Data received, ACK returned */
+#define STA_STOP       0xA0 /*!< STOP or repeated START received */
+#define STA_SLAR_ACK   0xA8 /*!< Own SLA+R received, ACK returned */
+#define STA_TX_ACK     0xB8 /*!< Data transmitted, ACK received */
+#define STA_TX_NACK    0xC0 /*!< Data transmitted, NACK received */
+#define STA_IDLE       0xF8 /*!< No relevant state information */
+
+typedef enum {
+    OP_START,
+    OP_WRITE,
+    OP_READ,
+    OP_STOP
+} op_type_t;
+
+typedef struct {
+    op_type_t type;
+    uint8_t value;
+    uint8_t *dest;
+    bool last;
+} op_t;
+
+typedef enum {
+    MODE_NOT_ADDRESSED,
+    MODE_RECEIVER,
+    MODE_TRANSMITTER
+} pca_mode_t;
+
+/* Times are kept in 1/256ths of a 6502 cycle */
+#define SUB(cycles) ((uint64_t)(cycles) << 8)
+
+static struct {
+    uint32_t bit_time;
+    uint64_t timeout;
+
+    // Controller registers
+    uint8_t con;
+    uint8_t sta;
+    uint8_t dat;
+    uint8_t adr;
+    bool si;
+    uint64_t si_time;
+    pca_mode_t mode;
+    bool ready;
+
+    // Master script, and the operation currently on the bus
+    op_t script[SCRIPT_SIZE];
+    size_t head;
+    size_t tail;
+    op_t op;
+    bool op_active;
+    bool op_deferred;
+    uint64_t op_end;
+    uint64_t bus_time;
+    bool bus_idle;
+    bool expect_address;
+    bool aborting;
+    bool timed_out;
+    uint32_t nacks;
+    uint32_t timeouts;
+
+    sim_pca9564_status_stats_t stats[256];
+} pca = { 0 };
+
+void sim_pca9564_reset(uint32_t bit_cycles)
+{
+    bzero(&pca, sizeof(pca));
+    pca.bit_time = bit_cycles;
+    pca.sta = STA_IDLE;
+    pca.bus_idle = true;
+}
+
+void sim_pca9564_set_timeout(uint32_t cycles)
+{
+    pca.timeout = SUB(cycles);
+}
+
+static void pca_set_si(uint8_t status, uint64_t time)
+{
+    pca.sta = status;
+    pca.si = true;
+    pca.si_time = time;
+}
+
+static void pca_skip_to_stop()
+{
+    // The master gives up on the transaction, and only sends STOP
+    while (pca.head != pca.tail && pca.script[pca.head % SCRIPT_SIZE].type != OP_STOP) {
+        pca.head++;
+    }
+}
+
+/*
+ * Apply the effect of an operation that has finished on the bus.
+ */
+static void pca_complete(const op_t *op, uint64_t time)
+{
+    switch (op->type) {
+    case OP_START:
+        if (pca.mode == MODE_RECEIVER) {
+            pca_set_si(STA_STOP, time);
+        }
+        pca.mode = MODE_NOT_ADDRESSED;
+        pca.expect_address = true;
+        pca.aborting = false;
+        break;
+    case OP_WRITE:
+        if (pca.expect_address) {
+            pca.expect_address = false;
+            bool enabled = (pca.con & (PCA9564_CON_ENSIO | PCA9564_CON_AA))
+                    == (PCA9564_CON_ENSIO | PCA9564_CON_AA);
+            if (enabled && (op->value >> 1) == (pca.adr >> 1)) {
+                bool read = (op->value & 0x01) != 0;
+                pca.mode = read ? MODE_TRANSMITTER : MODE_RECEIVER;
+                pca_set_si(read ? STA_SLAR_ACK : STA_SLAW_ACK, time);
+            } else {
+                pca.nacks++;
+                pca.aborting = true;
+                pca_skip_to_stop();
+            }
+        } else if (pca.mode == MODE_RECEIVER && !pca.aborting) {
+            pca.dat = op->value;
+            pca_set_si(STA_RX_ACK, time);
+        }
+        break;
+    case OP_READ:
+        if (pca.mode == MODE_TRANSMITTER && !pca.aborting) {
+            if (op->dest) {
+                *op->dest = op->value;
+            }
+            pca_set_si(op->last ? STA_TX_NACK : STA_TX_ACK, time);
+        }
+        break;
+    case OP_STOP:
+        if (pca.mode == MODE_RECEIVER) {
+            pca_set_si(STA_STOP, time);
+        }
+        pca.mode = MODE_NOT_ADDRESSED;
+        pca.aborting = false;
+        break;
+    }
+}
+
+/*
+ * Check whether SI is holding up the master, either in the middle of
+ * an operation or before it can start the next one. After a STOP the
+ * bus is free for the next start condition and address.
+ */
+static bool pca_stretching()
+{
+    if (!pca.si) {
+        return false;
+    }
+    if (pca.op_deferred) {
+        return true;
+    }
+    if (pca.op_active || pca.head == pca.tail) {
+        return false;
+    }
+    const op_t *next = &pca.script[pca.head % SCRIPT_SIZE];
+    return !(pca.sta == STA_STOP && (next->type == OP_START || pca.expect_address));
+}
+
+/*
+ * Give up on the transaction if the clock has been stretched for
+ * longer than the master timeout.
+ */
+static void pca_check_timeout(uint64_t time)
+{
+    if (pca.timeout == 0 || pca.timed_out || !pca_stretching()) {
+        return;
+    }
+    if (pca.bus_idle) {
+        // The master only started waiting once its work was queued
+        pca.bus_time = time;
+        pca.bus_idle = false;
+    }
+    uint64_t since = (pca.bus_time > pca.si_time) ? pca.bus_time : pca.si_time;
+    if (time > since + pca.timeout) {
+        pca.timeouts++;
+        pca.timed_out = true;
+        pca.aborting = true;
+        pca.op_deferred = false;
+        pca_skip_to_stop();
+    }
+}
+
+/*
+ * Run the bus forward to the provided time.
+ */
+static void pca_advance(uint64_t now)
+{
+    const uint64_t time = SUB(now);
+
+    pca_check_timeout(time);
+
+    for (;;) {
+        if (pca.op_active) {
+            if (pca.op_end > time) {
+                break;
+            }
+            pca.op_active = false;
+            if (pca.si) {
+                // Held off by clock stretching until SI is cleared
+                pca.op_deferred = true;
+                break;
+            }
+            pca_complete(&pca.op, pca.op_end);
+            continue;
+        }
+
+        if (pca.head == pca.tail) {
+            pca.bus_idle = true;
+            break;
+        }
+        if (pca.op_deferred) {
+            break;
+        }
+
+        // With SI set the clock is held low
+        const op_t *next = &pca.script[pca.head % SCRIPT_SIZE];
+        if (pca_stretching()) {
+            break;
+        }
+
+        if (pca.bus_idle) {
+            // The master only starts on new work once it has been queued
+            if (pca.bus_time < time) {
+                pca.bus_time = time;
+            }
+            pca.bus_idle = false;
+        }
+
+        pca.op = *next;
+        pca.head++;
+        if (pca.op.type == OP_READ) {
+            // The byte shifted out is whatever the firmware left in DAT
+            pca.op.value = pca.dat;
+        }
+
+        uint32_t bits = BITS_BYTE;
+        if (pca.op.type == OP_START) {
+            bits = BITS_START;
+        } else if (pca.op.type == OP_STOP) {
+            bits = BITS_STOP;
+        }
+        pca.op_end = pca.bus_time + ((uint64_t)bits * pca.bit_time);
+        pca.bus_time = pca.op_end;
+        pca.op_active = true;
+    }
+}
+
+static void pca_clear_si(uint64_t now)
+{
+    const uint64_t time = SUB(now);
+
+    sim_pca9564_status_stats_t *stats = &pca.stats[pca.sta];
+    uint32_t service = (uint32_t)((time - pca.si_time) >> 8);
+    stats->count++;
+    stats->service += service;
+    if (service > stats->max) {
+        stats->max = service;
+    }
+
+    if (pca.sta == STA_TX_NACK) {
+        pca.mode = MODE_NOT_ADDRESSED;
+    }
+    pca.si = false;
+    pca.sta = STA_IDLE;
+    pca.timed_out = false;
+
+    if (pca.bus_time < time) {
+        pca.bus_time = time;
+    }
+    if (pca.op_deferred) {
+        pca.op_deferred = false;
+        pca_complete(&pca.op, time);
+    }
+}
+
+uint8_t sim_pca9564_read(uint8_t reg, uint64_t now)
+{
+    pca_advance(now);
+
+    switch (reg & 0x03) {
+    case PCA9564_STA:
+        return pca.si ? pca.sta : STA_IDLE;
+    case PCA9564_DAT:
+        return pca.dat;
+    case PCA9564_ADR:
+        return pca.adr;
+    case PCA9564_CON:
+    default:
+        return pca.con | (pca.si ? PCA9564_CON_SI : 0);
+    }
+}
+
+void sim_pca9564_write(uint8_t reg, uint8_t value, uint64_t now)
+{
+    pca_advance(now);
+
+    switch (reg & 0x03) {
+    case PCA9564_TO:
+        break;
+    case PCA9564_DAT:
+        pca.dat = value;
+        break;
+    case PCA9564_ADR:
+        pca.adr = value;
+        break;
+    case PCA9564_CON:
+        pca.con = value & ~PCA9564_CON_SI;
+        if ((value & (PCA9564_CON_ENSIO | PCA9564_CON_AA)) == (PCA9564_CON_ENSIO | PCA9564_CON_AA)) {
+            pca.ready = true;
+        }
+        // Writing a zero to SI clears it, and writing a one does nothing
+        if (pca.si && !(value & PCA9564_CON_SI)) {
+            pca_clear_si(now);
+        }
+        break;
+    }
+
+    pca_advance(now);
+}
+
+bool sim_pca9564_int(uint64_t now)
+{
+    pca_advance(now);
+    return pca.si;
+}
+
+bool sim_pca9564_is_ready()
+{
+    return pca.ready;
+}
+
+static bool pca_script_add(op_type_t type, uint8_t value, uint8_t *dest, bool last)
+{
+    if (pca.tail - pca.head >= SCRIPT_SIZE) {
+        return false;
+    }
+    op_t *op = &pca.script[pca.tail % SCRIPT_SIZE];
+    op->type = type;
+    op->value = value;
+    op->dest = dest;
+    op->last = last;
+    pca.tail++;
+    return true;
+}
+
+bool sim_pca9564_master_write(uint8_t address, const uint8_t *data, size_t len)
+{
+    if (SCRIPT_SIZE - (pca.tail - pca.head) < len + 3) {
+        return false;
+    }
+    pca_script_add(OP_START, 0, NULL, false);
+    pca_script_add(OP_WRITE, (uint8_t)(address << 1), NULL, false);
+    for (size_t i = 0; i < len; i++) {
+        pca_script_add(OP_WRITE, data[i], NULL, false);
+    }
+    pca_script_add(OP_STOP, 0, NULL, false);
+    return true;
+}
+
+bool sim_pca9564_master_read(uint8_t address, uint8_t *data, size_t len)
+{
+    if (len == 0 || SCRIPT_SIZE - (pca.tail - pca.head) < len + 3) {
+        return false;
+    }
+    pca_script_add(OP_START, 0, NULL, false);
+    pca_script_add(OP_WRITE, (uint8_t)((address << 1) | 0x01), NULL, false);
+    for (size_t i = 0; i < len; i++) {
+        pca_script_add(OP_READ, 0, &data[i], i == len - 1);
+    }
+    pca_script_add(OP_STOP, 0, NULL, false);
+    return true;
+}
+
+bool sim_pca9564_master_done(uint64_t now)
+{
+    pca_advance(now);
+    return pca.head == pca.tail && !pca.op_active && !pca.op_deferred && !pca.si;
+}
+
+uint32_t sim_pca9564_nacks()
+{
+    return pca.nacks;
+}
+
+uint32_t sim_pca9564_timeouts()
+{
+    return pca.timeouts;
+}
+
+void sim_pca9564_get_status_stats(uint8_t status, sim_pca9564_status_stats_t *stats)
+{
+    memcpy(stats, &pca.stats[status], sizeof(sim_pca9564_status_stats_t));
+}
+
+void sim_pca9564_reset_stats()
+{
+    bzero(pca.stats, sizeof(pca.stats));
+}
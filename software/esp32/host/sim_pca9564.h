@@ -0,0 +1,114 @@
+/*
+ * PCA9564 I2C controller model, in slave mode
+ *
+ * Models the controller registers as the 2A03 firmware sees them at
+ * $6000-$6003, along with an I2C master on the other side of the bus
+ * that runs through a script of bus operations. All times are in 6502
+ * clock cycles.
+ *
+ * Each byte takes nine bit times on the bus, and the start and stop
+ * conditions one bit time each. Whenever the controller sets SI, it
+ * stretches the clock until the firmware clears it again, so the
+ * master cannot move on until the firmware has serviced the byte.
+ * Like the ESP32 master, it gives up on the transaction if the clock
+ * is stretched for longer than its timeout.
+ */
+
+#ifndef SIM_PCA9564_H
+#define SIM_PCA9564_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* PCA9564 register offsets from $6000 */
+#define PCA9564_STA 0 /*!< Status (R) */
+#define PCA9564_TO  0 /*!< Time-out (W) */
+#define PCA9564_DAT 1 /*!< Data (R/W) */
+#define PCA9564_ADR 2 /*!< Own address (R/W) */
+#define PCA9564_CON 3 /*!< Control (R/W) */
+
+/* Control register flags */
+#define PCA9564_CON_AA    0x80
+#define PCA9564_CON_ENSIO 0x40
+#define PCA9564_CON_SI    0x08
+
+typedef struct {
+    uint32_t count;   /*!< Number of times SI was set with this status */
+    uint64_t service; /*!< Total cycles from SI being set until it was cleared */
+    uint32_t max;     /*!< Longest time from SI being set until it was cleared */
+} sim_pca9564_status_stats_t;
+
+/**
+ * Reset the controller and the master.
+ *
+ * @param bit_cycles 6502 clock cycles per bus bit, in 1/256ths of a cycle
+ */
+void sim_pca9564_reset(uint32_t bit_cycles);
+
+/**
+ * Set how long the master lets the clock be stretched before it gives
+ * up on the transaction, and only sends STOP.
+ *
+ * @param cycles Timeout in 6502 clock cycles, or 0 to wait forever
+ */
+void sim_pca9564_set_timeout(uint32_t cycles);
+
+/* Register access from the 6502 side */
+uint8_t sim_pca9564_read(uint8_t reg, uint64_t now);
+void sim_pca9564_write(uint8_t reg, uint8_t value, uint64_t now);
+
+/**
+ * Check whether the interrupt output is asserted, which follows SI.
+ */
+bool sim_pca9564_int(uint64_t now);
+
+/**
+ * Check whether the firmware has enabled the controller as a slave.
+ */
+bool sim_pca9564_is_ready();
+
+/**
+ * Queue a complete write transaction from the master.
+ *
+ * @param address 7-bit slave address
+ * @param data Bytes to send after the address
+ * @param len Number of bytes
+ * @return false if the script is full
+ */
+bool sim_pca9564_master_write(uint8_t address, const uint8_t *data, size_t len);
+
+/**
+ * Queue a complete read transaction from the master.
+ *
+ * @param address 7-bit slave address
+ * @param data Where to store the received bytes, when they arrive
+ * @param len Number of bytes
+ * @return false if the script is full
+ */
+bool sim_pca9564_master_read(uint8_t address, uint8_t *data, size_t len);
+
+/**
+ * Check whether the master has run through its whole script, and the
+ * firmware has serviced everything that happened on the bus.
+ */
+bool sim_pca9564_master_done(uint64_t now);
+
+/**
+ * Get the number of transactions the slave did not acknowledge.
+ */
+uint32_t sim_pca9564_nacks();
+
+/**
+ * Get the number of transactions the master gave up on, after the
+ * clock was stretched for longer than its timeout.
+ */
+uint32_t sim_pca9564_timeouts();
+
+/**
+ * Get how long the firmware took to service SI, for one status code.
+ */
+void sim_pca9564_get_status_stats(uint8_t status, sim_pca9564_status_stats_t *stats);
+void sim_pca9564_reset_stats();
+
+#endif /* SIM_PCA9564_H */
@@ -0,0 +1,435 @@
+/*
+ * Host-side simulator for the DMC sample placement planner
+ *
+ * Scans a VGM file for sample references the same way
+ * vgm_player_prepare() does, builds a placement plan with vgm_plan.c,
+ * and then replays that plan against a data write throughput, as
+ * reported by the data write benchmark on the diagnostics menu. Each
+ * load starts once the previous reference has been played, and counts
+ * as a miss if it cannot finish before its own reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zlib.h"
+#include "vgm.h"
+#include "vgm_data.h"
+#include "vgm_plan.h"
+#include "nes.h"
+#include "utlist.h"
+
+#define BLOCK_LOAD_MIN 8
+#define BLOCK_LOAD_MAX 127
+
+/* Overall rate from the data write benchmark, in bits per second */
+#define DEFAULT_DATA_RATE 146000
+
+/* Same as nes.c, which cannot be built for the host */
+uint16_t nes_addr_to_apu_block(uint16_t addr)
+{
+    if (addr >= 0xC000) {
+        return (addr >> 6) & 0xFF;
+    } else if (addr >= 0x8000) {
+        return (((addr - 0xC000) >> 6) & 0xFF) + 256;
+    } else {
+        return 0;
+    }
+}
+
+uint16_t nes_len_to_apu_blocks(uint32_t len)
+{
+    if ((len & 0x3F) == 0) {
+        return len >> 6;
+    } else {
+        return ((len | 0x3F) + 1) >> 6;
+    }
+}
+
+/*
+ * Collect sample references, mirroring the scan in vgm_player_prepare().
+ */
+static vgm_data_state_t *scan_refs(vgm_file_t *vgm_file)
+{
+    vgm_command_t command;
+    uint32_t sample_time = 0;
+    uint16_t current_block = 0;
+    uint16_t current_len = 0;
+    bool mod_dirty = false;
+
+    vgm_data_state_t *data_state = vgm_data_state_create();
+    vgm_data_t *vgm_data = vgm_data_create();
+    if (!data_state || !vgm_data) {
+        vgm_data_state_free(data_state);
+        vgm_data_free(vgm_data);
+        return NULL;
+    }
+
+    while (vgm_next_command(vgm_file, &command, /*load_data*/true) == ESP_OK) {
+        if (command.type == VGM_CMD_DATA_BLOCK) {
+            if (command.info.data_block.data
+                    && (command.info.data_block.addr & 0xFFC0) == command.info.data_block.addr
+                    && command.info.data_block.len > 0) {
+                vgm_data_load(vgm_data, sample_time,
+                        command.info.data_block.addr,
+                        command.info.data_block.data,
+                        command.info.data_block.len);
+            }
+            free(command.info.data_block.data);
+        }
+        else if (command.type == VGM_CMD_NES_APU) {
+            if (command.info.nes_apu.reg == NES_APU_MODADDR) {
+                current_block = command.info.nes_apu.dat;
+                mod_dirty = true;
+            }
+            else if (command.info.nes_apu.reg == NES_APU_MODLEN) {
+                current_len = command.info.nes_apu.dat * 16;
+                mod_dirty = true;
+            }
+        }
+
+        if ((command.type == VGM_CMD_WAIT || command.type == VGM_CMD_DONE)
+                && mod_dirty && current_len > 0) {
+            mod_dirty = false;
+            if (vgm_data_state_add_ref(data_state, vgm_data, sample_time, current_block, current_len) != ESP_OK) {
+                fprintf(stderr, "Unable to add sample reference\n");
+                break;
+            }
+        }
+
+        if (command.type == VGM_CMD_WAIT) {
+            sample_time += command.info.wait.samples;
+        }
+        else if (command.type == VGM_CMD_DONE) {
+            break;
+        }
+    }
+
+    vgm_data_free(vgm_data);
+    return data_state;
+}
+
+static void write_sample(gzFile file, uint8_t block, const uint8_t *data, uint8_t len)
+{
+    uint32_t size = (len * 64) + 2;
+    uint16_t addr = 0xC000 + (block * 64);
+    uint8_t cmd[9] = {
+        0x67, 0x66, 0xC2,
+        size & 0xFF, (size >> 8) & 0xFF, (size >> 16) & 0xFF, (size >> 24) & 0xFF,
+        addr & 0xFF, addr >> 8
+    };
+    gzwrite(file, cmd, sizeof(cmd));
+    gzwrite(file, data, len * 64);
+}
+
+static int compare_ptr(const void *a, const void *b)
+{
+    uintptr_t pa = (uintptr_t)(*(const void * const *)a);
+    uintptr_t pb = (uintptr_t)(*(const void * const *)b);
+    return (pa > pb) - (pa < pb);
+}
+
+/*
+ * Write a GD3 tag block with only the track name filled in, since the
+ * player will not open a file without one. Returns its length.
+ */
+static uint32_t write_gd3(gzFile file, const char *track_name)
+{
+    // The track name, then ten empty strings, all in UTF-16
+    uint32_t size = ((strlen(track_name) + 1) * 2) + (10 * 2);
+    uint8_t gd3[12] = {
+        'G', 'd', '3', ' ',
+        0x00, 0x01, 0x00, 0x00,
+        size & 0xFF, (size >> 8) & 0xFF, (size >> 16) & 0xFF, (size >> 24) & 0xFF
+    };
+    if (file) {
+        gzwrite(file, gd3, sizeof(gd3));
+        for (const char *p = track_name; *p; p++) {
+            gzputc(file, *p);
+            gzputc(file, 0x00);
+        }
+        for (int i = 0; i < 11 * 2; i++) {
+            gzputc(file, 0x00);
+        }
+    }
+    return sizeof(gd3) + size;
+}
+
+/*
+ * Write a synthetic track that cycles through more sample data than
+ * fits in the sample window at once. Like many real tracks, it uploads
+ * the same sample data again at the start of every section.
+ */
+static int generate_track(const char *filename, int samples, int refs)
+{
+    uint8_t header[0x100] = {0};
+    gzFile file = gzopen(filename, "wb6");
+    if (!file) {
+        return -1;
+    }
+
+    // The GD3 tags go between the header and the data, since the file
+    // is compressed as it is written and cannot be patched afterwards
+    const char *track_name = "Synthetic sample track";
+    uint32_t data_offset = sizeof(header) + write_gd3(NULL, track_name);
+
+    memcpy(header, "Vgm ", 4);
+    header[0x08] = 0x61;
+    header[0x09] = 0x01;
+    header[0x14] = sizeof(header) - 0x14;
+    header[0x34] = (data_offset - 0x34) & 0xFF;
+    header[0x35] = ((data_offset - 0x34) >> 8) & 0xFF;
+    header[0x84] = 0x4C; /* 1789772 Hz */
+    header[0x85] = 0x4F;
+    header[0x86] = 0x1B;
+    gzwrite(file, header, sizeof(header));
+    write_gd3(file, track_name);
+
+    // Lay the samples out back to back from $C000, each 4 to 32 blocks
+    static uint8_t sample_data[256 * 64];
+    uint8_t sample_block[256];
+    uint8_t sample_len[256];
+    uint16_t block = 0;
+    srand(1);
+    for (int i = 0; i < samples; i++) {
+        uint8_t len = 4 + (rand() % 29);
+        if (block + len > 256) {
+            samples = i;
+            break;
+        }
+        sample_block[i] = block;
+        sample_len[i] = len;
+        for (int j = 0; j < len * 64; j++) {
+            sample_data[(block * 64) + j] = rand() & 0xFF;
+        }
+        block += len;
+    }
+
+    // Reference the samples with some locality, like drum patterns do
+    int current = 0;
+    for (int i = 0; i < refs && samples > 0; i++) {
+        if (i % 1000 == 0) {
+            for (int j = 0; j < samples; j++) {
+                write_sample(file, sample_block[j], sample_data + (sample_block[j] * 64), sample_len[j]);
+            }
+        }
+
+        if (rand() % 4 == 0) {
+            current = rand() % samples;
+        } else {
+            current = (current + 1 + (rand() % 3)) % samples;
+        }
+        uint8_t cmd[9] = {
+            0xB4, NES_APU_MODADDR - 0x4000, sample_block[current],
+            0xB4, NES_APU_MODLEN - 0x4000, sample_len[current] * 4,
+            0xB4, NES_APU_CHANCTRL - 0x4000, 0x1F
+        };
+        gzwrite(file, cmd, sizeof(cmd));
+
+        int frames = 1 + (rand() % 8);
+        for (int j = 0; j < frames; j++) {
+            gzputc(file, 0x62);
+        }
+    }
+    gzputc(file, 0x66);
+    gzclose(file);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-r rate] [-g samples] [-n refs] [-v] file.vgz\n", name);
+    fprintf(stderr, "  -r rate     Data write rate, in bits per second (default %d)\n", DEFAULT_DATA_RATE);
+    fprintf(stderr, "  -g samples  Generate a synthetic track with this many samples\n");
+    fprintf(stderr, "  -n refs     Number of sample references to generate (default 2000)\n");
+    fprintf(stderr, "  -v          Print every load\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int rate = DEFAULT_DATA_RATE;
+    int generate = 0;
+    int generate_refs = 2000;
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:g:n:vh")) != -1) {
+        switch (opt) {
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'g':
+            generate = atoi(optarg);
+            break;
+        case 'n':
+            generate_refs = atoi(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || rate <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *filename = argv[optind];
+
+    if (generate > 0 && generate_track(filename, generate, generate_refs) != 0) {
+        fprintf(stderr, "Unable to write: %s\n", filename);
+        return 1;
+    }
+
+    vgm_file_t *vgm_file;
+    if (vgm_open(&vgm_file, filename) != ESP_OK || vgm_seek_start(vgm_file) != ESP_OK) {
+        fprintf(stderr, "Unable to open: %s\n", filename);
+        return 1;
+    }
+
+    vgm_data_state_t *data_state = scan_refs(vgm_file);
+    vgm_free(vgm_file);
+    if (!data_state) {
+        fprintf(stderr, "Unable to scan: %s\n", filename);
+        return 1;
+    }
+
+    // Flatten the reference list into what the planner expects
+    size_t ref_count = 0;
+    vgm_data_block_ref_node_t *node;
+    for (node = vgm_data_state_ref_list(data_state); node; node = vgm_data_block_ref_list_next(node)) {
+        ref_count++;
+    }
+
+    vgm_plan_ref_t *refs = calloc(ref_count + 1, sizeof(vgm_plan_ref_t));
+    int64_t *ref_time = calloc(ref_count + 1, sizeof(int64_t));
+    uint16_t *ref_bytes = calloc(ref_count + 1, sizeof(uint16_t));
+    if (!refs || !ref_time || !ref_bytes) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    size_t i = 0;
+    for (node = vgm_data_state_ref_list(data_state); node; node = vgm_data_block_ref_list_next(node)) {
+        vgm_data_block_ref_t *block_ref = vgm_data_block_ref_list_element(node);
+        vgm_data_block_group_t *block_group = vgm_data_block_ref_block_group(block_ref);
+        refs[i].group = block_group;
+        refs[i].block_size = vgm_data_block_group_block_size(block_group);
+        ref_time[i] = (vgm_data_block_ref_sample_time(block_ref) * 1000000LL) / 44100;
+        ref_bytes[i] = vgm_data_block_group_byte_size(block_group);
+        i++;
+    }
+
+    // Count the distinct block groups
+    size_t group_count = 0;
+    const void **groups = calloc(ref_count + 1, sizeof(void *));
+    if (groups) {
+        for (i = 0; i < ref_count; i++) {
+            groups[i] = refs[i].group;
+        }
+        qsort(groups, ref_count, sizeof(void *), compare_ptr);
+        for (i = 0; i < ref_count; i++) {
+            if (i == 0 || groups[i] != groups[i - 1]) {
+                group_count++;
+            }
+        }
+        free(groups);
+    }
+
+    vgm_plan_t *plan;
+    if (vgm_plan_build(&plan, refs, ref_count, BLOCK_LOAD_MIN, BLOCK_LOAD_MAX) != ESP_OK) {
+        fprintf(stderr, "Unable to build plan\n");
+        return 1;
+    }
+
+    // Replay the plan against the data write rate
+    long preloads = 0;
+    long preload_bytes = 0;
+    long loads = 0;
+    long load_bytes = 0;
+    long misses = 0;
+    long skipped = 0;
+    int64_t worst_late = 0;
+    long errors = 0;
+    const void *load_map[256] = { 0 };
+
+    for (i = 0; i < ref_count; i++) {
+        const vgm_plan_step_t *step = vgm_plan_get_step(plan, i);
+
+        // Check that the plan never relies on a group it already evicted
+        if (step->action == VGM_PLAN_PRELOAD || step->action == VGM_PLAN_LOAD) {
+            for (int j = step->block; j < step->block + refs[i].block_size; j++) {
+                const void *evicted = load_map[j];
+                for (int k = BLOCK_LOAD_MIN; evicted && k <= BLOCK_LOAD_MAX; k++) {
+                    if (load_map[k] == evicted) {
+                        load_map[k] = NULL;
+                    }
+                }
+                load_map[j] = refs[i].group;
+            }
+        }
+        else if (step->action == VGM_PLAN_RESIDENT) {
+            for (int j = step->block; j < step->block + refs[i].block_size; j++) {
+                if (load_map[j] != refs[i].group) {
+                    errors++;
+                    break;
+                }
+            }
+        }
+
+        if (step->action == VGM_PLAN_PRELOAD) {
+            preloads++;
+            preload_bytes += ref_bytes[i];
+        }
+        else if (step->action == VGM_PLAN_LOAD) {
+            int64_t start = (i > 0) ? ref_time[i - 1] : 0;
+            int64_t duration = (ref_bytes[i] * 8LL * 1000000LL) / rate;
+            int64_t late = (start + duration) - ref_time[i];
+            loads++;
+            load_bytes += ref_bytes[i];
+            if (late > 0) {
+                misses++;
+                if (late > worst_late) {
+                    worst_late = late;
+                }
+            }
+            if (verbose) {
+                printf("[%6zu] t=%lldus load %u bytes at block %u%s\n",
+                        i, (long long)ref_time[i], ref_bytes[i], step->block,
+                        (late > 0) ? " (late)" : "");
+            }
+        }
+        else if (step->action == VGM_PLAN_SKIP) {
+            skipped++;
+            if (verbose) {
+                printf("[%6zu] t=%lldus skip %u bytes\n",
+                        i, (long long)ref_time[i], ref_bytes[i]);
+            }
+        }
+    }
+
+    printf("References:  %zu\n", ref_count);
+    printf("Groups:      %zu\n", group_count);
+    printf("Preloads:    %ld (%ld bytes, %lldms)\n", preloads, preload_bytes,
+            (long long)((preload_bytes * 8LL * 1000LL) / rate));
+    printf("Loads:       %ld (%ld bytes)\n", loads, load_bytes);
+    printf("Misses:      %ld late, %ld skipped\n", misses, skipped);
+    if (misses > 0) {
+        printf("Worst miss:  %lldus late\n", (long long)worst_late);
+    }
+    if (errors > 0) {
+        printf("Plan errors: %ld\n", errors);
+    }
+
+    vgm_plan_free(plan);
+    free(refs);
+    free(ref_time);
+    free(ref_bytes);
+    vgm_data_state_free(data_state);
+    return (errors > 0) ? 1 : 0;
+}
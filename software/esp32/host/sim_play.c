@@ -0,0 +1,244 @@
+/*
+ * Host-side playback through the simulated 2A03
+ *
+ * Runs a VGM or NSF file through the same player code as the device,
+ * with the simulated 2A03 endpoint standing in for the real bus, then
+ * reports the bus traffic along with the playback timing statistics.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <esp_err.h>
+#include <esp_timer.h>
+
+#include "board_config.h"
+#include "i2c_util.h"
+#include "i2c_bus.h"
+#include "nes.h"
+#include "vgm_player.h"
+#include "nsf_player.h"
+#include "playback_stats.h"
+#include "sim_2a03.h"
+
+static const char *bus_class_names[I2C_BUS_CLASS_MAX] = {
+    "APU", "Bulk", "Background"
+};
+
+static void stop_timer_callback(void *arg)
+{
+    EventGroupHandle_t event_group = arg;
+    xEventGroupSetBits(event_group, BIT0);
+}
+
+static bool has_extension(const char *filename, const char *ext)
+{
+    const char *dot = strrchr(filename, '.');
+    return dot && strcasecmp(dot, ext) == 0;
+}
+
+static esp_err_t play_vgm(const char *filename, EventGroupHandle_t event_group)
+{
+    vgm_player_t *player;
+    esp_err_t ret = vgm_player_init(&player, filename, NULL, NES_REPEAT_NONE, event_group);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ret = vgm_player_prepare(player);
+    if (ret == ESP_OK) {
+        i2c_bus_reset_stats();
+        playback_stats_reset();
+        sim_2a03_reset_stats();
+        ret = vgm_player_play_loop(player);
+    }
+
+    vgm_player_free(player);
+    return ret;
+}
+
+static esp_err_t play_nsf(const char *filename, uint8_t song, uint32_t run_ahead, EventGroupHandle_t event_group)
+{
+    nsf_player_t *player;
+    esp_err_t ret = nsf_player_init(&player, filename, NULL, NES_REPEAT_NONE, event_group);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    if (run_ahead > 0) {
+        nsf_player_set_run_ahead(player, run_ahead);
+    }
+
+    ret = nsf_player_prepare(player, song);
+    if (ret == ESP_OK) {
+        i2c_bus_reset_stats();
+        playback_stats_reset();
+        sim_2a03_reset_stats();
+        ret = nsf_player_play_loop(player);
+    }
+
+    nsf_player_free(player);
+    return ret;
+}
+
+static void print_report(int64_t elapsed)
+{
+    sim_2a03_stats_t sim_stats;
+    sim_2a03_get_stats(&sim_stats);
+
+    printf("Played for %.3fs\n", elapsed / 1000000.0);
+    printf("\nBus\n");
+    printf("  transactions=%u, bytes=%llu, nacks=%u\n",
+            sim_stats.transactions, (unsigned long long)sim_stats.bytes, sim_stats.nacks);
+    printf("  busy=%.3fs (%.1f%%)\n", sim_stats.busy_us / 1000000.0,
+            elapsed > 0 ? (sim_stats.busy_us * 100.0) / elapsed : 0.0);
+    printf("  apu writes=%u, queue writes=%u, pcm writes=%u, data bytes=%u\n",
+            sim_stats.apu_writes, sim_stats.queue_writes, sim_stats.pcm_writes,
+            sim_stats.data_bytes);
+
+    printf("\nScheduler\n");
+    for (int i = 0; i < I2C_BUS_CLASS_MAX; i++) {
+        i2c_bus_stats_t bus_stats;
+        i2c_bus_get_stats(i, &bus_stats);
+        if (bus_stats.count == 0) {
+            continue;
+        }
+        printf("  %s: count=%u, forced=%u, avg wait=%lldus, max wait=%lldus, max hold=%lldus\n",
+                bus_class_names[i], bus_stats.count, bus_stats.forced,
+                (long long)(bus_stats.total_wait / bus_stats.count),
+                (long long)bus_stats.max_wait, (long long)bus_stats.max_hold);
+    }
+
+    printf("\n");
+    fflush(stdout);
+    playback_stats_dump("/dev/stdout");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-a frames] [-r rate] [-s song] [-t seconds] [-w file] file.vgz|file.nsf\n", name);
+    fprintf(stderr, "  -a frames   NSF frames to emulate ahead of playback\n");
+    fprintf(stderr, "  -r rate     I2C bus clock rate, in Hz (default %d)\n", I2C_P0_FREQ_HZ);
+    fprintf(stderr, "  -s song     NSF song number (default 1)\n");
+    fprintf(stderr, "  -t seconds  Stop playback after this long\n");
+    fprintf(stderr, "  -w file     Write every APU and sample data write to this file\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int rate = 0;
+    int song = 1;
+    int seconds = 0;
+    int run_ahead = 0;
+    const char *write_filename = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:r:s:t:w:h")) != -1) {
+        switch (opt) {
+        case 'a':
+            run_ahead = atoi(optarg);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 's':
+            song = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'w':
+            write_filename = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || rate < 0 || song < 1 || song > 255 || seconds < 0 || run_ahead < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *filename = argv[optind];
+
+    FILE *write_file = NULL;
+    if (write_filename) {
+        write_file = fopen(write_filename, "w");
+        if (!write_file) {
+            fprintf(stderr, "Unable to open: %s\n", write_filename);
+            return 1;
+        }
+    }
+
+    sim_2a03_set_bus_rate(rate);
+    if (i2c_init_master_port0() != ESP_OK || nes_init(I2C_P0_NUM) != ESP_OK) {
+        fprintf(stderr, "Unable to initialize the simulated 2A03\n");
+        return 1;
+    }
+
+    // Same setup as the player task does before playback
+    i2c_bus_lock(I2C_BUS_APU, 0);
+    nes_set_config(I2C_P0_NUM, NES_CONFIG_INCREMENT);
+    nes_set_amplifier_enabled(I2C_P0_NUM, true);
+    nes_apu_init(I2C_P0_NUM);
+    i2c_bus_unlock();
+
+    EventGroupHandle_t event_group = xEventGroupCreate();
+    if (!event_group) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    esp_timer_handle_t stop_timer = NULL;
+    if (seconds > 0) {
+        esp_timer_create_args_t timer_args = {
+            .callback = stop_timer_callback,
+            .arg = event_group,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "stop_timer"
+        };
+        if (esp_timer_create(&timer_args, &stop_timer) != ESP_OK) {
+            fprintf(stderr, "Unable to create timer\n");
+            return 1;
+        }
+    }
+
+    sim_2a03_set_log(write_file);
+    if (stop_timer) {
+        esp_timer_start_once(stop_timer, seconds * 1000000ULL);
+    }
+
+    int64_t time0 = esp_timer_get_time();
+    esp_err_t ret;
+    if (has_extension(filename, ".nsf")) {
+        ret = play_nsf(filename, (uint8_t)song, (uint32_t)run_ahead, event_group);
+    } else {
+        ret = play_vgm(filename, event_group);
+    }
+    int64_t time1 = esp_timer_get_time();
+
+    i2c_bus_set_idle_until(I2C_BUS_IDLE_FOREVER);
+    sim_2a03_set_log(NULL);
+    if (write_file) {
+        fclose(write_file);
+    }
+    if (stop_timer) {
+        esp_timer_stop(stop_timer);
+        esp_timer_delete(stop_timer);
+    }
+    vEventGroupDelete(event_group);
+
+    if (ret != ESP_OK) {
+        fprintf(stderr, "Unable to play: %s (%s)\n", filename, esp_err_to_name(ret));
+        return 1;
+    }
+
+    print_report(time1 - time0);
+    return 0;
+}
@@ -12,7 +12,7 @@
 #include <time.h>
 
 #include "board_config.h"
-#include "i2c_util.h"
+#include "i2c_bus.h"
 #include "mcp7940.h"
 #include "settings.h"
 
@@ -52,7 +52,7 @@ esp_err_t board_rtc_init()
     };
     ESP_ERROR_CHECK(gpio_config(&config));
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_BACKGROUND, 0);
 
     // Enable the oscillator
     mcp7940_init(I2C_P0_NUM);
@@ -96,7 +96,7 @@ esp_err_t board_rtc_init()
     // Initialize the SRAM
     board_rtc_init_sram();
 
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     return ESP_OK;
 }
@@ -148,7 +148,7 @@ esp_err_t board_rtc_calibration()
     };
     ESP_ERROR_CHECK(gpio_config(&config));
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_BACKGROUND, 0);
 
     // Enable the oscillator
     mcp7940_init(I2C_P0_NUM);
@@ -159,7 +159,7 @@ esp_err_t board_rtc_calibration()
     // Set square wave output to 32kHz
     mcp7940_set_square_wave(I2C_P0_NUM, true, MCP7940_SW_FREQ_32KHZ);
 
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     return ESP_OK;
 }
@@ -224,9 +224,9 @@ esp_err_t board_rtc_get_time(time_t *time)
         return ESP_ERR_INVALID_ARG;
     }
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_BACKGROUND, 0);
     ret = mcp7940_get_time(I2C_P0_NUM, &timeinfo);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     if (ret != ESP_OK) {
        return ret;
@@ -253,9 +253,9 @@ esp_err_t board_rtc_set_time(const time_t *time)
         return ESP_FAIL;
     }
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_BACKGROUND, 0);
     ret = mcp7940_set_time(I2C_P0_NUM, &timeinfo);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     if (board_rtc_alarm_cb) {
         board_rtc_alarm_cb(false, false, *time);
@@ -298,7 +298,7 @@ esp_err_t board_rtc_int_event_handler()
 
     bzero(&timeinfo, sizeof(struct tm));
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_BACKGROUND, 0);
     do {
         ret = mcp7940_has_alarm_occurred(I2C_P0_NUM, MCP7940_ALARM_0, &alarm0_occurred);
         if (ret != ESP_OK) {
@@ -329,7 +329,7 @@ esp_err_t board_rtc_int_event_handler()
             }
         }
     } while (0);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     if (ret == ESP_OK && board_rtc_alarm_cb) {
         time_t time = board_rtc_timegm(&timeinfo);
@@ -0,0 +1,338 @@
+#include "i2c_bus.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <string.h>
+
+static const char *TAG = "i2c_bus";
+
+/* Most tasks that can be waiting for the bus at once */
+#define BUS_SLOTS 8
+
+/* Extra time left at the end of an idle window */
+#define BUS_MARGIN 250
+
+/* Longest a housekeeping request waits for an idle window by default */
+#define BUS_BACKGROUND_MAX_WAIT 100000
+
+/* Starting guesses for how long each class holds the bus */
+#define BUS_INITIAL_BULK_COST 3500
+#define BUS_INITIAL_BACKGROUND_COST 2000
+
+/* Should be above every task that uses the bus, so deadlines are not missed */
+#define BUS_TASK_PRIORITY 11
+
+typedef enum {
+    BUS_SLOT_FREE = 0,
+    BUS_SLOT_PENDING,
+    BUS_SLOT_GRANTED
+} i2c_bus_slot_state_t;
+
+typedef struct {
+    uint8_t state;
+    uint8_t bus_class;
+    int64_t deadline;
+    int64_t request_time;
+} i2c_bus_slot_t;
+
+static const char *bus_class_names[I2C_BUS_CLASS_MAX] = {
+    "APU", "Bulk", "Background"
+};
+
+static portMUX_TYPE bus_lock = portMUX_INITIALIZER_UNLOCKED;
+static EventGroupHandle_t bus_event_group = NULL;
+static TaskHandle_t bus_task = NULL;
+static i2c_bus_slot_t bus_slots[BUS_SLOTS];
+static int bus_owner = -1;
+static int64_t bus_grant_time = 0;
+static int64_t bus_idle_until = I2C_BUS_IDLE_FOREVER;
+static int64_t bus_cost[I2C_BUS_CLASS_MAX];
+static i2c_bus_stats_t bus_stats[I2C_BUS_CLASS_MAX];
+
+static bool i2c_bus_fits_idle_window(uint8_t bus_class, int64_t now)
+{
+    if (bus_idle_until == I2C_BUS_IDLE_FOREVER) {
+        return true;
+    }
+    return now + bus_cost[bus_class] + BUS_MARGIN <= bus_idle_until;
+}
+
+/*
+ * Rank a pending request, with lower values going first.
+ *
+ * APU writes always go first, followed by housekeeping that has run out
+ * of time. Everything else has to fit within the current idle window.
+ */
+static int i2c_bus_rank(const i2c_bus_slot_t *slot, int64_t now)
+{
+    if (slot->bus_class == I2C_BUS_APU) {
+        return 0;
+    } else if (slot->bus_class == I2C_BUS_BACKGROUND && slot->deadline <= now) {
+        return 1;
+    } else if (!i2c_bus_fits_idle_window(slot->bus_class, now)) {
+        return -1;
+    } else if (slot->bus_class == I2C_BUS_BULK) {
+        return 2;
+    } else {
+        return 3;
+    }
+}
+
+/*
+ * Pick the next request to get the bus, and mark it as the owner.
+ * Must be called with the lock held.
+ */
+static int i2c_bus_grant_next(int64_t now)
+{
+    int best = -1;
+    int best_rank = 0;
+
+    if (bus_owner >= 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < BUS_SLOTS; i++) {
+        const i2c_bus_slot_t *slot = &bus_slots[i];
+        if (slot->state != BUS_SLOT_PENDING) {
+            continue;
+        }
+
+        int rank = i2c_bus_rank(slot, now);
+        if (rank < 0) {
+            continue;
+        }
+
+        if (best < 0 || rank < best_rank
+                || (rank == best_rank && slot->deadline < bus_slots[best].deadline)
+                || (rank == best_rank && slot->deadline == bus_slots[best].deadline
+                    && slot->request_time < bus_slots[best].request_time)) {
+            best = i;
+            best_rank = rank;
+        }
+    }
+
+    if (best >= 0) {
+        i2c_bus_slot_t *slot = &bus_slots[best];
+        i2c_bus_stats_t *stats = &bus_stats[slot->bus_class];
+        int64_t wait = now - slot->request_time;
+
+        slot->state = BUS_SLOT_GRANTED;
+        bus_owner = best;
+        bus_grant_time = now;
+
+        stats->count++;
+        if (best_rank == 1 && !i2c_bus_fits_idle_window(slot->bus_class, now)) {
+            stats->forced++;
+        }
+        stats->total_wait += wait;
+        if (wait > stats->max_wait) {
+            stats->max_wait = wait;
+        }
+    }
+
+    return best;
+}
+
+static int i2c_bus_dispatch()
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&bus_lock);
+    int granted = i2c_bus_grant_next(now);
+    portEXIT_CRITICAL(&bus_lock);
+
+    if (granted >= 0) {
+        xEventGroupSetBits(bus_event_group, 1 << granted);
+    }
+    return granted;
+}
+
+static void i2c_bus_task(void *pvParameters)
+{
+    TickType_t timeout = portMAX_DELAY;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, timeout);
+        i2c_bus_dispatch();
+
+        // Wake up again when the next housekeeping deadline passes,
+        // since nothing else will happen to hand over the bus then
+        int64_t now = esp_timer_get_time();
+        int64_t next_deadline = INT64_MAX;
+        portENTER_CRITICAL(&bus_lock);
+        for (int i = 0; i < BUS_SLOTS; i++) {
+            if (bus_slots[i].state == BUS_SLOT_PENDING
+                    && bus_slots[i].bus_class == I2C_BUS_BACKGROUND
+                    && bus_slots[i].deadline < next_deadline) {
+                next_deadline = bus_slots[i].deadline;
+            }
+        }
+        portEXIT_CRITICAL(&bus_lock);
+
+        if (next_deadline == INT64_MAX) {
+            timeout = portMAX_DELAY;
+        } else if (next_deadline <= now) {
+            timeout = 1;
+        } else {
+            timeout = ((next_deadline - now) / 1000 / portTICK_RATE_MS) + 1;
+        }
+    }
+}
+
+esp_err_t i2c_bus_init()
+{
+    if (bus_event_group) {
+        return ESP_OK;
+    }
+
+    bzero(bus_slots, sizeof(bus_slots));
+    bzero(bus_stats, sizeof(bus_stats));
+    bus_cost[I2C_BUS_APU] = 0;
+    bus_cost[I2C_BUS_BULK] = BUS_INITIAL_BULK_COST;
+    bus_cost[I2C_BUS_BACKGROUND] = BUS_INITIAL_BACKGROUND_COST;
+
+    bus_event_group = xEventGroupCreate();
+    if (!bus_event_group) {
+        ESP_LOGE(TAG, "xEventGroupCreate error");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreate(i2c_bus_task, "i2c_bus_task", 2048, NULL, BUS_TASK_PRIORITY, &bus_task) != pdPASS) {
+        ESP_LOGE(TAG, "Unable to create bus scheduler task");
+        vEventGroupDelete(bus_event_group);
+        bus_event_group = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+void i2c_bus_lock(i2c_bus_class_t bus_class, int64_t deadline)
+{
+    if (!bus_event_group || bus_class >= I2C_BUS_CLASS_MAX) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (deadline <= 0) {
+        if (bus_class == I2C_BUS_APU) {
+            deadline = now;
+        } else if (bus_class == I2C_BUS_BULK) {
+            deadline = INT64_MAX;
+        } else {
+            deadline = now + BUS_BACKGROUND_MAX_WAIT;
+        }
+    }
+
+    int slot = -1;
+    while (slot < 0) {
+        portENTER_CRITICAL(&bus_lock);
+        for (int i = 0; i < BUS_SLOTS; i++) {
+            if (bus_slots[i].state == BUS_SLOT_FREE) {
+                bus_slots[i].state = BUS_SLOT_PENDING;
+                bus_slots[i].bus_class = bus_class;
+                bus_slots[i].deadline = deadline;
+                bus_slots[i].request_time = now;
+                slot = i;
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&bus_lock);
+
+        if (slot < 0) {
+            ESP_LOGW(TAG, "Out of request slots");
+            vTaskDelay(1);
+        }
+    }
+
+    // Take the bus right away if nothing is in the way, otherwise let
+    // the scheduler task keep track of the deadline
+    if (i2c_bus_dispatch() != slot) {
+        xTaskNotifyGive(bus_task);
+    }
+
+    xEventGroupWaitBits(bus_event_group, 1 << slot, pdTRUE, pdTRUE, portMAX_DELAY);
+}
+
+void i2c_bus_unlock()
+{
+    if (!bus_event_group) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&bus_lock);
+    if (bus_owner >= 0) {
+        uint8_t bus_class = bus_slots[bus_owner].bus_class;
+        int64_t hold = now - bus_grant_time;
+
+        // Track the hold time, reacting quickly to slower transactions
+        if (hold > bus_cost[bus_class]) {
+            bus_cost[bus_class] = hold;
+        } else {
+            bus_cost[bus_class] = ((bus_cost[bus_class] * 7) + hold) / 8;
+        }
+        if (hold > bus_stats[bus_class].max_hold) {
+            bus_stats[bus_class].max_hold = hold;
+        }
+
+        bus_slots[bus_owner].state = BUS_SLOT_FREE;
+        bus_owner = -1;
+    }
+    portEXIT_CRITICAL(&bus_lock);
+
+    i2c_bus_dispatch();
+}
+
+void i2c_bus_set_idle_until(int64_t idle_until)
+{
+    if (!bus_event_group) {
+        return;
+    }
+
+    portENTER_CRITICAL(&bus_lock);
+    bus_idle_until = idle_until;
+    portEXIT_CRITICAL(&bus_lock);
+
+    if (idle_until > 0) {
+        i2c_bus_dispatch();
+    }
+}
+
+void i2c_bus_get_stats(i2c_bus_class_t bus_class, i2c_bus_stats_t *stats)
+{
+    if (bus_class >= I2C_BUS_CLASS_MAX || !stats) {
+        return;
+    }
+
+    portENTER_CRITICAL(&bus_lock);
+    memcpy(stats, &bus_stats[bus_class], sizeof(i2c_bus_stats_t));
+    portEXIT_CRITICAL(&bus_lock);
+}
+
+void i2c_bus_reset_stats()
+{
+    portENTER_CRITICAL(&bus_lock);
+    bzero(bus_stats, sizeof(bus_stats));
+    portEXIT_CRITICAL(&bus_lock);
+}
+
+void i2c_bus_log_stats()
+{
+    for (int i = 0; i < I2C_BUS_CLASS_MAX; i++) {
+        i2c_bus_stats_t stats;
+        i2c_bus_get_stats(i, &stats);
+        if (stats.count == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%s: count=%u, forced=%u, wait avg=%lldus max=%lldus, hold max=%lldus",
+                bus_class_names[i], stats.count, stats.forced,
+                (long long)(stats.total_wait / stats.count), (long long)stats.max_wait,
+                (long long)stats.max_hold);
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * Scheduler for the shared I2C port 0 bus
+ *
+ * The 2A03, the RTC and the volume wiper all sit on port 0. Instead of
+ * taking turns on a plain mutex, each user asks for the bus with a
+ * traffic class and a deadline, and the bus is handed out in priority
+ * order. APU register writes always go first. Sample uploads and
+ * housekeeping only get the bus within the idle windows announced by
+ * the playback task, unless housekeeping has already waited past its
+ * deadline.
+ *
+ * This arbitrates ownership of the bus rather than running transactions
+ * on behalf of its users. Each user takes the lock and then talks to
+ * its device itself, and the scheduler task only wakes up to hand the
+ * bus over once a housekeeping deadline passes. A user that already
+ * holds the bus keeps it until it unlocks, so an APU write can still
+ * wait behind one housekeeping transaction that started before it was
+ * requested.
+ */
+
+#ifndef I2C_BUS_H
+#define I2C_BUS_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+typedef enum {
+    I2C_BUS_APU = 0,    /*!< Hard real-time APU register writes */
+    I2C_BUS_BULK,       /*!< Best-effort DMC sample uploads */
+    I2C_BUS_BACKGROUND, /*!< RTC and volume wiper housekeeping */
+    I2C_BUS_CLASS_MAX
+} i2c_bus_class_t;
+
+/* Idle window value for when no APU traffic is expected */
+#define I2C_BUS_IDLE_FOREVER INT64_MAX
+
+typedef struct {
+    uint32_t count;     /*!< Number of times the bus was granted */
+    uint32_t forced;    /*!< Grants made after the deadline, outside an idle window */
+    int64_t total_wait; /*!< Total time spent waiting for the bus, in microseconds */
+    int64_t max_wait;   /*!< Longest time spent waiting for the bus, in microseconds */
+    int64_t max_hold;   /*!< Longest time the bus was held, in microseconds */
+} i2c_bus_stats_t;
+
+/**
+ * Start the bus scheduler.
+ *
+ * This is called as part of initializing I2C port 0.
+ */
+esp_err_t i2c_bus_init();
+
+/**
+ * Wait for, and take ownership of, I2C port 0.
+ *
+ * @param bus_class Traffic class of the transactions that follow
+ * @param deadline Time, as returned by esp_timer_get_time(), by which
+ *                 the bus should be granted. Zero for the class default,
+ *                 which is immediately for APU writes, never for bulk
+ *                 uploads, and after a short wait for housekeeping.
+ */
+void i2c_bus_lock(i2c_bus_class_t bus_class, int64_t deadline);
+
+/**
+ * Release I2C port 0 and hand it to the next waiting request.
+ */
+void i2c_bus_unlock();
+
+/**
+ * Tell the scheduler that APU traffic does not need the bus until the
+ * provided time, as returned by esp_timer_get_time().
+ *
+ * A value of zero means that APU traffic needs the bus now, and
+ * I2C_BUS_IDLE_FOREVER means that no APU traffic is expected.
+ */
+void i2c_bus_set_idle_until(int64_t idle_until);
+
+void i2c_bus_get_stats(i2c_bus_class_t bus_class, i2c_bus_stats_t *stats);
+void i2c_bus_reset_stats();
+
+/**
+ * Log the queueing latency of each traffic class.
+ */
+void i2c_bus_log_stats();
+
+#endif /* I2C_BUS_H */
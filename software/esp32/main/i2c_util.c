@@ -10,10 +10,10 @@
 #include <driver/i2c.h>
 
 #include "board_config.h"
+#include "i2c_bus.h"
 
 static const char *TAG = "i2c_util";
 
-SemaphoreHandle_t i2c_p0_mutex = NULL;
 SemaphoreHandle_t i2c_p1_mutex = NULL;
 
 esp_err_t i2c_init_master_port0()
@@ -21,10 +21,11 @@ esp_err_t i2c_init_master_port0()
     esp_err_t ret;
     const i2c_port_t port = I2C_P0_NUM;
 
-    i2c_p0_mutex = xSemaphoreCreateMutex();
-    if (!i2c_p0_mutex) {
-        ESP_LOGE(TAG, "xSemaphoreCreateMutex error");
-        return ESP_ERR_NO_MEM;
+    // Access to port 0 is arbitrated by the bus scheduler
+    ret = i2c_bus_init();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "i2c_bus_init error: %d", ret);
+        return ret;
     }
 
     i2c_config_t conf;
@@ -99,17 +100,19 @@ esp_err_t i2c_init_master_port1()
 
 void i2c_mutex_lock(i2c_port_t port)
 {
-    SemaphoreHandle_t i2c_mutex = (port == I2C_P1_NUM) ? i2c_p1_mutex : i2c_p0_mutex;
-    if (i2c_mutex) {
-        xSemaphoreTake(i2c_mutex, portMAX_DELAY);
+    if (port == I2C_P0_NUM) {
+        i2c_bus_lock(I2C_BUS_BACKGROUND, 0);
+    } else if (i2c_p1_mutex) {
+        xSemaphoreTake(i2c_p1_mutex, portMAX_DELAY);
     }
 }
 
 void i2c_mutex_unlock(i2c_port_t port)
 {
-    SemaphoreHandle_t i2c_mutex = (port == I2C_P1_NUM) ? i2c_p1_mutex : i2c_p0_mutex;
-    if (i2c_mutex) {
-        xSemaphoreGive(i2c_mutex);
+    if (port == I2C_P0_NUM) {
+        i2c_bus_unlock();
+    } else if (i2c_p1_mutex) {
+        xSemaphoreGive(i2c_p1_mutex);
     }
 }
 
@@ -7,6 +7,10 @@
 esp_err_t i2c_init_master_port0();
 esp_err_t i2c_init_master_port1();
 
+/*
+ * Port 0 is shared through the bus scheduler in i2c_bus.h, and is
+ * locked here as background traffic.
+ */
 void i2c_mutex_lock(i2c_port_t port);
 void i2c_mutex_unlock(i2c_port_t port);
 
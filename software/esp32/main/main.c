@@ -27,6 +27,7 @@
 #include "time_handler.h"
 #include "wifi_handler.h"
 #include "i2c_util.h"
+#include "i2c_bus.h"
 #include "sdcard_util.h"
 #include "display.h"
 #include "board_rtc.h"
@@ -96,9 +97,9 @@ static void gpio_poll_task(void *pvParameters)
             int val = adc1_get_raw(ADC1_VOL_PIN);
             int rheo_val = val >> 5;
             if (last_rheo_val < 0 || abs(rheo_val - last_rheo_val) > 1) {
-                i2c_mutex_lock(I2C_P0_NUM);
+                i2c_bus_lock(I2C_BUS_BACKGROUND, 0);
                 mcp40d17_set_wiper(I2C_P0_NUM, 0x7F & rheo_val);
-                i2c_mutex_unlock(I2C_P0_NUM);
+                i2c_bus_unlock();
                 ESP_LOGI(TAG, "Set volume: %d", rheo_val);
                 last_rheo_val = rheo_val;
             }
@@ -6,6 +6,11 @@
 #include "tsl2591.h"
 #include "i2c_util.h"
 #include "nes_player.h"
+#include "playback_stats.h"
+#include "sdcard_util.h"
+
+/* File the playback statistics are written to */
+#define PLAYBACK_STATS_FILE "/sdcard/PLAYSTAT.TXT"
 
 static menu_result_t diagnostics_display()
 {
@@ -179,6 +184,102 @@ static menu_result_t diagnostics_volume()
     return menu_result;
 }
 
+static void diagnostics_playback_stats_dump()
+{
+    if (!sdcard_is_detected()) {
+        display_message("Error", "SD card was not detected", NULL, " OK ");
+    } else if (!sdcard_is_mounted()) {
+        display_message("Error", "SD card could not be accessed", NULL, " OK ");
+    } else if (playback_stats_dump(PLAYBACK_STATS_FILE) != ESP_OK) {
+        display_message("Error", "Could not write the stats file", NULL, " OK ");
+    } else {
+        display_message("Playback Stats", "Saved to SD card", NULL, " OK ");
+    }
+}
+
+static menu_result_t diagnostics_playback_stats()
+{
+    menu_result_t menu_result = MENU_OK;
+    char buf[160];
+    uint8_t page = 0;
+    int msec_elapsed = 0;
+
+    keypad_clear_events();
+
+    while (1) {
+        playback_stats_t stats;
+        playback_stats_get(&stats);
+
+        // One page for each histogram, followed by one for the counters
+        const char *title;
+        if (page < PLAYBACK_STATS_HIST_MAX) {
+            const playback_stats_histogram_t *h = &stats.hist[page];
+            title = playback_stats_hist_name(page);
+            sprintf(buf,
+                    "Count:   %u\n"
+                    "Average: %u\n"
+                    "Maximum: %u",
+                    h->count, h->count > 0 ? h->total / h->count : 0, h->max);
+        } else {
+            title = "Playback Stats";
+            size_t len = 0;
+            for (int i = 0; i < PLAYBACK_STATS_COUNTER_MAX; i++) {
+                len += sprintf(buf + len, "%s%s: %u", (i > 0) ? "\n" : "",
+                        playback_stats_counter_name(i), stats.counters[i]);
+            }
+        }
+
+        display_static_list(title, buf);
+
+        keypad_event_t keypad_event;
+        esp_err_t ret = keypad_wait_for_event(&keypad_event, 500);
+        if (ret == ESP_OK) {
+            msec_elapsed = 0;
+            if (keypad_event.pressed) {
+                if (keypad_event.key == KEYPAD_BUTTON_LEFT) {
+                    if (page == 0) { page = PLAYBACK_STATS_HIST_MAX; }
+                    else { page--; }
+                } else if (keypad_event.key == KEYPAD_BUTTON_RIGHT) {
+                    if (page == PLAYBACK_STATS_HIST_MAX) { page = 0; }
+                    else { page++; }
+                } else if (keypad_event.key == KEYPAD_BUTTON_START) {
+                    diagnostics_playback_stats_dump();
+                    keypad_clear_events();
+                } else if (keypad_event.key == KEYPAD_BUTTON_B) {
+                    break;
+                }
+            }
+        }
+        else if (ret == ESP_ERR_TIMEOUT) {
+            msec_elapsed += 500;
+            if (msec_elapsed >= MENU_TIMEOUT_MS) {
+                menu_result = MENU_TIMEOUT;
+                break;
+            }
+        }
+    }
+    return menu_result;
+}
+
+static menu_result_t diagnostics_apu_trace()
+{
+    menu_result_t menu_result = MENU_OK;
+
+    uint8_t option = display_message(
+            "APU Trace",
+            nes_player_get_trace_enabled() ? "Currently on" : "Currently off",
+            "Saves playback to TRACE.VGM\n",
+            " On \n Off ");
+    if (option == UINT8_MAX) {
+        menu_result = MENU_TIMEOUT;
+    } else if (option == 1) {
+        nes_player_set_trace_enabled(true);
+    } else if (option == 2) {
+        nes_player_set_trace_enabled(false);
+    }
+    return menu_result;
+}
+
 menu_result_t menu_diagnostics()
 {
     menu_result_t menu_result = MENU_OK;
@@ -191,7 +292,9 @@ menu_result_t menu_diagnostics()
                 "Capacitive Touch\n"
                 "Ambient Light Sensor\n"
                 "Volume Adjustment\n"
-                "NES Test");
+                "NES Test\n"
+                "Playback Stats\n"
+                "APU Trace");
 
         if (option == 1) {
             menu_result = diagnostics_display();
@@ -204,6 +307,10 @@ menu_result_t menu_diagnostics()
         } else if (option == 5) {
             nes_player_benchmark_data();
             menu_result = MENU_OK;
+        } else if (option == 6) {
+            menu_result = diagnostics_playback_stats();
+        } else if (option == 7) {
+            menu_result = diagnostics_apu_trace();
         } else if (option == UINT8_MAX) {
             menu_result = MENU_TIMEOUT;
         }
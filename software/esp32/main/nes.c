@@ -5,6 +5,7 @@
 #include <driver/i2c.h>
 
 #include "i2c_util.h"
+#include "nes_trace.h"
 
 static const char *TAG = "nes";
 
@@ -13,6 +14,10 @@ static const char *TAG = "nes";
 
 /* I2C registers */
 #define NES_OUTPUT  0x16 /*< NES OUTPUT register */
+#define NES_PCM_DELAY 0x7B /*< NES PCM sample delay */
+#define NES_PCM     0x7C /*< NES PCM stream */
+#define NES_QUEUE   0x7D /*< NES write queue */
+#define NES_LIST    0x7E /*< NES register list write */
 #define NES_CONFIG  0x7F /*< NES CONFIG register */
 
 esp_err_t nes_init(i2c_port_t i2c_num)
@@ -29,6 +34,11 @@ esp_err_t nes_init(i2c_port_t i2c_num)
         return ret;
     }
 
+    ret = nes_set_config(i2c_num, NES_CONFIG_INCREMENT);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
     ESP_LOGI(TAG, "NES CPU Initialized");
 
     return ret;
@@ -93,7 +103,228 @@ esp_err_t nes_apu_init(i2c_port_t i2c_num)
 
 esp_err_t nes_apu_write(i2c_port_t i2c_num, nes_apu_register_t reg, uint8_t dat)
 {
-    return i2c_write_register(i2c_num, NES_ADDRESS, (uint8_t)(reg & 0xFF), dat);
+    esp_err_t ret = i2c_write_register(i2c_num, NES_ADDRESS, (uint8_t)(reg & 0xFF), dat);
+    if (ret == ESP_OK && nes_trace_active) {
+        nes_trace_apu_burst((uint8_t)(reg & 0xFF), &dat, 1);
+    }
+    return ret;
+}
+
+esp_err_t nes_apu_write_burst(i2c_port_t i2c_num, nes_apu_register_t reg, uint8_t *data, size_t data_len)
+{
+    if (!data || data_len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (data_len == 1) {
+        return nes_apu_write(i2c_num, reg, data[0]);
+    }
+    if (reg < NES_APU_PULSE1CTRL || (reg + data_len - 1) > NES_APU_MODLEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    if (!cmd) {
+        ESP_LOGE(TAG, "i2c_cmd_link_create error");
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_ERROR_CHECK(i2c_master_start(cmd));
+    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, NES_ADDRESS << 1 | I2C_MASTER_WRITE, true));
+    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, (uint8_t)(reg & 0xFF), true));
+    ESP_ERROR_CHECK(i2c_master_write(cmd, data, data_len, true));
+    ESP_ERROR_CHECK(i2c_master_stop(cmd));
+
+    esp_err_t ret = i2c_master_cmd_begin(i2c_num, cmd, 1000 / portTICK_RATE_MS);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "i2c_master_cmd_begin error: [%02X] %s (%d)",
+                NES_ADDRESS, esp_err_to_name(ret), ret);
+    } else if (nes_trace_active) {
+        nes_trace_apu_burst((uint8_t)(reg & 0xFF), data, data_len);
+    }
+
+    i2c_cmd_link_delete(cmd);
+
+    return ret;
+}
+
+esp_err_t nes_apu_write_batch(i2c_port_t i2c_num, const uint8_t *regs, const uint8_t *data, size_t count)
+{
+    if (!regs || !data || count == 0 || count > NES_APU_BATCH_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (count == 1) {
+        return nes_apu_write(i2c_num, 0x4000 + regs[0], data[0]);
+    }
+
+    uint8_t buf[NES_APU_BATCH_MAX * 2];
+    for (size_t i = 0; i < count; i++) {
+        buf[i * 2] = regs[i];
+        buf[i * 2 + 1] = data[i];
+    }
+
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    if (!cmd) {
+        ESP_LOGE(TAG, "i2c_cmd_link_create error");
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_ERROR_CHECK(i2c_master_start(cmd));
+    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, NES_ADDRESS << 1 | I2C_MASTER_WRITE, true));
+    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, NES_LIST, true));
+    ESP_ERROR_CHECK(i2c_master_write(cmd, buf, count * 2, true));
+    ESP_ERROR_CHECK(i2c_master_stop(cmd));
+
+    esp_err_t ret = i2c_master_cmd_begin(i2c_num, cmd, 1000 / portTICK_RATE_MS);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "i2c_master_cmd_begin error: [%02X] %s (%d)",
+                NES_ADDRESS, esp_err_to_name(ret), ret);
+    } else if (nes_trace_active) {
+        nes_trace_apu_writes(regs, data, count);
+    }
+
+    i2c_cmd_link_delete(cmd);
+
+    return ret;
+}
+
+esp_err_t nes_apu_batch_append(i2c_port_t i2c_num, nes_apu_batch_t *batch, nes_apu_register_t reg, uint8_t dat)
+{
+    esp_err_t ret = ESP_OK;
+
+    if (batch->len >= NES_APU_BATCH_MAX) {
+        ret = nes_apu_batch_flush(i2c_num, batch);
+    }
+
+    batch->regs[batch->len] = (uint8_t)(reg & 0xFF);
+    batch->data[batch->len] = dat;
+    batch->len++;
+
+    return ret;
+}
+
+esp_err_t nes_apu_batch_flush(i2c_port_t i2c_num, nes_apu_batch_t *batch)
+{
+    if (batch->len == 0) {
+        return ESP_OK;
+    }
+
+    // A run of adjacent registers is cheaper to send as a burst,
+    // since it only needs one byte per write.
+    bool adjacent = batch->regs[batch->len - 1] <= (NES_APU_MODLEN & 0xFF);
+    for (uint8_t i = 1; adjacent && i < batch->len; i++) {
+        if (batch->regs[i] != batch->regs[i - 1] + 1) {
+            adjacent = false;
+        }
+    }
+
+    esp_err_t ret;
+    if (adjacent) {
+        ret = nes_apu_write_burst(i2c_num, 0x4000 + batch->regs[0], batch->data, batch->len);
+    } else {
+        ret = nes_apu_write_batch(i2c_num, batch->regs, batch->data, batch->len);
+    }
+    batch->len = 0;
+    return ret;
+}
+
+esp_err_t nes_apu_queue_write(i2c_port_t i2c_num, const nes_apu_queue_record_t *records, size_t count)
+{
+    if (!records || count == 0 || count > NES_APU_QUEUE_BATCH_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint8_t buf[NES_APU_QUEUE_BATCH_MAX * 3];
+    for (size_t i = 0; i < count; i++) {
+        buf[i * 3] = records[i].delta;
+        buf[i * 3 + 1] = records[i].reg;
+        buf[i * 3 + 2] = records[i].dat;
+    }
+
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    if (!cmd) {
+        ESP_LOGE(TAG, "i2c_cmd_link_create error");
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_ERROR_CHECK(i2c_master_start(cmd));
+    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, NES_ADDRESS << 1 | I2C_MASTER_WRITE, true));
+    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, NES_QUEUE, true));
+    ESP_ERROR_CHECK(i2c_master_write(cmd, buf, count * 3, true));
+    ESP_ERROR_CHECK(i2c_master_stop(cmd));
+
+    esp_err_t ret = i2c_master_cmd_begin(i2c_num, cmd, 1000 / portTICK_RATE_MS);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "i2c_master_cmd_begin error: [%02X] %s (%d)",
+                NES_ADDRESS, esp_err_to_name(ret), ret);
+    }
+
+    i2c_cmd_link_delete(cmd);
+
+    return ret;
+}
+
+esp_err_t nes_apu_queue_get_free(i2c_port_t i2c_num, uint8_t *free)
+{
+    if (!free) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint8_t data;
+    esp_err_t ret = i2c_read_register(i2c_num, NES_ADDRESS, NES_QUEUE, &data);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    *free = data;
+
+    return ESP_OK;
+}
+
+esp_err_t nes_pcm_set_rate(i2c_port_t i2c_num, uint32_t rate)
+{
+    if (rate == 0 || rate > NES_PCM_RATE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t period = NES_CPU_CLOCK / rate;
+    uint32_t delay = 1;
+    if (period > NES_PCM_LOOP_CYCLES + NES_PCM_PASS_CYCLES) {
+        delay = (period - NES_PCM_LOOP_CYCLES) / NES_PCM_PASS_CYCLES;
+    }
+    if (delay > 0xFF) {
+        delay = 0xFF;
+    }
+
+    return i2c_write_register(i2c_num, NES_ADDRESS, NES_PCM_DELAY, (uint8_t)delay);
+}
+
+esp_err_t nes_pcm_write(i2c_port_t i2c_num, const uint8_t *data, size_t data_len)
+{
+    if (!data || data_len == 0 || data_len > NES_PCM_BATCH_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    if (!cmd) {
+        ESP_LOGE(TAG, "i2c_cmd_link_create error");
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_ERROR_CHECK(i2c_master_start(cmd));
+    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, NES_ADDRESS << 1 | I2C_MASTER_WRITE, true));
+    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, NES_PCM, true));
+    ESP_ERROR_CHECK(i2c_master_write(cmd, (uint8_t *)data, data_len, true));
+    ESP_ERROR_CHECK(i2c_master_stop(cmd));
+
+    esp_err_t ret = i2c_master_cmd_begin(i2c_num, cmd, 1000 / portTICK_RATE_MS);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "i2c_master_cmd_begin error: [%02X] %s (%d)",
+                NES_ADDRESS, esp_err_to_name(ret), ret);
+    }
+
+    i2c_cmd_link_delete(cmd);
+
+    return ret;
 }
 
 esp_err_t nes_data_write(i2c_port_t i2c_num, uint8_t block, uint8_t *data, size_t data_len)
@@ -121,6 +352,8 @@ esp_err_t nes_data_write(i2c_port_t i2c_num, uint8_t block, uint8_t *data, size_
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "i2c_master_cmd_begin error: [%02X] %s (%d)",
         		NES_ADDRESS, esp_err_to_name(ret), ret);
+    } else if (nes_trace_active) {
+        nes_trace_data_write(block, data, data_len);
     }
 
     i2c_cmd_link_delete(cmd);
@@ -33,6 +33,41 @@ typedef enum {
     NES_APU_PAD2        = 0x4017  /**< Joypad #2/SOFTCLK (W) */
 } nes_apu_register_t;
 
+/* CONFIG register flags */
+#define NES_CONFIG_INCREMENT 0x01 /*< Auto-increment the APU register on write */
+#define NES_CONFIG_QUEUE     0x02 /*< Apply queued writes on APU frame ticks */
+#define NES_CONFIG_PCM       0x04 /*< Play streamed samples to $4011 at a steady rate */
+
+/* Most register writes that are sent in a single batch */
+#define NES_APU_BATCH_MAX 32
+
+/**
+ * Accumulator for register writes that are sent together
+ */
+typedef struct {
+    uint8_t len;
+    uint8_t regs[NES_APU_BATCH_MAX];
+    uint8_t data[NES_APU_BATCH_MAX];
+} nes_apu_batch_t;
+
+/* Usable records in the 2A03 write queue */
+#define NES_APU_QUEUE_SIZE 255
+
+/* Most queue records that are sent in a single transaction */
+#define NES_APU_QUEUE_BATCH_MAX 32
+
+/* Register offset of queue records that only carry a delay */
+#define NES_APU_QUEUE_NOP 0x14
+
+/**
+ * Write queue record, applied by the 2A03 on its own timing
+ */
+typedef struct {
+    uint8_t delta; /*!< APU frame ticks to wait after the previous record */
+    uint8_t reg;   /*!< APU register, as an offset from $4000 */
+    uint8_t dat;   /*!< Value to write */
+} nes_apu_queue_record_t;
+
 esp_err_t nes_init(i2c_port_t i2c_num);
 
 esp_err_t nes_set_config(i2c_port_t i2c_num, uint8_t value);
@@ -44,6 +79,96 @@ esp_err_t nes_get_amplifier_enabled(i2c_port_t i2c_num, bool *enabled);
 esp_err_t nes_apu_init(i2c_port_t i2c_num);
 esp_err_t nes_apu_write(i2c_port_t i2c_num, nes_apu_register_t reg, uint8_t dat);
 
+/**
+ * Write values to a run of adjacent APU registers in one transaction.
+ *
+ * This requires the auto-increment mode to be enabled through
+ * the CONFIG register.
+ *
+ * @param reg First register to write
+ * @param data Values for the first register and those following it
+ * @param data_len Number of registers to write, within $4000-$4013
+ */
+esp_err_t nes_apu_write_burst(i2c_port_t i2c_num, nes_apu_register_t reg, uint8_t *data, size_t data_len);
+
+/**
+ * Write values to any set of APU registers in one transaction.
+ *
+ * The writes are applied in order, using the register list mode.
+ *
+ * @param regs Registers to write, as offsets from $4000
+ * @param data Value for each register
+ * @param count Number of register writes
+ */
+esp_err_t nes_apu_write_batch(i2c_port_t i2c_num, const uint8_t *regs, const uint8_t *data, size_t count);
+
+/**
+ * Queue an APU register write, sending the queued writes first if
+ * the batch is already full.
+ */
+esp_err_t nes_apu_batch_append(i2c_port_t i2c_num, nes_apu_batch_t *batch, nes_apu_register_t reg, uint8_t dat);
+
+/**
+ * Send any queued APU register writes, as a burst if they cover
+ * adjacent registers and as a register list otherwise.
+ */
+esp_err_t nes_apu_batch_flush(i2c_port_t i2c_num, nes_apu_batch_t *batch);
+
+/**
+ * Append records to the 2A03 write queue.
+ *
+ * This requires the queue mode to be enabled through the CONFIG register.
+ * Records that do not fit in the queue are dropped, so the free space
+ * should be checked first.
+ */
+esp_err_t nes_apu_queue_write(i2c_port_t i2c_num, const nes_apu_queue_record_t *records, size_t count);
+
+/**
+ * Get the number of free records in the 2A03 write queue.
+ */
+esp_err_t nes_apu_queue_get_free(i2c_port_t i2c_num, uint8_t *free);
+
+/* Most PCM samples that are sent in a single transaction */
+#define NES_PCM_BATCH_MAX 32
+
+/* 2A03 CPU clock rate, in Hz */
+#define NES_CPU_CLOCK 1789773
+
+/*
+ * Cycles each PCM sample takes on the 2A03 outside of its delay loop,
+ * including handling the samples as they arrive, and the cycles each
+ * pass of the delay loop takes. The firmware corrects for any error
+ * from its buffer level, but holds the level closest to where it
+ * starts playing with the delay from here. host/bench_2a03 measures
+ * 305-306 loop cycles for a 5512 Hz stream in 16 sample chunks, at
+ * any bus rate from 100 kHz to 1 MHz.
+ */
+#define NES_PCM_LOOP_CYCLES 306
+#define NES_PCM_PASS_CYCLES 5
+
+/* Highest PCM stream rate the 2A03 can keep up with, in Hz */
+#define NES_PCM_RATE_MAX (NES_CPU_CLOCK / (NES_PCM_LOOP_CYCLES + NES_PCM_PASS_CYCLES))
+
+/* PCM samples the 2A03 buffers before it starts playing them */
+#define NES_PCM_START_LEVEL 64
+
+/**
+ * Set the rate the 2A03 plays streamed PCM samples at.
+ *
+ * This only sets the starting point, since the 2A03 then follows the
+ * rate the samples actually arrive at.
+ */
+esp_err_t nes_pcm_set_rate(i2c_port_t i2c_num, uint32_t rate);
+
+/**
+ * Append samples for $4011 to the 2A03 PCM buffer.
+ *
+ * This requires the PCM mode to be enabled through the CONFIG register.
+ * Samples are only played once the buffer has filled up to
+ * NES_PCM_START_LEVEL, so they should be sent at the stream rate.
+ */
+esp_err_t nes_pcm_write(i2c_port_t i2c_num, const uint8_t *data, size_t data_len);
+
 esp_err_t nes_data_write(i2c_port_t i2c_num, uint8_t block, uint8_t *data, size_t data_len);
 esp_err_t nes_data_read(i2c_port_t i2c_num, uint8_t block, uint8_t *data, size_t data_len);
 
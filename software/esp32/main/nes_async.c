@@ -0,0 +1,184 @@
+#include "nes_async.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "i2c_bus.h"
+#include "playback_stats.h"
+
+static const char *TAG = "nes_async";
+
+/* Number of command descriptors in the ring */
+#define ASYNC_RING_SIZE 8
+
+/* Should be above the playback task, so writes start as soon as they are submitted */
+#define ASYNC_TASK_PRIORITY 6
+
+struct nes_async_t {
+    i2c_port_t i2c_num;
+    TaskHandle_t task;
+    TaskHandle_t owner;
+    SemaphoreHandle_t exit_sem;
+    portMUX_TYPE lock;
+    volatile bool running;
+    nes_apu_batch_t ring[ASYNC_RING_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    esp_err_t result;
+};
+
+static void nes_async_task(void *pvParameters)
+{
+    nes_async_t *async = (nes_async_t *)pvParameters;
+
+    for (;;) {
+        portENTER_CRITICAL(&async->lock);
+        bool pending = async->tail != async->head;
+        portEXIT_CRITICAL(&async->lock);
+
+        if (!pending) {
+            if (!async->running) {
+                break;
+            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        // The submitting side never touches a descriptor until it
+        // has been completed, so it can be sent without the lock
+        nes_apu_batch_t *batch = &async->ring[async->tail % ASYNC_RING_SIZE];
+        int64_t time0 = esp_timer_get_time();
+        i2c_bus_lock(I2C_BUS_APU, 0);
+        esp_err_t ret = nes_apu_batch_flush(async->i2c_num, batch);
+        i2c_bus_unlock();
+        int64_t time1 = esp_timer_get_time();
+        playback_stats_record(PLAYBACK_STATS_APU_WRITE, (uint32_t)(time1 - time0));
+
+        portENTER_CRITICAL(&async->lock);
+        async->tail++;
+        if (ret != ESP_OK && async->result == ESP_OK) {
+            async->result = ret;
+        }
+        portEXIT_CRITICAL(&async->lock);
+
+        xTaskNotifyGive(async->owner);
+    }
+
+    xSemaphoreGive(async->exit_sem);
+    vTaskDelete(NULL);
+}
+
+esp_err_t nes_async_init(nes_async_t **async, i2c_port_t i2c_num)
+{
+    esp_err_t ret = ESP_OK;
+    nes_async_t *async_result = NULL;
+
+    do {
+        async_result = malloc(sizeof(nes_async_t));
+        if (!async_result) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        bzero(async_result, sizeof(nes_async_t));
+        portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+        async_result->lock = lock;
+        async_result->i2c_num = i2c_num;
+        async_result->owner = xTaskGetCurrentTaskHandle();
+        async_result->result = ESP_OK;
+        async_result->running = true;
+
+        async_result->exit_sem = xSemaphoreCreateBinary();
+        if (!async_result->exit_sem) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        if (xTaskCreate(nes_async_task, "nes_async_task", 2048, async_result,
+                ASYNC_TASK_PRIORITY, &async_result->task) != pdPASS) {
+            async_result->task = NULL;
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+    } while (0);
+
+    if (ret == ESP_OK) {
+        *async = async_result;
+    } else {
+        ESP_LOGE(TAG, "Unable to create writer");
+        nes_async_free(async_result);
+    }
+
+    return ret;
+}
+
+esp_err_t nes_async_submit(nes_async_t *async, nes_apu_batch_t *batch)
+{
+    if (!batch || batch->len == 0) {
+        return ESP_OK;
+    }
+
+    // Wait for a free descriptor
+    for (;;) {
+        portENTER_CRITICAL(&async->lock);
+        bool full = (async->head - async->tail) >= ASYNC_RING_SIZE;
+        portEXIT_CRITICAL(&async->lock);
+        if (!full) {
+            break;
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+
+    memcpy(&async->ring[async->head % ASYNC_RING_SIZE], batch, sizeof(nes_apu_batch_t));
+    batch->len = 0;
+
+    portENTER_CRITICAL(&async->lock);
+    async->head++;
+    portEXIT_CRITICAL(&async->lock);
+
+    xTaskNotifyGive(async->task);
+    return ESP_OK;
+}
+
+bool nes_async_is_idle(nes_async_t *async)
+{
+    portENTER_CRITICAL(&async->lock);
+    bool idle = async->tail == async->head;
+    portEXIT_CRITICAL(&async->lock);
+    return idle;
+}
+
+esp_err_t nes_async_wait(nes_async_t *async)
+{
+    while (!nes_async_is_idle(async)) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+
+    portENTER_CRITICAL(&async->lock);
+    esp_err_t ret = async->result;
+    async->result = ESP_OK;
+    portEXIT_CRITICAL(&async->lock);
+
+    return ret;
+}
+
+void nes_async_free(nes_async_t *async)
+{
+    if (async) {
+        if (async->task) {
+            async->running = false;
+            xTaskNotifyGive(async->task);
+            xSemaphoreTake(async->exit_sem, portMAX_DELAY);
+        }
+        if (async->exit_sem) {
+            vSemaphoreDelete(async->exit_sem);
+        }
+        free(async);
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ * Asynchronous APU register writes
+ *
+ * Batches of register writes are copied into a ring of command
+ * descriptors, and sent over the bus by a separate, higher priority
+ * task. Submitting a batch returns right away, so the playback task can
+ * parse and schedule the next command group while the current one is
+ * still on the wire. Completions are signalled to the submitting task
+ * through its task notification.
+ */
+
+#ifndef NES_ASYNC_H
+#define NES_ASYNC_H
+
+#include <esp_err.h>
+#include <driver/i2c.h>
+
+#include "nes.h"
+
+typedef struct nes_async_t nes_async_t;
+
+/**
+ * Create an asynchronous writer.
+ *
+ * The writer must only be used from the task that created it,
+ * which receives its completion notifications.
+ */
+esp_err_t nes_async_init(nes_async_t **async, i2c_port_t i2c_num);
+
+/**
+ * Submit a batch of APU register writes.
+ *
+ * The batch is copied, and cleared once submitted. This only blocks if
+ * every descriptor in the ring is still waiting to be sent.
+ */
+esp_err_t nes_async_submit(nes_async_t *async, nes_apu_batch_t *batch);
+
+/**
+ * Check whether every submitted batch has been sent.
+ */
+bool nes_async_is_idle(nes_async_t *async);
+
+/**
+ * Wait for every submitted batch to be sent.
+ *
+ * @return The first error from the batches sent since the last wait
+ */
+esp_err_t nes_async_wait(nes_async_t *async);
+
+/**
+ * Send any batches still in the ring, and free the writer.
+ */
+void nes_async_free(nes_async_t *async);
+
+#endif /* NES_ASYNC_H */
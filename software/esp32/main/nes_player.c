@@ -12,8 +12,11 @@
 #include <string.h>
 
 #include "board_config.h"
-#include "i2c_util.h"
+#include "i2c_bus.h"
+#include "playback_stats.h"
 #include "nes.h"
+#include "nes_trace.h"
+#include "sdcard_util.h"
 #include "display.h"
 #include "vgm_player.h"
 #include "nsf_player.h"
@@ -23,6 +26,10 @@ static const char *TAG = "nes_player";
 static xQueueHandle nes_player_event_queue = NULL;
 static EventGroupHandle_t nes_player_event_group = NULL;
 static TimerHandle_t nes_player_idle_timer = 0;
+static bool nes_player_trace_enabled = false;
+
+/* Trace of the writes from the most recent playback */
+#define NES_PLAYER_TRACE_FILE "/sdcard/TRACE.VGM"
 
 typedef enum {
     NES_PLAYER_PLAY_EFFECT,
@@ -51,9 +58,9 @@ static void nes_player_run_benchmark_data();
 
 static void nes_player_idle_timer_callback(TimerHandle_t xTimer)
 {
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_BACKGROUND, 0);
     nes_set_amplifier_enabled(I2C_P0_NUM, false);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 }
 
 static void nes_player_prepare()
@@ -61,7 +68,10 @@ static void nes_player_prepare()
     xTimerStop(nes_player_idle_timer, portMAX_DELAY);
     xEventGroupClearBits(nes_player_event_group, BIT0);
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_APU, 0);
+
+    // Make sure register bursts are enabled
+    nes_set_config(I2C_P0_NUM, NES_CONFIG_INCREMENT);
 
     bool amplifier_enabled;
     if (nes_get_amplifier_enabled(I2C_P0_NUM, &amplifier_enabled) != ESP_OK) {
@@ -71,15 +81,16 @@ static void nes_player_prepare()
     if (!amplifier_enabled) {
         nes_set_amplifier_enabled(I2C_P0_NUM, true);
         nes_apu_init(I2C_P0_NUM);
-        i2c_mutex_unlock(I2C_P0_NUM);
+        i2c_bus_unlock();
         vTaskDelay(250 / portTICK_RATE_MS);
     } else {
-        i2c_mutex_unlock(I2C_P0_NUM);
+        i2c_bus_unlock();
     }
 }
 
 static void nes_player_cleanup()
 {
+    i2c_bus_set_idle_until(I2C_BUS_IDLE_FOREVER);
     xTimerStart(nes_player_idle_timer, portMAX_DELAY);
 }
 
@@ -109,9 +120,15 @@ static void nes_player_task(void *pvParameters)
                 nes_player_cleanup();
             }
             else if (event.command == NES_PLAYER_PLAY_VGM || event.command == NES_PLAYER_PLAY_NSF) {
-                ESP_LOGI(TAG, "RAM left %d", esp_get_free_heap_size());
+                ESP_LOGI(TAG, "RAM left %d, lowest %d", esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
 
                 nes_player_prepare();
+                i2c_bus_reset_stats();
+                playback_stats_reset();
+
+                if (nes_player_trace_enabled && sdcard_is_mounted()) {
+                    nes_trace_start(NES_PLAYER_TRACE_FILE);
+                }
 
                 if (event.playback_cb) {
                     event.playback_cb(NES_PLAYER_INIT);
@@ -122,6 +139,7 @@ static void nes_player_task(void *pvParameters)
                         if (vgm_player_prepare(event.vgm_player) != ESP_OK) {
                             break;
                         }
+                        ESP_LOGI(TAG, "RAM left %d, lowest %d", esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
                         if (event.playback_cb) {
                             event.playback_cb(NES_PLAYER_STARTED);
                         }
@@ -136,6 +154,7 @@ static void nes_player_task(void *pvParameters)
                         if (nsf_player_prepare(event.nsf_player, event.song) != ESP_OK) {
                             break;
                         }
+                        ESP_LOGI(TAG, "RAM left %d, lowest %d", esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
                         if (event.playback_cb) {
                             event.playback_cb(NES_PLAYER_STARTED);
                         }
@@ -147,13 +166,16 @@ static void nes_player_task(void *pvParameters)
                     event.nsf_player = NULL;
                 }
 
+                nes_trace_stop();
+
                 if (event.playback_cb) {
                     event.playback_cb(NES_PLAYER_FINISHED);
                 }
 
                 nes_player_cleanup();
 
-                ESP_LOGI(TAG, "RAM left %d", esp_get_free_heap_size());
+                i2c_bus_log_stats();
+                ESP_LOGI(TAG, "RAM left %d, lowest %d", esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
             }
             else if (event.command == NES_PLAYER_BENCHMARK_DATA) {
                 nes_player_run_benchmark_data();
@@ -271,6 +293,16 @@ esp_err_t nes_player_stop()
     return ESP_OK;
 }
 
+void nes_player_set_trace_enabled(bool enabled)
+{
+    nes_player_trace_enabled = enabled;
+}
+
+bool nes_player_get_trace_enabled()
+{
+    return nes_player_trace_enabled;
+}
+
 esp_err_t nes_player_benchmark_data()
 {
     nes_player_event_t event;
@@ -297,34 +329,34 @@ void nes_player_play_effect_impl(nes_player_effect_t effect)
 
 void nes_player_play_effect_chime()
 {
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_APU, 0);
     nes_apu_write(I2C_P0_NUM, 0x06, 0x32);
     nes_apu_write(I2C_P0_NUM, 0x07, 0x08);
     nes_apu_write(I2C_P0_NUM, 0x05, 0x7F);
     nes_apu_write(I2C_P0_NUM, 0x04, 0x86);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     vTaskDelay(165 / portTICK_RATE_MS);
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_APU, 0);
     nes_apu_write(I2C_P0_NUM, 0x06, 0x21);
     nes_apu_write(I2C_P0_NUM, 0x07, 0x08);
     nes_apu_write(I2C_P0_NUM, 0x05, 0x7F);
     nes_apu_write(I2C_P0_NUM, 0x04, 0x86);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     vTaskDelay(330 / portTICK_RATE_MS);
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_APU, 0);
     nes_apu_write(I2C_P0_NUM, 0x04, 0x90);
     nes_apu_write(I2C_P0_NUM, 0x07, 0x18);
     nes_apu_write(I2C_P0_NUM, 0x06, 0x00);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 }
 
 void nes_player_play_effect_blip()
 {
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_APU, 0);
     nes_apu_write(I2C_P0_NUM, 0x15, 0x00);
     nes_apu_write(I2C_P0_NUM, 0x00, 0x00);
     nes_apu_write(I2C_P0_NUM, 0x01, 0x00);
@@ -357,30 +389,30 @@ void nes_player_play_effect_blip()
     nes_apu_write(I2C_P0_NUM, 0x02, 0x8E);
     nes_apu_write(I2C_P0_NUM, 0x03, 0x08);
     nes_apu_write(I2C_P0_NUM, 0x01, 0x7F);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     vTaskDelay(50 / portTICK_RATE_MS);
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_APU, 0);
     nes_apu_write(I2C_P0_NUM, 0x17, 0xC0);
     nes_apu_write(I2C_P0_NUM, 0x02, 0x47);
     nes_apu_write(I2C_P0_NUM, 0x03, 0x08);
     nes_apu_write(I2C_P0_NUM, 0x01, 0x7F);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     vTaskDelay(48 / portTICK_RATE_MS);
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_APU, 0);
     nes_apu_write(I2C_P0_NUM, 0x17, 0xC0);
     nes_apu_write(I2C_P0_NUM, 0x00, 0x90);
     nes_apu_write(I2C_P0_NUM, 0x03, 0x18);
     nes_apu_write(I2C_P0_NUM, 0x02, 0x00);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 }
 
 void nes_player_play_effect_credit()
 {
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_APU, 0);
     nes_apu_write(I2C_P0_NUM, 0x15, 0x00);
     nes_apu_write(I2C_P0_NUM, 0x00, 0x00);
     nes_apu_write(I2C_P0_NUM, 0x01, 0x00);
@@ -411,20 +443,20 @@ void nes_player_play_effect_credit()
     nes_apu_write(I2C_P0_NUM, 0x06, 0x71);
     nes_apu_write(I2C_P0_NUM, 0x07, 0x08);
     nes_apu_write(I2C_P0_NUM, 0x11, 0x00);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     vTaskDelay(83 / portTICK_RATE_MS);
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_APU, 0);
     nes_apu_write(I2C_P0_NUM, 0x17, 0xFF);
     nes_apu_write(I2C_P0_NUM, 0x15, 0x0F);
     nes_apu_write(I2C_P0_NUM, 0x06, 0x54);
     nes_apu_write(I2C_P0_NUM, 0x11, 0x00);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     vTaskDelay(765 / portTICK_RATE_MS);
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_APU, 0);
     nes_apu_write(I2C_P0_NUM, 0x17, 0xFF);
     nes_apu_write(I2C_P0_NUM, 0x15, 0x0F);
     nes_apu_write(I2C_P0_NUM, 0x15, 0x0D);
@@ -433,7 +465,7 @@ void nes_player_play_effect_credit()
     nes_apu_write(I2C_P0_NUM, 0x17, 0xFF);
     nes_apu_write(I2C_P0_NUM, 0x15, 0x0F);
     nes_apu_write(I2C_P0_NUM, 0x11, 0x00);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 }
 
 void nes_player_run_benchmark_data()
@@ -450,38 +482,38 @@ void nes_player_run_benchmark_data()
     int64_t time_total4 = 0;
 
     for (int i = 0; i < iterations; i++) {
-        i2c_mutex_lock(I2C_P0_NUM);
+        i2c_bus_lock(I2C_BUS_APU, 0);
         time0 = esp_timer_get_time();
         nes_data_write(I2C_P0_NUM, 8 + i, data, 32);
         time1 = esp_timer_get_time();
-        i2c_mutex_unlock(I2C_P0_NUM);
+        i2c_bus_unlock();
         time_total0 += (time1 - time0);
     }
 
     for (int i = 0; i < iterations; i++) {
-        i2c_mutex_lock(I2C_P0_NUM);
+        i2c_bus_lock(I2C_BUS_APU, 0);
         time0 = esp_timer_get_time();
         nes_data_write(I2C_P0_NUM, 8 + i, data, 64);
         time1 = esp_timer_get_time();
-        i2c_mutex_unlock(I2C_P0_NUM);
+        i2c_bus_unlock();
         time_total1 += (time1 - time0);
     }
 
     for (int i = 0; i < iterations; i++) {
-        i2c_mutex_lock(I2C_P0_NUM);
+        i2c_bus_lock(I2C_BUS_APU, 0);
         time0 = esp_timer_get_time();
         nes_data_write(I2C_P0_NUM, 8 + i, data, 128);
         time1 = esp_timer_get_time();
-        i2c_mutex_unlock(I2C_P0_NUM);
+        i2c_bus_unlock();
         time_total2 += (time1 - time0);
     }
 
     for (int i = 0; i < iterations; i++) {
-        i2c_mutex_lock(I2C_P0_NUM);
+        i2c_bus_lock(I2C_BUS_APU, 0);
         time0 = esp_timer_get_time();
         nes_data_write(I2C_P0_NUM, 8 + i, data, 256);
         time1 = esp_timer_get_time();
-        i2c_mutex_unlock(I2C_P0_NUM);
+        i2c_bus_unlock();
         time_total4 += (time1 - time0);
     }
 
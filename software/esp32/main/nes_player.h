@@ -42,4 +42,11 @@ esp_err_t nes_player_play_effect(nes_player_effect_t effect, nes_playback_repeat
 esp_err_t nes_player_stop();
 esp_err_t nes_player_benchmark_data();
 
+/**
+ * Enable recording of all APU writes during VGM and NSF playback.
+ * Each playback replaces the trace file on the SD card.
+ */
+void nes_player_set_trace_enabled(bool enabled);
+bool nes_player_get_trace_enabled();
+
 #endif /* NES_PLAYER_H */
@@ -0,0 +1,372 @@
+#include "nes_trace.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+static const char *TAG = "nes_trace";
+
+/* Size of the ring buffer, which must be a power of two */
+#define TRACE_RING_SIZE 16384
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+/* How often the ring buffer is written out to the file */
+#define TRACE_FLUSH_MS 100
+
+/* Should be below everything involved in playback */
+#define TRACE_TASK_PRIORITY 1
+
+/* Ring buffer entry types, followed by a 32-bit timestamp */
+#define TRACE_ENTRY_APU  0xB4 /*!< Count, then register and value pairs */
+#define TRACE_ENTRY_DATA 0x67 /*!< Block, 16-bit length, then the data */
+
+/* VGM header fields */
+#define VGM_HEADER_SIZE   0x100
+#define VGM_VERSION       0x00000161
+#define VGM_NES_APU_CLOCK 1789772
+#define VGM_SAMPLE_RATE   44100
+#define VGM_GD3_VERSION   0x00000100
+
+volatile bool nes_trace_active = false;
+
+static uint8_t *trace_ring = NULL;
+static volatile uint32_t trace_head = 0;
+static volatile uint32_t trace_tail = 0;
+static uint32_t trace_pos = 0;
+static uint32_t trace_dropped = 0;
+static int64_t trace_start_time = 0;
+
+static FILE *trace_file = NULL;
+static TaskHandle_t trace_task = NULL;
+static SemaphoreHandle_t trace_exit_sem = NULL;
+static volatile bool trace_running = false;
+
+/*
+ * Producer side. Every write to the 2A03 happens with the bus locked,
+ * so there is only ever one producer at a time.
+ */
+
+static bool nes_trace_begin(uint8_t type, size_t len)
+{
+    if (TRACE_RING_SIZE - (trace_head - trace_tail) < len) {
+        trace_dropped++;
+        return false;
+    }
+
+    uint32_t time = (uint32_t)(esp_timer_get_time() - trace_start_time);
+    trace_pos = trace_head;
+    trace_ring[trace_pos++ & TRACE_RING_MASK] = type;
+    trace_ring[trace_pos++ & TRACE_RING_MASK] = (uint8_t)(time & 0xFF);
+    trace_ring[trace_pos++ & TRACE_RING_MASK] = (uint8_t)((time >> 8) & 0xFF);
+    trace_ring[trace_pos++ & TRACE_RING_MASK] = (uint8_t)((time >> 16) & 0xFF);
+    trace_ring[trace_pos++ & TRACE_RING_MASK] = (uint8_t)((time >> 24) & 0xFF);
+    return true;
+}
+
+static inline void nes_trace_put(uint8_t value)
+{
+    trace_ring[trace_pos++ & TRACE_RING_MASK] = value;
+}
+
+static void nes_trace_commit()
+{
+    // Make sure the entry is in place before the consumer can see it
+    __sync_synchronize();
+    trace_head = trace_pos;
+}
+
+void nes_trace_apu_writes(const uint8_t *regs, const uint8_t *data, size_t count)
+{
+    if (!nes_trace_active || count == 0 || count > UINT8_MAX) {
+        return;
+    }
+    if (!nes_trace_begin(TRACE_ENTRY_APU, 6 + (count * 2))) {
+        return;
+    }
+    nes_trace_put((uint8_t)count);
+    for (size_t i = 0; i < count; i++) {
+        nes_trace_put(regs[i]);
+        nes_trace_put(data[i]);
+    }
+    nes_trace_commit();
+}
+
+void nes_trace_apu_burst(uint8_t reg, const uint8_t *data, size_t data_len)
+{
+    if (!nes_trace_active || data_len == 0 || data_len > UINT8_MAX) {
+        return;
+    }
+    if (!nes_trace_begin(TRACE_ENTRY_APU, 6 + (data_len * 2))) {
+        return;
+    }
+    nes_trace_put((uint8_t)data_len);
+    for (size_t i = 0; i < data_len; i++) {
+        nes_trace_put(reg + i);
+        nes_trace_put(data[i]);
+    }
+    nes_trace_commit();
+}
+
+void nes_trace_data_write(uint8_t block, const uint8_t *data, size_t data_len)
+{
+    if (!nes_trace_active || data_len == 0 || data_len > UINT16_MAX) {
+        return;
+    }
+    if (!nes_trace_begin(TRACE_ENTRY_DATA, 8 + data_len)) {
+        return;
+    }
+    nes_trace_put(block);
+    nes_trace_put((uint8_t)(data_len & 0xFF));
+    nes_trace_put((uint8_t)((data_len >> 8) & 0xFF));
+    for (size_t i = 0; i < data_len; i++) {
+        nes_trace_put(data[i]);
+    }
+    nes_trace_commit();
+}
+
+/*
+ * Consumer side, which turns ring buffer entries into VGM commands.
+ */
+
+static uint8_t nes_trace_get(uint32_t *pos)
+{
+    return trace_ring[(*pos)++ & TRACE_RING_MASK];
+}
+
+static void nes_trace_write_u32(uint8_t *buf, uint32_t value)
+{
+    buf[0] = (uint8_t)(value & 0xFF);
+    buf[1] = (uint8_t)((value >> 8) & 0xFF);
+    buf[2] = (uint8_t)((value >> 16) & 0xFF);
+    buf[3] = (uint8_t)((value >> 24) & 0xFF);
+}
+
+static void nes_trace_write_wait(FILE *file, uint32_t samples)
+{
+    while (samples > 0) {
+        uint32_t n = MIN(samples, UINT16_MAX);
+        if (n <= 16) {
+            fputc(0x70 | (n - 1), file);
+        } else {
+            fputc(0x61, file);
+            fputc(n & 0xFF, file);
+            fputc((n >> 8) & 0xFF, file);
+        }
+        samples -= n;
+    }
+}
+
+static void nes_trace_write_gd3(FILE *file)
+{
+    // Track, game, system and author names, each in English then
+    // Japanese, followed by the release date, converter and notes
+    static const char *tags[] = {
+        "APU trace", "", "", "", "Nintendo Entertainment System", "",
+        "", "", "", "Nestronic", ""
+    };
+
+    uint32_t size = 0;
+    for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+        size += (strlen(tags[i]) + 1) * 2;
+    }
+
+    uint8_t buf[12];
+    memcpy(buf, "Gd3 ", 4);
+    nes_trace_write_u32(buf + 4, VGM_GD3_VERSION);
+    nes_trace_write_u32(buf + 8, size);
+    fwrite(buf, 1, sizeof(buf), file);
+
+    // Strings are null-terminated UTF-16LE
+    for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+        const char *p = tags[i];
+        do {
+            fputc(*p, file);
+            fputc(0, file);
+        } while (*p++ != '\0');
+    }
+}
+
+static void nes_trace_task(void *pvParameters)
+{
+    uint32_t last_time = 0;
+    uint64_t elapsed_us = 0;
+    uint32_t sample_count = 0;
+    bool running = true;
+
+    while (running) {
+        ulTaskNotifyTake(pdTRUE, TRACE_FLUSH_MS / portTICK_RATE_MS);
+        running = trace_running;
+
+        uint32_t head = trace_head;
+        __sync_synchronize();
+        uint32_t pos = trace_tail;
+
+        while (pos != head) {
+            uint8_t type = nes_trace_get(&pos);
+            uint32_t time = nes_trace_get(&pos);
+            time |= (uint32_t)nes_trace_get(&pos) << 8;
+            time |= (uint32_t)nes_trace_get(&pos) << 16;
+            time |= (uint32_t)nes_trace_get(&pos) << 24;
+
+            // Work in differences, so the 32-bit timestamps can wrap
+            elapsed_us += (uint32_t)(time - last_time);
+            last_time = time;
+
+            uint32_t samples = (uint32_t)((elapsed_us * VGM_SAMPLE_RATE) / 1000000ULL);
+            if (samples > sample_count) {
+                nes_trace_write_wait(trace_file, samples - sample_count);
+                sample_count = samples;
+            }
+
+            if (type == TRACE_ENTRY_APU) {
+                uint8_t count = nes_trace_get(&pos);
+                for (uint8_t i = 0; i < count; i++) {
+                    fputc(0xB4, trace_file);
+                    fputc(nes_trace_get(&pos), trace_file);
+                    fputc(nes_trace_get(&pos), trace_file);
+                }
+            } else if (type == TRACE_ENTRY_DATA) {
+                uint8_t block = nes_trace_get(&pos);
+                uint16_t len = nes_trace_get(&pos);
+                len |= (uint16_t)nes_trace_get(&pos) << 8;
+                uint16_t addr = 0xC000 | ((uint16_t)block << 6);
+
+                // NES APU RAM write data block, with the start address first
+                uint8_t buf[9];
+                buf[0] = 0x67;
+                buf[1] = 0x66;
+                buf[2] = 0xC2;
+                nes_trace_write_u32(buf + 3, len + 2);
+                buf[7] = (uint8_t)(addr & 0xFF);
+                buf[8] = (uint8_t)((addr >> 8) & 0xFF);
+                fwrite(buf, 1, sizeof(buf), trace_file);
+                for (uint16_t i = 0; i < len; i++) {
+                    fputc(nes_trace_get(&pos), trace_file);
+                }
+            }
+
+            __sync_synchronize();
+            trace_tail = pos;
+        }
+    }
+
+    fputc(0x66, trace_file);
+
+    // Tag the trace, since players expect a GD3 block after the data
+    uint32_t gd3_offset = (uint32_t)ftell(trace_file);
+    nes_trace_write_gd3(trace_file);
+
+    // Go back and fill in the header, now that the lengths are known
+    uint8_t header[VGM_HEADER_SIZE];
+    bzero(header, sizeof(header));
+    memcpy(header, "Vgm ", 4);
+    nes_trace_write_u32(header + 0x04, (uint32_t)ftell(trace_file) - 0x04);
+    nes_trace_write_u32(header + 0x08, VGM_VERSION);
+    nes_trace_write_u32(header + 0x14, gd3_offset - 0x14);
+    nes_trace_write_u32(header + 0x18, sample_count);
+    nes_trace_write_u32(header + 0x34, VGM_HEADER_SIZE - 0x34);
+    nes_trace_write_u32(header + 0x84, VGM_NES_APU_CLOCK);
+    fseek(trace_file, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), trace_file);
+
+    ESP_LOGI(TAG, "Trace finished: samples=%u, dropped=%u", sample_count, trace_dropped);
+
+    xSemaphoreGive(trace_exit_sem);
+    vTaskDelete(NULL);
+}
+
+esp_err_t nes_trace_start(const char *filename)
+{
+    esp_err_t ret = ESP_OK;
+
+    if (trace_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    do {
+        trace_ring = malloc(TRACE_RING_SIZE);
+        if (!trace_ring) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        trace_exit_sem = xSemaphoreCreateBinary();
+        if (!trace_exit_sem) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        trace_file = fopen(filename, "wb");
+        if (!trace_file) {
+            ESP_LOGE(TAG, "Unable to open file: %s", filename);
+            ret = ESP_FAIL;
+            break;
+        }
+
+        // Leave room for the header, which is written at the end
+        uint8_t header[VGM_HEADER_SIZE];
+        bzero(header, sizeof(header));
+        if (fwrite(header, 1, sizeof(header), trace_file) != sizeof(header)) {
+            ret = ESP_FAIL;
+            break;
+        }
+
+        trace_head = 0;
+        trace_tail = 0;
+        trace_dropped = 0;
+        trace_start_time = esp_timer_get_time();
+        trace_running = true;
+
+        if (xTaskCreate(nes_trace_task, "nes_trace_task", 2560, NULL,
+                TRACE_TASK_PRIORITY, &trace_task) != pdPASS) {
+            trace_task = NULL;
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+    } while (0);
+
+    if (ret != ESP_OK) {
+        if (trace_file) {
+            fclose(trace_file);
+            trace_file = NULL;
+        }
+        if (trace_exit_sem) {
+            vSemaphoreDelete(trace_exit_sem);
+            trace_exit_sem = NULL;
+        }
+        free(trace_ring);
+        trace_ring = NULL;
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "Recording writes to %s", filename);
+    nes_trace_active = true;
+    return ESP_OK;
+}
+
+void nes_trace_stop()
+{
+    if (!trace_task) {
+        return;
+    }
+
+    nes_trace_active = false;
+    trace_running = false;
+    xTaskNotifyGive(trace_task);
+    xSemaphoreTake(trace_exit_sem, portMAX_DELAY);
+    trace_task = NULL;
+
+    fclose(trace_file);
+    trace_file = NULL;
+    vSemaphoreDelete(trace_exit_sem);
+    trace_exit_sem = NULL;
+    free(trace_ring);
+    trace_ring = NULL;
+}
@@ -0,0 +1,62 @@
+/*
+ * APU write trace recorder
+ *
+ * Timestamps every APU register and sample data write that goes out to
+ * the 2A03, and saves them as a VGM file. Writes are copied into a
+ * preallocated ring buffer on the bus path, and a low priority task
+ * converts them to VGM commands and writes them out to the file.
+ *
+ * Writes through the 2A03 write queue are applied on its own frame
+ * timing rather than when they are sent, so they are not recorded.
+ * Neither are samples sent to the PCM buffer, which the 2A03 plays out
+ * at its own rate, so a trace of a streamed track is missing those
+ * $4011 writes.
+ */
+
+#ifndef NES_TRACE_H
+#define NES_TRACE_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+/* Checked before recording, so nothing else happens while inactive */
+extern volatile bool nes_trace_active;
+
+/**
+ * Start recording writes to a new VGM file.
+ */
+esp_err_t nes_trace_start(const char *filename);
+
+/**
+ * Stop recording, and finish writing the VGM file.
+ */
+void nes_trace_stop();
+
+/**
+ * Record writes to a list of APU registers, sent in one transaction.
+ *
+ * @param regs Registers written, as offsets from $4000
+ * @param data Value written to each register
+ * @param count Number of register writes
+ */
+void nes_trace_apu_writes(const uint8_t *regs, const uint8_t *data, size_t count);
+
+/**
+ * Record writes to a run of adjacent APU registers, sent in one transaction.
+ *
+ * @param reg First register written, as an offset from $4000
+ * @param data Values written to the register and those following it
+ * @param data_len Number of register writes
+ */
+void nes_trace_apu_burst(uint8_t reg, const uint8_t *data, size_t data_len);
+
+/**
+ * Record a sample data write.
+ *
+ * @param block APU block the data was written to
+ * @param data Data that was written
+ * @param data_len Length of the data
+ */
+void nes_trace_data_write(uint8_t block, const uint8_t *data, size_t data_len);
+
+#endif /* NES_TRACE_H */
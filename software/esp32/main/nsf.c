@@ -10,19 +10,29 @@
 
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_attr.h>
+#include <esp_timer.h>
 
 #include "fake6502.h"
+#include "nsf_bank.h"
+#include "nsf_cpu.h"
+#include "nsf_memory.h"
 
 static const char *TAG = "nsf";
 
-#define ROM_BANK_SIZE  4096
-#define ROM_BANK_COUNT 10
+#define ROM_BANK_SIZE  NSF_BANK_SIZE
+
+/* Address the PRG stub loops on, between calls to the play routine */
+#define PRG_PLAY_LOOP 0x1007
+
+/* Most CPU cycles an init or play call can take, which is one second */
+#define CPU_TICKS_MAX 1789773
 
 typedef struct {
-    /* $0000 - $7FFF */
+    /* $0000 - $07FF */
     uint8_t ram[2048];
-    /* $1000 - $107F */
-    uint8_t prg[128];
+    /* $1000 - $107F, padded out to the end of the page */
+    uint8_t prg[NSF_PAGE_SIZE];
     /* $4000 - $4017 */
     uint8_t apu_regs[24];
     /* $5FF8 - $5FFF */
@@ -31,26 +41,28 @@ typedef struct {
     uint8_t int_vecs[6];
 
     /* ROM bank Pointers ($8000 - $FFFF) */
-    uint8_t *rom_block[8];
+    const uint8_t *rom_block[8];
 
     /* ID of the bank referenced by each ROM block */
     uint8_t rom_block_bank_id[8];
 
-    /* Raw ROM data */
+    /* Raw ROM data, when not bank switched */
     uint8_t *rom;
-    /* Bank ID of each 4k segment of the raw ROM data */
-    uint8_t rom_bank_id[ROM_BANK_COUNT];
-    /* Load status of a particular ROM bank */
-    uint8_t rom_bank_loaded[ROM_BANK_COUNT];
-    /* List of loaded banks in use order for LRU cache */
-    int rom_bank_use_order[ROM_BANK_COUNT];
+
+    /* Page table for the whole address space */
+    nsf_memory_map_t map;
 
 } nsf_nes_memory_t;
 
 struct nsf_file_t {
     FILE *file;
+    char *filename;
+    nsf_bank_store_t *bank_store;
     nsf_header_t header;
     nsf_nes_memory_t nes_memory;
+    nsf_cpu_t cpu;
+    bool reference_cpu;
+    uint32_t reference_start_ticks;
     nsf_apu_write_cb_t apu_write_cb;
 };
 
@@ -58,12 +70,13 @@ static nsf_file_t *active_nsf_file = NULL;
 
 static esp_err_t nsf_read_header_impl(FILE *file, nsf_header_t *header);
 static bool nsf_has_bank_switching(nsf_file_t *nsf);
-static void IRAM_ATTR mark_rom_bank_used(nsf_nes_memory_t *nes_memory, uint8_t bank);
 static void nsf_init_nes_memory(nsf_file_t *nsf);
+static void nsf_map_rom_block(nsf_nes_memory_t *nes_memory, uint8_t block);
 static void nsf_init_nes_prg(nsf_file_t *nsf, uint8_t song, uint8_t pal_ntsc);
 static esp_err_t nsf_init_load_nes_rom(nsf_file_t *nsf);
-static esp_err_t nsf_init_load_nes_rom_banks(nsf_file_t *nsf);
+static esp_err_t nsf_init_load_nes_rom_banks(nsf_file_t *nsf, uint8_t song);
 static esp_err_t nsf_load_rom_bank(nsf_file_t *nsf, uint16_t reg, uint8_t bank);
+static esp_err_t nsf_run_to_play_loop(nsf_file_t *nsf);
 
 esp_err_t nsf_read_header(const char *filename, nsf_header_t *header)
 {
@@ -121,6 +134,12 @@ esp_err_t nsf_open(nsf_file_t **nsf, const char *filename)
         if (ret != ESP_OK) {
             break;
         }
+
+        nsf_file->filename = strdup(filename);
+        if (!nsf_file->filename) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
     } while(0);
 
     if (ret >= 0) {
@@ -160,11 +179,11 @@ esp_err_t nsf_read_header_impl(FILE *file, nsf_header_t *header)
     header->play_address = buf[n] | (buf[n+1] << 8);
     n += 2;
 
-    strncpy(header->name, (char *)(buf + n), 32);
+    memcpy(header->name, buf + n, 32);
     n += 32;
-    strncpy(header->artist, (char *)(buf + n), 32);
+    memcpy(header->artist, buf + n, 32);
     n += 32;
-    strncpy(header->copyright, (char *)(buf + n), 32);
+    memcpy(header->copyright, buf + n, 32);
     n += 32;
     header->name[31] = '\0';
     header->artist[31] = '\0';
@@ -265,104 +284,148 @@ const nsf_header_t *nsf_get_header(const nsf_file_t *nsf)
     return &nsf->header;
 }
 
-void IRAM_ATTR mark_rom_bank_used(nsf_nes_memory_t *nes_memory, uint8_t bank)
+bool nsf_is_pal(const nsf_file_t *nsf)
 {
-    // Bank is already the most recent one
-    if (nes_memory->rom_bank_use_order[0] == bank) {
+    // Dual PAL/NTSC files are played as NTSC
+    return (nsf->header.pal_ntsc_bits & 0x03) == 0x01;
+}
+
+static uint8_t IRAM_ATTR nsf_read_open_bus(nsf_file_t *nsf, uint16_t address)
+{
+    return 0;
+}
+
+static void IRAM_ATTR nsf_write_open_bus(nsf_file_t *nsf, uint16_t address, uint8_t value)
+{
+}
+
+static uint8_t IRAM_ATTR nsf_read_apu(nsf_file_t *nsf, uint16_t address)
+{
+    if (address <= 0x4017) {
+        return nsf->nes_memory.apu_regs[address - 0x4000];
+    }
+    return 0;
+}
+
+static void IRAM_ATTR nsf_write_apu(nsf_file_t *nsf, uint16_t address, uint8_t value)
+{
+    if (address > 0x4017) {
         return;
     }
-    else {
-        int i;
-        // Try to find the bank in the LRU collection, and shift it forward
-        for (i = 1; i < ROM_BANK_COUNT; i++) {
-            if (nes_memory->rom_bank_use_order[i] == bank) {
-                for (int j = i; j > 0; --j) {
-                    nes_memory->rom_bank_use_order[j] = nes_memory->rom_bank_use_order[j - 1];
-                }
-                // Insert the bank at the head
-                nes_memory->rom_bank_use_order[0] = bank;
-                return;
-            }
+
+    nsf->nes_memory.apu_regs[address - 0x4000] = value;
+    if (address != 0x4016) {
+        //ESP_LOGI(TAG, "[%d] APU Write: $%04X <- $%02X\n",
+        //        get6502_ticks(),
+        //        address, value);
+        if (nsf->apu_write_cb) {
+            nsf->apu_write_cb(address, value);
         }
+    }
+}
 
-        // Bank was not in the collection, shift the list down and insert at the head
-        ESP_LOGD(TAG, "Used ROM bank [%d] not in LRU collection!", bank);
+static uint8_t IRAM_ATTR nsf_read_bank_regs(nsf_file_t *nsf, uint16_t address)
+{
+    if (address >= 0x5FF8) {
+        return nsf->nes_memory.bank_regs[address - 0x5FF8];
+    }
+    return 0;
+}
 
-        // Check for a condition that should not be possible if the loader code
-        // is working correctly and evicting the oldest element before loading
-        // a new one.
-        if (nes_memory->rom_bank_use_order[ROM_BANK_COUNT - 1] != -1) {
-            ESP_LOGE(TAG, "LRU collection tail was not empty!");
-            return;
-        }
+static void IRAM_ATTR nsf_write_bank_regs(nsf_file_t *nsf, uint16_t address, uint8_t value)
+{
+    nsf_nes_memory_t *nes_memory = &nsf->nes_memory;
 
-        // Shift the use list down by one element
-        for (i = ROM_BANK_COUNT - 1; i > 0; --i) {
-            nes_memory->rom_bank_use_order[i] = nes_memory->rom_bank_use_order[i - 1];
-        }
-        // Insert the bank at the head
-        nes_memory->rom_bank_use_order[0] = bank;
+    if (address >= 0x5FF8 && nes_memory->bank_regs[address - 0x5FF8] != value) {
+        nes_memory->bank_regs[address - 0x5FF8] = value;
+        nsf_load_rom_bank(nsf, address, value);
     }
 }
 
+/*
+ * Handler for ROM pages without a mapped block, and for the last page
+ * where the interrupt vectors sit over the top of the ROM.
+ */
+static uint8_t IRAM_ATTR nsf_read_rom(nsf_file_t *nsf, uint16_t address)
+{
+    nsf_nes_memory_t *nes_memory = &nsf->nes_memory;
+
+    if (address >= 0xFFFA) {
+        return nes_memory->int_vecs[address - 0xFFFA];
+    }
+
+    uint8_t block_index = (address & 0x7000) >> 12;
+    if (nes_memory->rom_block[block_index] == 0) {
+        ESP_LOGE(TAG, "Attempted read from unloaded block %d", block_index);
+        return 0;
+    }
+    return (nes_memory->rom_block[block_index])[address & 0x0FFF];
+}
+
 uint8_t IRAM_ATTR read6502(uint16_t address)
 {
     if (!active_nsf_file) { return 0; }
-    nsf_nes_memory_t *nes_memory = &active_nsf_file->nes_memory;
-
-    uint8_t value = 0;
-    if (address <= 0x07FF) {
-        value = nes_memory->ram[address];
-    } else if (address >= 0x1000 && address <= 0x107F) {
-        value = nes_memory->prg[address - 0x1000];
-    } else if (address >= 0x4000 && address <= 0x4017) {
-        value = nes_memory->apu_regs[address - 0x4000];
-    } else if (address >= 0x5FF8 && address <= 0x5FFF) {
-        value = nes_memory->bank_regs[address - 0x5FF8];
-    } else if (address >= 0x8000 && address < 0xFFFA) {
-        uint8_t block_index = (address & 0x7000) >> 12;
-        if (nes_memory->rom_block[block_index] == 0) {
-            ESP_LOGE(TAG, "Attempted read from unloaded block %d", block_index);
-            return 0;
-        }
-        value = (nes_memory->rom_block[block_index])[address & 0x0FFF];
-        mark_rom_bank_used(nes_memory, nes_memory->rom_block_bank_id[block_index]);
-    } else if (address >= 0xFFFA) {
-        value = nes_memory->int_vecs[address - 0xFFFA];
-    }
-    return value;
+    return nsf_memory_read(&active_nsf_file->nes_memory.map, address);
 }
 
 void IRAM_ATTR write6502(uint16_t address, uint8_t value)
 {
     if (!active_nsf_file) { return; }
-    nsf_nes_memory_t *nes_memory = &active_nsf_file->nes_memory;
-
-    if (address <= 0x07FF) {
-        nes_memory->ram[address] = value;
-    } else if (address >= 0x4000 && address <= 0x4017) {
-        nes_memory->apu_regs[address - 0x4000] = value;
-        if (address != 0x4016) {
-            //ESP_LOGI(TAG, "[%d] APU Write: $%04X <- $%02X\n",
-            //        get6502_ticks(),
-            //        address, value);
-            if (active_nsf_file->apu_write_cb) {
-                active_nsf_file->apu_write_cb(address, value);
-            }
-        }
-    } else if (address >= 0x5FF8 && address <= 0x5FFF) {
-        if (nes_memory->bank_regs[address - 0x5FF8] != value) {
-            nes_memory->bank_regs[address - 0x5FF8] = value;
-            nsf_load_rom_bank(active_nsf_file, address, value);
-        }
-    }
+    nsf_memory_write(&active_nsf_file->nes_memory.map, address, value);
 }
 
 void nsf_init_nes_memory(nsf_file_t *nsf)
 {
     nsf_nes_memory_t *nes_memory = &nsf->nes_memory;
+    nsf_memory_map_t *map = &nes_memory->map;
     bzero(nes_memory, sizeof(nsf_nes_memory_t));
     nes_memory->apu_regs[0x17] = 0x40;
+
+    map->nsf = nsf;
+    for (int i = 0; i < NSF_PAGE_COUNT; i++) {
+        map->read_handler[i] = nsf_read_open_bus;
+        map->write_handler[i] = nsf_write_open_bus;
+    }
+
+    // $0000 - $07FF
+    for (int i = 0; i < sizeof(nes_memory->ram) / NSF_PAGE_SIZE; i++) {
+        map->read_page[i] = nes_memory->ram + (i * NSF_PAGE_SIZE);
+        map->write_page[i] = nes_memory->ram + (i * NSF_PAGE_SIZE);
+    }
+
+    // $1000 - $10FF
+    map->read_page[0x10] = nes_memory->prg;
+
+    // $4000 - $40FF
+    map->read_handler[0x40] = nsf_read_apu;
+    map->write_handler[0x40] = nsf_write_apu;
+
+    // $5F00 - $5FFF
+    map->read_handler[0x5F] = nsf_read_bank_regs;
+    map->write_handler[0x5F] = nsf_write_bank_regs;
+
+    // $8000 - $FFFF, which gets pointers as blocks are mapped
+    for (int i = 0x80; i < NSF_PAGE_COUNT; i++) {
+        map->read_handler[i] = nsf_read_rom;
+    }
+}
+
+/*
+ * Update the page table entries for a ROM block, after its pointer
+ * has changed.
+ */
+void nsf_map_rom_block(nsf_nes_memory_t *nes_memory, uint8_t block)
+{
+    const uint8_t first_page = 0x80 + (block * (ROM_BANK_SIZE / NSF_PAGE_SIZE));
+
+    for (int i = 0; i < ROM_BANK_SIZE / NSF_PAGE_SIZE; i++) {
+        const uint8_t page = first_page + i;
+        if (nes_memory->rom_block[block] && page != 0xFF) {
+            nes_memory->map.read_page[page] = nes_memory->rom_block[block] + (i * NSF_PAGE_SIZE);
+        } else {
+            nes_memory->map.read_page[page] = NULL;
+        }
+    }
 }
 
 void nsf_init_nes_prg(nsf_file_t *nsf, uint8_t song, uint8_t pal_ntsc)
@@ -432,35 +495,36 @@ esp_err_t nsf_init_load_nes_rom(nsf_file_t *nsf)
         ESP_LOGE(TAG, "Read error");
         return ESP_FAIL;
     } else if (n != max_len) {
-        ESP_LOGW(TAG, "Short read: %d < %d", n, max_len);
+        ESP_LOGW(TAG, "Short read: %d < %d", (int)n, max_len);
     }
 
     for(int i = 0; i < 8; i++) {
         nsf->nes_memory.rom_block[i] = nsf->nes_memory.rom + (i * 4096);
+        nsf_map_rom_block(&nsf->nes_memory, i);
     }
 
     return ESP_OK;
 }
 
-esp_err_t nsf_init_load_nes_rom_banks(nsf_file_t *nsf)
+esp_err_t nsf_init_load_nes_rom_banks(nsf_file_t *nsf, uint8_t song)
 {
     esp_err_t ret = ESP_OK;
 
-    if (nsf->nes_memory.rom) {
-        free(nsf->nes_memory.rom);
-        nsf->nes_memory.rom = 0;
+    if (nsf->bank_store) {
+        nsf_bank_store_free(nsf->bank_store);
+        nsf->bank_store = NULL;
     }
-    nsf->nes_memory.rom = malloc(ROM_BANK_SIZE * ROM_BANK_COUNT);
-    bzero(nsf->nes_memory.rom, ROM_BANK_SIZE * ROM_BANK_COUNT);
-    bzero(nsf->nes_memory.rom_bank_id, ROM_BANK_COUNT);
-    bzero(nsf->nes_memory.rom_bank_loaded, ROM_BANK_COUNT);
-
-    for (int i = 0; i < ROM_BANK_COUNT; i++) {
-        nsf->nes_memory.rom_bank_use_order[i] = -1;
+    ret = nsf_bank_store_open(&nsf->bank_store, nsf->filename, nsf->header.load_address, song);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to open ROM banks");
+        return ret;
     }
 
     bzero(nsf->nes_memory.rom_block, sizeof(nsf->nes_memory.rom_block));
     bzero(nsf->nes_memory.rom_block_bank_id, sizeof(nsf->nes_memory.rom_block_bank_id));
+    for (int i = 0; i < 8; i++) {
+        nsf_map_rom_block(&nsf->nes_memory, i);
+    }
 
     for (int i = 0; i < 8; i++) {
         ret = nsf_load_rom_bank(nsf, 0x5FF8 + i, nsf->header.bankswitch_init[i]);
@@ -477,114 +541,22 @@ esp_err_t nsf_load_rom_bank(nsf_file_t *nsf, uint16_t reg, uint8_t bank)
     if (reg < 0x5FF8 || reg > 0x5FFF) {
         return ESP_ERR_INVALID_ARG;
     }
+    if (!nsf->bank_store) {
+        return ESP_ERR_INVALID_STATE;
+    }
     ESP_LOGD(TAG, "Load bank: $%04X -> %d", reg, bank);
 
-    int64_t time0 = esp_timer_get_time();
     nsf_nes_memory_t *nes_memory = &nsf->nes_memory;
-    uint16_t padding = nsf->header.load_address & 0x0FFF;
     uint8_t target_block = reg - 0x5FF8;
-    uint8_t i;
 
-    // Check if bank is already loaded
-    int bank_index = -1;
-    for (i = 0; i < ROM_BANK_COUNT; i++) {
-        if (nes_memory->rom_bank_loaded[i] && nes_memory->rom_bank_id[i] == bank) {
-            bank_index = i;
-            break;
-        }
+    const uint8_t *rom_bank = nsf_bank_store_switch(nsf->bank_store, target_block, bank);
+    if (!rom_bank) {
+        return ESP_FAIL;
     }
 
-    if (bank_index != -1) {
-        // Bank is already loaded
-        nes_memory->rom_block[target_block] = nes_memory->rom + (bank_index * 4096);
-        nes_memory->rom_block_bank_id[target_block] = bank;
-        mark_rom_bank_used(nes_memory, bank);
-    } else {
-        // Bank is not loaded
-
-        // Find an empty bank slot
-        bank_index = -1;
-        for (i = 0; i < ROM_BANK_COUNT; i++) {
-            if (!nes_memory->rom_bank_loaded[i]) {
-                bank_index = i;
-                break;
-            }
-        }
-        if (bank_index == -1) {
-            ESP_LOGD(TAG, "No empty ROM banks available");
-
-            // Grab the ROM bank ID at the end of the use list
-            int oldest_bank = nes_memory->rom_bank_use_order[ROM_BANK_COUNT - 1];
-            if (oldest_bank == -1) {
-                ESP_LOGE(TAG, "LRU list should not have an empty tail");
-                return ESP_FAIL;
-            }
-            for (i = 0; i < ROM_BANK_COUNT; i++) {
-                if (nes_memory->rom_bank_id[i] == oldest_bank) {
-                    bank_index = i;
-                    break;
-                }
-            }
-            if (bank_index == -1) {
-                ESP_LOGE(TAG, "Unable to find bank %d in loaded bank set!", oldest_bank);
-                return ESP_FAIL;
-            }
-            ESP_LOGI(TAG, "Evicting bank %d from slot %d", nes_memory->rom_bank_id[bank_index], bank_index);
-            // Set the least recently used bank as unloaded
-            nes_memory->rom_bank_use_order[ROM_BANK_COUNT - 1] = -1;
-            nes_memory->rom_bank_loaded[bank_index] = 0;
-            nes_memory->rom_bank_id[bank_index] = 0;
-
-            // If the unloaded bank is still referenced by a ROM block, then
-            // that reference also needs to be cleared out.
-            for (i = 0; i < 8; i++) {
-                if (nes_memory->rom_block[i] && nes_memory->rom_block_bank_id[i] == bank_index) {
-                    nes_memory->rom_block[i] = 0;
-                    nes_memory->rom_block_bank_id[i] = 0;
-                    break;
-                }
-            }
-        }
-
-        uint8_t *rom_bank = nes_memory->rom + (bank_index * 4096);
-
-        // Clear the target bank
-        bzero(rom_bank, 4096);
-        nes_memory->rom_bank_loaded[bank_index] = 0;
-
-        // Load the bank data
-        if (bank == 0) {
-            if (fseek(nsf->file, 0x080, SEEK_SET) < 0) {
-                return ESP_FAIL;
-            }
-
-            size_t n = fread(rom_bank + padding, 1, 4096 - padding, nsf->file);
-            if (n == 0 && !feof(nsf->file)) {
-                ESP_LOGE(TAG, "Read error");
-                return ESP_FAIL;
-            }
-        } else {
-            if (fseek(nsf->file, 0x080 + (4096 - padding) + (4096 * (bank - 1)), SEEK_SET) < 0) {
-                return ESP_FAIL;
-            }
-
-            size_t n = fread(rom_bank, 1, 4096, nsf->file);
-            if (n == 0 && !feof(nsf->file)) {
-                ESP_LOGE(TAG, "Read error");
-                return ESP_FAIL;
-            }
-        }
-
-        // Set the loaded state variables and pointers
-        nes_memory->rom_bank_loaded[bank_index] = 1;
-        nes_memory->rom_bank_id[bank_index] = bank;
-        nes_memory->rom_block[target_block] = rom_bank;
-        nes_memory->rom_block_bank_id[target_block] = bank;
-        mark_rom_bank_used(nes_memory, bank);
-
-        int64_t time1 = esp_timer_get_time();
-        ESP_LOGI(TAG, "Bank loaded: $%04X -> %d [%lld(us)]", reg, bank, (time1-time0));
-    }
+    nes_memory->rom_block[target_block] = rom_bank;
+    nes_memory->rom_block_bank_id[target_block] = bank;
+    nsf_map_rom_block(nes_memory, target_block);
 
     return ESP_OK;
 }
@@ -594,11 +566,11 @@ esp_err_t nsf_playback_init(nsf_file_t *nsf, uint8_t song, nsf_apu_write_cb_t ap
     esp_err_t ret;
     nsf->apu_write_cb = apu_write_cb;
     nsf_init_nes_memory(nsf);
-    nsf_init_nes_prg(nsf, song, 0);
+    nsf_init_nes_prg(nsf, song, nsf_is_pal(nsf) ? 1 : 0);
 
     if (nsf_has_bank_switching(nsf)) {
         ESP_LOGI(TAG, "Playback init loading bankswitched ROM");
-        ret = nsf_init_load_nes_rom_banks(nsf);
+        ret = nsf_init_load_nes_rom_banks(nsf, song);
     } else {
         ESP_LOGI(TAG, "Playback init loading contiguous ROM");
         ret = nsf_init_load_nes_rom(nsf);
@@ -607,40 +579,82 @@ esp_err_t nsf_playback_init(nsf_file_t *nsf, uint8_t song, nsf_apu_write_cb_t ap
         return ret;
     }
 
-    reset6502();
+    if (nsf->reference_cpu) {
+        reset6502();
+        nsf->reference_start_ticks = get6502_ticks();
+    } else {
+        nsf_cpu_reset(&nsf->cpu, &nsf->nes_memory.map);
+    }
 
-    do {
-        step6502();
-        //TODO have a sanity check condition
-    } while (get6502_pc() != 0x1007);
+    return nsf_run_to_play_loop(nsf);
+}
+
+/*
+ * Run the CPU until it gets back to the loop at the end of the PRG stub,
+ * after returning from the init or play routine.
+ */
+esp_err_t nsf_run_to_play_loop(nsf_file_t *nsf)
+{
+    bool returned;
+
+    if (nsf->reference_cpu) {
+        uint32_t start_ticks = get6502_ticks();
+        do {
+            step6502();
+        } while (get6502_pc() != PRG_PLAY_LOOP && (get6502_ticks() - start_ticks) < CPU_TICKS_MAX);
+        returned = get6502_pc() == PRG_PLAY_LOOP;
+    } else {
+        returned = nsf_cpu_run(&nsf->cpu, &nsf->nes_memory.map, PRG_PLAY_LOOP, CPU_TICKS_MAX);
+    }
 
+    if (!returned) {
+        ESP_LOGE(TAG, "Routine did not return within %d cycles", CPU_TICKS_MAX);
+        return ESP_ERR_TIMEOUT;
+    }
     return ESP_OK;
 }
 
 esp_err_t nsf_playback_frame(nsf_file_t *nsf)
 {
-    if (get6502_pc() != 0x1007) {
+    uint16_t pc = nsf->reference_cpu ? get6502_pc() : nsf->cpu.pc;
+    if (pc != PRG_PLAY_LOOP) {
         return ESP_ERR_INVALID_STATE;
     }
 
-    do {
-        step6502();
-        //TODO have a sanity check condition
-    } while (get6502_pc() != 0x1007);
+    return nsf_run_to_play_loop(nsf);
+}
 
-    return ESP_OK;
+void nsf_set_apu_write_cb(nsf_file_t *nsf, nsf_apu_write_cb_t apu_write_cb)
+{
+    nsf->apu_write_cb = apu_write_cb;
+}
+
+uint32_t nsf_get_ticks(const nsf_file_t *nsf)
+{
+    if (nsf->reference_cpu) {
+        return get6502_ticks() - nsf->reference_start_ticks;
+    } else {
+        return nsf->cpu.ticks;
+    }
+}
+
+void nsf_set_reference_cpu(nsf_file_t *nsf, bool enable)
+{
+    nsf->reference_cpu = enable;
 }
 
 void nsf_free(nsf_file_t *nsf)
 {
     if (nsf) {
         assert(active_nsf_file == nsf);
+        nsf_bank_store_free(nsf->bank_store);
         if (nsf->file) {
             fclose(nsf->file);
         }
         if (nsf->nes_memory.rom) {
             free(nsf->nes_memory.rom);
         }
+        free(nsf->filename);
         free(nsf);
         active_nsf_file = NULL;
     }
@@ -3,6 +3,7 @@
 
 #include <esp_err.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "nes.h"
 
@@ -44,9 +45,36 @@ esp_err_t nsf_open(nsf_file_t **nsf, const char *filename);
 void nsf_log_header_fields(const nsf_file_t *nsf);
 const nsf_header_t *nsf_get_header(const nsf_file_t *nsf);
 
+/**
+ * Check whether the file is played with PAL timing, which is only
+ * done for files that do not support NTSC.
+ */
+bool nsf_is_pal(const nsf_file_t *nsf);
+
 esp_err_t nsf_playback_init(nsf_file_t *nsf, uint8_t song, nsf_apu_write_cb_t apu_write_cb);
 esp_err_t nsf_playback_frame(nsf_file_t *nsf);
 
+/**
+ * Replace the APU write callback provided to nsf_playback_init().
+ */
+void nsf_set_apu_write_cb(nsf_file_t *nsf, nsf_apu_write_cb_t apu_write_cb);
+
+/**
+ * Get the number of CPU cycles run since playback was initialized.
+ *
+ * When called from the APU write callback, this is the cycle count
+ * at the start of the instruction doing the write.
+ */
+uint32_t nsf_get_ticks(const nsf_file_t *nsf);
+
+/**
+ * Run playback on the fake6502 core instead of the NSF interpreter.
+ *
+ * This is slower, and is only there to check the two against
+ * each other. It must be set before playback is initialized.
+ */
+void nsf_set_reference_cpu(nsf_file_t *nsf, bool enable);
+
 void nsf_free(nsf_file_t *nsf);
 
 #endif /* NSF_H */
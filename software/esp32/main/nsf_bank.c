@@ -0,0 +1,694 @@
+#include "nsf_bank.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/unistd.h>
+#include <sys/param.h>
+#include <errno.h>
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "playback_stats.h"
+
+static const char *TAG = "nsf_bank";
+
+/* Offset of the ROM data in the NSF file, after the header */
+#define NSF_DATA_OFFSET 0x080
+
+/* Largest ROM image, including one empty bank, that is loaded up front */
+#define BANK_PRELOAD_BUDGET (96 * 1024)
+
+/* Banks in the cache, which leaves room for eight more beyond those switched in */
+#define BANK_CACHE_COUNT 16
+
+/* ROM blocks from $8000 to $FFFF */
+#define BANK_BLOCK_COUNT 8
+
+/* Fewest banks the cache works with, which is one beyond those switched in */
+#define BANK_CACHE_MIN (BANK_BLOCK_COUNT + 1)
+
+/* Most bank switches recorded in the access history */
+#define BANK_HISTORY_MAX 8192
+
+/* Most bank switches the prefetch task looks ahead */
+#define BANK_LOOKAHEAD 64
+
+#define BANK_HISTORY_MAGIC "NSBH"
+#define BANK_HISTORY_VERSION 1
+#define BANK_HISTORY_EXTENSION ".nsfbank"
+#define BANK_HISTORY_TMP_EXTENSION ".tmp"
+
+/* Should be below the emulation task, so it only runs while that waits */
+#define PREFETCH_TASK_PRIORITY 3
+
+typedef enum {
+    BANK_SLOT_EMPTY = 0,
+    BANK_SLOT_LOADING,
+    BANK_SLOT_READY
+} nsf_bank_slot_state_t;
+
+typedef struct {
+    uint8_t bank;
+    uint8_t state;
+    uint32_t last_used;
+} nsf_bank_slot_t;
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint8_t song;
+    uint8_t reserved;
+    uint32_t source_size;
+    uint32_t source_mtime;
+    uint32_t count;
+} nsf_bank_history_header_t;
+
+struct nsf_bank_store_t {
+    FILE *file;
+    FILE *prefetch_file;
+    char *history_filename;
+    uint32_t source_size;
+    uint32_t source_mtime;
+    uint8_t song;
+    uint16_t padding;
+    uint16_t bank_count;
+
+    /* Every bank of the file, followed by an empty one, when preloaded */
+    uint8_t *image;
+
+    /* Cached banks, when not preloaded */
+    uint8_t *cache;
+    nsf_bank_slot_t slots[BANK_CACHE_COUNT];
+    /* Slots that the cache has memory for */
+    int slot_count;
+    /* Cache slot switched into each ROM block, or -1 */
+    int8_t block_slot[BANK_BLOCK_COUNT];
+    /* Count of bank switches, used as the LRU clock */
+    uint32_t switches;
+
+    /* Sequence of bank switches, either being recorded or followed */
+    uint8_t *history;
+    uint32_t history_len;
+    uint32_t history_pos;
+    bool recording;
+
+    TaskHandle_t task;
+    /* Task waiting for the prefetch task to finish reading a bank */
+    TaskHandle_t switch_task;
+    SemaphoreHandle_t exit_sem;
+    portMUX_TYPE lock;
+    volatile bool running;
+};
+
+static char *nsf_bank_history_filename(const char *filename, uint8_t song);
+static esp_err_t nsf_bank_history_load(nsf_bank_store_t *store);
+static esp_err_t nsf_bank_history_save(nsf_bank_store_t *store);
+static void nsf_bank_history_add(nsf_bank_store_t *store, uint8_t bank);
+static esp_err_t nsf_bank_preload(nsf_bank_store_t *store);
+static esp_err_t nsf_bank_read(nsf_bank_store_t *store, FILE *file, uint8_t bank, uint8_t *data);
+
+/*
+ * Build the history filename by replacing the extension of the NSF file
+ * with the song number and the history extension.
+ */
+char *nsf_bank_history_filename(const char *filename, uint8_t song)
+{
+    size_t len = strlen(filename);
+    const char *slash = strrchr(filename, '/');
+    const char *dot = strrchr(filename, '.');
+    if (dot && (!slash || dot > slash)) {
+        len = dot - filename;
+    }
+
+    // Room for the song number, as ".255"
+    size_t size = len + 4 + strlen(BANK_HISTORY_EXTENSION) + 1;
+    char *history_filename = malloc(size);
+    if (!history_filename) {
+        return NULL;
+    }
+
+    snprintf(history_filename, size, "%.*s.%d%s", (int)len, filename, song + 1, BANK_HISTORY_EXTENSION);
+    return history_filename;
+}
+
+esp_err_t nsf_bank_history_load(nsf_bank_store_t *store)
+{
+    esp_err_t ret = ESP_OK;
+    nsf_bank_history_header_t header;
+
+    FILE *file = fopen(store->history_filename, "rb");
+    if (!file) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    do {
+        if (fread(&header, 1, sizeof(header), file) != sizeof(header)) {
+            ESP_LOGW(TAG, "Unable to read bank history header");
+            ret = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+
+        if (memcmp(header.magic, BANK_HISTORY_MAGIC, 4) != 0
+                || header.version != BANK_HISTORY_VERSION
+                || header.song != store->song
+                || header.count == 0 || header.count > BANK_HISTORY_MAX) {
+            ESP_LOGW(TAG, "Unsupported bank history file");
+            ret = ESP_ERR_INVALID_STATE;
+            break;
+        }
+
+        if (header.source_size != store->source_size || header.source_mtime != store->source_mtime) {
+            ESP_LOGI(TAG, "Bank history is out of date");
+            ret = ESP_ERR_INVALID_STATE;
+            break;
+        }
+
+        store->history = malloc(header.count);
+        if (!store->history) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        if (fread(store->history, 1, header.count, file) != header.count) {
+            ESP_LOGW(TAG, "Unable to read bank history");
+            free(store->history);
+            store->history = NULL;
+            ret = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+        store->history_len = header.count;
+
+        ESP_LOGI(TAG, "Opened bank history: switches=%d", store->history_len);
+    } while (0);
+
+    fclose(file);
+    return ret;
+}
+
+esp_err_t nsf_bank_history_save(nsf_bank_store_t *store)
+{
+    esp_err_t ret = ESP_OK;
+    char *tmp_filename = NULL;
+    FILE *file = NULL;
+
+    do {
+        tmp_filename = malloc(strlen(store->history_filename) + strlen(BANK_HISTORY_TMP_EXTENSION) + 1);
+        if (!tmp_filename) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+        strcpy(tmp_filename, store->history_filename);
+        strcat(tmp_filename, BANK_HISTORY_TMP_EXTENSION);
+
+        file = fopen(tmp_filename, "wb");
+        if (!file) {
+            ESP_LOGE(TAG, "Unable to create bank history: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+
+        nsf_bank_history_header_t header;
+        bzero(&header, sizeof(header));
+        memcpy(header.magic, BANK_HISTORY_MAGIC, 4);
+        header.version = BANK_HISTORY_VERSION;
+        header.song = store->song;
+        header.source_size = store->source_size;
+        header.source_mtime = store->source_mtime;
+        header.count = store->history_len;
+
+        if (fwrite(&header, 1, sizeof(header), file) != sizeof(header)
+                || fwrite(store->history, 1, store->history_len, file) != store->history_len) {
+            ESP_LOGE(TAG, "Unable to write bank history: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+
+        int result = fclose(file);
+        file = NULL;
+        if (result != 0) {
+            ESP_LOGE(TAG, "Unable to close bank history: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+
+        // FATFS will not rename over an existing file
+        unlink(store->history_filename);
+        if (rename(tmp_filename, store->history_filename) != 0) {
+            ESP_LOGE(TAG, "Unable to rename bank history: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+
+        ESP_LOGI(TAG, "Wrote bank history: switches=%d", store->history_len);
+    } while (0);
+
+    if (file) {
+        fclose(file);
+    }
+    if (ret != ESP_OK && tmp_filename) {
+        unlink(tmp_filename);
+    }
+    free(tmp_filename);
+
+    return ret;
+}
+
+/*
+ * Record a bank switch, or move along the recorded sequence of them.
+ * This is only called from the switching task, and the position is
+ * published for the prefetch task.
+ */
+void nsf_bank_history_add(nsf_bank_store_t *store, uint8_t bank)
+{
+    if (store->recording) {
+        if (store->history_len < BANK_HISTORY_MAX) {
+            store->history[store->history_len++] = bank;
+        }
+        return;
+    }
+    if (store->history_len == 0) {
+        return;
+    }
+
+    // Normally this is the next entry, but the search also finds the way
+    // back when playback strays from the recording or loops past its end
+    uint32_t pos = store->history_pos;
+    for (uint32_t i = 0; i < store->history_len; i++) {
+        uint32_t index = (pos + i) % store->history_len;
+        if (store->history[index] == bank) {
+            __atomic_store_n(&store->history_pos, (index + 1) % store->history_len, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+esp_err_t nsf_bank_preload(nsf_bank_store_t *store)
+{
+    int64_t time0 = esp_timer_get_time();
+    size_t size = (store->bank_count + 1) * NSF_BANK_SIZE;
+
+    store->image = malloc(size);
+    if (!store->image) {
+        return ESP_ERR_NO_MEM;
+    }
+    bzero(store->image, size);
+
+    size_t len = (store->bank_count * NSF_BANK_SIZE) - store->padding;
+    if (fseek(store->file, NSF_DATA_OFFSET, SEEK_SET) < 0
+            || (fread(store->image + store->padding, 1, len, store->file) == 0 && ferror(store->file))) {
+        ESP_LOGE(TAG, "Read error");
+        free(store->image);
+        store->image = NULL;
+        return ESP_FAIL;
+    }
+
+    int64_t time1 = esp_timer_get_time();
+    ESP_LOGI(TAG, "Preloaded %d banks [%lld(us)]", store->bank_count, (long long)(time1-time0));
+    return ESP_OK;
+}
+
+esp_err_t nsf_bank_read(nsf_bank_store_t *store, FILE *file, uint8_t bank, uint8_t *data)
+{
+    long offset;
+    uint8_t *dest;
+    size_t len;
+
+    bzero(data, NSF_BANK_SIZE);
+
+    // Bank 0 starts at the load address, with padding before it
+    if (bank == 0) {
+        offset = NSF_DATA_OFFSET;
+        dest = data + store->padding;
+        len = NSF_BANK_SIZE - store->padding;
+    } else {
+        offset = NSF_DATA_OFFSET + (NSF_BANK_SIZE - store->padding) + (NSF_BANK_SIZE * (bank - 1));
+        dest = data;
+        len = NSF_BANK_SIZE;
+    }
+
+    if (fseek(file, offset, SEEK_SET) < 0) {
+        return ESP_FAIL;
+    }
+
+    size_t n = fread(dest, 1, len, file);
+    if (n == 0 && !feof(file)) {
+        ESP_LOGE(TAG, "Read error");
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+static int nsf_bank_find_slot(const nsf_bank_store_t *store, uint8_t bank)
+{
+    for (int i = 0; i < store->slot_count; i++) {
+        if (store->slots[i].state != BANK_SLOT_EMPTY && store->slots[i].bank == bank) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool nsf_bank_is_mapped(const nsf_bank_store_t *store, int slot, int except_block)
+{
+    for (int i = 0; i < BANK_BLOCK_COUNT; i++) {
+        if (i != except_block && store->block_slot[i] == slot) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Pick the cache slot to load a bank into, which is either an empty one
+ * or the least recently switched in bank that is not still in use,
+ * and is not about to be.
+ */
+static int nsf_bank_pick_victim(const nsf_bank_store_t *store, int except_block,
+        const uint8_t *upcoming, size_t upcoming_len)
+{
+    int victim = -1;
+    for (int i = 0; i < store->slot_count; i++) {
+        const nsf_bank_slot_t *slot = &store->slots[i];
+        if (slot->state == BANK_SLOT_EMPTY) {
+            return i;
+        }
+        if (slot->state == BANK_SLOT_LOADING || nsf_bank_is_mapped(store, i, except_block)) {
+            continue;
+        }
+        if (upcoming_len > 0 && memchr(upcoming, slot->bank, upcoming_len)) {
+            continue;
+        }
+        if (victim == -1 || slot->last_used < store->slots[victim].last_used) {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+static void nsf_bank_prefetch_task(void *pvParameters)
+{
+    nsf_bank_store_t *store = (nsf_bank_store_t *)pvParameters;
+    uint8_t upcoming[BANK_CACHE_COUNT - BANK_BLOCK_COUNT];
+    const size_t upcoming_max = store->slot_count - BANK_BLOCK_COUNT;
+
+    while (store->running) {
+        uint32_t pos = __atomic_load_n(&store->history_pos, __ATOMIC_ACQUIRE);
+        size_t upcoming_len = 0;
+        int bank = -1;
+        int slot = -1;
+
+        portENTER_CRITICAL(&store->lock);
+
+        // Collect the next banks to be switched in, up to as many as the
+        // spare slots can hold, and find the first one not in the cache
+        for (uint32_t i = 0; i < BANK_LOOKAHEAD && upcoming_len < upcoming_max; i++) {
+            uint8_t next = store->history[(pos + i) % store->history_len];
+            if (memchr(upcoming, next, upcoming_len)) {
+                continue;
+            }
+            int next_slot = nsf_bank_find_slot(store, next);
+            if (next_slot >= 0 && nsf_bank_is_mapped(store, next_slot, -1)) {
+                continue;
+            }
+            upcoming[upcoming_len++] = next;
+            if (bank == -1 && next_slot == -1) {
+                bank = next;
+            }
+        }
+
+        if (bank != -1) {
+            slot = nsf_bank_pick_victim(store, -1, upcoming, upcoming_len);
+            if (slot != -1) {
+                store->slots[slot].bank = bank;
+                store->slots[slot].state = BANK_SLOT_LOADING;
+            }
+        }
+
+        portEXIT_CRITICAL(&store->lock);
+
+        if (slot == -1) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        esp_err_t ret = nsf_bank_read(store, store->prefetch_file, bank, store->cache + (slot * NSF_BANK_SIZE));
+
+        portENTER_CRITICAL(&store->lock);
+        if (ret == ESP_OK) {
+            store->slots[slot].state = BANK_SLOT_READY;
+            store->slots[slot].last_used = store->switches;
+        } else {
+            store->slots[slot].state = BANK_SLOT_EMPTY;
+        }
+        TaskHandle_t switch_task = store->switch_task;
+        portEXIT_CRITICAL(&store->lock);
+
+        if (switch_task) {
+            xTaskNotifyGive(switch_task);
+        }
+
+        if (ret != ESP_OK) {
+            // Leave the bank to be read when it is switched in
+            ESP_LOGE(TAG, "Unable to prefetch bank %d", bank);
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
+
+    xSemaphoreGive(store->exit_sem);
+    vTaskDelete(NULL);
+}
+
+esp_err_t nsf_bank_store_open(nsf_bank_store_t **store, const char *filename,
+        uint16_t load_address, uint8_t song)
+{
+    esp_err_t ret = ESP_OK;
+    nsf_bank_store_t *store_result = NULL;
+
+    do {
+        store_result = malloc(sizeof(nsf_bank_store_t));
+        if (!store_result) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        bzero(store_result, sizeof(nsf_bank_store_t));
+        portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+        store_result->lock = lock;
+        store_result->song = song;
+        store_result->padding = load_address & 0x0FFF;
+        memset(store_result->block_slot, -1, sizeof(store_result->block_slot));
+
+        struct stat st;
+        if (stat(filename, &st) != 0) {
+            ESP_LOGE(TAG, "Unable to stat file: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+        store_result->source_size = (uint32_t)st.st_size;
+        store_result->source_mtime = (uint32_t)st.st_mtime;
+
+        size_t data_len = st.st_size > NSF_DATA_OFFSET ? st.st_size - NSF_DATA_OFFSET : 0;
+        store_result->bank_count = (store_result->padding + data_len + NSF_BANK_SIZE - 1) / NSF_BANK_SIZE;
+
+        store_result->file = fopen(filename, "rb");
+        if (!store_result->file) {
+            ESP_LOGE(TAG, "Failed to open file for reading: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+
+        // Bank switches are free if the whole file fits in memory
+        if ((store_result->bank_count + 1) * NSF_BANK_SIZE <= BANK_PRELOAD_BUDGET) {
+            ret = nsf_bank_preload(store_result);
+            if (ret != ESP_ERR_NO_MEM) {
+                break;
+            }
+            ESP_LOGW(TAG, "Not enough memory to preload, using the bank cache");
+            ret = ESP_OK;
+        }
+
+        // Fall back on a smaller cache if memory is short
+        for (int count = BANK_CACHE_COUNT; count >= BANK_CACHE_MIN; count--) {
+            store_result->cache = malloc(count * NSF_BANK_SIZE);
+            if (store_result->cache) {
+                store_result->slot_count = count;
+                break;
+            }
+        }
+        if (!store_result->cache) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+        if (store_result->slot_count < BANK_CACHE_COUNT) {
+            ESP_LOGW(TAG, "Not enough memory for the full bank cache, using %d banks",
+                    store_result->slot_count);
+        }
+
+        store_result->history_filename = nsf_bank_history_filename(filename, song);
+        if (!store_result->history_filename) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        // Without a history, record one on this play for the next
+        if (nsf_bank_history_load(store_result) != ESP_OK) {
+            store_result->history = malloc(BANK_HISTORY_MAX);
+            store_result->recording = store_result->history != NULL;
+            ESP_LOGI(TAG, "Recording bank history");
+            break;
+        }
+
+        store_result->prefetch_file = fopen(filename, "rb");
+        if (!store_result->prefetch_file) {
+            ESP_LOGE(TAG, "Failed to open file for reading: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+
+        store_result->exit_sem = xSemaphoreCreateBinary();
+        if (!store_result->exit_sem) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        store_result->running = true;
+        if (xTaskCreate(nsf_bank_prefetch_task, "nsf_bank_task", 3072, store_result,
+                PREFETCH_TASK_PRIORITY, &store_result->task) != pdPASS) {
+            store_result->task = NULL;
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+    } while (0);
+
+    if (ret == ESP_OK) {
+        *store = store_result;
+    } else {
+        nsf_bank_store_free(store_result);
+    }
+
+    return ret;
+}
+
+bool nsf_bank_store_is_preloaded(const nsf_bank_store_t *store)
+{
+    return store->image != NULL;
+}
+
+const uint8_t *nsf_bank_store_switch(nsf_bank_store_t *store, uint8_t block, uint8_t bank)
+{
+    if (block >= BANK_BLOCK_COUNT) {
+        return NULL;
+    }
+
+    if (store->image) {
+        // Banks past the end of the file are empty
+        return store->image + (MIN(bank, store->bank_count) * NSF_BANK_SIZE);
+    }
+
+    int64_t time0 = esp_timer_get_time();
+    bool missed = false;
+    bool load = false;
+
+    portENTER_CRITICAL(&store->lock);
+    int slot = nsf_bank_find_slot(store, bank);
+    while (slot != -1 && store->slots[slot].state == BANK_SLOT_LOADING) {
+        // The prefetch task is already reading it, so wait for that to finish
+        store->switch_task = xTaskGetCurrentTaskHandle();
+        portEXIT_CRITICAL(&store->lock);
+        missed = true;
+        ulTaskNotifyTake(pdTRUE, 1);
+        portENTER_CRITICAL(&store->lock);
+        slot = nsf_bank_find_slot(store, bank);
+    }
+    store->switch_task = NULL;
+
+    if (slot == -1) {
+        slot = nsf_bank_pick_victim(store, block, NULL, 0);
+        if (slot != -1) {
+            store->slots[slot].bank = bank;
+            store->slots[slot].state = BANK_SLOT_LOADING;
+            load = true;
+        }
+    }
+    if (slot != -1 && !load) {
+        store->block_slot[block] = slot;
+        store->slots[slot].last_used = ++store->switches;
+    }
+    portEXIT_CRITICAL(&store->lock);
+
+    if (slot == -1) {
+        ESP_LOGE(TAG, "Unable to find a ROM bank to evict!");
+        return NULL;
+    }
+
+    uint8_t *data = store->cache + (slot * NSF_BANK_SIZE);
+
+    if (load) {
+        missed = true;
+        esp_err_t ret = nsf_bank_read(store, store->file, bank, data);
+
+        portENTER_CRITICAL(&store->lock);
+        if (ret == ESP_OK) {
+            store->slots[slot].state = BANK_SLOT_READY;
+            store->block_slot[block] = slot;
+            store->slots[slot].last_used = ++store->switches;
+        } else {
+            store->slots[slot].state = BANK_SLOT_EMPTY;
+        }
+        portEXIT_CRITICAL(&store->lock);
+
+        if (ret != ESP_OK) {
+            return NULL;
+        }
+    }
+
+    nsf_bank_history_add(store, bank);
+
+    if (missed) {
+        playback_stats_add(PLAYBACK_STATS_BANK_MISS, 1);
+        int64_t time1 = esp_timer_get_time();
+        ESP_LOGI(TAG, "Bank loaded: %d -> %d [%lld(us)]", bank, block, (long long)(time1-time0));
+    }
+
+    if (store->task) {
+        xTaskNotifyGive(store->task);
+    }
+
+    return data;
+}
+
+void nsf_bank_store_free(nsf_bank_store_t *store)
+{
+    if (store) {
+        if (store->task) {
+            store->running = false;
+            xTaskNotifyGive(store->task);
+            xSemaphoreTake(store->exit_sem, portMAX_DELAY);
+        }
+        if (store->exit_sem) {
+            vSemaphoreDelete(store->exit_sem);
+        }
+        if (store->recording && store->history_len > 0) {
+            nsf_bank_history_save(store);
+        }
+        if (store->file) {
+            fclose(store->file);
+        }
+        if (store->prefetch_file) {
+            fclose(store->prefetch_file);
+        }
+        free(store->history);
+        free(store->history_filename);
+        free(store->cache);
+        free(store->image);
+        free(store);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * NSF ROM bank store
+ *
+ * Supplies the 4k ROM banks of a bank-switched NSF file. If the whole
+ * file fits within the preload budget, it is read into memory up front
+ * and a bank switch is only a pointer change. Otherwise banks are kept
+ * in a cache, which a background task fills ahead of each switch using
+ * the sequence of banks recorded on the first play of the song. That
+ * sequence is stored next to the NSF file with a ".nsfbank" extension.
+ */
+
+#ifndef NSF_BANK_H
+#define NSF_BANK_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+#define NSF_BANK_SIZE 4096
+
+typedef struct nsf_bank_store_t nsf_bank_store_t;
+
+/**
+ * Open the bank store for an NSF file.
+ *
+ * @param filename NSF file, which also names the access history
+ * @param load_address Load address from the header, which sets the
+ *                     padding before the start of bank 0
+ * @param song Song being played, since each has its own access history
+ */
+esp_err_t nsf_bank_store_open(nsf_bank_store_t **store, const char *filename,
+        uint16_t load_address, uint8_t song);
+
+/**
+ * Check whether every bank of the file was loaded up front.
+ */
+bool nsf_bank_store_is_preloaded(const nsf_bank_store_t *store);
+
+/**
+ * Switch a bank into one of the eight ROM blocks.
+ *
+ * If the bank is not already in memory, this has to read it from the
+ * file before returning. The data remains valid until another bank is
+ * switched into the same block.
+ *
+ * @param block ROM block, from 0 for $8000 to 7 for $F000
+ * @param bank Bank to switch in
+ * @return The bank data, or NULL if it could not be read
+ */
+const uint8_t *nsf_bank_store_switch(nsf_bank_store_t *store, uint8_t block, uint8_t bank);
+
+/**
+ * Stop prefetching, save the access history if this was the first
+ * play of the song, and free the store.
+ */
+void nsf_bank_store_free(nsf_bank_store_t *store);
+
+#endif /* NSF_BANK_H */
@@ -0,0 +1,567 @@
+#include "nsf_cpu.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FLAG_CARRY     0x01
+#define FLAG_ZERO      0x02
+#define FLAG_INTERRUPT 0x04
+#define FLAG_DECIMAL   0x08
+#define FLAG_BREAK     0x10
+#define FLAG_CONSTANT  0x20
+#define FLAG_OVERFLOW  0x40
+#define FLAG_SIGN      0x80
+
+#define BASE_STACK     0x100
+
+/* Base cycle count of each opcode, as used by fake6502 */
+static const uint8_t ticktable[256] = {
+/*        |  0  |  1  |  2  |  3  |  4  |  5  |  6  |  7  |  8  |  9  |  A  |  B  |  C  |  D  |  E  |  F  |     */
+/* 0 */      7,    6,    2,    8,    3,    3,    5,    5,    3,    2,    2,    2,    4,    4,    6,    6,  /* 0 */
+/* 1 */      2,    5,    2,    8,    4,    4,    6,    6,    2,    4,    2,    7,    4,    4,    7,    7,  /* 1 */
+/* 2 */      6,    6,    2,    8,    3,    3,    5,    5,    4,    2,    2,    2,    4,    4,    6,    6,  /* 2 */
+/* 3 */      2,    5,    2,    8,    4,    4,    6,    6,    2,    4,    2,    7,    4,    4,    7,    7,  /* 3 */
+/* 4 */      6,    6,    2,    8,    3,    3,    5,    5,    3,    2,    2,    2,    3,    4,    6,    6,  /* 4 */
+/* 5 */      2,    5,    2,    8,    4,    4,    6,    6,    2,    4,    2,    7,    4,    4,    7,    7,  /* 5 */
+/* 6 */      6,    6,    2,    8,    3,    3,    5,    5,    4,    2,    2,    2,    5,    4,    6,    6,  /* 6 */
+/* 7 */      2,    5,    2,    8,    4,    4,    6,    6,    2,    4,    2,    7,    4,    4,    7,    7,  /* 7 */
+/* 8 */      2,    6,    2,    6,    3,    3,    3,    3,    2,    2,    2,    2,    4,    4,    4,    4,  /* 8 */
+/* 9 */      2,    6,    2,    6,    4,    4,    4,    4,    2,    5,    2,    5,    5,    5,    5,    5,  /* 9 */
+/* A */      2,    6,    2,    6,    3,    3,    3,    3,    2,    2,    2,    2,    4,    4,    4,    4,  /* A */
+/* B */      2,    5,    2,    5,    4,    4,    4,    4,    2,    4,    2,    4,    4,    4,    4,    4,  /* B */
+/* C */      2,    6,    2,    8,    3,    3,    5,    5,    2,    2,    2,    2,    4,    4,    6,    6,  /* C */
+/* D */      2,    5,    2,    8,    4,    4,    6,    6,    2,    4,    2,    7,    4,    4,    7,    7,  /* D */
+/* E */      2,    6,    2,    8,    3,    3,    5,    5,    2,    2,    2,    2,    4,    4,    6,    6,  /* E */
+/* F */      2,    5,    2,    8,    4,    4,    6,    6,    2,    4,    2,    7,    4,    4,    7,    7   /* F */
+};
+
+// Memory accesses, through the page table
+#define READ(address) nsf_memory_read(map, (address))
+
+// Writes that go to a handler can reach the APU, so the cycle count
+// is stored first for anything that wants the time of the write
+#define WRITE(address, value) do { \
+    const uint16_t address_ = (address); \
+    uint8_t *page_ = map->write_page[address_ >> 8]; \
+    if (page_) { \
+        page_[address_ & 0xFF] = (value); \
+    } else { \
+        cpu->ticks = ticks; \
+        map->write_handler[address_ >> 8](map->nsf, address_, (value)); \
+    } \
+} while (0)
+
+#define PUSH8(value) WRITE(BASE_STACK + sp--, (value))
+#define PUSH16(value) do { \
+    const uint16_t value_ = (value); \
+    WRITE(BASE_STACK + sp, value_ >> 8); \
+    WRITE(BASE_STACK + (uint8_t)(sp - 1), value_ & 0xFF); \
+    sp -= 2; \
+} while (0)
+#define PULL8() READ(BASE_STACK + ++sp)
+#define PULL16() (sp += 2, \
+    (uint16_t)(READ(BASE_STACK + (uint8_t)(sp - 1)) | (READ(BASE_STACK + sp) << 8)))
+
+// Addressing modes, which leave the effective address in ea
+#define IMM() ea = pc++
+#define ZP()  ea = READ(pc++)
+#define ZPX() ea = (uint8_t)(READ(pc++) + x)
+#define ZPY() ea = (uint8_t)(READ(pc++) + y)
+#define ABS() do { \
+    ea = READ(pc) | (READ(pc + 1) << 8); \
+    pc += 2; \
+} while (0)
+#define ABSX() do { \
+    ABS(); \
+    cross = ((ea ^ (ea + x)) & 0xFF00) != 0; \
+    ea += x; \
+} while (0)
+#define ABSY() do { \
+    ABS(); \
+    cross = ((ea ^ (ea + y)) & 0xFF00) != 0; \
+    ea += y; \
+} while (0)
+#define IND() do { \
+    ABS(); \
+    ea = READ(ea) | (READ((ea & 0xFF00) | ((ea + 1) & 0x00FF)) << 8); \
+} while (0)
+#define INDX() do { \
+    const uint8_t zp_ = READ(pc++) + x; \
+    ea = READ(zp_) | (READ((uint8_t)(zp_ + 1)) << 8); \
+} while (0)
+#define INDY() do { \
+    const uint8_t zp_ = READ(pc++); \
+    ea = READ(zp_) | (READ((uint8_t)(zp_ + 1)) << 8); \
+    cross = ((ea ^ (ea + y)) & 0xFF00) != 0; \
+    ea += y; \
+} while (0)
+
+// Extra cycle for reads that cross a page with an indexed address
+#define PAGE_PENALTY() ticks += cross
+
+#define SET_NZ(n) status = (status & ~(FLAG_ZERO | FLAG_SIGN)) \
+    | ((n) ? 0 : FLAG_ZERO) | ((n) & FLAG_SIGN)
+
+// Instructions, with the operand already read
+#define ADC(m) do { \
+    const uint8_t m_ = (m); \
+    const uint16_t result_ = a + m_ + (status & FLAG_CARRY); \
+    status &= ~(FLAG_CARRY | FLAG_OVERFLOW); \
+    status |= (result_ >> 8) & FLAG_CARRY; \
+    status |= ((result_ ^ a) & (result_ ^ m_) & 0x80) ? FLAG_OVERFLOW : 0; \
+    a = (uint8_t)result_; \
+    SET_NZ(a); \
+} while (0)
+#define SBC(m) ADC((m) ^ 0xFF)
+#define AND(m) do { a &= (m); SET_NZ(a); } while (0)
+#define ORA(m) do { a |= (m); SET_NZ(a); } while (0)
+#define EOR(m) do { a ^= (m); SET_NZ(a); } while (0)
+#define CMP(r, m) do { \
+    const uint8_t m_ = (m); \
+    const uint8_t result_ = (r) - m_; \
+    status = (status & ~FLAG_CARRY) | (((r) >= m_) ? FLAG_CARRY : 0); \
+    SET_NZ(result_); \
+} while (0)
+#define BIT(m) do { \
+    const uint8_t m_ = (m); \
+    status = (status & ~(FLAG_ZERO | FLAG_OVERFLOW | FLAG_SIGN)) \
+        | ((a & m_) ? 0 : FLAG_ZERO) | (m_ & (FLAG_OVERFLOW | FLAG_SIGN)); \
+} while (0)
+
+// Read-modify-write instructions, applied to a variable
+#define ASL(v) do { \
+    status = (status & ~FLAG_CARRY) | ((v) >> 7); \
+    (v) <<= 1; \
+    SET_NZ(v); \
+} while (0)
+#define LSR(v) do { \
+    status = (status & ~FLAG_CARRY) | ((v) & FLAG_CARRY); \
+    (v) >>= 1; \
+    SET_NZ(v); \
+} while (0)
+#define ROL(v) do { \
+    const uint8_t carry_ = status & FLAG_CARRY; \
+    status = (status & ~FLAG_CARRY) | ((v) >> 7); \
+    (v) = ((v) << 1) | carry_; \
+    SET_NZ(v); \
+} while (0)
+#define ROR(v) do { \
+    const uint8_t carry_ = status & FLAG_CARRY; \
+    status = (status & ~FLAG_CARRY) | ((v) & FLAG_CARRY); \
+    (v) = ((v) >> 1) | (carry_ << 7); \
+    SET_NZ(v); \
+} while (0)
+#define INC(v) do { (v)++; SET_NZ(v); } while (0)
+#define DEC(v) do { (v)--; SET_NZ(v); } while (0)
+
+#define BRANCH(condition) do { \
+    const int8_t offset_ = (int8_t)READ(pc++); \
+    if (condition) { \
+        const uint16_t oldpc_ = pc; \
+        pc += offset_; \
+        ticks += ((oldpc_ ^ pc) & 0xFF00) ? 2 : 1; \
+    } \
+} while (0)
+
+void nsf_cpu_reset(nsf_cpu_t *cpu, const nsf_memory_map_t *map)
+{
+    cpu->pc = nsf_memory_read(map, 0xFFFC) | (nsf_memory_read(map, 0xFFFD) << 8);
+    cpu->a = 0;
+    cpu->x = 0;
+    cpu->y = 0;
+    cpu->sp = 0xFD;
+    cpu->status = FLAG_CONSTANT;
+    cpu->ticks = 0;
+}
+
+bool nsf_cpu_run(nsf_cpu_t *cpu, const nsf_memory_map_t *map, uint16_t stop_pc, uint32_t max_ticks)
+{
+    uint16_t pc = cpu->pc;
+    uint8_t sp = cpu->sp;
+    uint8_t a = cpu->a;
+    uint8_t x = cpu->x;
+    uint8_t y = cpu->y;
+    uint8_t status = cpu->status;
+    uint32_t ticks = cpu->ticks;
+    const uint32_t end_ticks = ticks + max_ticks;
+
+    uint16_t ea;
+    uint8_t value;
+    uint8_t cross;
+
+    do {
+        const uint8_t opcode = READ(pc++);
+
+        switch (opcode) {
+        // LDA
+        case 0xA1: INDX(); a = READ(ea); SET_NZ(a); break;
+        case 0xA5: ZP(); a = READ(ea); SET_NZ(a); break;
+        case 0xA9: IMM(); a = READ(ea); SET_NZ(a); break;
+        case 0xAD: ABS(); a = READ(ea); SET_NZ(a); break;
+        case 0xB1: INDY(); PAGE_PENALTY(); a = READ(ea); SET_NZ(a); break;
+        case 0xB5: ZPX(); a = READ(ea); SET_NZ(a); break;
+        case 0xB9: ABSY(); PAGE_PENALTY(); a = READ(ea); SET_NZ(a); break;
+        case 0xBD: ABSX(); PAGE_PENALTY(); a = READ(ea); SET_NZ(a); break;
+
+        // LDX
+        case 0xA2: IMM(); x = READ(ea); SET_NZ(x); break;
+        case 0xA6: ZP(); x = READ(ea); SET_NZ(x); break;
+        case 0xAE: ABS(); x = READ(ea); SET_NZ(x); break;
+        case 0xB6: ZPY(); x = READ(ea); SET_NZ(x); break;
+        case 0xBE: ABSY(); PAGE_PENALTY(); x = READ(ea); SET_NZ(x); break;
+
+        // LDY
+        case 0xA0: IMM(); y = READ(ea); SET_NZ(y); break;
+        case 0xA4: ZP(); y = READ(ea); SET_NZ(y); break;
+        case 0xAC: ABS(); y = READ(ea); SET_NZ(y); break;
+        case 0xB4: ZPX(); y = READ(ea); SET_NZ(y); break;
+        case 0xBC: ABSX(); PAGE_PENALTY(); y = READ(ea); SET_NZ(y); break;
+
+        // STA
+        case 0x81: INDX(); WRITE(ea, a); break;
+        case 0x85: ZP(); WRITE(ea, a); break;
+        case 0x8D: ABS(); WRITE(ea, a); break;
+        case 0x91: INDY(); WRITE(ea, a); break;
+        case 0x95: ZPX(); WRITE(ea, a); break;
+        case 0x99: ABSY(); WRITE(ea, a); break;
+        case 0x9D: ABSX(); WRITE(ea, a); break;
+
+        // STX
+        case 0x86: ZP(); WRITE(ea, x); break;
+        case 0x8E: ABS(); WRITE(ea, x); break;
+        case 0x96: ZPY(); WRITE(ea, x); break;
+
+        // STY
+        case 0x84: ZP(); WRITE(ea, y); break;
+        case 0x8C: ABS(); WRITE(ea, y); break;
+        case 0x94: ZPX(); WRITE(ea, y); break;
+
+        // ADC
+        case 0x61: INDX(); ADC(READ(ea)); break;
+        case 0x65: ZP(); ADC(READ(ea)); break;
+        case 0x69: IMM(); ADC(READ(ea)); break;
+        case 0x6D: ABS(); ADC(READ(ea)); break;
+        case 0x71: INDY(); PAGE_PENALTY(); ADC(READ(ea)); break;
+        case 0x75: ZPX(); ADC(READ(ea)); break;
+        case 0x79: ABSY(); PAGE_PENALTY(); ADC(READ(ea)); break;
+        case 0x7D: ABSX(); PAGE_PENALTY(); ADC(READ(ea)); break;
+
+        // SBC
+        case 0xE1: INDX(); SBC(READ(ea)); break;
+        case 0xE5: ZP(); SBC(READ(ea)); break;
+        case 0xE9: IMM(); SBC(READ(ea)); break;
+        case 0xEB: IMM(); SBC(READ(ea)); break;
+        case 0xED: ABS(); SBC(READ(ea)); break;
+        case 0xF1: INDY(); PAGE_PENALTY(); SBC(READ(ea)); break;
+        case 0xF5: ZPX(); SBC(READ(ea)); break;
+        case 0xF9: ABSY(); PAGE_PENALTY(); SBC(READ(ea)); break;
+        case 0xFD: ABSX(); PAGE_PENALTY(); SBC(READ(ea)); break;
+
+        // AND
+        case 0x21: INDX(); AND(READ(ea)); break;
+        case 0x25: ZP(); AND(READ(ea)); break;
+        case 0x29: IMM(); AND(READ(ea)); break;
+        case 0x2D: ABS(); AND(READ(ea)); break;
+        case 0x31: INDY(); PAGE_PENALTY(); AND(READ(ea)); break;
+        case 0x35: ZPX(); AND(READ(ea)); break;
+        case 0x39: ABSY(); PAGE_PENALTY(); AND(READ(ea)); break;
+        case 0x3D: ABSX(); PAGE_PENALTY(); AND(READ(ea)); break;
+
+        // ORA
+        case 0x01: INDX(); ORA(READ(ea)); break;
+        case 0x05: ZP(); ORA(READ(ea)); break;
+        case 0x09: IMM(); ORA(READ(ea)); break;
+        case 0x0D: ABS(); ORA(READ(ea)); break;
+        case 0x11: INDY(); PAGE_PENALTY(); ORA(READ(ea)); break;
+        case 0x15: ZPX(); ORA(READ(ea)); break;
+        case 0x19: ABSY(); PAGE_PENALTY(); ORA(READ(ea)); break;
+        case 0x1D: ABSX(); PAGE_PENALTY(); ORA(READ(ea)); break;
+
+        // EOR
+        case 0x41: INDX(); EOR(READ(ea)); break;
+        case 0x45: ZP(); EOR(READ(ea)); break;
+        case 0x49: IMM(); EOR(READ(ea)); break;
+        case 0x4D: ABS(); EOR(READ(ea)); break;
+        case 0x51: INDY(); PAGE_PENALTY(); EOR(READ(ea)); break;
+        case 0x55: ZPX(); EOR(READ(ea)); break;
+        case 0x59: ABSY(); PAGE_PENALTY(); EOR(READ(ea)); break;
+        case 0x5D: ABSX(); PAGE_PENALTY(); EOR(READ(ea)); break;
+
+        // CMP
+        case 0xC1: INDX(); CMP(a, READ(ea)); break;
+        case 0xC5: ZP(); CMP(a, READ(ea)); break;
+        case 0xC9: IMM(); CMP(a, READ(ea)); break;
+        case 0xCD: ABS(); CMP(a, READ(ea)); break;
+        case 0xD1: INDY(); PAGE_PENALTY(); CMP(a, READ(ea)); break;
+        case 0xD5: ZPX(); CMP(a, READ(ea)); break;
+        case 0xD9: ABSY(); PAGE_PENALTY(); CMP(a, READ(ea)); break;
+        case 0xDD: ABSX(); PAGE_PENALTY(); CMP(a, READ(ea)); break;
+
+        // CPX
+        case 0xE0: IMM(); CMP(x, READ(ea)); break;
+        case 0xE4: ZP(); CMP(x, READ(ea)); break;
+        case 0xEC: ABS(); CMP(x, READ(ea)); break;
+
+        // CPY
+        case 0xC0: IMM(); CMP(y, READ(ea)); break;
+        case 0xC4: ZP(); CMP(y, READ(ea)); break;
+        case 0xCC: ABS(); CMP(y, READ(ea)); break;
+
+        // BIT
+        case 0x24: ZP(); BIT(READ(ea)); break;
+        case 0x2C: ABS(); BIT(READ(ea)); break;
+
+        // INC
+        case 0xE6: ZP(); value = READ(ea); INC(value); WRITE(ea, value); break;
+        case 0xEE: ABS(); value = READ(ea); INC(value); WRITE(ea, value); break;
+        case 0xF6: ZPX(); value = READ(ea); INC(value); WRITE(ea, value); break;
+        case 0xFE: ABSX(); value = READ(ea); INC(value); WRITE(ea, value); break;
+
+        // DEC
+        case 0xC6: ZP(); value = READ(ea); DEC(value); WRITE(ea, value); break;
+        case 0xCE: ABS(); value = READ(ea); DEC(value); WRITE(ea, value); break;
+        case 0xD6: ZPX(); value = READ(ea); DEC(value); WRITE(ea, value); break;
+        case 0xDE: ABSX(); value = READ(ea); DEC(value); WRITE(ea, value); break;
+
+        // ASL
+        case 0x06: ZP(); value = READ(ea); ASL(value); WRITE(ea, value); break;
+        case 0x0A: ASL(a); break;
+        case 0x0E: ABS(); value = READ(ea); ASL(value); WRITE(ea, value); break;
+        case 0x16: ZPX(); value = READ(ea); ASL(value); WRITE(ea, value); break;
+        case 0x1E: ABSX(); value = READ(ea); ASL(value); WRITE(ea, value); break;
+
+        // LSR
+        case 0x46: ZP(); value = READ(ea); LSR(value); WRITE(ea, value); break;
+        case 0x4A: LSR(a); break;
+        case 0x4E: ABS(); value = READ(ea); LSR(value); WRITE(ea, value); break;
+        case 0x56: ZPX(); value = READ(ea); LSR(value); WRITE(ea, value); break;
+        case 0x5E: ABSX(); value = READ(ea); LSR(value); WRITE(ea, value); break;
+
+        // ROL
+        case 0x26: ZP(); value = READ(ea); ROL(value); WRITE(ea, value); break;
+        case 0x2A: ROL(a); break;
+        case 0x2E: ABS(); value = READ(ea); ROL(value); WRITE(ea, value); break;
+        case 0x36: ZPX(); value = READ(ea); ROL(value); WRITE(ea, value); break;
+        case 0x3E: ABSX(); value = READ(ea); ROL(value); WRITE(ea, value); break;
+
+        // ROR
+        case 0x66: ZP(); value = READ(ea); ROR(value); WRITE(ea, value); break;
+        case 0x6A: ROR(a); break;
+        case 0x6E: ABS(); value = READ(ea); ROR(value); WRITE(ea, value); break;
+        case 0x76: ZPX(); value = READ(ea); ROR(value); WRITE(ea, value); break;
+        case 0x7E: ABSX(); value = READ(ea); ROR(value); WRITE(ea, value); break;
+
+        // INX
+        case 0xE8: x++; SET_NZ(x); break;
+
+        // INY
+        case 0xC8: y++; SET_NZ(y); break;
+
+        // DEX
+        case 0xCA: x--; SET_NZ(x); break;
+
+        // DEY
+        case 0x88: y--; SET_NZ(y); break;
+
+        // TAX
+        case 0xAA: x = a; SET_NZ(x); break;
+
+        // TAY
+        case 0xA8: y = a; SET_NZ(y); break;
+
+        // TXA
+        case 0x8A: a = x; SET_NZ(a); break;
+
+        // TYA
+        case 0x98: a = y; SET_NZ(a); break;
+
+        // TSX
+        case 0xBA: x = sp; SET_NZ(x); break;
+
+        // TXS
+        case 0x9A: sp = x; break;
+
+        // PHA
+        case 0x48: PUSH8(a); break;
+
+        // PHP
+        case 0x08: PUSH8(status | FLAG_BREAK); break;
+
+        // PLA
+        case 0x68: a = PULL8(); SET_NZ(a); break;
+
+        // PLP
+        case 0x28: status = PULL8() | FLAG_CONSTANT; break;
+
+        // JMP
+        case 0x4C: ABS(); pc = ea; break;
+        case 0x6C: IND(); pc = ea; break;
+
+        // JSR
+        case 0x20: ABS(); PUSH16(pc - 1); pc = ea; break;
+
+        // RTS
+        case 0x60: pc = PULL16() + 1; break;
+
+        // RTI
+        case 0x40: status = PULL8() | FLAG_CONSTANT; pc = PULL16(); break;
+
+        // BRK
+        case 0x00:
+            pc++;
+            PUSH16(pc);
+            PUSH8(status | FLAG_BREAK);
+            status |= FLAG_INTERRUPT;
+            pc = READ(0xFFFE) | (READ(0xFFFF) << 8);
+            break;
+
+        // BPL
+        case 0x10: BRANCH(!(status & FLAG_SIGN)); break;
+
+        // BMI
+        case 0x30: BRANCH(status & FLAG_SIGN); break;
+
+        // BVC
+        case 0x50: BRANCH(!(status & FLAG_OVERFLOW)); break;
+
+        // BVS
+        case 0x70: BRANCH(status & FLAG_OVERFLOW); break;
+
+        // BCC
+        case 0x90: BRANCH(!(status & FLAG_CARRY)); break;
+
+        // BCS
+        case 0xB0: BRANCH(status & FLAG_CARRY); break;
+
+        // BNE
+        case 0xD0: BRANCH(!(status & FLAG_ZERO)); break;
+
+        // BEQ
+        case 0xF0: BRANCH(status & FLAG_ZERO); break;
+
+        // CLC
+        case 0x18: status &= ~FLAG_CARRY; break;
+
+        // SEC
+        case 0x38: status |= FLAG_CARRY; break;
+
+        // CLI
+        case 0x58: status &= ~FLAG_INTERRUPT; break;
+
+        // SEI
+        case 0x78: status |= FLAG_INTERRUPT; break;
+
+        // CLV
+        case 0xB8: status &= ~FLAG_OVERFLOW; break;
+
+        // CLD
+        case 0xD8: status &= ~FLAG_DECIMAL; break;
+
+        // SED
+        case 0xF8: status |= FLAG_DECIMAL; break;
+
+        // Undocumented instructions
+
+        // LAX
+        case 0xA3: INDX(); a = x = READ(ea); SET_NZ(a); break;
+        case 0xA7: ZP(); a = x = READ(ea); SET_NZ(a); break;
+        case 0xAF: ABS(); a = x = READ(ea); SET_NZ(a); break;
+        case 0xB3: INDY(); PAGE_PENALTY(); a = x = READ(ea); SET_NZ(a); break;
+        case 0xB7: ZPY(); a = x = READ(ea); SET_NZ(a); break;
+        case 0xBB: ABSY(); PAGE_PENALTY(); a = x = READ(ea); SET_NZ(a); break;
+        case 0xBF: ABSY(); PAGE_PENALTY(); a = x = READ(ea); SET_NZ(a); break;
+
+        // SAX, which fake6502 applies as three separate writes
+        case 0x83: INDX(); WRITE(ea, a); WRITE(ea, x); WRITE(ea, a & x); break;
+        case 0x87: ZP(); WRITE(ea, a); WRITE(ea, x); WRITE(ea, a & x); break;
+        case 0x8F: ABS(); WRITE(ea, a); WRITE(ea, x); WRITE(ea, a & x); break;
+        case 0x97: ZPY(); WRITE(ea, a); WRITE(ea, x); WRITE(ea, a & x); break;
+
+        // SLO
+        case 0x03: INDX(); value = READ(ea); ASL(value); WRITE(ea, value); ORA(READ(ea)); break;
+        case 0x07: ZP(); value = READ(ea); ASL(value); WRITE(ea, value); ORA(READ(ea)); break;
+        case 0x0F: ABS(); value = READ(ea); ASL(value); WRITE(ea, value); ORA(READ(ea)); break;
+        case 0x13: INDY(); value = READ(ea); ASL(value); WRITE(ea, value); ORA(READ(ea)); break;
+        case 0x17: ZPX(); value = READ(ea); ASL(value); WRITE(ea, value); ORA(READ(ea)); break;
+        case 0x1B: ABSY(); value = READ(ea); ASL(value); WRITE(ea, value); ORA(READ(ea)); break;
+        case 0x1F: ABSX(); value = READ(ea); ASL(value); WRITE(ea, value); ORA(READ(ea)); break;
+
+        // RLA
+        case 0x23: INDX(); value = READ(ea); ROL(value); WRITE(ea, value); AND(READ(ea)); break;
+        case 0x27: ZP(); value = READ(ea); ROL(value); WRITE(ea, value); AND(READ(ea)); break;
+        case 0x2F: ABS(); value = READ(ea); ROL(value); WRITE(ea, value); AND(READ(ea)); break;
+        case 0x33: INDY(); value = READ(ea); ROL(value); WRITE(ea, value); AND(READ(ea)); break;
+        case 0x37: ZPX(); value = READ(ea); ROL(value); WRITE(ea, value); AND(READ(ea)); break;
+        case 0x3B: ABSY(); value = READ(ea); ROL(value); WRITE(ea, value); AND(READ(ea)); break;
+        case 0x3F: ABSX(); value = READ(ea); ROL(value); WRITE(ea, value); AND(READ(ea)); break;
+
+        // SRE
+        case 0x43: INDX(); value = READ(ea); LSR(value); WRITE(ea, value); EOR(READ(ea)); break;
+        case 0x47: ZP(); value = READ(ea); LSR(value); WRITE(ea, value); EOR(READ(ea)); break;
+        case 0x4F: ABS(); value = READ(ea); LSR(value); WRITE(ea, value); EOR(READ(ea)); break;
+        case 0x53: INDY(); value = READ(ea); LSR(value); WRITE(ea, value); EOR(READ(ea)); break;
+        case 0x57: ZPX(); value = READ(ea); LSR(value); WRITE(ea, value); EOR(READ(ea)); break;
+        case 0x5B: ABSY(); value = READ(ea); LSR(value); WRITE(ea, value); EOR(READ(ea)); break;
+        case 0x5F: ABSX(); value = READ(ea); LSR(value); WRITE(ea, value); EOR(READ(ea)); break;
+
+        // RRA
+        case 0x63: INDX(); value = READ(ea); ROR(value); WRITE(ea, value); ADC(READ(ea)); break;
+        case 0x67: ZP(); value = READ(ea); ROR(value); WRITE(ea, value); ADC(READ(ea)); break;
+        case 0x6F: ABS(); value = READ(ea); ROR(value); WRITE(ea, value); ADC(READ(ea)); break;
+        case 0x73: INDY(); value = READ(ea); ROR(value); WRITE(ea, value); ADC(READ(ea)); break;
+        case 0x77: ZPX(); value = READ(ea); ROR(value); WRITE(ea, value); ADC(READ(ea)); break;
+        case 0x7B: ABSY(); value = READ(ea); ROR(value); WRITE(ea, value); ADC(READ(ea)); break;
+        case 0x7F: ABSX(); value = READ(ea); ROR(value); WRITE(ea, value); ADC(READ(ea)); break;
+
+        // DCP
+        case 0xC3: INDX(); value = READ(ea); DEC(value); WRITE(ea, value); CMP(a, READ(ea)); break;
+        case 0xC7: ZP(); value = READ(ea); DEC(value); WRITE(ea, value); CMP(a, READ(ea)); break;
+        case 0xCF: ABS(); value = READ(ea); DEC(value); WRITE(ea, value); CMP(a, READ(ea)); break;
+        case 0xD3: INDY(); value = READ(ea); DEC(value); WRITE(ea, value); CMP(a, READ(ea)); break;
+        case 0xD7: ZPX(); value = READ(ea); DEC(value); WRITE(ea, value); CMP(a, READ(ea)); break;
+        case 0xDB: ABSY(); value = READ(ea); DEC(value); WRITE(ea, value); CMP(a, READ(ea)); break;
+        case 0xDF: ABSX(); value = READ(ea); DEC(value); WRITE(ea, value); CMP(a, READ(ea)); break;
+
+        // ISB
+        case 0xE3: INDX(); value = READ(ea); INC(value); WRITE(ea, value); SBC(READ(ea)); break;
+        case 0xE7: ZP(); value = READ(ea); INC(value); WRITE(ea, value); SBC(READ(ea)); break;
+        case 0xEF: ABS(); value = READ(ea); INC(value); WRITE(ea, value); SBC(READ(ea)); break;
+        case 0xF3: INDY(); value = READ(ea); INC(value); WRITE(ea, value); SBC(READ(ea)); break;
+        case 0xF7: ZPX(); value = READ(ea); INC(value); WRITE(ea, value); SBC(READ(ea)); break;
+        case 0xFB: ABSY(); value = READ(ea); INC(value); WRITE(ea, value); SBC(READ(ea)); break;
+        case 0xFF: ABSX(); value = READ(ea); INC(value); WRITE(ea, value); SBC(READ(ea)); break;
+
+        // NOP
+        case 0x1A: case 0x3A: case 0x5A: case 0x7A: case 0xDA: case 0xEA: case 0xFA:
+        case 0x02: case 0x12: case 0x22: case 0x32: case 0x42: case 0x52: case 0x62:
+        case 0x72: case 0x92: case 0xB2: case 0xD2: case 0xF2:
+            break;
+        case 0x04: case 0x44: case 0x64: case 0x14: case 0x34: case 0x54: case 0x74:
+        case 0xD4: case 0xF4: case 0x80: case 0x82: case 0x89: case 0xC2: case 0xE2:
+        case 0x0B: case 0x2B: case 0x4B: case 0x6B: case 0x8B: case 0xAB: case 0xCB:
+        case 0x93:
+            pc++;
+            break;
+        case 0x0C: case 0x9B: case 0x9C: case 0x9E: case 0x9F:
+            pc += 2;
+            break;
+        case 0x1C: case 0x3C: case 0x5C: case 0x7C: case 0xDC: case 0xFC:
+            ABSX(); PAGE_PENALTY();
+            break;
+        }
+
+        // Added afterwards, so writes see the count at the start of
+        // the instruction the same way they do with fake6502
+        ticks += ticktable[opcode];
+    } while (pc != stop_pc && (int32_t)(end_ticks - ticks) > 0);
+
+    cpu->pc = pc;
+    cpu->sp = sp;
+    cpu->a = a;
+    cpu->x = x;
+    cpu->y = y;
+    cpu->status = status;
+    cpu->ticks = ticks;
+
+    return pc == stop_pc;
+}
@@ -0,0 +1,47 @@
+#ifndef NSF_CPU_H
+#define NSF_CPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "nsf_memory.h"
+
+/*
+ * 6502 interpreter for NSF playback.
+ *
+ * This behaves the same as fake6502, including its cycle counts and
+ * its handling of undocumented opcodes, but runs until the program
+ * counter reaches a stop address instead of one instruction per call.
+ * The registers are only kept in this structure between runs.
+ */
+typedef struct {
+    uint16_t pc;
+    uint8_t sp;
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t status;
+    uint32_t ticks;
+} nsf_cpu_t;
+
+/**
+ * Reset the CPU, and load the program counter from the reset vector.
+ */
+void nsf_cpu_reset(nsf_cpu_t *cpu, const nsf_memory_map_t *map);
+
+/**
+ * Run instructions until the program counter reaches the stop address.
+ *
+ * At least one instruction is always run, so this can be called with
+ * the program counter already sitting on the stop address.
+ *
+ * @param cpu CPU state
+ * @param map Memory map to run against
+ * @param stop_pc Address to stop at
+ * @param max_ticks Most CPU cycles to run before giving up
+ * @return True if the stop address was reached, false if the
+ *         cycle limit ran out first
+ */
+bool nsf_cpu_run(nsf_cpu_t *cpu, const nsf_memory_map_t *map, uint16_t stop_pc, uint32_t max_ticks);
+
+#endif /* NSF_CPU_H */
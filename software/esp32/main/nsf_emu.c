@@ -0,0 +1,211 @@
+#include "nsf_emu.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "playback_stats.h"
+
+static const char *TAG = "nsf_emu";
+
+/* Records in the write ring, which holds several busy frames */
+#define EMU_RING_SIZE 1024
+
+/* Keep emulation off the core doing playback, where there is a second one */
+#if CONFIG_FREERTOS_UNICORE
+#define EMU_TASK_CORE 0
+#else
+#define EMU_TASK_CORE 1
+#endif
+
+/* Should be below the playback task, so writes still go out on time when sharing a core */
+#define EMU_TASK_PRIORITY 4
+
+struct nsf_emu_t {
+    nsf_file_t *nsf;
+    nsf_ring_t *ring;
+    TaskHandle_t task;
+    TaskHandle_t consumer_task;
+    SemaphoreHandle_t exit_sem;
+    volatile bool running;
+    volatile bool failed;
+    uint32_t run_ahead;
+    uint32_t frames_emulated;
+    uint32_t frames_played;
+    uint32_t frame_start_ticks;
+};
+
+/* Emulator receiving writes from the NSF file, since the callback has no context */
+static nsf_emu_t *active_emu = NULL;
+
+static void nsf_emu_push(nsf_emu_t *emu, uint16_t reg, uint8_t dat)
+{
+    nsf_ring_record_t record = {
+        .ticks = nsf_get_ticks(emu->nsf) - emu->frame_start_ticks,
+        .reg = reg,
+        .dat = dat
+    };
+
+    // Playback only wakes this task at the end of each frame,
+    // so poll while a very busy frame has filled the ring
+    while (!nsf_ring_push(emu->ring, &record)) {
+        if (!emu->running) {
+            return;
+        }
+        ulTaskNotifyTake(pdTRUE, 1);
+    }
+}
+
+static void nsf_emu_apu_write(nes_apu_register_t reg, uint8_t dat)
+{
+    if (active_emu) {
+        nsf_emu_push(active_emu, reg, dat);
+    }
+}
+
+static void nsf_emu_task(void *pvParameters)
+{
+    nsf_emu_t *emu = (nsf_emu_t *)pvParameters;
+
+    while (emu->running) {
+        // Once a frame has failed, just wait around to be freed
+        uint32_t frames_played = __atomic_load_n(&emu->frames_played, __ATOMIC_ACQUIRE);
+        if (emu->failed || emu->frames_emulated - frames_played >= emu->run_ahead) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        emu->frame_start_ticks = nsf_get_ticks(emu->nsf);
+        int64_t time0 = esp_timer_get_time();
+        esp_err_t ret = nsf_playback_frame(emu->nsf);
+        int64_t time1 = esp_timer_get_time();
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "NSF frame playback failed");
+            emu->failed = true;
+            xTaskNotifyGive(emu->consumer_task);
+            continue;
+        }
+        playback_stats_record(PLAYBACK_STATS_NSF_FRAME, (uint32_t)(time1 - time0));
+
+        nsf_emu_push(emu, NSF_RING_FRAME_END, 0);
+        __atomic_store_n(&emu->frames_emulated, emu->frames_emulated + 1, __ATOMIC_RELEASE);
+        xTaskNotifyGive(emu->consumer_task);
+    }
+
+    xSemaphoreGive(emu->exit_sem);
+    vTaskDelete(NULL);
+}
+
+esp_err_t nsf_emu_init(nsf_emu_t **emu, nsf_file_t *nsf, uint32_t run_ahead)
+{
+    esp_err_t ret = ESP_OK;
+    nsf_emu_t *emu_result = NULL;
+
+    if (!nsf || run_ahead == 0 || active_emu) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    do {
+        emu_result = malloc(sizeof(nsf_emu_t));
+        if (!emu_result) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        bzero(emu_result, sizeof(nsf_emu_t));
+        emu_result->nsf = nsf;
+        emu_result->consumer_task = xTaskGetCurrentTaskHandle();
+        emu_result->run_ahead = run_ahead;
+        emu_result->running = true;
+
+        ret = nsf_ring_init(&emu_result->ring, EMU_RING_SIZE);
+        if (ret != ESP_OK) {
+            break;
+        }
+
+        emu_result->exit_sem = xSemaphoreCreateBinary();
+        if (!emu_result->exit_sem) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        active_emu = emu_result;
+        nsf_set_apu_write_cb(nsf, nsf_emu_apu_write);
+
+        if (xTaskCreatePinnedToCore(nsf_emu_task, "nsf_emu_task", 4096, emu_result,
+                EMU_TASK_PRIORITY, &emu_result->task, EMU_TASK_CORE) != pdPASS) {
+            emu_result->task = NULL;
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+    } while (0);
+
+    if (ret == ESP_OK) {
+        *emu = emu_result;
+    } else {
+        nsf_emu_free(emu_result);
+    }
+
+    return ret;
+}
+
+const nsf_ring_record_t *nsf_emu_peek(nsf_emu_t *emu)
+{
+    return nsf_ring_peek(emu->ring);
+}
+
+void nsf_emu_pop(nsf_emu_t *emu)
+{
+    const nsf_ring_record_t *record = nsf_ring_peek(emu->ring);
+    if (!record) {
+        return;
+    }
+
+    bool frame_end = record->reg == NSF_RING_FRAME_END;
+    nsf_ring_pop(emu->ring);
+
+    if (frame_end) {
+        __atomic_store_n(&emu->frames_played, emu->frames_played + 1, __ATOMIC_RELEASE);
+        xTaskNotifyGive(emu->task);
+    }
+}
+
+size_t nsf_emu_ring_count(nsf_emu_t *emu)
+{
+    return nsf_ring_count(emu->ring);
+}
+
+uint32_t nsf_emu_frames_ahead(nsf_emu_t *emu)
+{
+    return __atomic_load_n(&emu->frames_emulated, __ATOMIC_ACQUIRE) - emu->frames_played;
+}
+
+bool nsf_emu_has_failed(nsf_emu_t *emu)
+{
+    return emu->failed;
+}
+
+void nsf_emu_free(nsf_emu_t *emu)
+{
+    if (emu) {
+        if (emu->task) {
+            emu->running = false;
+            xTaskNotifyGive(emu->task);
+            xSemaphoreTake(emu->exit_sem, portMAX_DELAY);
+        }
+        if (active_emu == emu) {
+            nsf_set_apu_write_cb(emu->nsf, NULL);
+            active_emu = NULL;
+        }
+        if (emu->exit_sem) {
+            vSemaphoreDelete(emu->exit_sem);
+        }
+        nsf_ring_free(emu->ring);
+        free(emu);
+    }
+}
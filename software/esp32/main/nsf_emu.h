@@ -0,0 +1,67 @@
+/*
+ * Background NSF emulation
+ *
+ * Runs the NSF play routine on a separate task, up to a set number of
+ * frames ahead of playback, and pushes every APU write into a ring
+ * along with the CPU cycle it happened on. The playback task pops the
+ * writes and sends them at their offsets within the frame, so the time
+ * spent on the I2C bus is never charged against emulation.
+ */
+
+#ifndef NSF_EMU_H
+#define NSF_EMU_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+#include "nsf.h"
+#include "nsf_ring.h"
+
+typedef struct nsf_emu_t nsf_emu_t;
+
+/**
+ * Start emulating frames in the background.
+ *
+ * Playback must already be initialized on the NSF file, and the file
+ * must not be used by anything else until the emulator is freed.
+ * The calling task is the consumer of the write ring, and is notified
+ * as each frame is finished.
+ *
+ * @param nsf NSF file to play
+ * @param run_ahead Most frames to emulate ahead of playback
+ */
+esp_err_t nsf_emu_init(nsf_emu_t **emu, nsf_file_t *nsf, uint32_t run_ahead);
+
+/**
+ * Get the oldest write that has not been played yet.
+ *
+ * Each frame is followed by a record with NSF_RING_FRAME_END as its
+ * register, whose timestamp is the length of the frame.
+ *
+ * @return The record, or NULL if emulation has not got that far yet
+ */
+const nsf_ring_record_t *nsf_emu_peek(nsf_emu_t *emu);
+
+/**
+ * Remove the oldest write, once it has been played.
+ */
+void nsf_emu_pop(nsf_emu_t *emu);
+
+/**
+ * Get the number of records waiting in the write ring.
+ */
+size_t nsf_emu_ring_count(nsf_emu_t *emu);
+
+/**
+ * Get the number of emulated frames that have not been played yet.
+ */
+uint32_t nsf_emu_frames_ahead(nsf_emu_t *emu);
+
+/**
+ * Check whether emulation has stopped because a frame failed.
+ */
+bool nsf_emu_has_failed(nsf_emu_t *emu);
+
+void nsf_emu_free(nsf_emu_t *emu);
+
+#endif /* NSF_EMU_H */
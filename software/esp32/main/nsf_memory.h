@@ -0,0 +1,46 @@
+#ifndef NSF_MEMORY_H
+#define NSF_MEMORY_H
+
+#include <stdint.h>
+
+#include "nsf.h"
+
+#define NSF_PAGE_SIZE  256
+#define NSF_PAGE_COUNT 256
+
+typedef uint8_t (*nsf_read_handler_t)(nsf_file_t *nsf, uint16_t address);
+typedef void (*nsf_write_handler_t)(nsf_file_t *nsf, uint16_t address, uint8_t value);
+
+/*
+ * Memory map of the emulated NES, indexed by the high byte of the address.
+ * Pages with a pointer are accessed directly, and all others
+ * go through their handler.
+ */
+typedef struct {
+    const uint8_t *read_page[NSF_PAGE_COUNT];
+    uint8_t *write_page[NSF_PAGE_COUNT];
+    nsf_read_handler_t read_handler[NSF_PAGE_COUNT];
+    nsf_write_handler_t write_handler[NSF_PAGE_COUNT];
+    nsf_file_t *nsf;
+} nsf_memory_map_t;
+
+static inline uint8_t nsf_memory_read(const nsf_memory_map_t *map, uint16_t address)
+{
+    const uint8_t page = address >> 8;
+    if (map->read_page[page]) {
+        return map->read_page[page][address & 0xFF];
+    }
+    return map->read_handler[page](map->nsf, address);
+}
+
+static inline void nsf_memory_write(const nsf_memory_map_t *map, uint16_t address, uint8_t value)
+{
+    const uint8_t page = address >> 8;
+    if (map->write_page[page]) {
+        map->write_page[page][address & 0xFF] = value;
+    } else {
+        map->write_handler[page](map->nsf, address, value);
+    }
+}
+
+#endif /* NSF_MEMORY_H */
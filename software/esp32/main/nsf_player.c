@@ -1,23 +1,50 @@
 #include "nsf_player.h"
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <string.h>
-#include <unistd.h>
 
 #include "board_config.h"
-#include "i2c_util.h"
+#include "i2c_bus.h"
 #include "nes.h"
+#include "nes_async.h"
+#include "nsf_emu.h"
+#include "playback_clock.h"
+#include "playback_stats.h"
 
 static const char *TAG = "nsf_player";
 
+/* NES CPU clock rates, which are the unit of the write timestamps */
+#define NSF_CPU_CLOCK_NTSC 1789773
+#define NSF_CPU_CLOCK_PAL  1662607
+
+/* Frames the play routine may be emulated ahead of playback by default */
+#define NSF_RUN_AHEAD_DEFAULT 4
+
+/*
+ * Bit times in a single APU register write: start, the address,
+ * register and value bytes with their acks, and stop. Writes due
+ * within this long of the start of a batch are sent along with it.
+ */
+#define NSF_WRITE_TRANSACTION_BITS 29
+
 typedef struct nsf_player_t {
     nsf_file_t *nsf_file;
     nes_playback_cb_t playback_cb;
     nes_playback_repeat_t repeat;
     EventGroupHandle_t event_group;
+    uint32_t run_ahead;
 } nsf_player_t;
 
+/* Writes collected while emulating a frame, sent together */
+static nes_apu_batch_t nsf_apu_batch = { 0 };
+
+/* Sends the collected writes while the next frame is emulated */
+static nes_async_t *nsf_apu_async = NULL;
+
 esp_err_t nsf_player_init(nsf_player_t **player,
         const char *filename,
         nes_playback_cb_t playback_cb,
@@ -38,6 +65,7 @@ esp_err_t nsf_player_init(nsf_player_t **player,
         player_result->playback_cb = playback_cb;
         player_result->repeat = repeat;
         player_result->event_group = event_group;
+        player_result->run_ahead = NSF_RUN_AHEAD_DEFAULT;
 
         ESP_LOGI(TAG, "Opening file: %s", filename);
         ret = nsf_open(&player_result->nsf_file, filename);
@@ -71,15 +99,39 @@ const nsf_header_t *nsf_player_get_header(const nsf_player_t *player)
     }
 }
 
+void nsf_player_set_run_ahead(nsf_player_t *player, uint32_t frames)
+{
+    if (player && frames > 0) {
+        player->run_ahead = frames;
+    }
+}
+
+static void vgm_player_nsf_apu_flush()
+{
+    if (nsf_apu_batch.len > 0) {
+        if (nsf_apu_async) {
+            nes_async_submit(nsf_apu_async, &nsf_apu_batch);
+        } else {
+            int64_t time0 = esp_timer_get_time();
+            i2c_bus_lock(I2C_BUS_APU, 0);
+            nes_apu_batch_flush(I2C_P0_NUM, &nsf_apu_batch);
+            i2c_bus_unlock();
+            int64_t time1 = esp_timer_get_time();
+            playback_stats_record(PLAYBACK_STATS_APU_WRITE, (uint32_t)(time1 - time0));
+        }
+    }
+}
+
 static void vgm_player_nsf_apu_write(nes_apu_register_t reg, uint8_t dat)
 {
     if (reg == NES_APU_MODCTRL || reg == NES_APU_MODADDR || reg == NES_APU_MODLEN) {
         // Skip DMC commands until we can handle them
         //ESP_LOGI(TAG, "Unsupported DMC command: $%04X, $%02X", reg, dat);
     } else {
-        i2c_mutex_lock(I2C_P0_NUM);
-        nes_apu_write(I2C_P0_NUM, reg, dat);
-        i2c_mutex_unlock(I2C_P0_NUM);
+        if (nsf_apu_batch.len >= NES_APU_BATCH_MAX) {
+            vgm_player_nsf_apu_flush();
+        }
+        nes_apu_batch_append(I2C_P0_NUM, &nsf_apu_batch, reg, dat);
     }
 }
 
@@ -93,10 +145,12 @@ esp_err_t nsf_player_prepare(nsf_player_t *player, uint8_t song)
         return ESP_ERR_INVALID_ARG;
     }
 
+    nsf_apu_batch.len = 0;
     if (nsf_playback_init(player->nsf_file, (header->starting_song + (song - 1)) - 1, vgm_player_nsf_apu_write) != ESP_OK) {
         ESP_LOGE(TAG, "NSF initialization failed");
         return ESP_FAIL;
     }
+    vgm_player_nsf_apu_flush();
 
     return ESP_OK;
 }
@@ -105,39 +159,122 @@ esp_err_t nsf_player_play_loop(nsf_player_t *player)
 {
     ESP_LOGI(TAG, "Starting playback");
     const nsf_header_t *header = nsf_get_header(player->nsf_file);
+    playback_clock_t *clock = NULL;
+    nsf_emu_t *emu = NULL;
+
+    const bool pal = nsf_is_pal(player->nsf_file);
+    const uint64_t cpu_clock = pal ? NSF_CPU_CLOCK_PAL : NSF_CPU_CLOCK_NTSC;
+    const uint64_t play_speed = pal ? header->play_speed_pal : header->play_speed_ntsc;
+    ESP_LOGI(TAG, "Playing with %s timing", pal ? "PAL" : "NTSC");
+
+    // Write timestamps are in CPU cycles
+    if (playback_clock_init(&clock, (uint32_t)cpu_clock) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (nsf_emu_init(&emu, player->nsf_file, player->run_ahead) != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to start NSF emulation");
+        playback_clock_free(clock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (nes_async_init(&nsf_apu_async, I2C_P0_NUM) != ESP_OK) {
+        ESP_LOGW(TAG, "Falling back to blocking register writes");
+        nsf_apu_async = NULL;
+    }
 
-    int64_t underrun = 0;
+    // Let the emulator get ahead before the clock starts
+    while (nsf_emu_frames_ahead(emu) < player->run_ahead && !nsf_emu_has_failed(emu)) {
+        ulTaskNotifyTake(pdTRUE, 1);
+    }
+
+    // Positions are signed, since a play call may run past the next frame start
+    const int64_t group_ticks = (int64_t)((NSF_WRITE_TRANSACTION_BITS * cpu_clock) / I2C_P0_FREQ_HZ);
+    uint64_t frame = 0;
+    int64_t frame_start = 0;
+    int64_t position = 0;
+
+    playback_clock_start(clock);
     while(true) {
         if ((xEventGroupGetBits(player->event_group) & BIT0) == BIT0) {
             break;
         }
 
-        int64_t time0 = esp_timer_get_time();
-        if (nsf_playback_frame(player->nsf_file) != ESP_OK) {
-            ESP_LOGE(TAG, "NSF frame playback failed");
-            break;
+        const nsf_ring_record_t *record = nsf_emu_peek(emu);
+        if (!record) {
+            if (nsf_emu_has_failed(emu)) {
+                break;
+            }
+            // Emulation has fallen behind, so send what there is and wait
+            vgm_player_nsf_apu_flush();
+            ulTaskNotifyTake(pdTRUE, 1);
+            continue;
         }
-        int64_t time1 = esp_timer_get_time();
 
-        int64_t time_remaining = header->play_speed_ntsc - (time1 - time0);
-        if (time_remaining > 0 && underrun > 0) {
-            time_remaining -= underrun;
-            underrun = 0;
-        }
+        if (record->reg == NSF_RING_FRAME_END) {
+            nsf_emu_pop(emu);
+            vgm_player_nsf_apu_flush();
+            playback_stats_record(PLAYBACK_STATS_NSF_RING, (uint32_t)nsf_emu_ring_count(emu));
+
+            // Frame start times are computed from scratch, so rounding never accumulates
+            frame++;
+            frame_start = (int64_t)((frame * play_speed * cpu_clock) / 1000000ULL);
+
+            // If the last play call wrote past this frame start, the frame
+            // starts from where those writes left off instead
+            int64_t ahead = frame_start - position;
+            if (ahead > 0) {
+                playback_clock_advance(clock, (uint32_t)ahead);
+                position = frame_start;
+            }
+
+            // Wait for the absolute time of the next frame
+            i2c_bus_set_idle_until(playback_clock_target(clock));
+            int64_t late = playback_clock_wait(clock);
+            i2c_bus_set_idle_until(0);
 
-        if (time_remaining > 0 && time_remaining <= header->play_speed_ntsc) {
-            usleep(time_remaining);
+            if (ahead < 0) {
+                playback_stats_add(PLAYBACK_STATS_FRAME_UNDERRUN, 1);
+                ESP_LOGW(TAG, "Frame overrun: %lld(ticks)", (long long)-ahead);
+            } else if (late > 0) {
+                playback_stats_add(PLAYBACK_STATS_FRAME_UNDERRUN, 1);
+                ESP_LOGW(TAG, "Frame underrun: %lld(us)", (long long)late);
+            }
+            continue;
         }
-        if (time_remaining < 0) {
-            ESP_LOGW(TAG, "Frame underrun: %lld(us)", time_remaining);
-            underrun = time_remaining * -1;
+
+        // Send what has been collected, and wait, before a write that is due
+        // later than a single transaction would take, so its timing survives
+        int64_t due = frame_start + record->ticks;
+        int64_t ahead = due - position;
+        if (ahead > group_ticks) {
+            playback_clock_advance(clock, (uint32_t)ahead);
+            position = due;
+
+            // A write that is already late joins the writes waiting for
+            // the bus instead, since it could not go out any sooner alone
+            bool behind = nsf_apu_async && !nes_async_is_idle(nsf_apu_async)
+                    && playback_clock_target(clock) <= esp_timer_get_time();
+            if (!behind) {
+                vgm_player_nsf_apu_flush();
+                playback_clock_wait(clock);
+            }
         }
+
+        vgm_player_nsf_apu_write(record->reg, record->dat);
+        nsf_emu_pop(emu);
     }
 
+    nsf_emu_free(emu);
+    nes_async_free(nsf_apu_async);
+    nsf_apu_async = NULL;
+    playback_clock_log_stats(clock);
+    playback_clock_free(clock);
+
     // Reset the APU
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_APU, 0);
     nes_apu_init(I2C_P0_NUM);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     ESP_LOGI(TAG, "Finished playback");
 
@@ -21,6 +21,13 @@ esp_err_t nsf_player_init(nsf_player_t **player,
 
 const nsf_header_t *nsf_player_get_header(const nsf_player_t *player);
 
+/**
+ * Set how many frames the play routine may be emulated ahead of
+ * playback, which must be done before the play loop starts.
+ * More frames ride out longer stalls in emulation.
+ */
+void nsf_player_set_run_ahead(nsf_player_t *player, uint32_t frames);
+
 esp_err_t nsf_player_prepare(nsf_player_t *player, uint8_t song);
 esp_err_t nsf_player_play_loop(nsf_player_t *player);
 
@@ -0,0 +1,95 @@
+#include "nsf_ring.h"
+
+#include <esp_err.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct nsf_ring_t {
+    nsf_ring_record_t *records;
+    size_t mask;
+    size_t head;  /* Next slot to push, only written by the producer */
+    size_t tail;  /* Next slot to pop, only written by the consumer */
+};
+
+esp_err_t nsf_ring_init(nsf_ring_t **ring, size_t size)
+{
+    esp_err_t ret = ESP_OK;
+    nsf_ring_t *ring_result = NULL;
+
+    if (size == 0 || (size & (size - 1)) != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    do {
+        ring_result = malloc(sizeof(nsf_ring_t));
+        if (!ring_result) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+        bzero(ring_result, sizeof(nsf_ring_t));
+        ring_result->mask = size - 1;
+
+        ring_result->records = malloc(size * sizeof(nsf_ring_record_t));
+        if (!ring_result->records) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+    } while (0);
+
+    if (ret == ESP_OK) {
+        *ring = ring_result;
+    } else {
+        nsf_ring_free(ring_result);
+    }
+
+    return ret;
+}
+
+bool nsf_ring_push(nsf_ring_t *ring, const nsf_ring_record_t *record)
+{
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > ring->mask) {
+        return false;
+    }
+
+    ring->records[head & ring->mask] = *record;
+
+    // Publish the record only once it has been completely written
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+const nsf_ring_record_t *nsf_ring_peek(nsf_ring_t *ring)
+{
+    size_t tail = ring->tail;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return &ring->records[tail & ring->mask];
+}
+
+void nsf_ring_pop(nsf_ring_t *ring)
+{
+    size_t tail = ring->tail;
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != tail) {
+        // The slot may be reused as soon as this is visible
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+size_t nsf_ring_count(nsf_ring_t *ring)
+{
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return head - tail;
+}
+
+void nsf_ring_free(nsf_ring_t *ring)
+{
+    if (ring) {
+        free(ring->records);
+        free(ring);
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * Timestamped APU write ring
+ *
+ * Single-producer, single-consumer ring of APU register writes, each
+ * stamped with the CPU cycle it happened on. One task pushes and one
+ * other task pops, without taking a lock, using acquire and release
+ * ordering on the two indexes.
+ */
+
+#ifndef NSF_RING_H
+#define NSF_RING_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+/* Register value marking the end of a frame, since it is never an APU register */
+#define NSF_RING_FRAME_END 0
+
+typedef struct {
+    uint32_t ticks;  /*!< CPU cycles since the start of the frame */
+    uint16_t reg;    /*!< APU register, or NSF_RING_FRAME_END */
+    uint8_t dat;     /*!< Value written */
+} nsf_ring_record_t;
+
+typedef struct nsf_ring_t nsf_ring_t;
+
+/**
+ * Create a ring.
+ *
+ * @param size Number of records, which must be a power of two
+ */
+esp_err_t nsf_ring_init(nsf_ring_t **ring, size_t size);
+
+/**
+ * Add a record to the ring, from the producer task.
+ *
+ * @return False if the ring is full
+ */
+bool nsf_ring_push(nsf_ring_t *ring, const nsf_ring_record_t *record);
+
+/**
+ * Get the oldest record in the ring, from the consumer task, without
+ * removing it.
+ *
+ * @return The record, or NULL if the ring is empty
+ */
+const nsf_ring_record_t *nsf_ring_peek(nsf_ring_t *ring);
+
+/**
+ * Remove the oldest record from the ring, from the consumer task.
+ */
+void nsf_ring_pop(nsf_ring_t *ring);
+
+/**
+ * Get the number of records in the ring, from either task.
+ */
+size_t nsf_ring_count(nsf_ring_t *ring);
+
+void nsf_ring_free(nsf_ring_t *ring);
+
+#endif /* NSF_RING_H */
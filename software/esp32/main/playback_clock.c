@@ -0,0 +1,166 @@
+#include "playback_clock.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "playback_stats.h"
+
+static const char *TAG = "playback_clock";
+
+/* Furthest the clock may fall behind before it is re-anchored */
+#define CLOCK_MAX_LAG 100000
+
+struct playback_clock_t {
+    uint32_t rate;
+    int64_t anchor;
+    uint64_t position;
+    TaskHandle_t task;
+    esp_timer_handle_t timer;
+    playback_clock_stats_t stats;
+};
+
+static void playback_clock_timer_callback(void *arg)
+{
+    playback_clock_t *clock = (playback_clock_t *)arg;
+    xTaskNotifyGive(clock->task);
+}
+
+esp_err_t playback_clock_init(playback_clock_t **clock, uint32_t rate)
+{
+    esp_err_t ret = ESP_OK;
+    playback_clock_t *clock_result = NULL;
+
+    if (!clock || rate == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    do {
+        clock_result = malloc(sizeof(playback_clock_t));
+        if (!clock_result) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        bzero(clock_result, sizeof(playback_clock_t));
+        clock_result->rate = rate;
+        clock_result->task = xTaskGetCurrentTaskHandle();
+
+        esp_timer_create_args_t timer_args = {
+            .callback = playback_clock_timer_callback,
+            .arg = clock_result,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "playback_clock"
+        };
+        ret = esp_timer_create(&timer_args, &clock_result->timer);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "esp_timer_create error: %d", ret);
+            clock_result->timer = NULL;
+            break;
+        }
+
+        playback_clock_start(clock_result);
+    } while (0);
+
+    if (ret == ESP_OK) {
+        *clock = clock_result;
+    } else {
+        playback_clock_free(clock_result);
+    }
+
+    return ret;
+}
+
+void playback_clock_start(playback_clock_t *clock)
+{
+    clock->anchor = esp_timer_get_time();
+    clock->position = 0;
+}
+
+void playback_clock_advance(playback_clock_t *clock, uint32_t ticks)
+{
+    clock->position += ticks;
+}
+
+int64_t playback_clock_target(const playback_clock_t *clock)
+{
+    return clock->anchor + (int64_t)((clock->position * 1000000ULL) / clock->rate);
+}
+
+int64_t playback_clock_wait(playback_clock_t *clock)
+{
+    int64_t target = playback_clock_target(clock);
+    int64_t now = esp_timer_get_time();
+
+    clock->stats.waits++;
+
+    if (now >= target) {
+        int64_t late = now - target;
+        playback_stats_record(PLAYBACK_STATS_WAKE_ERROR, (uint32_t)MIN(late, UINT32_MAX));
+        clock->stats.late++;
+        if (late > clock->stats.max_late) {
+            clock->stats.max_late = late;
+        }
+
+        // Too far behind to catch up, so drop the time that was lost
+        if (late > CLOCK_MAX_LAG) {
+            clock->anchor += late;
+            clock->stats.catch_ups++;
+            clock->stats.drift += late;
+        }
+        return late;
+    }
+
+    // Other sources may notify this task as well,
+    // so keep going until the target time has passed
+    esp_timer_start_once(clock->timer, target - now);
+    while (now < target) {
+        ulTaskNotifyTake(pdTRUE, ((target - now) / 1000 / portTICK_RATE_MS) + 2);
+        now = esp_timer_get_time();
+    }
+    esp_timer_stop(clock->timer);
+
+    int64_t wake = now - target;
+    playback_stats_record(PLAYBACK_STATS_WAKE_ERROR, (uint32_t)MIN(wake, UINT32_MAX));
+    clock->stats.total_wake += wake;
+    if (wake > clock->stats.max_wake) {
+        clock->stats.max_wake = wake;
+    }
+
+    return 0;
+}
+
+void playback_clock_get_stats(const playback_clock_t *clock, playback_clock_stats_t *stats)
+{
+    memcpy(stats, &clock->stats, sizeof(playback_clock_stats_t));
+}
+
+void playback_clock_log_stats(const playback_clock_t *clock)
+{
+    const playback_clock_stats_t *stats = &clock->stats;
+    uint32_t woken = stats->waits - stats->late;
+
+    ESP_LOGI(TAG, "Clock: waits=%u, late=%u, max late=%lldus, catch-ups=%u, drift=%lldus",
+            stats->waits, stats->late, (long long)stats->max_late, stats->catch_ups,
+            (long long)stats->drift);
+    if (woken > 0) {
+        ESP_LOGI(TAG, "Wake: avg=%lldus, max=%lldus",
+                (long long)(stats->total_wake / woken), (long long)stats->max_wake);
+    }
+}
+
+void playback_clock_free(playback_clock_t *clock)
+{
+    if (clock) {
+        if (clock->timer) {
+            esp_timer_stop(clock->timer);
+            esp_timer_delete(clock->timer);
+        }
+        free(clock);
+    }
+}
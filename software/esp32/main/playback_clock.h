@@ -0,0 +1,76 @@
+/*
+ * Absolute-deadline playback clock
+ *
+ * Tracks the playback position in integer ticks of the source rate,
+ * such as 44.1 kHz VGM samples, and derives the target time of every
+ * position from a single anchor taken from esp_timer_get_time(). Since
+ * each target is computed from scratch, rounding never accumulates, and
+ * time lost to a short stall is made up by the waits that follow.
+ * Waits are woken by a one-shot high resolution timer and a task
+ * notification, rather than by usleep().
+ */
+
+#ifndef PLAYBACK_CLOCK_H
+#define PLAYBACK_CLOCK_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+typedef struct playback_clock_t playback_clock_t;
+
+typedef struct {
+    uint32_t waits;      /*!< Number of waits */
+    uint32_t late;       /*!< Waits whose target time had already passed */
+    uint32_t catch_ups;  /*!< Times the clock gave up on a stall and was re-anchored */
+    int64_t max_late;    /*!< Furthest behind the clock has been, in microseconds */
+    int64_t max_wake;    /*!< Latest a wake-up has been, in microseconds */
+    int64_t total_wake;  /*!< Total wake-up lateness, in microseconds */
+    int64_t drift;       /*!< Total time dropped by catch-ups, in microseconds */
+} playback_clock_stats_t;
+
+/**
+ * Create a playback clock.
+ *
+ * The clock must only be waited on from the task that created it,
+ * which receives its timer notifications.
+ *
+ * @param rate Clock ticks per second
+ */
+esp_err_t playback_clock_init(playback_clock_t **clock, uint32_t rate);
+
+/**
+ * Anchor position zero of the clock at the current time.
+ */
+void playback_clock_start(playback_clock_t *clock);
+
+/**
+ * Move the playback position forward by the provided number of ticks.
+ */
+void playback_clock_advance(playback_clock_t *clock, uint32_t ticks);
+
+/**
+ * Get the target time of the current playback position,
+ * as returned by esp_timer_get_time().
+ */
+int64_t playback_clock_target(const playback_clock_t *clock);
+
+/**
+ * Wait until the target time of the current playback position.
+ *
+ * If the clock has fallen too far behind, it is re-anchored at the
+ * current time instead of rushing through everything that was missed.
+ *
+ * @return How late the target already was, in microseconds, or zero
+ */
+int64_t playback_clock_wait(playback_clock_t *clock);
+
+void playback_clock_get_stats(const playback_clock_t *clock, playback_clock_stats_t *stats);
+
+/**
+ * Log the drift and catch-up statistics of the clock.
+ */
+void playback_clock_log_stats(const playback_clock_t *clock);
+
+void playback_clock_free(playback_clock_t *clock);
+
+#endif /* PLAYBACK_CLOCK_H */
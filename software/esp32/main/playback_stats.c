@@ -0,0 +1,132 @@
+#include "playback_stats.h"
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *TAG = "playback_stats";
+
+static const char *hist_names[PLAYBACK_STATS_HIST_MAX] = {
+    "Wake error (us)",
+    "APU write (us)",
+    "DMC upload (B/s)",
+    "NSF frame (us)",
+    "NSF ring (writes)"
+};
+
+static const char *counter_names[PLAYBACK_STATS_COUNTER_MAX] = {
+    "Block not loaded",
+    "Block partial",
+    "Frame underrun",
+    "DMC bytes",
+    "PCM samples",
+    "Bank miss"
+};
+
+static playback_stats_t playback_stats = { 0 };
+
+static uint8_t playback_stats_bucket(uint32_t value)
+{
+    uint8_t bucket = 0;
+    while (value > 0 && bucket < PLAYBACK_STATS_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void playback_stats_reset()
+{
+    uint32_t *values = (uint32_t *)&playback_stats;
+    for (size_t i = 0; i < sizeof(playback_stats_t) / sizeof(uint32_t); i++) {
+        __atomic_store_n(&values[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+void playback_stats_record(playback_stats_hist_t hist, uint32_t value)
+{
+    if (hist >= PLAYBACK_STATS_HIST_MAX) {
+        return;
+    }
+
+    playback_stats_histogram_t *h = &playback_stats.hist[hist];
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[playback_stats_bucket(value)], 1, __ATOMIC_RELAXED);
+
+    uint32_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > max) {
+        if (__atomic_compare_exchange_n(&h->max, &max, value, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+void playback_stats_add(playback_stats_counter_t counter, uint32_t value)
+{
+    if (counter >= PLAYBACK_STATS_COUNTER_MAX) {
+        return;
+    }
+    __atomic_fetch_add(&playback_stats.counters[counter], value, __ATOMIC_RELAXED);
+}
+
+void playback_stats_get(playback_stats_t *stats)
+{
+    const uint32_t *src = (const uint32_t *)&playback_stats;
+    uint32_t *dst = (uint32_t *)stats;
+    for (size_t i = 0; i < sizeof(playback_stats_t) / sizeof(uint32_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+const char *playback_stats_hist_name(playback_stats_hist_t hist)
+{
+    return (hist < PLAYBACK_STATS_HIST_MAX) ? hist_names[hist] : NULL;
+}
+
+const char *playback_stats_counter_name(playback_stats_counter_t counter)
+{
+    return (counter < PLAYBACK_STATS_COUNTER_MAX) ? counter_names[counter] : NULL;
+}
+
+esp_err_t playback_stats_dump(const char *filename)
+{
+    playback_stats_t stats;
+    playback_stats_get(&stats);
+
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        ESP_LOGE(TAG, "Unable to open file: %s", filename);
+        return ESP_FAIL;
+    }
+
+    for (int i = 0; i < PLAYBACK_STATS_COUNTER_MAX; i++) {
+        fprintf(file, "%s: %u\n", counter_names[i], stats.counters[i]);
+    }
+
+    for (int i = 0; i < PLAYBACK_STATS_HIST_MAX; i++) {
+        const playback_stats_histogram_t *h = &stats.hist[i];
+        fprintf(file, "\n%s\n", hist_names[i]);
+        fprintf(file, "count=%u, avg=%u, max=%u\n",
+                h->count, h->count > 0 ? h->total / h->count : 0, h->max);
+        for (int j = 0; j < PLAYBACK_STATS_BUCKETS; j++) {
+            if (h->buckets[j] == 0) {
+                continue;
+            }
+            uint32_t low = (j == 0) ? 0 : (1UL << (j - 1));
+            fprintf(file, "  >=%u: %u\n", low, h->buckets[j]);
+        }
+    }
+
+    if (ferror(file)) {
+        ESP_LOGE(TAG, "Unable to write file: %s", filename);
+        fclose(file);
+        return ESP_FAIL;
+    }
+
+    fclose(file);
+    ESP_LOGI(TAG, "Wrote stats to %s", filename);
+    return ESP_OK;
+}
@@ -0,0 +1,80 @@
+/*
+ * Playback timing telemetry
+ *
+ * Keeps histograms and counters describing how well the current track
+ * is being timed, in a fixed block of memory. Values are recorded with
+ * atomic operations, so the playback, writer and loader tasks can all
+ * record without taking a lock, and the diagnostics menu can read them
+ * at any time.
+ */
+
+#ifndef PLAYBACK_STATS_H
+#define PLAYBACK_STATS_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+typedef enum {
+    PLAYBACK_STATS_WAKE_ERROR = 0, /*!< Lateness of each clock wake-up, in microseconds */
+    PLAYBACK_STATS_APU_WRITE,      /*!< Time to send each APU register batch, in microseconds */
+    PLAYBACK_STATS_DMC_UPLOAD,     /*!< Throughput of each DMC block upload, in bytes per second */
+    PLAYBACK_STATS_NSF_FRAME,      /*!< Time to emulate each NSF frame, in microseconds */
+    PLAYBACK_STATS_NSF_RING,       /*!< NSF writes emulated ahead of playback, at each frame */
+    PLAYBACK_STATS_HIST_MAX
+} playback_stats_hist_t;
+
+typedef enum {
+    PLAYBACK_STATS_BLOCK_NOT_LOADED = 0, /*!< Sample references to groups that were not loaded */
+    PLAYBACK_STATS_BLOCK_PARTIAL,        /*!< Sample references to groups still being loaded */
+    PLAYBACK_STATS_FRAME_UNDERRUN,       /*!< NSF frames that finished after their deadline */
+    PLAYBACK_STATS_DMC_BYTES,            /*!< Total DMC bytes uploaded */
+    PLAYBACK_STATS_PCM_SAMPLES,          /*!< Total $4011 samples streamed to the 2A03 */
+    PLAYBACK_STATS_BANK_MISS,            /*!< NSF bank switches that waited on the SD card */
+    PLAYBACK_STATS_COUNTER_MAX
+} playback_stats_counter_t;
+
+/*
+ * Histogram buckets are powers of two. Bucket 0 holds zero, and
+ * bucket N holds values from 2^(N-1) up to 2^N, with the last
+ * bucket also holding everything larger.
+ */
+#define PLAYBACK_STATS_BUCKETS 20
+
+typedef struct {
+    uint32_t count;
+    uint32_t total;
+    uint32_t max;
+    uint32_t buckets[PLAYBACK_STATS_BUCKETS];
+} playback_stats_histogram_t;
+
+typedef struct {
+    playback_stats_histogram_t hist[PLAYBACK_STATS_HIST_MAX];
+    uint32_t counters[PLAYBACK_STATS_COUNTER_MAX];
+} playback_stats_t;
+
+/**
+ * Clear all statistics, which is done as each track starts.
+ */
+void playback_stats_reset();
+
+void playback_stats_record(playback_stats_hist_t hist, uint32_t value);
+void playback_stats_add(playback_stats_counter_t counter, uint32_t value);
+
+/**
+ * Copy the current statistics.
+ *
+ * Since recording never blocks, values may change while they are being
+ * copied, so the copy is only consistent to within a few samples.
+ */
+void playback_stats_get(playback_stats_t *stats);
+
+const char *playback_stats_hist_name(playback_stats_hist_t hist);
+const char *playback_stats_counter_name(playback_stats_counter_t counter);
+
+/**
+ * Write the current statistics, including every histogram bucket,
+ * to a text file.
+ */
+esp_err_t playback_stats_dump(const char *filename);
+
+#endif /* PLAYBACK_STATS_H */
@@ -19,15 +19,29 @@ static const char *TAG = "vgm";
 #define UINT16_FROM_BYTES(buf, n) \
     (uint16_t)(buf[n+1] << 8 | buf[n])
 
+/*
+ * Size of the window that the command stream is inflated into.
+ * Commands are decoded directly out of this buffer, and it is only
+ * refilled from the compressed file once it runs dry.
+ */
+#define VGM_READ_BUFFER_SIZE 4096
+
 struct vgm_file_t {
     gzFile file;
     vgm_header_t header;
     bool at_vgm_data;
     uint32_t sample_index;
+    size_t buf_pos;
+    size_t buf_len;
+    uint8_t buf[VGM_READ_BUFFER_SIZE];
 };
 
 static int bcd_to_decimal(unsigned char x);
 static esp_err_t vgm_read_header(vgm_file_t *vgm_file);
+static void vgm_buffer_reset(vgm_file_t *vgm_file);
+static esp_err_t vgm_buffer_require(vgm_file_t *vgm_file, size_t len);
+static esp_err_t vgm_buffer_read(vgm_file_t *vgm_file, uint8_t *data, size_t len);
+static esp_err_t vgm_buffer_skip(vgm_file_t *vgm_file, size_t len);
 
 int bcd_to_decimal(unsigned char x)
 {
@@ -216,6 +230,7 @@ esp_err_t vgm_read_gd3_tags(vgm_gd3_tags_t **tags, vgm_file_t *vgm_file)
 
     // Calling this function moves us off valid data
     vgm_file->at_vgm_data = false;
+    vgm_buffer_reset(vgm_file);
 
     // Seek to the start of the GD3 data
     if (gzseek(vgm_file->file, vgm_file->header.gd3_offset, SEEK_SET) < 0) {
@@ -345,6 +360,7 @@ esp_err_t vgm_seek_start(vgm_file_t *vgm_file)
             ESP_LOGE(TAG, "gzseek: %s [%d]", msg, errnum);
             return ESP_FAIL;
         }
+        vgm_buffer_reset(vgm_file);
         vgm_file->at_vgm_data = true;
         vgm_file->sample_index = 0;
     }
@@ -370,12 +386,107 @@ esp_err_t vgm_seek_loop(vgm_file_t *vgm_file)
         ESP_LOGE(TAG, "gzseek: %s [%d]", msg, errnum);
         return ESP_FAIL;
     }
+    vgm_buffer_reset(vgm_file);
     vgm_file->at_vgm_data = true;
     return ESP_OK;
 }
 
+void vgm_buffer_reset(vgm_file_t *vgm_file)
+{
+    vgm_file->buf_pos = 0;
+    vgm_file->buf_len = 0;
+}
+
+/*
+ * Make sure that at least the requested number of bytes are available
+ * in the read buffer, refilling it from the file if necessary.
+ */
+esp_err_t vgm_buffer_require(vgm_file_t *vgm_file, size_t len)
+{
+    size_t avail = vgm_file->buf_len - vgm_file->buf_pos;
+    if (avail >= len) {
+        return ESP_OK;
+    }
+
+    if (len > VGM_READ_BUFFER_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Move any unconsumed bytes to the front of the buffer
+    if (avail > 0 && vgm_file->buf_pos > 0) {
+        memmove(vgm_file->buf, vgm_file->buf + vgm_file->buf_pos, avail);
+    }
+    vgm_file->buf_pos = 0;
+    vgm_file->buf_len = avail;
+
+    int n = gzread(vgm_file->file, vgm_file->buf + avail, VGM_READ_BUFFER_SIZE - avail);
+    if (n > 0) {
+        vgm_file->buf_len += n;
+    }
+
+    if (vgm_file->buf_len < len) {
+        int errnum;
+        const char *msg = gzerror(vgm_file->file, &errnum);
+        ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+/*
+ * Read an arbitrary length of data, such as the contents of a data block.
+ * Anything already buffered is consumed first, and the rest is read
+ * directly from the file.
+ */
+esp_err_t vgm_buffer_read(vgm_file_t *vgm_file, uint8_t *data, size_t len)
+{
+    size_t avail = vgm_file->buf_len - vgm_file->buf_pos;
+    size_t copy_len = (len < avail) ? len : avail;
+
+    memcpy(data, vgm_file->buf + vgm_file->buf_pos, copy_len);
+    vgm_file->buf_pos += copy_len;
+    data += copy_len;
+    len -= copy_len;
+
+    if (len > 0) {
+        vgm_buffer_reset(vgm_file);
+        if (gzread(vgm_file->file, data, len) != len) {
+            int errnum;
+            const char *msg = gzerror(vgm_file->file, &errnum);
+            ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+            return ESP_FAIL;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t vgm_buffer_skip(vgm_file_t *vgm_file, size_t len)
+{
+    size_t avail = vgm_file->buf_len - vgm_file->buf_pos;
+    if (len <= avail) {
+        vgm_file->buf_pos += len;
+        return ESP_OK;
+    }
+
+    // The file position is at the end of the buffered data,
+    // so only the remainder needs to be skipped.
+    len -= avail;
+    vgm_buffer_reset(vgm_file);
+    if (gzseek(vgm_file->file, len, SEEK_CUR) < 0) {
+        int errnum;
+        const char *msg = gzerror(vgm_file->file, &errnum);
+        ESP_LOGE(TAG, "gzseek: %s [%d]", msg, errnum);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
 esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool load_data)
 {
+    const uint8_t *buf;
     uint8_t cmd;
 
     if (vgm_seek_start(vgm_file) != ESP_OK) {
@@ -385,51 +496,91 @@ esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool lo
     memset(command, 0, sizeof(vgm_command_t));
     command->sample_index = vgm_file->sample_index;
 
-    if(gzread(vgm_file->file, &cmd, sizeof(cmd)) != sizeof(cmd)) {
-        int errnum;
-        const char *msg = gzerror(vgm_file->file, &errnum);
-        ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+    if (vgm_buffer_require(vgm_file, 1) != ESP_OK) {
         return ESP_FAIL;
     }
 
-    if (cmd == 0x61) {
+    cmd = vgm_file->buf[vgm_file->buf_pos];
+
+    if (cmd == 0xB4) {
+        /* NES APU, write value dd to register aa */
+        if (vgm_buffer_require(vgm_file, 3) != ESP_OK) {
+            return ESP_FAIL;
+        }
+        buf = vgm_file->buf + vgm_file->buf_pos + 1;
+        vgm_file->buf_pos += 3;
+
+        uint8_t reg_l = 0;
+        if (buf[0] <= 0x1F) {
+            /* Registers $00-$1F equal NES address $4000-$401F */
+            reg_l = buf[0];
+        }
+        else if (buf[0] >= 0x20 && buf[0] <= 0x3E) {
+            /* Registers $20-$3E equal NES address $4080-$409E */
+            reg_l = 0x80 + (buf[0] - 0x20);
+        }
+        else if (buf[0] == 0x3F) {
+            /* Register $3F equals NES address $4023 */
+            reg_l = 0x23;
+        }
+        else if (buf[0] >= 0x40 && buf[0] <= 0x7F) {
+           /* Registers $40-$7F equal NES address $4040-$407F */
+           reg_l = 0x40 + (buf[0] - 0x40);
+        }
+        else {
+            ESP_LOGE(TAG, "Unknown NES APU register: %02X", buf[0]);
+            command->type = VGM_CMD_UNKNOWN;
+            return 0;
+        }
+
+        command->type = VGM_CMD_NES_APU;
+        command->info.nes_apu.reg = 0x4000 + reg_l; /* Write to 0x4000 + reg_l */
+        command->info.nes_apu.dat = buf[1];
+    }
+    else if (cmd == 0x61) {
         /* Wait n samples, n can range from 0 to 65535 */
-        uint8_t buf[2];
-        if(gzread(vgm_file->file, &buf, sizeof(buf)) != sizeof(buf)) {
-            int errnum;
-            const char *msg = gzerror(vgm_file->file, &errnum);
-            ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+        if (vgm_buffer_require(vgm_file, 3) != ESP_OK) {
             return ESP_FAIL;
         }
+        buf = vgm_file->buf + vgm_file->buf_pos + 1;
+        vgm_file->buf_pos += 3;
+
         command->type = VGM_CMD_WAIT;
         command->info.wait.samples = UINT16_FROM_BYTES(buf, 0);
         vgm_file->sample_index += command->info.wait.samples;
     }
     else if (cmd == 0x62) {
         /* Wait 735 samples */
+        vgm_file->buf_pos++;
         command->type = VGM_CMD_WAIT;
         command->info.wait.samples = 735;
         vgm_file->sample_index += command->info.wait.samples;
     }
     else if (cmd == 0x63) {
         /* Wait 882 samples */
+        vgm_file->buf_pos++;
         command->type = VGM_CMD_WAIT;
         command->info.wait.samples = 882;
         vgm_file->sample_index += command->info.wait.samples;
     }
     else if (cmd == 0x66) {
         /* End of sound data */
+        vgm_file->buf_pos++;
         command->type = VGM_CMD_DONE;
     }
+    else if (cmd >= 0x70 && cmd <= 0x7F) {
+        /* Wait n+1 samples, n can range from 0 to 15 */
+        vgm_file->buf_pos++;
+        command->type = VGM_CMD_WAIT;
+        command->info.wait.samples = (cmd & 0x0F) + 1;
+    }
     else if (cmd == 0x67) {
         /* Data block */
-        uint8_t header[6];
-        if(gzread(vgm_file->file, &header, sizeof(header)) != sizeof(header)) {
-            int errnum;
-            const char *msg = gzerror(vgm_file->file, &errnum);
-            ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+        if (vgm_buffer_require(vgm_file, 7) != ESP_OK) {
             return ESP_FAIL;
         }
+        const uint8_t *header = vgm_file->buf + vgm_file->buf_pos + 1;
+        vgm_file->buf_pos += 7;
 
         if (header[0] != 0x66) {
             ESP_LOGE(TAG, "Unknown value at start of data block: %02X", header[0]);
@@ -458,23 +609,21 @@ esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool lo
         }
 #endif
 
+        uint8_t block_type = header[1];
         uint32_t data_size = UINT32_FROM_BYTES(header, 2);
         uint16_t start_addr = 0;
         uint8_t *data_buf = 0;
 
-        if (header[1] >= 0xC0 && header[1] <= 0xDF) {
+        if (block_type >= 0xC0 && block_type <= 0xDF) {
             /* RAM writes (for RAM with up to 64 KB) */
-            uint8_t addr_buf[2];
-
-            if(gzread(vgm_file->file, addr_buf, 2) != 2) {
-                int errnum;
-                const char *msg = gzerror(vgm_file->file, &errnum);
-                ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+            if (vgm_buffer_require(vgm_file, 2) != ESP_OK) {
                 return ESP_FAIL;
             }
+            buf = vgm_file->buf + vgm_file->buf_pos;
+            vgm_file->buf_pos += 2;
 
             data_size -= 2;
-            start_addr = UINT16_FROM_BYTES(addr_buf, 0);
+            start_addr = UINT16_FROM_BYTES(buf, 0);
 
             ESP_LOGI(TAG, "Data start address: $%04X", start_addr);
 
@@ -484,25 +633,18 @@ esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool lo
                     return ESP_ERR_NO_MEM;
                 }
 
-                if(gzread(vgm_file->file, data_buf, data_size) != data_size) {
+                if (vgm_buffer_read(vgm_file, data_buf, data_size) != ESP_OK) {
                     free(data_buf);
-                    int errnum;
-                    const char *msg = gzerror(vgm_file->file, &errnum);
-                    ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
                     return ESP_FAIL;
                 }
-
             } else {
-                if (gzseek(vgm_file->file, data_size, SEEK_CUR) < 0) {
-                    int errnum;
-                    const char *msg = gzerror(vgm_file->file, &errnum);
-                    ESP_LOGE(TAG, "gzseek: %s [%d]", msg, errnum);
+                if (vgm_buffer_skip(vgm_file, data_size) != ESP_OK) {
                     return ESP_FAIL;
                 }
             }
         }
         else {
-            ESP_LOGE(TAG, "Unsupported data block type: %02X", header[1]);
+            ESP_LOGE(TAG, "Unsupported data block type: %02X", block_type);
         }
 
         if (start_addr > 0) {
@@ -518,48 +660,6 @@ esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool lo
             }
         }
     }
-    else if (cmd >= 0x70 && cmd <= 0x7F) {
-        /* Wait n+1 samples, n can range from 0 to 15 */
-        command->type = VGM_CMD_WAIT;
-        command->info.wait.samples = (cmd & 0x0F) + 1;
-    }
-    else if (cmd == 0xB4) {
-        /* NES APU, write value dd to register aa */
-        uint8_t buf[2];
-        if(gzread(vgm_file->file, &buf, sizeof(buf)) != sizeof(buf)) {
-            int errnum;
-            const char *msg = gzerror(vgm_file->file, &errnum);
-            ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
-            return ESP_FAIL;
-        }
-
-        uint8_t reg_l = 0;
-        if (buf[0] <= 0x1F) {
-            /* Registers $00-$1F equal NES address $4000-$401F */
-            reg_l = buf[0];
-        }
-        else if (buf[0] >= 0x20 && buf[0] <= 0x3E) {
-            /* Registers $20-$3E equal NES address $4080-$409E */
-            reg_l = 0x80 + (buf[0] - 0x20);
-        }
-        else if (buf[0] == 0x3F) {
-            /* Register $3F equals NES address $4023 */
-            reg_l = 0x23;
-        }
-        else if (buf[0] >= 0x40 && buf[0] <= 0x7F) {
-           /* Registers $40-$7F equal NES address $4040-$407F */
-           reg_l = 0x40 + (buf[0] - 0x40);
-        }
-        else {
-            ESP_LOGE(TAG, "Unknown NES APU register: %02X", buf[0]);
-            command->type = VGM_CMD_UNKNOWN;
-            return 0;
-        }
-
-        command->type = VGM_CMD_NES_APU;
-        command->info.nes_apu.reg = 0x4000 + reg_l; /* Write to 0x4000 + reg_l */
-        command->info.nes_apu.dat = buf[1];
-    }
     else {
         ESP_LOGE(TAG, "Unsupported command: %02X", cmd);
         // Probably safer to fail here, in case its a multi-byte command
@@ -570,6 +670,16 @@ esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool lo
     return ESP_OK;
 }
 
+uint32_t vgm_get_offset(vgm_file_t *vgm_file)
+{
+    // The file position is at the end of the buffered data
+    z_off_t pos = gztell(vgm_file->file);
+    if (pos < 0) {
+        return 0;
+    }
+    return (uint32_t)pos - (vgm_file->buf_len - vgm_file->buf_pos);
+}
+
 void vgm_free(vgm_file_t *vgm_file)
 {
     if (vgm_file) {
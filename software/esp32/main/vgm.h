@@ -87,6 +87,11 @@ esp_err_t vgm_seek_restart(vgm_file_t *vgm_file);
 esp_err_t vgm_seek_loop(vgm_file_t *vgm_file);
 esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool load_data);
 
+/**
+ * Get the uncompressed file offset of the next command.
+ */
+uint32_t vgm_get_offset(vgm_file_t *vgm_file);
+
 void vgm_free(vgm_file_t *vgm_file);
 
 #endif /* VGM_H */
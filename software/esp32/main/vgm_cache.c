@@ -0,0 +1,585 @@
+#include "vgm_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/unistd.h>
+#include <errno.h>
+
+#include <esp_err.h>
+#include <esp_log.h>
+
+static const char *TAG = "vgm_cache";
+
+#define VGM_CACHE_MAGIC "NSEV"
+#define VGM_CACHE_VERSION 3
+#define VGM_CACHE_FLAG_DMC 0x0001
+#define VGM_CACHE_FLAG_FRAMES 0x0002
+#define VGM_CACHE_EXTENSION ".nesev"
+#define VGM_CACHE_TMP_EXTENSION ".tmp"
+#define VGM_CACHE_NO_LOOP UINT32_MAX
+
+/* Samples per 60Hz frame */
+#define VGM_CACHE_FRAME_SAMPLES 735
+
+/* Number of event records read or written at a time */
+#define VGM_CACHE_EVENT_BUFFER 256
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t flags;
+    uint32_t source_size;
+    uint32_t source_mtime;
+    uint32_t event_count;
+    uint32_t loop_index;
+    uint32_t data_offset;
+    uint32_t data_count;
+} vgm_cache_header_t;
+
+typedef struct {
+    uint8_t block;
+    uint8_t reserved;
+    uint16_t len;
+} vgm_cache_data_header_t;
+
+struct vgm_cache_t {
+    FILE *file;
+    vgm_cache_header_t header;
+    uint32_t event_index;
+    vgm_cache_event_t events[VGM_CACHE_EVENT_BUFFER];
+};
+
+struct vgm_cache_writer_t {
+    FILE *file;
+    char *filename;
+    char *tmp_filename;
+    vgm_cache_header_t header;
+    esp_err_t status;
+    bool frame_aligned;
+    uint64_t last_time_us;
+    uint32_t event_count;
+    uint32_t flushed_count;
+    size_t events_len;
+    vgm_cache_event_t events[VGM_CACHE_EVENT_BUFFER];
+};
+
+static char *vgm_cache_filename(const char *vgm_filename, const char *suffix);
+static esp_err_t vgm_cache_source_stat(const char *vgm_filename, uint32_t *size, uint32_t *mtime);
+static esp_err_t vgm_cache_writer_append(vgm_cache_writer_t *writer, uint16_t delay_us, uint8_t reg, uint8_t dat);
+static esp_err_t vgm_cache_writer_flush(vgm_cache_writer_t *writer);
+static uint16_t vgm_cache_writer_take_delay(vgm_cache_writer_t *writer, uint32_t sample_time);
+
+/*
+ * Build the cache filename by replacing the extension of the VGM file.
+ */
+char *vgm_cache_filename(const char *vgm_filename, const char *suffix)
+{
+    size_t len = strlen(vgm_filename);
+    const char *slash = strrchr(vgm_filename, '/');
+    const char *dot = strrchr(vgm_filename, '.');
+    if (dot && (!slash || dot > slash)) {
+        len = dot - vgm_filename;
+    }
+
+    char *filename = malloc(len + strlen(VGM_CACHE_EXTENSION) + strlen(suffix) + 1);
+    if (!filename) {
+        return NULL;
+    }
+
+    memcpy(filename, vgm_filename, len);
+    strcpy(filename + len, VGM_CACHE_EXTENSION);
+    strcat(filename, suffix);
+    return filename;
+}
+
+esp_err_t vgm_cache_source_stat(const char *vgm_filename, uint32_t *size, uint32_t *mtime)
+{
+    struct stat st;
+    if (stat(vgm_filename, &st) != 0) {
+        ESP_LOGE(TAG, "Unable to stat file: %s", strerror(errno));
+        return ESP_FAIL;
+    }
+    *size = (uint32_t)st.st_size;
+    *mtime = (uint32_t)st.st_mtime;
+    return ESP_OK;
+}
+
+esp_err_t vgm_cache_open(vgm_cache_t **cache, const char *vgm_filename)
+{
+    esp_err_t ret = ESP_OK;
+    vgm_cache_t *cache_result = NULL;
+    char *filename = NULL;
+
+    do {
+        uint32_t source_size;
+        uint32_t source_mtime;
+        ret = vgm_cache_source_stat(vgm_filename, &source_size, &source_mtime);
+        if (ret != ESP_OK) {
+            break;
+        }
+
+        filename = vgm_cache_filename(vgm_filename, "");
+        if (!filename) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        cache_result = malloc(sizeof(struct vgm_cache_t));
+        if (!cache_result) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+        bzero(cache_result, sizeof(struct vgm_cache_t));
+
+        cache_result->file = fopen(filename, "rb");
+        if (!cache_result->file) {
+            ret = ESP_ERR_NOT_FOUND;
+            break;
+        }
+
+        vgm_cache_header_t *header = &cache_result->header;
+        if (fread(header, 1, sizeof(vgm_cache_header_t), cache_result->file) != sizeof(vgm_cache_header_t)) {
+            ESP_LOGW(TAG, "Unable to read cache header");
+            ret = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+
+        if (memcmp(header->magic, VGM_CACHE_MAGIC, 4) != 0
+                || header->version != VGM_CACHE_VERSION) {
+            ESP_LOGW(TAG, "Unsupported cache file");
+            ret = ESP_ERR_INVALID_STATE;
+            break;
+        }
+
+        if (header->source_size != source_size || header->source_mtime != source_mtime) {
+            ESP_LOGI(TAG, "Cache is out of date");
+            ret = ESP_ERR_INVALID_STATE;
+            break;
+        }
+
+        if (header->loop_index != VGM_CACHE_NO_LOOP && header->loop_index >= header->event_count) {
+            ESP_LOGW(TAG, "Invalid cache loop index");
+            ret = ESP_ERR_INVALID_STATE;
+            break;
+        }
+
+        ESP_LOGI(TAG, "Opened cache: events=%d, data=%d",
+                header->event_count, header->data_count);
+    } while (0);
+
+    free(filename);
+
+    if (ret == ESP_OK) {
+        *cache = cache_result;
+    } else {
+        vgm_cache_free(cache_result);
+    }
+
+    return ret;
+}
+
+bool vgm_cache_has_dmc(const vgm_cache_t *cache)
+{
+    return (cache->header.flags & VGM_CACHE_FLAG_DMC) != 0;
+}
+
+bool vgm_cache_has_loop(const vgm_cache_t *cache)
+{
+    return cache->header.loop_index != VGM_CACHE_NO_LOOP;
+}
+
+bool vgm_cache_is_frame_aligned(const vgm_cache_t *cache)
+{
+    return (cache->header.flags & VGM_CACHE_FLAG_FRAMES) != 0;
+}
+
+uint32_t vgm_cache_event_count(const vgm_cache_t *cache)
+{
+    return cache->header.event_count;
+}
+
+esp_err_t vgm_cache_load_data(vgm_cache_t *cache, vgm_cache_data_cb_t data_cb, void *arg)
+{
+    esp_err_t ret = ESP_OK;
+    uint8_t buf[256];
+
+    if (fseek(cache->file, cache->header.data_offset, SEEK_SET) != 0) {
+        ESP_LOGE(TAG, "Unable to seek to cache data: %s", strerror(errno));
+        return ESP_FAIL;
+    }
+
+    for (uint32_t i = 0; i < cache->header.data_count; i++) {
+        vgm_cache_data_header_t data_header;
+        if (fread(&data_header, 1, sizeof(data_header), cache->file) != sizeof(data_header)) {
+            ESP_LOGE(TAG, "Unable to read cache data header");
+            ret = ESP_FAIL;
+            break;
+        }
+
+        uint8_t block = data_header.block;
+        size_t load_len = data_header.len;
+        while (load_len > 0) {
+            size_t len = (load_len < sizeof(buf)) ? load_len : sizeof(buf);
+            if (fread(buf, 1, len, cache->file) != len) {
+                ESP_LOGE(TAG, "Unable to read cache data");
+                ret = ESP_FAIL;
+                break;
+            }
+
+            ret = data_cb(block, buf, len, arg);
+            if (ret != ESP_OK) {
+                break;
+            }
+            load_len -= len;
+            block += 4;
+        }
+        if (ret != ESP_OK) {
+            break;
+        }
+    }
+
+    // Leave the file positioned at the start of the event stream
+    if (vgm_cache_seek_start(cache) != ESP_OK) {
+        ret = ESP_FAIL;
+    }
+
+    return ret;
+}
+
+esp_err_t vgm_cache_seek_start(vgm_cache_t *cache)
+{
+    if (fseek(cache->file, sizeof(vgm_cache_header_t), SEEK_SET) != 0) {
+        ESP_LOGE(TAG, "Unable to seek to start of events: %s", strerror(errno));
+        return ESP_FAIL;
+    }
+    cache->event_index = 0;
+    return ESP_OK;
+}
+
+esp_err_t vgm_cache_seek_loop(vgm_cache_t *cache)
+{
+    if (!vgm_cache_has_loop(cache)) {
+        ESP_LOGE(TAG, "cache does not have a loop index");
+        return ESP_FAIL;
+    }
+
+    long offset = sizeof(vgm_cache_header_t)
+            + (cache->header.loop_index * sizeof(vgm_cache_event_t));
+    if (fseek(cache->file, offset, SEEK_SET) != 0) {
+        ESP_LOGE(TAG, "Unable to seek to loop: %s", strerror(errno));
+        return ESP_FAIL;
+    }
+    cache->event_index = cache->header.loop_index;
+    return ESP_OK;
+}
+
+esp_err_t vgm_cache_next_events(vgm_cache_t *cache, const vgm_cache_event_t **events, size_t *count)
+{
+    size_t remaining = cache->header.event_count - cache->event_index;
+    size_t len = (remaining < VGM_CACHE_EVENT_BUFFER) ? remaining : VGM_CACHE_EVENT_BUFFER;
+
+    if (len > 0) {
+        if (fread(cache->events, sizeof(vgm_cache_event_t), len, cache->file) != len) {
+            ESP_LOGE(TAG, "Unable to read events");
+            return ESP_FAIL;
+        }
+        cache->event_index += len;
+    }
+
+    *events = cache->events;
+    *count = len;
+    return ESP_OK;
+}
+
+void vgm_cache_free(vgm_cache_t *cache)
+{
+    if (cache) {
+        if (cache->file) {
+            fclose(cache->file);
+        }
+        free(cache);
+    }
+}
+
+esp_err_t vgm_cache_writer_create(vgm_cache_writer_t **writer, const char *vgm_filename)
+{
+    esp_err_t ret = ESP_OK;
+    vgm_cache_writer_t *writer_result = NULL;
+
+    do {
+        writer_result = malloc(sizeof(struct vgm_cache_writer_t));
+        if (!writer_result) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+        bzero(writer_result, sizeof(struct vgm_cache_writer_t));
+
+        vgm_cache_header_t *header = &writer_result->header;
+        memcpy(header->magic, VGM_CACHE_MAGIC, 4);
+        header->version = VGM_CACHE_VERSION;
+        header->loop_index = VGM_CACHE_NO_LOOP;
+        writer_result->frame_aligned = true;
+
+        ret = vgm_cache_source_stat(vgm_filename, &header->source_size, &header->source_mtime);
+        if (ret != ESP_OK) {
+            break;
+        }
+
+        writer_result->filename = vgm_cache_filename(vgm_filename, "");
+        writer_result->tmp_filename = vgm_cache_filename(vgm_filename, VGM_CACHE_TMP_EXTENSION);
+        if (!writer_result->filename || !writer_result->tmp_filename) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        writer_result->file = fopen(writer_result->tmp_filename, "w+b");
+        if (!writer_result->file) {
+            ESP_LOGE(TAG, "Unable to create cache file: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+
+        // Write a placeholder header, to be filled in when finished
+        if (fwrite(header, 1, sizeof(vgm_cache_header_t), writer_result->file) != sizeof(vgm_cache_header_t)) {
+            ESP_LOGE(TAG, "Unable to write cache header");
+            ret = ESP_FAIL;
+            break;
+        }
+    } while (0);
+
+    if (ret == ESP_OK) {
+        *writer = writer_result;
+    } else {
+        vgm_cache_writer_abort(writer_result);
+    }
+
+    return ret;
+}
+
+esp_err_t vgm_cache_writer_append(vgm_cache_writer_t *writer, uint16_t delay_us, uint8_t reg, uint8_t dat)
+{
+    if (writer->events_len == VGM_CACHE_EVENT_BUFFER) {
+        if (vgm_cache_writer_flush(writer) != ESP_OK) {
+            return writer->status;
+        }
+    }
+
+    vgm_cache_event_t *event = &writer->events[writer->events_len++];
+    event->delay_us = delay_us;
+    event->reg = reg;
+    event->dat = dat;
+    writer->event_count++;
+
+    return writer->status;
+}
+
+esp_err_t vgm_cache_writer_flush(vgm_cache_writer_t *writer)
+{
+    if (writer->status == ESP_OK && writer->events_len > 0) {
+        if (fwrite(writer->events, sizeof(vgm_cache_event_t), writer->events_len, writer->file) != writer->events_len) {
+            ESP_LOGE(TAG, "Unable to write events: %s", strerror(errno));
+            writer->status = ESP_FAIL;
+        }
+    }
+    writer->flushed_count += writer->events_len;
+    writer->events_len = 0;
+    return writer->status;
+}
+
+/*
+ * Convert the time since the last event into microseconds, emitting
+ * delay-only records for any part of it that does not fit in the
+ * following event.
+ */
+uint16_t vgm_cache_writer_take_delay(vgm_cache_writer_t *writer, uint32_t sample_time)
+{
+    uint64_t time_us = ((uint64_t)sample_time * 1000000ULL) / 44100ULL;
+    uint64_t delay_us = time_us - writer->last_time_us;
+    writer->last_time_us = time_us;
+
+    while (delay_us > UINT16_MAX) {
+        vgm_cache_writer_append(writer, UINT16_MAX, VGM_CACHE_REG_NONE, 0);
+        delay_us -= UINT16_MAX;
+    }
+    return (uint16_t)delay_us;
+}
+
+uint32_t vgm_cache_writer_add_write(vgm_cache_writer_t *writer, uint32_t sample_time,
+        nes_apu_register_t reg, uint8_t dat)
+{
+    if ((sample_time % VGM_CACHE_FRAME_SAMPLES) != 0) {
+        writer->frame_aligned = false;
+    }
+
+    // The frame-clocked queue rewrites $4017 to keep 4-step mode,
+    // so a stream selecting 5-step mode has to stay on the timed loop
+    if (reg == NES_APU_PAD2 && (dat & 0x80) != 0) {
+        writer->frame_aligned = false;
+    }
+
+    uint16_t delay_us = vgm_cache_writer_take_delay(writer, sample_time);
+    uint32_t index = writer->event_count;
+    vgm_cache_writer_append(writer, delay_us, (uint8_t)(reg - 0x4000), dat);
+    return index;
+}
+
+esp_err_t vgm_cache_writer_set_loop(vgm_cache_writer_t *writer, uint32_t sample_time)
+{
+    if ((sample_time % VGM_CACHE_FRAME_SAMPLES) != 0) {
+        writer->frame_aligned = false;
+    }
+
+    // Flush the delay up to the loop point into its own record, so that
+    // the loop starts with a clean time base.
+    uint16_t delay_us = vgm_cache_writer_take_delay(writer, sample_time);
+    if (delay_us > 0) {
+        vgm_cache_writer_append(writer, delay_us, VGM_CACHE_REG_NONE, 0);
+    }
+    writer->header.loop_index = writer->event_count;
+    return writer->status;
+}
+
+esp_err_t vgm_cache_writer_set_end(vgm_cache_writer_t *writer, uint32_t sample_time)
+{
+    uint16_t delay_us = vgm_cache_writer_take_delay(writer, sample_time);
+    if (delay_us > 0) {
+        vgm_cache_writer_append(writer, delay_us, VGM_CACHE_REG_NONE, 0);
+    }
+    return writer->status;
+}
+
+esp_err_t vgm_cache_writer_patch(vgm_cache_writer_t *writer, uint32_t index, uint8_t dat)
+{
+    if (writer->status != ESP_OK) {
+        return writer->status;
+    }
+
+    if (index >= writer->event_count) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (index >= writer->flushed_count) {
+        writer->events[index - writer->flushed_count].dat = dat;
+        return ESP_OK;
+    }
+
+    long offset = sizeof(vgm_cache_header_t)
+            + (index * sizeof(vgm_cache_event_t))
+            + offsetof(vgm_cache_event_t, dat);
+    if (fseek(writer->file, offset, SEEK_SET) != 0
+            || fwrite(&dat, 1, 1, writer->file) != 1
+            || fseek(writer->file, 0, SEEK_END) != 0) {
+        ESP_LOGE(TAG, "Unable to patch event: %s", strerror(errno));
+        writer->status = ESP_FAIL;
+    }
+    return writer->status;
+}
+
+esp_err_t vgm_cache_writer_add_data(vgm_cache_writer_t *writer, uint8_t block,
+        const uint8_t *data, size_t len)
+{
+    if (len == 0 || len > UINT16_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // The data section starts after the last event
+    if (vgm_cache_writer_flush(writer) != ESP_OK) {
+        return writer->status;
+    }
+    if (writer->header.data_count == 0) {
+        writer->header.data_offset = sizeof(vgm_cache_header_t)
+                + (writer->event_count * sizeof(vgm_cache_event_t));
+    }
+
+    vgm_cache_data_header_t data_header = {
+        .block = block,
+        .reserved = 0,
+        .len = len
+    };
+    if (fwrite(&data_header, 1, sizeof(data_header), writer->file) != sizeof(data_header)
+            || fwrite(data, 1, len, writer->file) != len) {
+        ESP_LOGE(TAG, "Unable to write data: %s", strerror(errno));
+        writer->status = ESP_FAIL;
+        return writer->status;
+    }
+    writer->header.data_count++;
+    return ESP_OK;
+}
+
+esp_err_t vgm_cache_writer_finish(vgm_cache_writer_t *writer, bool has_dmc)
+{
+    esp_err_t ret = ESP_OK;
+
+    do {
+        if (vgm_cache_writer_flush(writer) != ESP_OK) {
+            ret = writer->status;
+            break;
+        }
+
+        vgm_cache_header_t *header = &writer->header;
+        header->event_count = writer->event_count;
+        if (header->data_count == 0) {
+            header->data_offset = sizeof(vgm_cache_header_t)
+                    + (writer->event_count * sizeof(vgm_cache_event_t));
+        }
+        if (has_dmc) {
+            header->flags |= VGM_CACHE_FLAG_DMC;
+        }
+        if (writer->frame_aligned) {
+            header->flags |= VGM_CACHE_FLAG_FRAMES;
+        }
+
+        if (fseek(writer->file, 0, SEEK_SET) != 0
+                || fwrite(header, 1, sizeof(vgm_cache_header_t), writer->file) != sizeof(vgm_cache_header_t)) {
+            ESP_LOGE(TAG, "Unable to write cache header: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+
+        int result = fclose(writer->file);
+        writer->file = NULL;
+        if (result != 0) {
+            ESP_LOGE(TAG, "Unable to close cache file: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+
+        // FATFS will not rename over an existing file
+        unlink(writer->filename);
+        if (rename(writer->tmp_filename, writer->filename) != 0) {
+            ESP_LOGE(TAG, "Unable to rename cache file: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+
+        ESP_LOGI(TAG, "Wrote cache: events=%d, data=%d",
+                header->event_count, header->data_count);
+    } while (0);
+
+    if (ret == ESP_OK) {
+        free(writer->tmp_filename);
+        writer->tmp_filename = NULL;
+    }
+    vgm_cache_writer_abort(writer);
+
+    return ret;
+}
+
+void vgm_cache_writer_abort(vgm_cache_writer_t *writer)
+{
+    if (writer) {
+        if (writer->file) {
+            fclose(writer->file);
+        }
+        if (writer->tmp_filename) {
+            unlink(writer->tmp_filename);
+            free(writer->tmp_filename);
+        }
+        free(writer->filename);
+        free(writer);
+    }
+}
@@ -0,0 +1,104 @@
+/*
+ * Pre-compiled APU event stream cache
+ *
+ * The event stream is generated while scanning a VGM file, and stored
+ * next to it on the SD card with a ".nesev" extension. It contains every
+ * APU register write as a fixed-width record with the delay preceding it
+ * already converted to microseconds, and with DMC sample addresses
+ * already remapped to their preloaded locations. The sample data itself
+ * is stored after the event records.
+ */
+
+#ifndef VGM_CACHE_H
+#define VGM_CACHE_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+#include "nes.h"
+
+/* Register value for records that only carry a delay */
+#define VGM_CACHE_REG_NONE 0xFF
+
+typedef struct {
+    uint16_t delay_us;  /*!< Time to wait before applying this write */
+    uint8_t reg;        /*!< APU register, as an offset from $4000 */
+    uint8_t dat;        /*!< Value to write */
+} vgm_cache_event_t;
+
+typedef struct vgm_cache_t vgm_cache_t;
+typedef struct vgm_cache_writer_t vgm_cache_writer_t;
+
+typedef esp_err_t (*vgm_cache_data_cb_t)(uint8_t block, uint8_t *data, size_t len, void *arg);
+
+/**
+ * Open the event stream cache for a VGM file, if one exists and it
+ * matches the current size and modification time of that file.
+ */
+esp_err_t vgm_cache_open(vgm_cache_t **cache, const char *vgm_filename);
+
+bool vgm_cache_has_dmc(const vgm_cache_t *cache);
+bool vgm_cache_has_loop(const vgm_cache_t *cache);
+
+/**
+ * Check whether every event in the stream falls on a 60Hz frame boundary.
+ */
+bool vgm_cache_is_frame_aligned(const vgm_cache_t *cache);
+uint32_t vgm_cache_event_count(const vgm_cache_t *cache);
+
+/**
+ * Read all the stored DMC sample data, in chunks of up to 256 bytes
+ * that are passed to the provided callback along with their
+ * destination block.
+ */
+esp_err_t vgm_cache_load_data(vgm_cache_t *cache, vgm_cache_data_cb_t data_cb, void *arg);
+
+esp_err_t vgm_cache_seek_start(vgm_cache_t *cache);
+esp_err_t vgm_cache_seek_loop(vgm_cache_t *cache);
+
+/**
+ * Get the next run of events from the stream.
+ *
+ * The returned pointer refers to an internal buffer that remains valid
+ * until the next call. A count of zero indicates the end of the stream.
+ */
+esp_err_t vgm_cache_next_events(vgm_cache_t *cache, const vgm_cache_event_t **events, size_t *count);
+
+void vgm_cache_free(vgm_cache_t *cache);
+
+
+esp_err_t vgm_cache_writer_create(vgm_cache_writer_t **writer, const char *vgm_filename);
+
+/**
+ * Append a register write that happens at the provided sample time.
+ *
+ * @return Index of the event, for use with vgm_cache_writer_patch()
+ */
+uint32_t vgm_cache_writer_add_write(vgm_cache_writer_t *writer, uint32_t sample_time,
+        nes_apu_register_t reg, uint8_t dat);
+
+/**
+ * Mark the loop point of the stream at the provided sample time.
+ */
+esp_err_t vgm_cache_writer_set_loop(vgm_cache_writer_t *writer, uint32_t sample_time);
+
+/**
+ * Mark the end of the stream at the provided sample time.
+ */
+esp_err_t vgm_cache_writer_set_end(vgm_cache_writer_t *writer, uint32_t sample_time);
+
+esp_err_t vgm_cache_writer_patch(vgm_cache_writer_t *writer, uint32_t index, uint8_t dat);
+esp_err_t vgm_cache_writer_add_data(vgm_cache_writer_t *writer, uint8_t block,
+        const uint8_t *data, size_t len);
+
+/**
+ * Finish writing the cache, moving it into place next to the VGM file.
+ */
+esp_err_t vgm_cache_writer_finish(vgm_cache_writer_t *writer, bool has_dmc);
+
+/**
+ * Discard a partially written cache.
+ */
+void vgm_cache_writer_abort(vgm_cache_writer_t *writer);
+
+#endif /* VGM_CACHE_H */
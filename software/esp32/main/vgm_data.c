@@ -9,14 +9,35 @@
 #include <string.h>
 
 #include "nes.h"
+#include "zlib.h"
 #include "uthash.h"
 #include "utlist.h"
 
 static const char *TAG = "vgm_data";
 
+/*
+ * Block group data is kept deflated, with a small window so that the
+ * compressor and decompressor state stay within a few KB of heap.
+ */
+#define DATA_DEFLATE_LEVEL 6
+#define DATA_WINDOW_BITS 10
+#define DATA_MEM_LEVEL 2
+
+/*
+ * A range of loaded data, or of APU blocks, along with the sample time
+ * it was loaded at. Extents in the same list never overlap.
+ */
+typedef struct vgm_data_extent_t {
+    uint16_t start;     /*!< Byte offset from $8000, or first APU block */
+    uint16_t len;       /*!< Length in bytes, or in APU blocks */
+    uint32_t sample_time;
+    uint8_t *data;      /*!< Loaded data, or NULL for APU block ranges */
+    struct vgm_data_extent_t *next, *prev;
+} vgm_data_extent_t;
+
 struct vgm_data_t {
-    uint8_t raw_data[32768];
-    uint32_t block_sample_time[512];
+    vgm_data_extent_t *data_extents;
+    vgm_data_extent_t *block_extents;
 };
 
 typedef struct {
@@ -24,16 +45,37 @@ typedef struct {
     uint16_t block;
 } vgm_data_block_group_key_t;
 
+typedef struct {
+    uint32_t crc;
+    uint32_t byte_size;
+} vgm_data_block_group_content_t;
+
 struct vgm_data_block_group_t {
     vgm_data_block_group_key_t key;
+    vgm_data_block_group_content_t content;
     vgm_data_block_ref_node_t *block_refs_head;
+    uint16_t key_count;
     uint16_t block_size;
     uint16_t byte_size;
-    uint8_t *raw_data;
+    uint8_t *stored_data;
+    uint16_t stored_size;
+    bool compressed;
     uint8_t loaded_block;
+    bool indexed;
     UT_hash_handle hh;
+    struct vgm_data_block_group_t *next, *prev;
 };
 
+/*
+ * Maps a block group key onto the group holding its data, which may be
+ * shared with other keys whose uploads had identical contents.
+ */
+typedef struct {
+    vgm_data_block_group_key_t key;
+    vgm_data_block_group_t *block_group;
+    UT_hash_handle hh;
+} vgm_data_block_alias_t;
+
 typedef struct vgm_data_block_ref_t {
     uint32_t sample_time;
     vgm_data_block_group_t *block_group;
@@ -46,8 +88,16 @@ typedef struct vgm_data_block_ref_node_t {
     struct vgm_data_block_ref_node_t *next, *prev;
 } vgm_data_block_ref_node_t;
 
+struct vgm_data_block_reader_t {
+    const vgm_data_block_group_t *block_group;
+    z_stream strm;
+    size_t offset;
+};
+
 struct vgm_data_state_t {
+    vgm_data_block_alias_t *block_aliases;
     struct vgm_data_block_group_t *block_groups;
+    struct vgm_data_block_group_t *content_index;
     vgm_data_block_ref_node_t *block_refs_head;
 };
 
@@ -66,6 +116,119 @@ vgm_data_t* vgm_data_create()
     return vgm_data;
 }
 
+static void vgm_data_extent_free(vgm_data_extent_t *extent)
+{
+    if (extent) {
+        free(extent->data);
+        free(extent);
+    }
+}
+
+static vgm_data_extent_t *vgm_data_extent_create(uint16_t start, uint16_t len,
+        uint32_t sample_time, const uint8_t *data)
+{
+    vgm_data_extent_t *extent = malloc(sizeof(vgm_data_extent_t));
+    if (!extent) {
+        return NULL;
+    }
+    bzero(extent, sizeof(vgm_data_extent_t));
+    extent->start = start;
+    extent->len = len;
+    extent->sample_time = sample_time;
+
+    if (data) {
+        extent->data = malloc(len);
+        if (!extent->data) {
+            free(extent);
+            return NULL;
+        }
+        memcpy(extent->data, data, len);
+    }
+
+    return extent;
+}
+
+/*
+ * Replace a range within an extent list, trimming or splitting any
+ * existing extents that overlap it.
+ */
+static esp_err_t vgm_data_extent_assign(vgm_data_extent_t **head, uint16_t start, uint16_t len,
+        uint32_t sample_time, const uint8_t *data)
+{
+    vgm_data_extent_t *extent, *tmp_extent;
+    uint32_t end = start + len;
+
+    vgm_data_extent_t *add_extent = vgm_data_extent_create(start, len, sample_time, data);
+    if (!add_extent) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    DL_FOREACH_SAFE(*head, extent, tmp_extent) {
+        uint32_t extent_end = extent->start + extent->len;
+        if (extent_end <= start || extent->start >= end) {
+            continue;
+        }
+
+        if (extent->start >= start && extent_end <= end) {
+            // Completely replaced
+            DL_DELETE(*head, extent);
+            vgm_data_extent_free(extent);
+        } else if (extent->start < start && extent_end > end) {
+            // Replaced in the middle, so split off the tail
+            vgm_data_extent_t *tail_extent = vgm_data_extent_create(end, extent_end - end,
+                    extent->sample_time, extent->data ? extent->data + (end - extent->start) : NULL);
+            if (!tail_extent) {
+                vgm_data_extent_free(add_extent);
+                return ESP_ERR_NO_MEM;
+            }
+            DL_APPEND(*head, tail_extent);
+            extent->len = start - extent->start;
+        } else if (extent->start < start) {
+            // Tail replaced
+            extent->len = start - extent->start;
+        } else {
+            // Head replaced
+            uint16_t shift = end - extent->start;
+            if (extent->data) {
+                memmove(extent->data, extent->data + shift, extent->len - shift);
+            }
+            extent->start += shift;
+            extent->len -= shift;
+        }
+    }
+
+    DL_APPEND(*head, add_extent);
+    return ESP_OK;
+}
+
+static void vgm_data_extent_clear(vgm_data_extent_t **head)
+{
+    vgm_data_extent_t *extent, *tmp_extent;
+    DL_FOREACH_SAFE(*head, extent, tmp_extent) {
+        DL_DELETE(*head, extent);
+        vgm_data_extent_free(extent);
+    }
+}
+
+/*
+ * Copy whatever loaded data falls within a range, leaving the rest alone.
+ */
+static void vgm_data_extent_copy(const vgm_data_extent_t *head, uint16_t start, size_t len, uint8_t *data)
+{
+    const vgm_data_extent_t *extent;
+    uint32_t end = start + len;
+
+    DL_FOREACH(head, extent) {
+        uint32_t copy_start = MAX(start, extent->start);
+        uint32_t copy_end = MIN(end, (uint32_t)extent->start + extent->len);
+        if (copy_start < copy_end) {
+            memcpy(data + (copy_start - start),
+                    extent->data + (copy_start - extent->start),
+                    copy_end - copy_start);
+        }
+    }
+}
+
 esp_err_t vgm_data_load(vgm_data_t *vgm_data, uint32_t sample_time,
         uint16_t addr, const uint8_t *data, size_t len)
 {
@@ -119,8 +282,11 @@ esp_err_t vgm_data_load_impl(vgm_data_t *vgm_data, uint32_t sample_time,
         return ESP_ERR_INVALID_ARG;
     }
 
-    // Copy the data into our internal buffer
-    memcpy(vgm_data->raw_data + (addr - 0x8000), data, len);
+    // Copy the data into our internal extent list
+    esp_err_t ret = vgm_data_extent_assign(&vgm_data->data_extents, addr - 0x8000, len, sample_time, data);
+    if (ret != ESP_OK) {
+        return ret;
+    }
 
     // Convert memory addresses into APU blocks
     uint16_t apu_block = nes_addr_to_apu_block(addr);
@@ -142,23 +308,24 @@ esp_err_t vgm_data_load_impl(vgm_data_t *vgm_data, uint32_t sample_time,
          has_block2 = true;
     }
 
-    // Populate the sample time array for the loaded blocks
-    for (uint16_t i = start_block1; i <= end_block1; i++) {
-        vgm_data->block_sample_time[i] = sample_time;
+    // Record the sample time for the loaded blocks
+    ret = vgm_data_extent_assign(&vgm_data->block_extents, start_block1,
+            (end_block1 - start_block1) + 1, sample_time, NULL);
+    if (ret == ESP_OK && has_block2) {
+        ret = vgm_data_extent_assign(&vgm_data->block_extents, start_block2,
+                (end_block2 - start_block2) + 1, sample_time, NULL);
     }
-    if (has_block2) {
-        for (uint16_t i = start_block2; i <= end_block2; i++) {
-            vgm_data->block_sample_time[i] = sample_time;
-        }
+    if (ret != ESP_OK) {
+        return ret;
     }
 
     // Log the results of what we just did
     if (has_block2) {
         ESP_LOGI(TAG, "[%d] Data block: $%04X + $%04X (%d-%d)(%d-%d) %d", sample_time,
-            addr, len, start_block2, end_block2, start_block1, end_block1, block_count);
+            addr, (unsigned)len, start_block2, end_block2, start_block1, end_block1, block_count);
     } else {
         ESP_LOGI(TAG, "[%d] Data block: $%04X + $%04X (%d-%d) %d", sample_time,
-            addr, len, start_block1, end_block1, block_count);
+            addr, (unsigned)len, start_block1, end_block1, block_count);
     }
 
     return ESP_OK;
@@ -175,9 +342,13 @@ esp_err_t vgm_data_get_sample_time(const vgm_data_t *vgm_data, uint16_t block, s
         return ESP_ERR_INVALID_ARG;
     }
 
+    // Blocks that were never loaded have a sample time of zero
     uint32_t val = 0;
-    for (uint16_t i = block; i < block + block_count; i++) {
-        val = MAX(val, vgm_data->block_sample_time[i]);
+    const vgm_data_extent_t *extent;
+    DL_FOREACH(vgm_data->block_extents, extent) {
+        if (extent->start < block + block_count && extent->start + extent->len > block) {
+            val = MAX(val, extent->sample_time);
+        }
     }
 
     *sample_time = val;
@@ -191,14 +362,17 @@ esp_err_t vgm_data_get_data(const vgm_data_t *vgm_data, uint16_t block, size_t l
         return ESP_ERR_INVALID_ARG;
     }
 
+    // Anything that was never loaded reads back as zero
+    bzero(data, len);
+
     // Copy the initial segment
     uint16_t addr = 0xC000 + (block * 64);
     size_t copy_len = MIN(len, (0xFFFF - addr) + 1);
-    memcpy(data, vgm_data->raw_data + (addr - 0x8000), copy_len);
+    vgm_data_extent_copy(vgm_data->data_extents, addr - 0x8000, copy_len, data);
 
     // Handle wrap-around
     if (copy_len < len) {
-        memcpy(data + copy_len, vgm_data->raw_data, len - copy_len);
+        vgm_data_extent_copy(vgm_data->data_extents, 0, len - copy_len, data + copy_len);
     }
 
     return ESP_OK;
@@ -206,7 +380,11 @@ esp_err_t vgm_data_get_data(const vgm_data_t *vgm_data, uint16_t block, size_t l
 
 void vgm_data_free(vgm_data_t *vgm_data)
 {
-    free(vgm_data);
+    if (vgm_data) {
+        vgm_data_extent_clear(&vgm_data->data_extents);
+        vgm_data_extent_clear(&vgm_data->block_extents);
+        free(vgm_data);
+    }
 }
 
 vgm_data_state_t* vgm_data_state_create()
@@ -221,6 +399,121 @@ vgm_data_state_t* vgm_data_state_create()
     return vgm_data_state;
 }
 
+/*
+ * Deflate the data for a block group, taking ownership of the data.
+ *
+ * If the data does not get any smaller, then it is returned as-is.
+ */
+static uint8_t *vgm_data_deflate(uint8_t *raw_data, size_t len, uint16_t *stored_size, bool *compressed)
+{
+    z_stream strm;
+    bzero(&strm, sizeof(z_stream));
+
+    *stored_size = len;
+    *compressed = false;
+
+    if (deflateInit2(&strm, DATA_DEFLATE_LEVEL, Z_DEFLATED,
+            -DATA_WINDOW_BITS, DATA_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return raw_data;
+    }
+
+    uint8_t *deflated_data = malloc(len);
+    if (deflated_data) {
+        strm.next_in = raw_data;
+        strm.avail_in = len;
+        strm.next_out = deflated_data;
+        strm.avail_out = len;
+        if (deflate(&strm, Z_FINISH) == Z_STREAM_END && strm.total_out < len) {
+            uint8_t *shrunk_data = realloc(deflated_data, strm.total_out);
+            if (shrunk_data) {
+                deflated_data = shrunk_data;
+            }
+            *stored_size = strm.total_out;
+            *compressed = true;
+        }
+    }
+    deflateEnd(&strm);
+
+    if (*compressed) {
+        free(raw_data);
+        return deflated_data;
+    } else {
+        free(deflated_data);
+        return raw_data;
+    }
+}
+
+/*
+ * Point a block group key at the group holding the provided data,
+ * taking ownership of the stored data.
+ *
+ * If another group already holds identical data, the key shares that
+ * group and the stored data is freed. Otherwise the key's own group is
+ * grown in place, unless other keys still share it.
+ */
+static esp_err_t vgm_data_state_set_alias_data(vgm_data_state_t *vgm_data_state,
+        vgm_data_block_alias_t *alias, uint32_t crc, size_t len,
+        uint8_t *stored_data, uint16_t stored_size, bool compressed)
+{
+    struct vgm_data_block_group_t *group;
+    vgm_data_block_group_content_t content;
+    bzero(&content, sizeof(vgm_data_block_group_content_t));
+    content.crc = crc;
+    content.byte_size = len;
+
+    // Both copies went through the same compressor, so identical data
+    // also has identical stored bytes
+    HASH_FIND(hh, vgm_data_state->content_index, &content, sizeof(vgm_data_block_group_content_t), group);
+    if (group && group->stored_size == stored_size && group->compressed == compressed
+            && memcmp(group->stored_data, stored_data, stored_size) == 0) {
+        free(stored_data);
+        stored_data = NULL;
+    } else if (alias->block_group && alias->block_group->key_count == 1) {
+        group = alias->block_group;
+        if (group->indexed) {
+            HASH_DELETE(hh, vgm_data_state->content_index, group);
+            group->indexed = false;
+        }
+        free(group->stored_data);
+    } else {
+        group = malloc(sizeof(struct vgm_data_block_group_t));
+        if (!group) {
+            return ESP_ERR_NO_MEM;
+        }
+        bzero(group, sizeof(struct vgm_data_block_group_t));
+        group->key = alias->key;
+        DL_APPEND(vgm_data_state->block_groups, group);
+    }
+
+    if (stored_data) {
+        group->stored_data = stored_data;
+        group->stored_size = stored_size;
+        group->compressed = compressed;
+        group->byte_size = len;
+        group->block_size = nes_len_to_apu_blocks(len);
+        group->content = content;
+    }
+    // Only the first group with a given content hash can be found again
+    if (!group->indexed) {
+        struct vgm_data_block_group_t *existing;
+        HASH_FIND(hh, vgm_data_state->content_index, &content, sizeof(vgm_data_block_group_content_t), existing);
+        if (!existing) {
+            HASH_ADD(hh, vgm_data_state->content_index, content, sizeof(vgm_data_block_group_content_t), group);
+            group->indexed = true;
+        }
+    }
+
+    if (alias->block_group != group) {
+        if (alias->block_group) {
+            alias->block_group->key_count--;
+        }
+        alias->block_group = group;
+        group->key_count++;
+    }
+
+    return ESP_OK;
+}
+
 esp_err_t vgm_data_state_add_ref(vgm_data_state_t *vgm_data_state, const vgm_data_t *vgm_data,
         uint32_t sample_time, uint16_t block, size_t len)
 {
@@ -234,29 +527,17 @@ esp_err_t vgm_data_state_add_ref(vgm_data_state_t *vgm_data_state, const vgm_dat
 
     // Get the saved block group, keyed on a combination of the block
     // identifier and the most recent sample time
-    struct vgm_data_block_group_t *group;
-    vgm_data_block_group_key_t group_key = {
-            .sample_time = data_sample_time,
-            .block = block
-    };
-    HASH_FIND(hh, vgm_data_state->block_groups, &group_key, sizeof(vgm_data_block_group_key_t), group);
-
-    // Create and insert a new block group if a saved one did not exist
-    if (!group) {
-        group = malloc(sizeof(struct vgm_data_block_group_t));
-        if (!group) {
-            return ESP_ERR_NO_MEM;
-        }
-        bzero(group, sizeof(struct vgm_data_block_group_t));
-        group->key.sample_time = data_sample_time;
-        group->key.block = block;
-        HASH_ADD(hh, vgm_data_state->block_groups, key, sizeof(vgm_data_block_group_key_t), group);
-    }
-
-    // Update the group data, if its unpopulated or shorter than the
-    // referenced data
-    if (group->byte_size < len) {
-        uint8_t *raw_data = realloc(group->raw_data, len);
+    vgm_data_block_alias_t *alias;
+    vgm_data_block_group_key_t group_key;
+    bzero(&group_key, sizeof(vgm_data_block_group_key_t));
+    group_key.sample_time = data_sample_time;
+    group_key.block = block;
+    HASH_FIND(hh, vgm_data_state->block_aliases, &group_key, sizeof(vgm_data_block_group_key_t), alias);
+
+    // Collect the referenced data, if the key is new or the saved group
+    // is shorter than the referenced data
+    if (!alias || !alias->block_group || alias->block_group->byte_size < len) {
+        uint8_t *raw_data = malloc(len);
         if (!raw_data) {
             return ESP_ERR_NO_MEM;
         }
@@ -265,10 +546,31 @@ esp_err_t vgm_data_state_add_ref(vgm_data_state_t *vgm_data_state, const vgm_dat
             free(raw_data);
             return ret;
         }
-        group->raw_data = raw_data;
-        group->byte_size = len;
-        group->block_size = nes_len_to_apu_blocks(len);
+
+        uint32_t crc = crc32(0L, raw_data, len);
+        uint16_t stored_size;
+        bool compressed;
+        uint8_t *stored_data = vgm_data_deflate(raw_data, len, &stored_size, &compressed);
+
+        if (!alias) {
+            alias = malloc(sizeof(vgm_data_block_alias_t));
+            if (!alias) {
+                free(stored_data);
+                return ESP_ERR_NO_MEM;
+            }
+            bzero(alias, sizeof(vgm_data_block_alias_t));
+            alias->key = group_key;
+            HASH_ADD(hh, vgm_data_state->block_aliases, key, sizeof(vgm_data_block_group_key_t), alias);
+        }
+
+        ret = vgm_data_state_set_alias_data(vgm_data_state, alias, crc, len,
+                stored_data, stored_size, compressed);
+        if (ret != ESP_OK) {
+            free(stored_data);
+            return ret;
+        }
     }
+    struct vgm_data_block_group_t *group = alias->block_group;
 
     // Create a block reference
     vgm_data_block_ref_t *block_ref = malloc(sizeof(vgm_data_block_ref_t));
@@ -350,32 +652,53 @@ vgm_data_block_ref_t* vgm_data_state_take_next_ref(vgm_data_state_t *vgm_data_st
 void vgm_data_state_log_block_groups(const vgm_data_state_t *vgm_data_state)
 {
     struct vgm_data_block_group_t *group;
+    int group_count = 0;
+    int key_count = 0;
+    int byte_total = 0;
+    int stored_total = 0;
 
-    for(group = vgm_data_state->block_groups; group != NULL; group = group->hh.next) {
+    DL_FOREACH(vgm_data_state->block_groups, group) {
         uint16_t block_address = (((uint16_t)group->key.block) << 6) | 0xC000;
 
         int ref_count = 0;
         vgm_data_block_ref_node_t *current_ref;
         DL_COUNT(group->block_refs_head, current_ref, ref_count);
 
-        ESP_LOGI(TAG, "Block Group: [t=%u, $%04X~%03d] refs=%d, blocks=%d, bytes=%d",
+        ESP_LOGI(TAG, "Block Group: [t=%u, $%04X~%03d] refs=%d, keys=%d, blocks=%d, bytes=%d, stored=%d",
                 group->key.sample_time, block_address, group->key.block,
-                ref_count, group->block_size, group->byte_size);
+                ref_count, group->key_count, group->block_size, group->byte_size,
+                group->stored_size);
+
+        group_count++;
+        key_count += group->key_count;
+        byte_total += group->byte_size;
+        stored_total += group->stored_size;
     }
+
+    ESP_LOGI(TAG, "Block groups: %d, shared by %d keys, bytes=%d, stored=%d",
+            group_count, key_count, byte_total, stored_total);
 }
 
 void vgm_data_state_free(vgm_data_state_t *vgm_data_state)
 {
     struct vgm_data_block_group_t *current_group, *tmp_group;
+    vgm_data_block_alias_t *current_alias, *tmp_alias;
     vgm_data_block_ref_node_t *current_ref, *tmp_ref;
 
     if (!vgm_data_state) {
         return;
     }
 
-    // Delete the hash table of block groups
-    HASH_ITER(hh, vgm_data_state->block_groups, current_group, tmp_group) {
-        HASH_DEL(vgm_data_state->block_groups, current_group);
+    // Delete the hash table of block group keys
+    HASH_ITER(hh, vgm_data_state->block_aliases, current_alias, tmp_alias) {
+        HASH_DEL(vgm_data_state->block_aliases, current_alias);
+        free(current_alias);
+    }
+
+    // Delete the list of block groups, along with their content index
+    HASH_CLEAR(hh, vgm_data_state->content_index);
+    DL_FOREACH_SAFE(vgm_data_state->block_groups, current_group, tmp_group) {
+        DL_DELETE(vgm_data_state->block_groups, current_group);
 
         // Free the block refs list, only deleting the nodes.
         // The actual ref data will be deleted as part of the
@@ -385,7 +708,7 @@ void vgm_data_state_free(vgm_data_state_t *vgm_data_state)
             free(current_ref);
         }
 
-        free(current_group->raw_data);
+        free(current_group->stored_data);
         free(current_group);
     }
 
@@ -441,9 +764,9 @@ uint16_t vgm_data_block_group_byte_size(const vgm_data_block_group_t *block_grou
     return block_group->byte_size;
 }
 
-uint8_t *vgm_data_block_group_raw_data(const vgm_data_block_group_t *block_group)
+uint16_t vgm_data_block_group_stored_size(const vgm_data_block_group_t *block_group)
 {
-    return block_group->raw_data;
+    return block_group->stored_size;
 }
 
 uint8_t vgm_data_block_group_get_loaded_block(const vgm_data_block_group_t *block_group)
@@ -460,3 +783,68 @@ vgm_data_block_ref_node_t* vgm_data_block_group_ref_list(const vgm_data_block_gr
 {
     return block_group->block_refs_head;
 }
+
+esp_err_t vgm_data_block_reader_open(vgm_data_block_reader_t **reader, const vgm_data_block_group_t *block_group)
+{
+    if (!reader || !block_group) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    vgm_data_block_reader_t *reader_result = malloc(sizeof(vgm_data_block_reader_t));
+    if (!reader_result) {
+        return ESP_ERR_NO_MEM;
+    }
+    bzero(reader_result, sizeof(vgm_data_block_reader_t));
+    reader_result->block_group = block_group;
+
+    if (block_group->compressed) {
+        reader_result->strm.next_in = block_group->stored_data;
+        reader_result->strm.avail_in = block_group->stored_size;
+        if (inflateInit2(&reader_result->strm, -DATA_WINDOW_BITS) != Z_OK) {
+            ESP_LOGE(TAG, "Unable to initialize inflate");
+            free(reader_result);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    *reader = reader_result;
+    return ESP_OK;
+}
+
+esp_err_t vgm_data_block_reader_read(vgm_data_block_reader_t *reader, uint8_t *data, size_t len, size_t *read_len)
+{
+    const vgm_data_block_group_t *block_group = reader->block_group;
+    size_t remaining = block_group->byte_size - reader->offset;
+
+    len = MIN(len, remaining);
+    if (len == 0) {
+        *read_len = 0;
+        return ESP_OK;
+    }
+
+    if (!block_group->compressed) {
+        memcpy(data, block_group->stored_data + reader->offset, len);
+    } else {
+        reader->strm.next_out = data;
+        reader->strm.avail_out = len;
+        int ret = inflate(&reader->strm, Z_SYNC_FLUSH);
+        if ((ret != Z_OK && ret != Z_STREAM_END) || reader->strm.avail_out != 0) {
+            ESP_LOGE(TAG, "Unable to inflate block data: %d", ret);
+            return ESP_FAIL;
+        }
+    }
+
+    reader->offset += len;
+    *read_len = len;
+    return ESP_OK;
+}
+
+void vgm_data_block_reader_free(vgm_data_block_reader_t *reader)
+{
+    if (reader) {
+        if (reader->block_group->compressed) {
+            inflateEnd(&reader->strm);
+        }
+        free(reader);
+    }
+}
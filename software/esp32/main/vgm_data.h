@@ -13,6 +13,7 @@ typedef struct vgm_data_state_t vgm_data_state_t;
 typedef struct vgm_data_block_group_t vgm_data_block_group_t;
 typedef struct vgm_data_block_ref_t vgm_data_block_ref_t;
 typedef struct vgm_data_block_ref_node_t vgm_data_block_ref_node_t;
+typedef struct vgm_data_block_reader_t vgm_data_block_reader_t;
 
 vgm_data_t* vgm_data_create();
 
@@ -47,9 +48,17 @@ void vgm_data_block_ref_free(vgm_data_block_ref_t *block_ref);
 
 uint16_t vgm_data_block_group_block_size(const vgm_data_block_group_t *block_group);
 uint16_t vgm_data_block_group_byte_size(const vgm_data_block_group_t *block_group);
-uint8_t *vgm_data_block_group_raw_data(const vgm_data_block_group_t *block_group);
+uint16_t vgm_data_block_group_stored_size(const vgm_data_block_group_t *block_group);
 uint8_t vgm_data_block_group_get_loaded_block(const vgm_data_block_group_t *block_group);
 void vgm_data_block_group_set_loaded_block(vgm_data_block_group_t *block_group, uint8_t loaded_block);
 vgm_data_block_ref_node_t* vgm_data_block_group_ref_list(const vgm_data_block_group_t *block_group);
 
+/*
+ * Block group data is stored compressed, so it has to be read back
+ * through a reader that inflates it a chunk at a time.
+ */
+esp_err_t vgm_data_block_reader_open(vgm_data_block_reader_t **reader, const vgm_data_block_group_t *block_group);
+esp_err_t vgm_data_block_reader_read(vgm_data_block_reader_t *reader, uint8_t *data, size_t len, size_t *read_len);
+void vgm_data_block_reader_free(vgm_data_block_reader_t *reader);
+
 #endif /* VGM_DATA_H */
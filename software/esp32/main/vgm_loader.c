@@ -0,0 +1,239 @@
+#include "vgm_loader.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "board_config.h"
+#include "i2c_bus.h"
+#include "nes.h"
+#include "playback_stats.h"
+
+static const char *TAG = "vgm_loader";
+
+/* Bytes in one APU sample block, which is the unit of each upload */
+#define LOADER_BLOCK_BYTES 64
+
+/* Starting guess for the time it takes to upload one block */
+#define LOADER_INITIAL_BLOCK_COST 3500
+
+/* Extra time left at the end of an idle window */
+#define LOADER_MARGIN 250
+
+/* Should be below the playback task, so it only runs while that sleeps */
+#define LOADER_TASK_PRIORITY 4
+
+struct vgm_loader_t {
+    TaskHandle_t task;
+    SemaphoreHandle_t exit_sem;
+    portMUX_TYPE lock;
+    volatile bool running;
+    uint32_t generation;
+    uint8_t starting_block;
+    const vgm_data_block_group_t *block_group;
+    bool busy;
+    int64_t idle_until;
+    int64_t block_cost;
+};
+
+static void vgm_loader_finish(vgm_loader_t *loader, uint32_t generation)
+{
+    portENTER_CRITICAL(&loader->lock);
+    if (loader->generation == generation) {
+        loader->busy = false;
+    }
+    portEXIT_CRITICAL(&loader->lock);
+}
+
+static void vgm_loader_task(void *pvParameters)
+{
+    vgm_loader_t *loader = (vgm_loader_t *)pvParameters;
+    uint32_t generation = 0;
+    uint8_t starting_block = 0;
+    const vgm_data_block_group_t *block_group = NULL;
+    vgm_data_block_reader_t *reader = NULL;
+    uint8_t data[LOADER_BLOCK_BYTES];
+    size_t len = 0;
+    size_t offset = 0;
+
+    while (loader->running) {
+        // Pick up the most recent request, and the current idle window
+        bool restart = false;
+        portENTER_CRITICAL(&loader->lock);
+        if (loader->generation != generation) {
+            generation = loader->generation;
+            starting_block = loader->starting_block;
+            block_group = loader->block_group;
+            restart = true;
+        }
+        int64_t idle_until = loader->idle_until;
+        portEXIT_CRITICAL(&loader->lock);
+
+        if (restart) {
+            vgm_data_block_reader_free(reader);
+            reader = NULL;
+            len = vgm_data_block_group_byte_size(block_group);
+            offset = 0;
+            if (vgm_data_block_reader_open(&reader, block_group) != ESP_OK) {
+                ESP_LOGE(TAG, "Unable to read block group");
+                offset = len;
+                vgm_loader_finish(loader, generation);
+            }
+        }
+
+        if (!reader || offset >= len) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        // Only start a block if it will finish before playback needs the bus
+        if (esp_timer_get_time() + loader->block_cost + LOADER_MARGIN > idle_until) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        size_t chunk_len;
+        uint8_t block = starting_block + (offset / LOADER_BLOCK_BYTES);
+        esp_err_t ret = vgm_data_block_reader_read(reader, data, sizeof(data), &chunk_len);
+        if (ret != ESP_OK || chunk_len == 0) {
+            ESP_LOGE(TAG, "Unable to read block group");
+            offset = len;
+            vgm_loader_finish(loader, generation);
+            continue;
+        }
+
+        int64_t time0 = esp_timer_get_time();
+        i2c_bus_lock(I2C_BUS_BULK, 0);
+        ret = nes_data_write(I2C_P0_NUM, block, data, chunk_len);
+        i2c_bus_unlock();
+        int64_t time1 = esp_timer_get_time();
+
+        // Track the block cost, reacting quickly to slower uploads
+        int64_t cost = time1 - time0;
+        if (cost > loader->block_cost) {
+            loader->block_cost = cost;
+        } else {
+            loader->block_cost = ((loader->block_cost * 7) + cost) / 8;
+        }
+
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Unable to load data block");
+            offset = len;
+        } else {
+            if (cost > 0) {
+                playback_stats_record(PLAYBACK_STATS_DMC_UPLOAD, (uint32_t)((chunk_len * 1000000LL) / cost));
+            }
+            playback_stats_add(PLAYBACK_STATS_DMC_BYTES, chunk_len);
+            offset += chunk_len;
+        }
+
+        if (offset >= len) {
+            vgm_loader_finish(loader, generation);
+        }
+    }
+
+    vgm_data_block_reader_free(reader);
+    xSemaphoreGive(loader->exit_sem);
+    vTaskDelete(NULL);
+}
+
+esp_err_t vgm_loader_init(vgm_loader_t **loader)
+{
+    esp_err_t ret = ESP_OK;
+    vgm_loader_t *loader_result = NULL;
+
+    do {
+        loader_result = malloc(sizeof(vgm_loader_t));
+        if (!loader_result) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        bzero(loader_result, sizeof(vgm_loader_t));
+        portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+        loader_result->lock = lock;
+        loader_result->block_cost = LOADER_INITIAL_BLOCK_COST;
+        loader_result->running = true;
+
+        loader_result->exit_sem = xSemaphoreCreateBinary();
+        if (!loader_result->exit_sem) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        if (xTaskCreate(vgm_loader_task, "vgm_loader_task", 3072, loader_result,
+                LOADER_TASK_PRIORITY, &loader_result->task) != pdPASS) {
+            loader_result->task = NULL;
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+    } while (0);
+
+    if (ret == ESP_OK) {
+        *loader = loader_result;
+    } else {
+        vgm_loader_free(loader_result);
+    }
+
+    return ret;
+}
+
+esp_err_t vgm_loader_start(vgm_loader_t *loader, uint8_t starting_block,
+        const vgm_data_block_group_t *block_group)
+{
+    if (!block_group || vgm_data_block_group_byte_size(block_group) == 0 || starting_block < 8
+            || starting_block + (vgm_data_block_group_block_size(block_group) - 1) > 127) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    portENTER_CRITICAL(&loader->lock);
+    loader->generation++;
+    loader->starting_block = starting_block;
+    loader->block_group = block_group;
+    loader->busy = true;
+    portEXIT_CRITICAL(&loader->lock);
+
+    xTaskNotifyGive(loader->task);
+    return ESP_OK;
+}
+
+bool vgm_loader_is_busy(vgm_loader_t *loader)
+{
+    portENTER_CRITICAL(&loader->lock);
+    bool busy = loader->busy;
+    portEXIT_CRITICAL(&loader->lock);
+    return busy;
+}
+
+void vgm_loader_set_idle_until(vgm_loader_t *loader, int64_t idle_until)
+{
+    portENTER_CRITICAL(&loader->lock);
+    loader->idle_until = idle_until;
+    bool busy = loader->busy;
+    portEXIT_CRITICAL(&loader->lock);
+
+    if (busy && idle_until > 0) {
+        xTaskNotifyGive(loader->task);
+    }
+}
+
+void vgm_loader_free(vgm_loader_t *loader)
+{
+    if (loader) {
+        if (loader->task) {
+            loader->running = false;
+            xTaskNotifyGive(loader->task);
+            xSemaphoreTake(loader->exit_sem, portMAX_DELAY);
+        }
+        if (loader->exit_sem) {
+            vSemaphoreDelete(loader->exit_sem);
+        }
+        free(loader);
+    }
+}
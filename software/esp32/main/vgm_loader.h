@@ -0,0 +1,50 @@
+/*
+ * Background DMC sample loader
+ *
+ * Uploads sample data to the 2A03 from a separate, lower priority task,
+ * one APU block at a time. Uploads only start within the idle windows
+ * announced by the playback task, and only if the measured cost of a
+ * block fits in the time remaining, so playback register writes never
+ * have to wait behind a sample upload.
+ */
+
+#ifndef VGM_LOADER_H
+#define VGM_LOADER_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+#include "vgm_data.h"
+
+typedef struct vgm_loader_t vgm_loader_t;
+
+esp_err_t vgm_loader_init(vgm_loader_t **loader);
+
+/**
+ * Start loading a block group into the 2A03, replacing any load in progress.
+ *
+ * The block group must remain valid until the load completes, is
+ * replaced, or the loader is freed.
+ *
+ * @param starting_block Block to load the data at
+ * @param block_group Block group to load
+ */
+esp_err_t vgm_loader_start(vgm_loader_t *loader, uint8_t starting_block,
+        const vgm_data_block_group_t *block_group);
+
+/**
+ * Check whether the most recent load is still in progress.
+ */
+bool vgm_loader_is_busy(vgm_loader_t *loader);
+
+/**
+ * Tell the loader that the bus is free until the provided time,
+ * as returned by esp_timer_get_time().
+ *
+ * A value of zero means that the playback task needs the bus now.
+ */
+void vgm_loader_set_idle_until(vgm_loader_t *loader, int64_t idle_until);
+
+void vgm_loader_free(vgm_loader_t *loader);
+
+#endif /* VGM_LOADER_H */
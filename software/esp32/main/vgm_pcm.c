@@ -0,0 +1,198 @@
+#include "vgm_pcm.h"
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "board_config.h"
+#include "i2c_bus.h"
+#include "nes.h"
+#include "playback_stats.h"
+
+static const char *TAG = "vgm_pcm";
+
+/* Stream rate, in Hz, which is one sample for every 8 VGM samples */
+#define VGM_PCM_RATE 5512
+
+/* Samples sent to the 2A03 in each transaction */
+#define VGM_PCM_CHUNK 16
+
+/* Most time between $4011 writes for them to count towards a run */
+#define VGM_PCM_DENSE_US 1000
+
+/* Run of close together $4011 writes that starts the stream */
+#define VGM_PCM_RUN_MIN 32
+
+/* Time without any $4011 writes that ends the stream */
+#define VGM_PCM_IDLE_US 250000
+
+struct vgm_pcm_t {
+    bool enabled;
+    bool failed;
+    bool streaming;
+    uint32_t run;
+    int64_t last_write_us;
+    int64_t start_us;
+    uint32_t produced;
+    uint8_t level;
+    uint8_t chunk[VGM_PCM_CHUNK];
+    size_t chunk_len;
+};
+
+esp_err_t vgm_pcm_init(vgm_pcm_t **pcm)
+{
+    if (!pcm) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    vgm_pcm_t *pcm_result = malloc(sizeof(vgm_pcm_t));
+    if (!pcm_result) {
+        return ESP_ERR_NO_MEM;
+    }
+    bzero(pcm_result, sizeof(vgm_pcm_t));
+
+    *pcm = pcm_result;
+    return ESP_OK;
+}
+
+static esp_err_t vgm_pcm_send(vgm_pcm_t *pcm)
+{
+    if (pcm->chunk_len == 0) {
+        return ESP_OK;
+    }
+
+    i2c_bus_lock(I2C_BUS_APU, 0);
+    esp_err_t ret = nes_pcm_write(I2C_P0_NUM, pcm->chunk, pcm->chunk_len);
+    i2c_bus_unlock();
+
+    if (ret == ESP_OK) {
+        playback_stats_add(PLAYBACK_STATS_PCM_SAMPLES, pcm->chunk_len);
+    }
+    pcm->chunk_len = 0;
+    return ret;
+}
+
+/*
+ * Put the 2A03 into PCM mode, the first time a stream starts.
+ */
+static esp_err_t vgm_pcm_enable(vgm_pcm_t *pcm)
+{
+    esp_err_t ret;
+
+    i2c_bus_lock(I2C_BUS_APU, 0);
+    ret = nes_set_config(I2C_P0_NUM, NES_CONFIG_INCREMENT | NES_CONFIG_PCM);
+    if (ret == ESP_OK) {
+        ret = nes_pcm_set_rate(I2C_P0_NUM, VGM_PCM_RATE);
+    }
+    i2c_bus_unlock();
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to enable PCM mode");
+        pcm->failed = true;
+        return ret;
+    }
+
+    pcm->enabled = true;
+    return ESP_OK;
+}
+
+bool vgm_pcm_write(vgm_pcm_t *pcm, int64_t time_us, uint8_t dat)
+{
+    if (!pcm) {
+        return false;
+    }
+
+    // Samples up to this write still hold the previous level
+    vgm_pcm_advance(pcm, time_us);
+
+    if (pcm->streaming) {
+        pcm->level = dat;
+        pcm->last_write_us = time_us;
+        return true;
+    }
+
+    if (pcm->run > 0 && (time_us - pcm->last_write_us) <= VGM_PCM_DENSE_US) {
+        pcm->run++;
+    } else {
+        pcm->run = 1;
+    }
+    pcm->last_write_us = time_us;
+
+    if (pcm->run < VGM_PCM_RUN_MIN || pcm->failed) {
+        return false;
+    }
+    if (!pcm->enabled && vgm_pcm_enable(pcm) != ESP_OK) {
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Streaming $4011 writes");
+    pcm->streaming = true;
+    pcm->start_us = time_us;
+    pcm->produced = 0;
+    pcm->level = dat;
+    pcm->chunk_len = 0;
+    return true;
+}
+
+bool vgm_pcm_is_streaming(const vgm_pcm_t *pcm)
+{
+    return pcm && pcm->streaming;
+}
+
+void vgm_pcm_advance(vgm_pcm_t *pcm, int64_t time_us)
+{
+    if (!pcm || !pcm->streaming) {
+        return;
+    }
+
+    // The stream only runs on for a while past the last write
+    bool finished = (time_us - pcm->last_write_us) > VGM_PCM_IDLE_US;
+    if (finished) {
+        time_us = pcm->last_write_us + VGM_PCM_IDLE_US;
+    }
+
+    while (pcm->start_us + (((int64_t)pcm->produced * 1000000) / VGM_PCM_RATE) <= time_us) {
+        pcm->chunk[pcm->chunk_len++] = pcm->level;
+        pcm->produced++;
+        if (pcm->chunk_len == VGM_PCM_CHUNK && vgm_pcm_send(pcm) != ESP_OK) {
+            // Go back to writing $4011 directly
+            pcm->failed = true;
+            finished = true;
+            break;
+        }
+    }
+
+    if (finished) {
+        vgm_pcm_send(pcm);
+        pcm->streaming = false;
+        pcm->run = 0;
+        ESP_LOGI(TAG, "Finished streaming $4011 writes");
+    }
+}
+
+void vgm_pcm_stop(vgm_pcm_t *pcm)
+{
+    if (!pcm) {
+        return;
+    }
+
+    pcm->streaming = false;
+    pcm->run = 0;
+    pcm->chunk_len = 0;
+
+    if (pcm->enabled) {
+        i2c_bus_lock(I2C_BUS_APU, 0);
+        nes_set_config(I2C_P0_NUM, NES_CONFIG_INCREMENT);
+        i2c_bus_unlock();
+        pcm->enabled = false;
+    }
+}
+
+void vgm_pcm_free(vgm_pcm_t *pcm)
+{
+    if (!pcm) {
+        return;
+    }
+    free(pcm);
+}
@@ -0,0 +1,62 @@
+/*
+ * $4011 PCM streaming for VGM playback
+ *
+ * Tracks that play samples through the raw DAC write $4011 thousands
+ * of times per second, and each of those writes is otherwise its own
+ * transaction that has to reach the 2A03 on time. This watches the
+ * $4011 writes going by, and once they come close enough together,
+ * takes them over. The level last written is then sampled at a fixed
+ * stream rate, and sent to the PCM buffer of the 2A03 in chunks, which
+ * plays them out on its own cycle-counted timing.
+ *
+ * Streamed samples play back later than the writes around them, by
+ * the level the 2A03 keeps its buffer at and up to one chunk.
+ */
+
+#ifndef VGM_PCM_H
+#define VGM_PCM_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+/* Longest the stream can go without being advanced, in microseconds */
+#define VGM_PCM_ADVANCE_US 2000
+
+typedef struct vgm_pcm_t vgm_pcm_t;
+
+esp_err_t vgm_pcm_init(vgm_pcm_t **pcm);
+
+/**
+ * Handle a write to $4011 at the provided playback time.
+ *
+ * @param time_us Playback position, in microseconds
+ * @param dat Value written
+ * @return true if the write was taken over by the stream, and must not
+ *         be sent to the APU
+ */
+bool vgm_pcm_write(vgm_pcm_t *pcm, int64_t time_us, uint8_t dat);
+
+/**
+ * Check whether $4011 writes are being streamed, in which case the
+ * stream has to be advanced at least every VGM_PCM_ADVANCE_US.
+ */
+bool vgm_pcm_is_streaming(const vgm_pcm_t *pcm);
+
+/**
+ * Move the stream up to the provided playback time, sending any full
+ * chunks of samples.
+ *
+ * The stream ends by itself once $4011 has gone unwritten for a while.
+ */
+void vgm_pcm_advance(vgm_pcm_t *pcm, int64_t time_us);
+
+/**
+ * End the stream, and take the 2A03 back out of PCM mode, which drops
+ * anything still in its buffer. This is for seeking, and for the end
+ * of playback.
+ */
+void vgm_pcm_stop(vgm_pcm_t *pcm);
+
+void vgm_pcm_free(vgm_pcm_t *pcm);
+
+#endif /* VGM_PCM_H */
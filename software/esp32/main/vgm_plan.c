@@ -0,0 +1,268 @@
+#include "vgm_plan.h"
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_types.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uthash.h"
+
+static const char *TAG = "vgm_plan";
+
+/* Next use index for groups that are never referenced again */
+#define PLAN_NEVER UINT32_MAX
+
+struct vgm_plan_t {
+    vgm_plan_step_t *steps;
+    size_t step_count;
+    uint32_t preload_count;
+    uint32_t load_count;
+    uint32_t load_blocks;
+    uint32_t skip_count;
+};
+
+typedef struct {
+    const void *group;
+    uint32_t next_use;
+    uint16_t block_size;
+    uint8_t block;
+    UT_hash_handle hh;
+} vgm_plan_group_t;
+
+typedef struct {
+    uint32_t min_next_use;
+    uint32_t used_blocks;
+    uint32_t evict_count;
+} vgm_plan_range_cost_t;
+
+/*
+ * Work out what it would cost to place a group at the provided block.
+ *
+ * Every group overlapping the range gets evicted in full. The range is
+ * rated by the soonest next use of any evicted group, and then by how
+ * many blocks of still-needed data it would throw away.
+ */
+static bool vgm_plan_range_cost(vgm_plan_group_t **load_map, uint8_t start, uint16_t size,
+        const vgm_plan_group_t *active_group, vgm_plan_range_cost_t *cost)
+{
+    cost->min_next_use = PLAN_NEVER;
+    cost->used_blocks = 0;
+    cost->evict_count = 0;
+
+    uint16_t i = start;
+    while (i < start + size) {
+        vgm_plan_group_t *group = load_map[i];
+        if (!group) {
+            i++;
+            continue;
+        }
+
+        // The previous sample may still be playing
+        if (group == active_group) {
+            return false;
+        }
+
+        if (group->next_use < cost->min_next_use) {
+            cost->min_next_use = group->next_use;
+        }
+        if (group->next_use != PLAN_NEVER) {
+            cost->used_blocks += group->block_size;
+        }
+        cost->evict_count++;
+
+        i = group->block + group->block_size;
+    }
+
+    return true;
+}
+
+static bool vgm_plan_range_is_better(const vgm_plan_range_cost_t *a, const vgm_plan_range_cost_t *b)
+{
+    if (a->min_next_use != b->min_next_use) {
+        return a->min_next_use > b->min_next_use;
+    }
+    if (a->used_blocks != b->used_blocks) {
+        return a->used_blocks < b->used_blocks;
+    }
+    return a->evict_count < b->evict_count;
+}
+
+static void vgm_plan_unload_group(vgm_plan_group_t **load_map, vgm_plan_group_t *group)
+{
+    for (uint16_t i = group->block; i < group->block + group->block_size; i++) {
+        load_map[i] = NULL;
+    }
+    group->block = 0;
+}
+
+esp_err_t vgm_plan_build(vgm_plan_t **plan, const vgm_plan_ref_t *refs, size_t ref_count,
+        uint8_t block_min, uint8_t block_max)
+{
+    esp_err_t ret = ESP_OK;
+    vgm_plan_t *plan_result = NULL;
+    vgm_plan_group_t *groups = NULL;
+    vgm_plan_group_t *group;
+    vgm_plan_group_t *tmp_group;
+    vgm_plan_group_t *load_map[256] = { 0 };
+    uint32_t *next_use = NULL;
+
+    if (!plan || (!refs && ref_count > 0) || block_min == 0 || block_max < block_min) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    do {
+        plan_result = malloc(sizeof(vgm_plan_t));
+        if (!plan_result) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+        bzero(plan_result, sizeof(vgm_plan_t));
+
+        if (ref_count == 0) {
+            break;
+        }
+
+        plan_result->steps = calloc(ref_count, sizeof(vgm_plan_step_t));
+        next_use = malloc(ref_count * sizeof(uint32_t));
+        if (!plan_result->steps || !next_use) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+        plan_result->step_count = ref_count;
+
+        // Walk the references backwards to find when each one's group
+        // is needed next, leaving every group pointing at its first use
+        for (size_t i = ref_count; i > 0; i--) {
+            const vgm_plan_ref_t *ref = &refs[i - 1];
+            HASH_FIND_PTR(groups, &ref->group, group);
+            if (!group) {
+                group = malloc(sizeof(vgm_plan_group_t));
+                if (!group) {
+                    ret = ESP_ERR_NO_MEM;
+                    break;
+                }
+                bzero(group, sizeof(vgm_plan_group_t));
+                group->group = ref->group;
+                group->next_use = PLAN_NEVER;
+                group->block_size = ref->block_size;
+                HASH_ADD_PTR(groups, group, group);
+            }
+            next_use[i - 1] = group->next_use;
+            group->next_use = i - 1;
+        }
+        if (ret != ESP_OK) {
+            break;
+        }
+
+        const uint16_t window_size = (block_max - block_min) + 1;
+        vgm_plan_group_t *active_group = NULL;
+        bool preloading = true;
+
+        for (size_t i = 0; i < ref_count; i++) {
+            vgm_plan_step_t *step = &plan_result->steps[i];
+            HASH_FIND_PTR(groups, &refs[i].group, group);
+
+            if (group->block > 0) {
+                step->block = group->block;
+                step->action = VGM_PLAN_RESIDENT;
+            } else if (group->block_size == 0 || group->block_size > window_size) {
+                step->block = 0;
+                step->action = VGM_PLAN_SKIP;
+                plan_result->skip_count++;
+            } else {
+                // Find the contiguous range that is cheapest to evict,
+                // preferring the lowest one to keep free space together
+                vgm_plan_range_cost_t best_cost;
+                uint8_t best_start = 0;
+                for (uint16_t start = block_min; start + group->block_size - 1 <= block_max; start++) {
+                    vgm_plan_range_cost_t cost;
+                    if (!vgm_plan_range_cost(load_map, start, group->block_size, active_group, &cost)) {
+                        continue;
+                    }
+                    if (best_start == 0 || vgm_plan_range_is_better(&cost, &best_cost)) {
+                        best_start = start;
+                        best_cost = cost;
+                    }
+                }
+
+                if (best_start == 0) {
+                    step->block = 0;
+                    step->action = VGM_PLAN_SKIP;
+                    plan_result->skip_count++;
+                } else {
+                    for (uint16_t j = best_start; j < best_start + group->block_size; j++) {
+                        if (load_map[j]) {
+                            vgm_plan_unload_group(load_map, load_map[j]);
+                        }
+                    }
+                    for (uint16_t j = best_start; j < best_start + group->block_size; j++) {
+                        load_map[j] = group;
+                    }
+                    group->block = best_start;
+
+                    // Everything that fits before the first eviction can
+                    // be loaded ahead of playback
+                    if (best_cost.evict_count > 0) {
+                        preloading = false;
+                    }
+
+                    step->block = best_start;
+                    if (preloading) {
+                        step->action = VGM_PLAN_PRELOAD;
+                        plan_result->preload_count++;
+                    } else {
+                        step->action = VGM_PLAN_LOAD;
+                        plan_result->load_count++;
+                        plan_result->load_blocks += group->block_size;
+                    }
+                }
+            }
+
+            group->next_use = next_use[i];
+            active_group = group;
+        }
+    } while (0);
+
+    HASH_ITER(hh, groups, group, tmp_group) {
+        HASH_DEL(groups, group);
+        free(group);
+    }
+    free(next_use);
+
+    if (ret == ESP_OK) {
+        *plan = plan_result;
+    } else {
+        vgm_plan_free(plan_result);
+    }
+
+    return ret;
+}
+
+size_t vgm_plan_step_count(const vgm_plan_t *plan)
+{
+    return plan->step_count;
+}
+
+const vgm_plan_step_t *vgm_plan_get_step(const vgm_plan_t *plan, size_t index)
+{
+    if (index >= plan->step_count) {
+        return NULL;
+    }
+    return &plan->steps[index];
+}
+
+void vgm_plan_log_summary(const vgm_plan_t *plan)
+{
+    ESP_LOGI(TAG, "Plan: refs=%d, preloads=%u, loads=%u, blocks=%u, skipped=%u",
+            (int)plan->step_count, plan->preload_count,
+            plan->load_count, plan->load_blocks, plan->skip_count);
+}
+
+void vgm_plan_free(vgm_plan_t *plan)
+{
+    if (plan) {
+        free(plan->steps);
+        free(plan);
+    }
+}
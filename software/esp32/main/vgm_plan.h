@@ -0,0 +1,61 @@
+/*
+ * DMC sample placement planner
+ *
+ * Works out ahead of playback where each referenced block group should
+ * live within the sample window of the 2A03, and when it needs to be
+ * loaded. Since the whole reference timeline is known in advance, the
+ * planner evicts whichever loaded groups are needed again furthest in
+ * the future, while keeping every group in one contiguous range.
+ */
+
+#ifndef VGM_PLAN_H
+#define VGM_PLAN_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+typedef enum {
+    VGM_PLAN_RESIDENT = 0, /*!< Still loaded from an earlier reference */
+    VGM_PLAN_PRELOAD,      /*!< Loaded before playback starts */
+    VGM_PLAN_LOAD,         /*!< Loaded once the previous reference has been played */
+    VGM_PLAN_SKIP          /*!< Does not fit in the sample window */
+} vgm_plan_action_t;
+
+typedef struct {
+    const void *group;     /*!< Block group being referenced */
+    uint16_t block_size;   /*!< Size of the block group, in APU blocks */
+} vgm_plan_ref_t;
+
+typedef struct {
+    uint8_t block;         /*!< Location of the group for this reference */
+    uint8_t action;        /*!< One of vgm_plan_action_t */
+} vgm_plan_step_t;
+
+typedef struct vgm_plan_t vgm_plan_t;
+
+/**
+ * Build a placement plan for a list of sample references.
+ *
+ * @param refs References, in playback order
+ * @param ref_count Number of references
+ * @param block_min First APU block available for samples
+ * @param block_max Last APU block available for samples
+ */
+esp_err_t vgm_plan_build(vgm_plan_t **plan, const vgm_plan_ref_t *refs, size_t ref_count,
+        uint8_t block_min, uint8_t block_max);
+
+size_t vgm_plan_step_count(const vgm_plan_t *plan);
+
+/**
+ * Get the plan step for the reference at the provided index.
+ */
+const vgm_plan_step_t *vgm_plan_get_step(const vgm_plan_t *plan, size_t index);
+
+/**
+ * Log the number of loads, and blocks loaded, required by the plan.
+ */
+void vgm_plan_log_summary(const vgm_plan_t *plan);
+
+void vgm_plan_free(vgm_plan_t *plan);
+
+#endif /* VGM_PLAN_H */
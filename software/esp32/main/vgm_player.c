@@ -1,25 +1,43 @@
 #include "vgm_player.h"
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <esp_types.h>
+#include <string.h>
 #include <sys/param.h>
 #include <sys/unistd.h>
 
 #include "vgm.h"
 #include "nes_player.h"
 #include "vgm_data.h"
+#include "vgm_cache.h"
+#include "vgm_loader.h"
+#include "vgm_plan.h"
+#include "vgm_pcm.h"
 #include "utarray.h"
 #include "board_config.h"
-#include "i2c_util.h"
+#include "i2c_bus.h"
 #include "nes.h"
+#include "nes_async.h"
+#include "playback_clock.h"
+#include "playback_stats.h"
 
 static const char *TAG = "vgm_player";
 
 #define BLOCK_LOAD_MIN 8
 #define BLOCK_LOAD_MAX 127
 
+/* Period of the 2A03 frame counter, in microseconds (29830 cycles) */
+#define QUEUE_FRAME_US 16667
+
+/* Convert a position in 44.1 kHz VGM samples into microseconds */
+#define VGM_SAMPLES_TO_US(samples) ((((int64_t)(samples)) * 1000000) / 44100)
+
 typedef struct vgm_player_t {
+    char *filename;
     vgm_file_t *vgm_file;
     vgm_gd3_tags_t *tags;
     nes_playback_cb_t playback_cb;
@@ -27,22 +45,23 @@ typedef struct vgm_player_t {
     EventGroupHandle_t event_group;
     bool has_data_block;
     vgm_data_state_t *data_state;
+    vgm_plan_t *plan;
+    vgm_cache_t *cache;
 } vgm_player_t;
 
 typedef struct {
-    uint8_t loaded_block;
-    uint16_t block_size;
-    uint32_t cost;
-} vgm_data_block_segment_t;
+    uint32_t event_index;
+    uint32_t ref_index;
+} vgm_cache_patch_t;
 
-UT_icd vgm_data_block_segment_icd = {sizeof(vgm_data_block_segment_t), NULL, NULL, NULL};
 UT_icd uint8_icd = {sizeof(uint8_t), NULL, NULL, NULL};
+UT_icd vgm_cache_patch_icd = {sizeof(vgm_cache_patch_t), NULL, NULL, NULL};
 
-static UT_array* vgm_player_build_segment_list(
-        vgm_data_block_ref_t *last_block_ref,
-        uint32_t sample_time, vgm_data_block_group_t *load_map[]);
-static UT_array* vgm_player_find_eviction_candiates(
-        UT_array *segments, uint32_t block_size);
+static esp_err_t vgm_player_build_plan(vgm_player_t *player);
+static esp_err_t vgm_player_finish_cache(vgm_player_t *player,
+        vgm_cache_writer_t *writer, UT_array *patches);
+static esp_err_t vgm_player_play_cache_loop(vgm_player_t *player);
+static esp_err_t vgm_player_play_queue_loop(vgm_player_t *player);
 
 esp_err_t vgm_player_init(vgm_player_t **player,
         const char *filename,
@@ -65,6 +84,12 @@ esp_err_t vgm_player_init(vgm_player_t **player,
         player_result->repeat = repeat;
         player_result->event_group = event_group;
 
+        player_result->filename = strdup(filename);
+        if (!player_result->filename) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
         ESP_LOGI(TAG, "Opening file: %s", filename);
         ret = vgm_open(&player_result->vgm_file, filename);
         if (ret != ESP_OK) {
@@ -103,6 +128,13 @@ const vgm_gd3_tags_t *vgm_player_get_gd3_tags(const vgm_player_t *player)
 
 esp_err_t vgm_player_prepare(vgm_player_t *player)
 {
+    // Skip the scan entirely if a previous one left a usable event stream
+    if (vgm_cache_open(&player->cache, player->filename) == ESP_OK) {
+        ESP_LOGI(TAG, "Using cached event stream");
+        player->has_data_block = vgm_cache_has_dmc(player->cache);
+        return ESP_OK;
+    }
+
     ESP_LOGI(TAG, "Scanning file");
 
     vgm_command_t command;
@@ -113,10 +145,29 @@ esp_err_t vgm_player_prepare(vgm_player_t *player)
     uint16_t current_len = 0;
     bool mod_dirty = false;
 
+    // Collect the event stream cache alongside the scan. If it cannot be
+    // created, playback simply falls back to parsing the file.
+    vgm_cache_writer_t *writer = NULL;
+    if (vgm_cache_writer_create(&writer, player->filename) != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to create event stream cache");
+        writer = NULL;
+    }
+    const uint32_t loop_offset = vgm_get_header(player->vgm_file)->loop_offset;
+    bool loop_marked = false;
+    bool scan_complete = false;
+    uint32_t ref_count = 0;
+    UT_array *pending_modaddr;
+    UT_array *patches;
+    utarray_new(pending_modaddr, &ut_int_icd);
+    utarray_new(patches, &vgm_cache_patch_icd);
+
     // Allocate the state structure for playback VGM data blocks
     player->data_state = vgm_data_state_create();
     if (!player->data_state) {
         ESP_LOGE(TAG, "Unable to allocate VGM data state");
+        vgm_cache_writer_abort(writer);
+        utarray_free(pending_modaddr);
+        utarray_free(patches);
         return ESP_ERR_NO_MEM;
     }
 
@@ -124,6 +175,9 @@ esp_err_t vgm_player_prepare(vgm_player_t *player)
     vgm_data_t *vgm_data = vgm_data_create();
     if (!vgm_data) {
         ESP_LOGE(TAG, "Unable to allocate VGM data map");
+        vgm_cache_writer_abort(writer);
+        utarray_free(pending_modaddr);
+        utarray_free(patches);
         return ESP_ERR_NO_MEM;
     }
 
@@ -132,6 +186,12 @@ esp_err_t vgm_player_prepare(vgm_player_t *player)
             break;
         }
 
+        if (writer && loop_offset > 0 && !loop_marked
+                && vgm_get_offset(player->vgm_file) >= loop_offset) {
+            vgm_cache_writer_set_loop(writer, sample_time);
+            loop_marked = true;
+        }
+
         if (vgm_next_command(player->vgm_file, &command, /*load_data*/true) != ESP_OK) {
             break;
         }
@@ -167,6 +227,15 @@ esp_err_t vgm_player_prepare(vgm_player_t *player)
             free(command.info.data_block.data);
         }
         else if (command.type == VGM_CMD_NES_APU) {
+            if (writer) {
+                uint32_t index = vgm_cache_writer_add_write(writer, sample_time,
+                        command.info.nes_apu.reg, command.info.nes_apu.dat);
+                if (command.info.nes_apu.reg == NES_APU_MODADDR) {
+                    int pending_index = index;
+                    utarray_push_back(pending_modaddr, &pending_index);
+                }
+            }
+
             if (command.info.nes_apu.reg == NES_APU_MODADDR) {
                 current_block = command.info.nes_apu.dat;
                 mod_dirty = true;
@@ -193,6 +262,24 @@ esp_err_t vgm_player_prepare(vgm_player_t *player)
                 ESP_LOGI(TAG, "Unable to add sample reference");
                 break;
             }
+
+            // Address writes in this group get remapped to wherever
+            // the referenced block group ends up being loaded.
+            int *pending_index;
+            for(pending_index = (int*)utarray_front(pending_modaddr);
+                    pending_index != NULL;
+                    pending_index = (int*)utarray_next(pending_modaddr, pending_index)) {
+                vgm_cache_patch_t patch = {
+                    .event_index = *pending_index,
+                    .ref_index = ref_count
+                };
+                utarray_push_back(patches, &patch);
+            }
+            ref_count++;
+        }
+
+        if (command.type == VGM_CMD_WAIT || command.type == VGM_CMD_DONE) {
+            utarray_clear(pending_modaddr);
         }
 
         // Handle commands that should be processed after a command group
@@ -201,11 +288,17 @@ esp_err_t vgm_player_prepare(vgm_player_t *player)
         }
         else if (command.type == VGM_CMD_DONE) {
             ESP_LOGI(TAG, "At end of data tag");
+            scan_complete = true;
             break;
         }
     }
 
     vgm_data_free(vgm_data);
+    utarray_free(pending_modaddr);
+
+    if (writer && scan_complete) {
+        vgm_cache_writer_set_end(writer, sample_time);
+    }
 
     if (!vgm_data_state_has_refs(player->data_state)) {
         if (player->has_data_block) {
@@ -220,28 +313,231 @@ esp_err_t vgm_player_prepare(vgm_player_t *player)
         vgm_data_state_log_block_groups(player->data_state);
     }
 
+    if (writer && scan_complete) {
+        if (vgm_player_finish_cache(player, writer, patches) == ESP_OK) {
+            ESP_LOGI(TAG, "Using new event stream cache");
+        }
+    } else {
+        vgm_cache_writer_abort(writer);
+    }
+    utarray_free(patches);
+
+    // Plan sample loading for anything the cache could not take over
+    if (player->data_state) {
+        esp_err_t ret = vgm_player_build_plan(player);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Unable to plan sample loading");
+            return ret;
+        }
+    }
+
     vgm_seek_restart(player->vgm_file);
 
     return ESP_OK;
 }
 
+/*
+ * Work out where, and when, every referenced block group gets loaded
+ * during playback.
+ */
+esp_err_t vgm_player_build_plan(vgm_player_t *player)
+{
+    size_t ref_count = 0;
+    vgm_data_block_ref_node_t *node = vgm_data_state_ref_list(player->data_state);
+    while (node) {
+        ref_count++;
+        node = vgm_data_block_ref_list_next(node);
+    }
+
+    vgm_plan_ref_t *refs = malloc(ref_count * sizeof(vgm_plan_ref_t));
+    if (!refs) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    size_t i = 0;
+    node = vgm_data_state_ref_list(player->data_state);
+    while (node) {
+        vgm_data_block_group_t *block_group = vgm_data_block_ref_block_group(
+                vgm_data_block_ref_list_element(node));
+        refs[i].group = block_group;
+        refs[i].block_size = vgm_data_block_group_block_size(block_group);
+        i++;
+        node = vgm_data_block_ref_list_next(node);
+    }
+
+    esp_err_t ret = vgm_plan_build(&player->plan, refs, ref_count, BLOCK_LOAD_MIN, BLOCK_LOAD_MAX);
+    free(refs);
+
+    if (ret == ESP_OK) {
+        vgm_plan_log_summary(player->plan);
+    }
+
+    return ret;
+}
+
+static void vgm_player_reset_loaded_blocks(vgm_player_t *player)
+{
+    vgm_data_block_ref_node_t *node = vgm_data_state_ref_list(player->data_state);
+    while (node) {
+        vgm_data_block_ref_t *block_ref = vgm_data_block_ref_list_element(node);
+        vgm_data_block_group_set_loaded_block(vgm_data_block_ref_block_group(block_ref), 0);
+        node = vgm_data_block_ref_list_next(node);
+    }
+}
+
+/*
+ * Add the inflated data of a block group to the event stream cache.
+ */
+static esp_err_t vgm_player_cache_add_group(vgm_cache_writer_t *writer,
+        uint8_t loaded_block, const vgm_data_block_group_t *block_group)
+{
+    esp_err_t ret;
+    uint8_t data[256];
+    size_t len;
+
+    vgm_data_block_reader_t *reader;
+    ret = vgm_data_block_reader_open(&reader, block_group);
+    if (ret != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    while ((ret = vgm_data_block_reader_read(reader, data, sizeof(data), &len)) == ESP_OK && len > 0) {
+        ret = vgm_cache_writer_add_data(writer, loaded_block, data, len);
+        if (ret != ESP_OK) {
+            break;
+        }
+        loaded_block += 4;
+    }
+
+    vgm_data_block_reader_free(reader);
+    return ret;
+}
+
+/*
+ * Complete the event stream cache once the scan has finished.
+ *
+ * The cached stream can only resolve sample addresses ahead of time if
+ * every block group fits in memory at once, so it is laid out the same
+ * way the play loop preloads block groups. Anything larger is left to
+ * the regular play loop, which can evict and reload block groups.
+ */
+esp_err_t vgm_player_finish_cache(vgm_player_t *player,
+        vgm_cache_writer_t *writer, UT_array *patches)
+{
+    esp_err_t ret = ESP_OK;
+    UT_array *ref_blocks = NULL;
+
+    do {
+        if (!player->has_data_block) {
+            ret = vgm_cache_writer_finish(writer, false);
+            writer = NULL;
+            break;
+        }
+
+        // Assign a location to each block group, in order of first use
+        utarray_new(ref_blocks, &uint8_icd);
+        uint8_t block_offset = BLOCK_LOAD_MIN;
+        vgm_data_block_ref_node_t *node = vgm_data_state_ref_list(player->data_state);
+        while (node) {
+            vgm_data_block_ref_t *block_ref = vgm_data_block_ref_list_element(node);
+            vgm_data_block_group_t *block_group = vgm_data_block_ref_block_group(block_ref);
+            uint8_t loaded_block = vgm_data_block_group_get_loaded_block(block_group);
+            if (loaded_block == 0) {
+                uint16_t group_block_size = vgm_data_block_group_block_size(block_group);
+                if (block_offset + group_block_size - 1 > BLOCK_LOAD_MAX) {
+                    ret = ESP_ERR_NO_MEM;
+                    break;
+                }
+                loaded_block = block_offset;
+                vgm_data_block_group_set_loaded_block(block_group, loaded_block);
+                block_offset += group_block_size;
+
+                ret = vgm_player_cache_add_group(writer, loaded_block, block_group);
+                if (ret != ESP_OK) {
+                    break;
+                }
+            }
+            utarray_push_back(ref_blocks, &loaded_block);
+            node = vgm_data_block_ref_list_next(node);
+        }
+        if (ret != ESP_OK) {
+            if (ret == ESP_ERR_NO_MEM) {
+                ESP_LOGI(TAG, "Sample data too large to cache");
+            }
+            break;
+        }
+
+        // Resolve the sample address writes
+        vgm_cache_patch_t *patch;
+        for(patch = (vgm_cache_patch_t*)utarray_front(patches);
+                patch != NULL;
+                patch = (vgm_cache_patch_t*)utarray_next(patches, patch)) {
+            uint8_t *loaded_block = (uint8_t*)utarray_eltptr(ref_blocks, patch->ref_index);
+            if (!loaded_block) {
+                ret = ESP_ERR_INVALID_STATE;
+                break;
+            }
+            ret = vgm_cache_writer_patch(writer, patch->event_index, *loaded_block);
+            if (ret != ESP_OK) {
+                break;
+            }
+        }
+        if (ret != ESP_OK) {
+            break;
+        }
+
+        ret = vgm_cache_writer_finish(writer, true);
+        writer = NULL;
+    } while (0);
+
+    if (ref_blocks) {
+        utarray_free(ref_blocks);
+    }
+    vgm_cache_writer_abort(writer);
+
+    if (ret == ESP_OK) {
+        ret = vgm_cache_open(&player->cache, player->filename);
+    }
+
+    if (ret == ESP_OK) {
+        // The cache now holds everything needed for playback
+        vgm_data_state_free(player->data_state);
+        player->data_state = NULL;
+    } else if (player->data_state) {
+        vgm_player_reset_loaded_blocks(player);
+    }
+
+    return ret;
+}
+
 static bool vgm_player_load_block_group(const vgm_data_block_group_t *block_group, uint8_t starting_block)
 {
     uint8_t block = starting_block;
     size_t load_len = vgm_data_block_group_byte_size(block_group);
-    uint8_t *load_data = vgm_data_block_group_raw_data(block_group);
-    i2c_mutex_lock(I2C_P0_NUM);
+    uint8_t load_data[256];
+
+    vgm_data_block_reader_t *reader;
+    if (vgm_data_block_reader_open(&reader, block_group) != ESP_OK) {
+        return false;
+    }
+
+    // Inflate the data one transfer at a time
+    i2c_bus_lock(I2C_BUS_APU, 0);
     while(load_len > 0) {
-        size_t len = MIN(load_len, 256);
+        size_t len;
+        if (vgm_data_block_reader_read(reader, load_data, sizeof(load_data), &len) != ESP_OK || len == 0) {
+            break;
+        }
         if (nes_data_write(I2C_P0_NUM, block, load_data, len) != ESP_OK) {
             ESP_LOGE(TAG, "Unable to load data block");
             break;
         }
-        load_data += len;
         load_len -= len;
         block += 4;
     }
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
+
+    vgm_data_block_reader_free(reader);
 
 #if 1
     uint16_t load_address = (((uint16_t)starting_block) << 6) | 0xC000;
@@ -253,94 +549,510 @@ static bool vgm_player_load_block_group(const vgm_data_block_group_t *block_grou
     return load_len == 0;
 }
 
-static bool vgm_player_load_block_group_increment(const vgm_data_block_group_t *block_group,
-        uint8_t starting_block, uint16_t blocks_loaded, uint8_t block_load_limit)
+/*
+ * Send any register writes collected during the current command group.
+ *
+ * If an asynchronous writer is available, the writes are only handed
+ * off to it, and go out on the bus while playback moves on.
+ */
+static void vgm_player_batch_flush(nes_async_t *async, nes_apu_batch_t *batch)
 {
-    uint8_t block = starting_block + blocks_loaded;
-    size_t byte_size = vgm_data_block_group_byte_size(block_group);
-    size_t load_offset = blocks_loaded * 64;
+    if (batch->len == 0) {
+        return;
+    }
+    if (async) {
+        nes_async_submit(async, batch);
+    } else {
+        int64_t time0 = esp_timer_get_time();
+        i2c_bus_lock(I2C_BUS_APU, 0);
+        nes_apu_batch_flush(I2C_P0_NUM, batch);
+        i2c_bus_unlock();
+        int64_t time1 = esp_timer_get_time();
+        playback_stats_record(PLAYBACK_STATS_APU_WRITE, (uint32_t)(time1 - time0));
+    }
+}
 
-    if (load_offset >= byte_size) {
-        ESP_LOGE(TAG, "Offset is past end of data");
-        return false;
+/*
+ * Queue a register write, so that a whole command group goes out
+ * as a single transaction.
+ */
+static void vgm_player_batch_write(nes_async_t *async, nes_apu_batch_t *batch,
+        nes_apu_register_t reg, uint8_t dat)
+{
+    if (batch->len >= NES_APU_BATCH_MAX) {
+        vgm_player_batch_flush(async, batch);
     }
+    nes_apu_batch_append(I2C_P0_NUM, batch, reg, dat);
+}
 
-    size_t load_len = MIN(byte_size - load_offset, block_load_limit * 64);
-    uint8_t *load_data = vgm_data_block_group_raw_data(block_group) + load_offset;
+static esp_err_t vgm_player_cache_data_cb(uint8_t block, uint8_t *data, size_t len, void *arg)
+{
+    esp_err_t ret;
+    i2c_bus_lock(I2C_BUS_APU, 0);
+    ret = nes_data_write(I2C_P0_NUM, block, data, len);
+    i2c_bus_unlock();
+    return ret;
+}
 
-    i2c_mutex_lock(I2C_P0_NUM);
-    while(load_len > 0) {
-        size_t len = MIN(load_len, 256);
-        if (nes_data_write(I2C_P0_NUM, block, load_data, len) != ESP_OK) {
-            ESP_LOGE(TAG, "Unable to load data block");
+static esp_err_t vgm_player_cache_preload(vgm_player_t *player)
+{
+    if (player->has_data_block) {
+        ESP_LOGI(TAG, "Preloading data blocks");
+        if (vgm_cache_load_data(player->cache, vgm_player_cache_data_cb, NULL) != ESP_OK) {
+            ESP_LOGE(TAG, "Unable to load data blocks");
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t vgm_player_play_cache_loop(vgm_player_t *player)
+{
+    vgm_cache_t *cache = player->cache;
+    playback_clock_t *clock = NULL;
+
+    if (vgm_player_cache_preload(player) != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    // Event delays are already in microseconds
+    if (playback_clock_init(&clock, 1000000) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Starting cached playback");
+
+    nes_async_t *async = NULL;
+    if (nes_async_init(&async, I2C_P0_NUM) != ESP_OK) {
+        ESP_LOGW(TAG, "Falling back to blocking register writes");
+    }
+
+    vgm_pcm_t *pcm = NULL;
+    if (vgm_pcm_init(&pcm) != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to stream $4011 writes");
+    }
+
+    const vgm_cache_event_t *events;
+    size_t count;
+    nes_apu_batch_t batch = { 0 };
+    int64_t time_us = 0;
+    bool stopped = false;
+
+    playback_clock_start(clock);
+
+    while (!stopped) {
+        if (vgm_cache_next_events(cache, &events, &count) != ESP_OK) {
             break;
         }
-        load_data += len;
-        load_len -= len;
-        block += 4;
+
+        if (count == 0) {
+            vgm_player_batch_flush(async, &batch);
+
+            ESP_LOGI(TAG, "At end of event stream");
+            if (player->repeat == NES_REPEAT_LOOP && vgm_cache_has_loop(cache)) {
+                ESP_LOGI(TAG, "Seeking to start of loop");
+                vgm_cache_seek_loop(cache);
+                continue;
+            } else if (player->repeat == NES_REPEAT_CONTINUOUS) {
+                ESP_LOGI(TAG, "Seeking to start of file");
+
+                // Let any writes still in flight go out first
+                if (async) {
+                    nes_async_wait(async);
+                }
+                vgm_pcm_stop(pcm);
+
+                // Reset APU for a clean state
+                i2c_bus_lock(I2C_BUS_APU, 0);
+                nes_apu_init(I2C_P0_NUM);
+                i2c_bus_unlock();
+
+                // Small delay
+                vTaskDelay(500 / portTICK_RATE_MS);
+
+                vgm_cache_seek_start(cache);
+                playback_clock_start(clock);
+                continue;
+            } else {
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            const vgm_cache_event_t *event = &events[i];
+
+            if (event->delay_us > 0) {
+                if ((xEventGroupGetBits(player->event_group) & BIT0) == BIT0) {
+                    stopped = true;
+                    break;
+                }
+
+                // Send the writes collected since the last delay
+                vgm_player_batch_flush(async, &batch);
+
+                // Wait for the absolute time of the next event, in steps
+                // short enough to keep any $4011 stream fed
+                uint32_t delay_us = event->delay_us;
+                while (delay_us > 0) {
+                    uint32_t step = delay_us;
+                    if (vgm_pcm_is_streaming(pcm)) {
+                        step = MIN(step, VGM_PCM_ADVANCE_US);
+                    }
+                    playback_clock_advance(clock, step);
+                    i2c_bus_set_idle_until(playback_clock_target(clock));
+                    playback_clock_wait(clock);
+                    i2c_bus_set_idle_until(0);
+
+                    delay_us -= step;
+                    time_us += step;
+                    vgm_pcm_advance(pcm, time_us);
+                }
+            }
+
+            if (event->reg == VGM_CACHE_REG_NONE) {
+                continue;
+            }
+
+            nes_apu_register_t reg = 0x4000 + event->reg;
+            if ((reg == NES_APU_MODCTRL || reg == NES_APU_MODADDR || reg == NES_APU_MODLEN)
+                    && !player->has_data_block) {
+                // Skip DMC commands until we can handle them
+                continue;
+            }
+            if (reg == NES_APU_MODDA && vgm_pcm_write(pcm, time_us, event->dat)) {
+                continue;
+            }
+
+            vgm_player_batch_write(async, &batch, reg, event->dat);
+        }
     }
-    i2c_mutex_unlock(I2C_P0_NUM);
 
-#if 0
-    uint16_t load_address = (((uint16_t)starting_block) << 6) | 0xC000;
-    ESP_LOGI(TAG, "Loaded %d bytes into $%04X [%d]",
-            vgm_data_block_group_byte_size(block_group),
-            load_address, starting_block);
-#endif
+    nes_async_free(async);
+    vgm_pcm_stop(pcm);
+    vgm_pcm_free(pcm);
+    playback_clock_log_stats(clock);
+    playback_clock_free(clock);
 
-    return load_len == 0;
+    // Reset the APU in case we bailed early
+    i2c_bus_lock(I2C_BUS_APU, 0);
+    nes_apu_init(I2C_P0_NUM);
+    i2c_bus_unlock();
+
+    ESP_LOGI(TAG, "Finished playback");
+
+    return ESP_OK;
+}
+
+static void vgm_player_queue_set_enabled(bool enabled)
+{
+    // Changing the mode also empties the queue
+    i2c_bus_lock(I2C_BUS_APU, 0);
+    nes_set_config(I2C_P0_NUM, NES_CONFIG_INCREMENT | (enabled ? NES_CONFIG_QUEUE : 0));
+    i2c_bus_unlock();
+}
+
+/*
+ * Send records to the 2A03 write queue, waiting for space to free up
+ * as the queue drains.
+ *
+ * @return false if playback was stopped or the bus failed
+ */
+static bool vgm_player_queue_send(vgm_player_t *player, nes_apu_queue_record_t *records, size_t count)
+{
+    uint8_t queue_free = 0;
+
+    while (count > 0) {
+        if ((xEventGroupGetBits(player->event_group) & BIT0) == BIT0) {
+            return false;
+        }
+
+        i2c_bus_lock(I2C_BUS_APU, 0);
+        esp_err_t ret = nes_apu_queue_get_free(I2C_P0_NUM, &queue_free);
+        if (ret == ESP_OK && queue_free > 0) {
+            size_t len = MIN(count, queue_free);
+            ret = nes_apu_queue_write(I2C_P0_NUM, records, len);
+            records += len;
+            count -= len;
+        }
+        i2c_bus_unlock();
+
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Unable to write to queue");
+            return false;
+        }
+
+        if (count > 0) {
+            // Wait for a few queued frames to play out
+            i2c_bus_set_idle_until(esp_timer_get_time() + (QUEUE_FRAME_US * 4));
+            usleep(QUEUE_FRAME_US * 4);
+            i2c_bus_set_idle_until(0);
+        }
+    }
+    return true;
+}
+
+/*
+ * Wait for everything in the 2A03 write queue to be applied.
+ */
+static bool vgm_player_queue_drain(vgm_player_t *player)
+{
+    uint8_t queue_free = 0;
+    while (queue_free < NES_APU_QUEUE_SIZE) {
+        if ((xEventGroupGetBits(player->event_group) & BIT0) == BIT0) {
+            return false;
+        }
+
+        i2c_bus_lock(I2C_BUS_APU, 0);
+        esp_err_t ret = nes_apu_queue_get_free(I2C_P0_NUM, &queue_free);
+        i2c_bus_unlock();
+        if (ret != ESP_OK) {
+            return false;
+        }
+
+        if (queue_free < NES_APU_QUEUE_SIZE) {
+            i2c_bus_set_idle_until(esp_timer_get_time() + QUEUE_FRAME_US);
+            usleep(QUEUE_FRAME_US);
+            i2c_bus_set_idle_until(0);
+        }
+    }
+    return true;
+}
+
+/*
+ * Play a frame-aligned event stream by keeping the write queue on the
+ * 2A03 topped up, and letting it apply each write on its own frame
+ * counter. Bus latency and task scheduling then only have to keep up
+ * with the queue, rather than with each individual write.
+ */
+esp_err_t vgm_player_play_queue_loop(vgm_player_t *player)
+{
+    vgm_cache_t *cache = player->cache;
+
+    if (vgm_player_cache_preload(player) != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Starting queued playback");
+    vgm_player_queue_set_enabled(true);
+
+    const vgm_cache_event_t *events;
+    size_t count;
+    nes_apu_queue_record_t records[NES_APU_QUEUE_BATCH_MAX];
+    size_t record_count = 0;
+    uint64_t time_us = 0;
+    uint32_t queued_frame = 0;
+    bool stopped = false;
+
+    while (!stopped) {
+        if (vgm_cache_next_events(cache, &events, &count) != ESP_OK) {
+            break;
+        }
+
+        if (count == 0) {
+            if (record_count > 0 && !vgm_player_queue_send(player, records, record_count)) {
+                break;
+            }
+            record_count = 0;
+
+            ESP_LOGI(TAG, "At end of event stream");
+            if (player->repeat == NES_REPEAT_LOOP && vgm_cache_has_loop(cache)) {
+                ESP_LOGI(TAG, "Seeking to start of loop");
+                vgm_cache_seek_loop(cache);
+                continue;
+            }
+
+            if (!vgm_player_queue_drain(player)) {
+                break;
+            }
+
+            if (player->repeat == NES_REPEAT_CONTINUOUS) {
+                ESP_LOGI(TAG, "Seeking to start of file");
+
+                // Reset APU for a clean state
+                i2c_bus_lock(I2C_BUS_APU, 0);
+                nes_apu_init(I2C_P0_NUM);
+                i2c_bus_unlock();
+
+                // Small delay
+                vTaskDelay(500 / portTICK_RATE_MS);
+
+                vgm_player_queue_set_enabled(true);
+                vgm_cache_seek_start(cache);
+                time_us = 0;
+                queued_frame = 0;
+                continue;
+            } else {
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            const vgm_cache_event_t *event = &events[i];
+            time_us += event->delay_us;
+
+            if (event->reg == VGM_CACHE_REG_NONE) {
+                continue;
+            }
+
+            nes_apu_register_t reg = 0x4000 + event->reg;
+            if ((reg == NES_APU_MODCTRL || reg == NES_APU_MODADDR || reg == NES_APU_MODLEN)
+                    && !player->has_data_block) {
+                // Skip DMC commands until we can handle them
+                continue;
+            }
+
+            // Round to the nearest frame, so delays never accumulate error
+            uint32_t frame = (time_us + (QUEUE_FRAME_US / 2)) / QUEUE_FRAME_US;
+            uint32_t delta = frame - queued_frame;
+            queued_frame = frame;
+
+            do {
+                nes_apu_queue_record_t *record = &records[record_count++];
+                if (delta > UINT8_MAX) {
+                    record->delta = UINT8_MAX;
+                    record->reg = NES_APU_QUEUE_NOP;
+                    record->dat = 0;
+                    delta -= UINT8_MAX;
+                } else {
+                    record->delta = delta;
+                    record->reg = event->reg;
+                    record->dat = event->dat;
+                    delta = 0;
+                }
+
+                if (record_count == NES_APU_QUEUE_BATCH_MAX) {
+                    if (!vgm_player_queue_send(player, records, record_count)) {
+                        stopped = true;
+                        break;
+                    }
+                    record_count = 0;
+                }
+            } while (delta > 0);
+
+            if (stopped) {
+                break;
+            }
+        }
+    }
+
+    // Drop anything still queued, and reset the APU
+    vgm_player_queue_set_enabled(false);
+    i2c_bus_lock(I2C_BUS_APU, 0);
+    nes_apu_init(I2C_P0_NUM);
+    i2c_bus_unlock();
+
+    ESP_LOGI(TAG, "Finished playback");
+
+    return ESP_OK;
+}
+
+/*
+ * Mark a block group as loaded at the provided block.
+ */
+static void vgm_player_set_loaded(vgm_data_block_group_t *load_map[],
+        vgm_data_block_group_t *block_group, uint8_t loaded_block)
+{
+    vgm_data_block_group_set_loaded_block(block_group, loaded_block);
+    for (uint16_t i = loaded_block;
+            i < loaded_block + vgm_data_block_group_block_size(block_group) && i <= BLOCK_LOAD_MAX;
+            i++) {
+        load_map[i] = block_group;
+    }
+}
+
+/*
+ * Mark every block group overlapping the provided range as unloaded.
+ */
+static void vgm_player_unload_range(vgm_data_block_group_t *load_map[],
+        uint8_t start_block, uint16_t block_size)
+{
+    if (start_block < BLOCK_LOAD_MIN) {
+        return;
+    }
+
+    for (uint16_t i = start_block; i < start_block + block_size && i <= BLOCK_LOAD_MAX; i++) {
+        vgm_data_block_group_t *block_group = load_map[i];
+        if (!block_group) {
+            continue;
+        }
+
+        uint8_t loaded_block = vgm_data_block_group_get_loaded_block(block_group);
+        for (uint16_t j = loaded_block;
+                j < loaded_block + vgm_data_block_group_block_size(block_group) && j <= BLOCK_LOAD_MAX;
+                j++) {
+            load_map[j] = NULL;
+        }
+        vgm_data_block_group_set_loaded_block(block_group, 0);
+    }
 }
 
 esp_err_t vgm_player_play_loop(vgm_player_t *player)
 {
+    if (player->cache) {
+        if (vgm_cache_is_frame_aligned(player->cache)) {
+            return vgm_player_play_queue_loop(player);
+        }
+        return vgm_player_play_cache_loop(player);
+    }
+
     vgm_data_block_group_t *load_map[128] = { 0 };
     vgm_data_block_ref_t *block_ref = NULL;
+    playback_clock_t *clock = NULL;
+    vgm_loader_t *loader = NULL;
+    vgm_data_block_group_t *loading_group = NULL;
+    size_t ref_index = 0;
 
-    uint8_t inc_load_start = 0;
-    uint16_t inc_blocks_loaded = 0;
+    // Positions are counted in 44.1 kHz VGM samples
+    if (playback_clock_init(&clock, 44100) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
 
-    // Pre-load block groups up to available memory
-    if (player->has_data_block) {
+    // Pre-load the block groups the plan places ahead of playback
+    if (player->has_data_block && player->plan) {
         ESP_LOGI(TAG, "Preloading data blocks");
-        const uint8_t max_blocks = (BLOCK_LOAD_MAX - BLOCK_LOAD_MIN) + 1;
-        uint8_t block_offset = BLOCK_LOAD_MIN;
-        uint8_t remaining_blocks = max_blocks;
+        size_t index = 0;
         vgm_data_block_ref_node_t *node = vgm_data_state_ref_list(player->data_state);
         while (node) {
-            block_ref = vgm_data_block_ref_list_element(node);
-
-            vgm_data_block_group_t *block_group = vgm_data_block_ref_block_group(block_ref);
-            if (vgm_data_block_group_get_loaded_block(block_group) == 0) {
-                uint16_t group_block_size = vgm_data_block_group_block_size(block_group);
-                if (group_block_size <= remaining_blocks) {
-                    if (!vgm_player_load_block_group(block_group, block_offset)) {
-                        ESP_LOGI(TAG, "Block loading error");
-                        break;
-                    }
-                    vgm_data_block_group_set_loaded_block(block_group, block_offset);
-                    for (uint8_t i = block_offset; i < block_offset + group_block_size; i++) {
-                        load_map[i] = block_group;
-                    }
-                    block_offset += group_block_size;
-                    remaining_blocks -= group_block_size;
-                } else {
-                    ESP_LOGI(TAG, "No more space for preloading");
+            const vgm_plan_step_t *step = vgm_plan_get_step(player->plan, index);
+            if (step && step->action == VGM_PLAN_PRELOAD) {
+                vgm_data_block_group_t *block_group = vgm_data_block_ref_block_group(
+                        vgm_data_block_ref_list_element(node));
+                if (!vgm_player_load_block_group(block_group, step->block)) {
+                    ESP_LOGI(TAG, "Block loading error");
                     break;
                 }
+                vgm_player_set_loaded(load_map, block_group, step->block);
             }
 
+            index++;
             node = vgm_data_block_ref_list_next(node);
         }
         block_ref = vgm_data_state_take_next_ref(player->data_state);
+
+        // Anything that did not fit gets loaded in the background
+        if (vgm_loader_init(&loader) != ESP_OK) {
+            ESP_LOGE(TAG, "Unable to start data loader");
+        }
     }
 
     ESP_LOGI(TAG, "Starting playback");
 
+    nes_async_t *async = NULL;
+    if (nes_async_init(&async, I2C_P0_NUM) != ESP_OK) {
+        ESP_LOGW(TAG, "Falling back to blocking register writes");
+    }
+
+    vgm_pcm_t *pcm = NULL;
+    if (vgm_pcm_init(&pcm) != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to stream $4011 writes");
+    }
+
     vgm_command_t command;
-    const double wait_multiplier = 1000000.0/44100.0;
-    int64_t last_write_time = 0;
+    nes_apu_batch_t batch = { 0 };
     uint32_t sample_time = 0;
 
+    playback_clock_start(clock);
+
     while(true) {
         if ((xEventGroupGetBits(player->event_group) & BIT0) == BIT0) {
             break;
@@ -365,17 +1077,18 @@ esp_err_t vgm_player_play_loop(vgm_player_t *player)
                 vgm_data_block_group_t *block_group = vgm_data_block_ref_block_group(block_ref);
                 uint8_t loaded_block = vgm_data_block_group_get_loaded_block(block_group);
                 if (loaded_block == 0) {
+                    playback_stats_add(PLAYBACK_STATS_BLOCK_NOT_LOADED, 1);
 #if 1
                     ESP_LOGI(TAG, "Referenced block not loaded: [%d] $%04X",
                             command.info.nes_apu.dat,
                             (((uint16_t)command.info.nes_apu.dat) << 6) | 0xC000);
 #endif
-                } else if (inc_load_start > 0) {
+                } else if (block_group == loading_group && vgm_loader_is_busy(loader)) {
+                    playback_stats_add(PLAYBACK_STATS_BLOCK_PARTIAL, 1);
 #if 1
-                    ESP_LOGI(TAG, "Referenced block partially loaded: [%d] $%04X (%d)",
+                    ESP_LOGI(TAG, "Referenced block partially loaded: [%d] $%04X",
                             command.info.nes_apu.dat,
-                            (((uint16_t)command.info.nes_apu.dat) << 6) | 0xC000,
-                            inc_blocks_loaded * 64);
+                            (((uint16_t)command.info.nes_apu.dat) << 6) | 0xC000);
 #endif
                 } else {
 #if 0
@@ -389,65 +1102,50 @@ esp_err_t vgm_player_play_loop(vgm_player_t *player)
 
             }
 
-            int64_t time0 = esp_timer_get_time();
-            i2c_mutex_lock(I2C_P0_NUM);
-            nes_apu_write(I2C_P0_NUM, command.info.nes_apu.reg, command.info.nes_apu.dat);
-            i2c_mutex_unlock(I2C_P0_NUM);
-            int64_t time1 = esp_timer_get_time();
-            last_write_time += (time1 - time0);
+            // Dense runs of raw DAC writes go out as a PCM stream
+            if (command.info.nes_apu.reg == NES_APU_MODDA &&
+                    vgm_pcm_write(pcm, VGM_SAMPLES_TO_US(sample_time), command.info.nes_apu.dat)) {
+                continue;
+            }
+
+            vgm_player_batch_write(async, &batch,
+                    command.info.nes_apu.reg, command.info.nes_apu.dat);
         }
         else if (command.type == VGM_CMD_WAIT) {
+            // Send the writes collected during this command group
+            vgm_player_batch_flush(async, &batch);
+
             if (block_ref && vgm_data_block_ref_sample_time(block_ref) == sample_time) {
-                int64_t time0 = esp_timer_get_time();
                 vgm_data_block_ref_t *last_block_ref = block_ref;
                 block_ref = vgm_data_state_take_next_ref(player->data_state);
+                ref_index++;
                 if (block_ref) {
                     vgm_data_block_group_t *block_group = vgm_data_block_ref_block_group(block_ref);
-                    uint8_t loaded_block = vgm_data_block_group_get_loaded_block(block_group);
-                    if (loaded_block == 0) {
+                    const vgm_plan_step_t *step = vgm_plan_get_step(player->plan, ref_index);
+                    if (loader && step && step->action == VGM_PLAN_LOAD) {
 #if 0
                         ESP_LOGI(TAG, "Need to load block, size=%d, wait=%d",
                                 vgm_data_block_group_byte_size(block_group),
                                 command.info.wait.samples);
 #endif
 
-                        // Build the list of loaded data segments and eviction costs
-                        UT_array *segments = vgm_player_build_segment_list(last_block_ref, sample_time, load_map);
-
-                        // Find the loaded segments to evict
-                        UT_array *evict = vgm_player_find_eviction_candiates(segments, vgm_data_block_group_block_size(block_group));
-                        utarray_free(segments);
-
-                        uint8_t load_segment = 0;
-                        if (utarray_len(evict) > 0) {
-                            // Evict the chosen segments
-                            load_segment = *(uint8_t*)utarray_front(evict); // make safer
-                            uint8_t *evict_segment;
-                            for(evict_segment = (uint8_t*)utarray_front(evict);
-                                    evict_segment != NULL;
-                                    evict_segment = (uint8_t*)utarray_next(evict, evict_segment)) {
-                                vgm_data_block_group_t *evict_group = load_map[*evict_segment];
-                                if (evict_group) {
-                                    vgm_data_block_group_set_loaded_block(evict_group, 0);
-                                    for (uint8_t i = *evict_segment;
-                                            i < *evict_segment + vgm_data_block_group_block_size(evict_group);
-                                            i++) {
-                                        load_map[i] = NULL;
-                                    }
-                                }
-                            }
-                        } else {
-                            ESP_LOGI(TAG, "Nothing to evict!");
+                        // A group still being loaded will never finish, so forget it
+                        if (loading_group && vgm_loader_is_busy(loader)) {
+                            vgm_player_unload_range(load_map,
+                                    vgm_data_block_group_get_loaded_block(loading_group),
+                                    vgm_data_block_group_block_size(loading_group));
                         }
-                        utarray_free(evict);
 
-                        if (load_segment > 0) {
-                            // Set block as if it was loaded
-                            vgm_data_block_group_set_loaded_block(block_group, load_segment);
-
-                            // Set state variables for incremental loading
-                            inc_load_start = load_segment;
-                            inc_blocks_loaded = 0;
+                        // Evict whatever the plan is replacing, then let the
+                        // loader fill in the group while playback is idle
+                        vgm_player_unload_range(load_map, step->block,
+                                vgm_data_block_group_block_size(block_group));
+                        if (vgm_loader_start(loader, step->block, block_group) == ESP_OK) {
+                            vgm_player_set_loaded(load_map, block_group, step->block);
+                            loading_group = block_group;
+                        } else {
+                            ESP_LOGE(TAG, "Unable to start block load");
+                            loading_group = NULL;
                         }
                     }
 
@@ -456,54 +1154,41 @@ esp_err_t vgm_player_play_loop(vgm_player_t *player)
                 else {
                     ESP_LOGI(TAG, "End of block references");
                 }
-                int64_t time1 = esp_timer_get_time();
-                last_write_time += (time1 - time0);
             }
 
-            // Figure out how long we need to wait
-            int64_t wait = (command.info.wait.samples * wait_multiplier) - last_write_time;
-
-            // If a block group needs to be loaded, then incrementally load
-            // until complete.
-            if (block_ref && inc_load_start > 0 && wait > 0) {
-                // 3000-3500 uS per block
-                uint8_t block_load_limit = MIN(wait / 3500, 120);
-
-                if (block_load_limit > 0) {
-                    int64_t time0 = esp_timer_get_time();
+            // Wait for the absolute time of the next sample position,
+            // letting other bus traffic through in the meantime. While
+            // $4011 writes are streamed, this goes in steps short enough
+            // to keep the stream fed.
+            uint32_t samples = command.info.wait.samples;
+            while (samples > 0) {
+                uint32_t step = samples;
+                if (vgm_pcm_is_streaming(pcm)) {
+                    step = MIN(step, (VGM_PCM_ADVANCE_US * 44100) / 1000000);
+                }
+                playback_clock_advance(clock, step);
+                int64_t idle_until = playback_clock_target(clock);
+                i2c_bus_set_idle_until(idle_until);
+                if (loader) {
+                    vgm_loader_set_idle_until(loader, idle_until);
+                }
 
-                    vgm_data_block_group_t *block_group = vgm_data_block_ref_block_group(block_ref);
-                    if (!vgm_player_load_block_group_increment(block_group, inc_load_start, inc_blocks_loaded, block_load_limit)) {
-                        ESP_LOGE(TAG, "Incremental block load error");
-                        inc_load_start = 0;
-                        inc_blocks_loaded = 0;
-                    }
-                    else {
-                        inc_blocks_loaded += block_load_limit;
-                        // Check if the load is complete
-                        if (inc_blocks_loaded >= vgm_data_block_group_block_size(block_group)) {
-                            inc_load_start = 0;
-                            inc_blocks_loaded = 0;
-                        }
-                    }
+                playback_clock_wait(clock);
 
-                    // Update the wait time based on block loading
-                    int64_t time1 = esp_timer_get_time();
-                    wait -= (time1 - time0);
-                    last_write_time = 0;
+                if (loader) {
+                    vgm_loader_set_idle_until(loader, 0);
                 }
-            }
+                i2c_bus_set_idle_until(0);
 
-            if (wait > 0) {
-                last_write_time = 0;
-                // Need to use this because vTaskDelay() only has 1ms resolution
-                usleep(wait);
+                // Update the sample time
+                samples -= step;
+                sample_time += step;
+                vgm_pcm_advance(pcm, VGM_SAMPLES_TO_US(sample_time));
             }
-
-            // Update the sample time
-            sample_time += command.info.wait.samples;
         }
         else if (command.type == VGM_CMD_DONE) {
+            vgm_player_batch_flush(async, &batch);
+
             ESP_LOGI(TAG, "At end of data tag");
             if (player->repeat == NES_REPEAT_LOOP && vgm_has_loop(player->vgm_file)) {
                 ESP_LOGI(TAG, "Seeking to start of loop");
@@ -511,164 +1196,56 @@ esp_err_t vgm_player_play_loop(vgm_player_t *player)
             } else if (player->repeat == NES_REPEAT_CONTINUOUS) {
                 ESP_LOGI(TAG, "Seeking to start of file");
 
+                // Let any writes still in flight go out first
+                if (async) {
+                    nes_async_wait(async);
+                }
+                vgm_pcm_stop(pcm);
+
                 // Reset APU for a clean state
-                i2c_mutex_lock(I2C_P0_NUM);
+                i2c_bus_lock(I2C_BUS_APU, 0);
                 nes_apu_init(I2C_P0_NUM);
-                i2c_mutex_unlock(I2C_P0_NUM);
+                i2c_bus_unlock();
 
                 // Small delay
                 vTaskDelay(500 / portTICK_RATE_MS);
 
                 // Seek to start of file
                 vgm_seek_restart(player->vgm_file);
+                playback_clock_start(clock);
             } else {
                 break;
             }
         }
     }
 
+    nes_async_free(async);
+    vgm_pcm_stop(pcm);
+    vgm_pcm_free(pcm);
+    vgm_loader_free(loader);
     vgm_data_block_ref_free(block_ref);
+    playback_clock_log_stats(clock);
+    playback_clock_free(clock);
 
     // Reset the APU in case we bailed early
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_bus_lock(I2C_BUS_APU, 0);
     nes_apu_init(I2C_P0_NUM);
-    i2c_mutex_unlock(I2C_P0_NUM);
+    i2c_bus_unlock();
 
     ESP_LOGI(TAG, "Finished playback");
 
     return ESP_OK;
 }
 
-UT_array* vgm_player_build_segment_list(
-        vgm_data_block_ref_t *last_block_ref,
-        uint32_t sample_time, vgm_data_block_group_t *load_map[])
-{
-    UT_array *segments;
-    utarray_new(segments, &vgm_data_block_segment_icd);
-    vgm_data_block_group_t *active_group = vgm_data_block_ref_block_group(last_block_ref);
-    vgm_data_block_group_t *current_group = load_map[BLOCK_LOAD_MIN];
-    int q = BLOCK_LOAD_MIN;
-    for (int i = BLOCK_LOAD_MIN + 1; i <= BLOCK_LOAD_MAX; i++) {
-        if (load_map[i] != current_group || i == BLOCK_LOAD_MAX) {
-            if (!current_group) {
-                #if 0
-                ESP_LOGI(TAG, "Block: <empty>, location = %d, len=%d",
-                    q, i - q);
-                #endif
-                vgm_data_block_segment_t segment = {
-                    .loaded_block = q,
-                    .block_size = i - q,
-                    .cost = 0
-                };
-                utarray_push_back(segments, &segment);
-            } else {
-                uint32_t cost;
-
-                if (active_group == current_group) {
-                    cost = UINT32_MAX;
-                } else {
-                    vgm_data_block_ref_node_t *ref_node = vgm_data_block_group_ref_list(current_group);
-                    if (ref_node) {
-                        vgm_data_block_ref_t *next_ref = vgm_data_block_ref_list_element(ref_node);
-                        uint32_t next_ref_time = vgm_data_block_ref_sample_time(next_ref);
-                        cost = INT32_MAX - (next_ref_time - sample_time);
-                    } else {
-                        cost = 0;
-                    }
-                }
-
-                #if 0
-                ESP_LOGI(TAG, "Block: location = %d, len=%d, cost=%u",
-                    q, i - q, cost);
-                #endif
-
-                vgm_data_block_segment_t segment = {
-                    .loaded_block = q,
-                    .block_size = i - q,
-                    .cost = cost
-                };
-                utarray_push_back(segments, &segment);
-
-                current_group = load_map[i];
-                q = i;
-            }
-        }
-    }
-    return segments;
-}
-
-UT_array* vgm_player_find_eviction_candiates(
-        UT_array *segments, uint32_t block_size)
-{
-    vgm_data_block_segment_t *candidate_p = NULL;
-    vgm_data_block_segment_t *candidate_q = NULL;
-    uint32_t candidate_size = 0;
-    uint32_t candidate_cost = 0;
-
-    vgm_data_block_segment_t *p, *q;
-    for(p = (vgm_data_block_segment_t*)utarray_front(segments);
-        p != NULL;
-        p = (vgm_data_block_segment_t*)utarray_next(segments, p)) {
-
-        int elements = 0;
-        uint32_t range_size = 0;
-        uint32_t range_cost = 0;
-        for(q = p;
-            q != NULL;
-            q = (vgm_data_block_segment_t*)utarray_next(segments, q)) {
-            range_size += p->block_size;
-            if (range_cost + p->cost < range_cost) {
-                range_cost = UINT32_MAX;
-            } else {
-                range_cost += p->cost;
-            }
-            elements++;
-            if (range_size >= block_size) {
-                break;
-            }
-        }
-
-        if (p && q && (!candidate_p || range_cost < candidate_cost
-            || (range_cost == candidate_cost && range_size < candidate_size))) {
-            candidate_p = p;
-            candidate_q = q;
-            candidate_size = range_size;
-            candidate_cost = range_cost;
-        }
-
-#if 0
-        printf("Elements=%d, size=%u, cost=%u\n", elements, range_size, range_cost);
-
-        printf("Block: location = %d, len=%d, cost=%u\n",
-            p->loaded_block, p->block_size, p->cost);
-#endif
-
-    }
-
-#if 0
-    printf("Block range: location = %d, len=%d, cost=%u\n",
-            candidate_p->loaded_block, candidate_size, candidate_cost);
-#endif
-
-    UT_array *evict;
-    utarray_new(evict, &uint8_icd);
-
-    candidate_q = (vgm_data_block_segment_t*)utarray_next(segments, candidate_q);
-    for(p = candidate_p; p != candidate_q;
-        p = (vgm_data_block_segment_t*)utarray_next(segments, p)) {
-        uint8_t val = p->loaded_block;
-        utarray_push_back(evict, &val);
-    }
-
-    return evict;
-}
-
 void vgm_player_free(vgm_player_t *player)
 {
     if (player) {
+        vgm_cache_free(player->cache);
+        vgm_plan_free(player->plan);
         vgm_data_state_free(player->data_state);
         vgm_free_gd3_tags(player->tags);
         vgm_free(player->vgm_file);
+        free(player->filename);
         free(player);
     }
 }